@@ -0,0 +1,34 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_BALANCE
+#define __EVSE_BALANCE
+
+#include <stdint.h>
+
+#define BALANCE_CIRCUITS 4                                                  // Sub-circuits (distribution boards) below the mains connection
+#define BALANCE_NO_LIMIT INT32_MAX
+
+struct BalanceEVSE {
+    uint16_t Min;           // minimal current (0.1A)
+    uint16_t Max;           // maximal current (0.1A)
+    uint8_t Weight;         // share of the current above Min, relative to the other EVSE's (1 or more)
+    uint8_t Phases;         // phases used, bit 0-2: L1-L3 (0: all phases)
+    uint8_t Circuit;        // sub-circuit 1-BALANCE_CIRCUITS (0: connected to the mains)
+    uint16_t Current;       // result (0.1A)
+    uint16_t Uses;          // set by BalanceFill(): limits used by this EVSE
+};
+
+// A sub-circuit limits the sum of the EVSE's on it, and on the circuits below it
+struct BalanceCircuit {
+    int32_t Phase[3];       // limit per phase L1-L3 (0.1A), BALANCE_NO_LIMIT: not limited
+    uint8_t Parent;         // circuit it is connected to 1-BALANCE_CIRCUITS (0: the mains)
+};
+
+void BalanceFill(struct BalanceEVSE *evse, uint16_t *order, uint16_t count, int32_t total, const int32_t *phase,
+                 const struct BalanceCircuit *circuit);
+
+#endif
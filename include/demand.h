@@ -0,0 +1,37 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_DEMAND
+#define __EVSE_DEMAND
+
+#include <stdint.h>
+
+#define DEMAND_WINDOW 900                                                       // Average import power over 15 minutes
+#define DEMAND_BUCKETS 15                                                       // kept as 15 sums of 1 minute
+#define DEMAND_BUCKET (DEMAND_WINDOW / DEMAND_BUCKETS)
+#define DEMAND_REST_MIN 15                                                      // The allowed power is spread over at least 15 seconds
+
+// Mains import power over a rolling window, and over the fixed quarter hours of the clock (as billed)
+struct Demand {
+    int32_t Bucket[DEMAND_BUCKETS]; // energy per minute (Ws)
+    uint16_t Measured[DEMAND_BUCKETS];  // time with measurements per minute (ms)
+    int32_t Sum;                    // energy of the rolling window (Ws)
+    int32_t Quarter;                // energy of this quarter hour (Ws)
+    int32_t Power;                  // last measurement (W)
+    int32_t Last;                   // average of the last complete quarter hour (W)
+    uint32_t Time;                  // of the last measurement (s)
+    uint32_t Covered;               // time of the rolling window with measurements (ms)
+    uint8_t Index;                  // bucket of Time
+};
+
+void DemandInit(struct Demand *d, uint32_t now);
+void DemandRebase(struct Demand *d, uint32_t now);
+bool DemandAdd(struct Demand *d, int32_t power, uint32_t now, uint32_t dt);
+int32_t DemandAverage(const struct Demand *d);
+int32_t DemandProjected(const struct Demand *d);
+int32_t DemandAllowed(const struct Demand *d, int32_t target);
+
+#endif
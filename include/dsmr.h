@@ -0,0 +1,46 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_DSMR
+#define __EVSE_DSMR
+
+#include <stdint.h>
+
+#define DSMR_LINE_SIZE 48                                                       // OBIS lines we need are < 40 chars, longer lines are ignored
+
+#define DSMR_VOLTAGE 0x01                                                       // Flags: which values were found in the telegram
+#define DSMR_CURRENT 0x02
+#define DSMR_PHASE_POWER 0x04
+#define DSMR_POWER 0x08
+
+struct P1Data {
+    int32_t Current[3];     // Phase current (mA), negative when returning power
+    int32_t Power;          // Total power (W), delivered - returned
+    int32_t PhasePower[3];  // Phase power (W), delivered - returned
+    uint16_t Voltage[3];    // Phase voltage (0.1V)
+    uint8_t Flags;          // DSMR_xxx
+};
+
+struct DSMRParser {
+    uint8_t State;
+    uint16_t Crc;           // CRC16 (ARC) from '/' up to and including '!'
+    uint16_t RxCrc;         // CRC as received after '!'
+    uint8_t CrcLen;
+    uint8_t LineLen;        // 0xFF: line too long, ignored
+    char Line[DSMR_LINE_SIZE];
+    int32_t Delivered[3];   // Phase power delivered (W)
+    int32_t Returned[3];    // Phase power returned (W)
+    int32_t Current[3];     // Phase current (mA), unsigned
+    int32_t PowerDelivered;
+    int32_t PowerReturned;
+    uint16_t Voltage[3];
+    uint8_t Flags;
+};
+
+void DSMRInit(struct DSMRParser *p);
+uint8_t DSMRFeed(struct DSMRParser *p, uint8_t c, struct P1Data *out);
+
+#endif
@@ -6,6 +6,8 @@
 #ifndef __EVSE_MAIN
 #define __EVSE_MAIN
 
+#include <stdint.h>
+
 //debug信息数据
 #define LOG_DEBUG 3                                                             // Debug messages including measurement data
 #define LOG_INFO 2                                                              // Information messages without measurement data
@@ -16,7 +18,6 @@
 #define LOG_MODBUS LOG_WARN                                                     // Default: LOG_WARN
 
 #define VERSION "3.0.1"         	                                            // SmartEVSE software version
-#define TRANSFORMER_COMP 100   
 
 // Pin definitions left side ESP32
 #define PIN_TEMP 16                                         //DS18b20 GPIO16，lyx
@@ -43,6 +44,8 @@
 #define PIN_RS485_TX 25                                     //485-tx gpio25,lyx
 //#define PIN_RXD 
 //#define PIN_TXD
+#define PIN_P1_RX 14                                        //DSMR P1 data input (optional), UART2
+#define P1_INVERTED 0                                       //1: P1 data line connected without inverter
 
 // #define PIN_CP_OUT 19
 // #define PIN_CPOFF 15
@@ -73,6 +76,27 @@
 #define PWM_5 50                                                                // 5% of PWM
 #define PWM_95 950                                                              // 95% of PWM
 #define PWM_100 1000                                                            // 100% of PWM
+#define CP_PWM_BITS 16                                                          // LEDC resolution of the CP PWM (max 16 bits at 1kHz)
+#define CP_DUTY_MAX (1UL << CP_PWM_BITS)                                        // Duty cycle 100%, PWM off (+12V)
+#define CP_CURRENT_MIN 60                                                       // Range of the current to duty cycle table (0.1A)
+#define CP_CURRENT_MAX 800
+
+#define CP_SAMPLE_DMA 0                                                         // 1: Sample the CP signal continuously with the I2S ADC (DMA), 0: Timer interrupt per sample
+#define CP_DMA_RATE 40000                                                       // CP samples per second in DMA mode (40 per PWM period)
+#define CP_DMA_BLOCK 400                                                        // Samples per DMA buffer (10 PWM periods)
+#define CP_DMA_EDGE 512                                                         // Raw (10 bit) level between the CP low and high level, to find the rising edge
+#define CP_EDGE_GUARD 20                                                        // Samples closer than 20us to a PWM edge are rejected
+
+#define CP_EDGE_IRQ 0                                                           // 1: rising edge interrupt on PIN_CP_OUT starts the CP sampling
+
+#if CP_EDGE_IRQ && !defined(PIN_CP_OUT)
+#error "CP_EDGE_IRQ needs PIN_CP_OUT"
+#endif
+#if CP_SAMPLE_DMA || CP_EDGE_IRQ
+#define CP_EDGE_SYNC 1                                                          // Sampling follows the PWM edges: high and low plateau every period
+#else
+#define CP_EDGE_SYNC 0
+#endif
 
 #define ICAL 1024                                                               // Irms Calibration value (for Current transformers)
 #define MAX_MAINS 25                                                            // max Current the Mains connection can supply
@@ -97,8 +121,40 @@
 #define MAINS_METER_MEASURE 0
 #define PV_METER 0
 #define PV_METER_ADDRESS 11
+#define MAINS_METER_IP 0                                                        // IP address of a Mains meter on the network (Modbus TCP), 0 = read over RS485
+#define PV_METER_IP 0                                                           // IP address of a PV meter on the network (Modbus TCP), 0 = read over RS485
+#define METER_TCP_PORT 502
+#define MODBUS_TCP_WRITE 0                                                      // Registers served over Modbus TCP are read-only (1: allow FC06/FC10 writes)
 #define EV_METER 0
 #define EV_METER_ADDRESS 12
+#define PHASE_ALL 7
+#define EV_PHASES PHASE_ALL                                                     // Phases the EV uses, bit 0-2: L1-L3, 0 = learn from the EV meter (not with rotated phases)
+#define PHASE_CURRENT 10                                                        // The EV uses a phase when the EV meter measures more than 1A on it (Amps *10)
+#define PI_KP 500                                                               // Mains current controller, proportional gain (1/1000)
+#define PI_KI 300                                                               // integral gain (1/1000 per second)
+#define PI_KI_DOWN 1000                                                         // integral gain when over MaxMains, or importing in Solar mode (1/1000 per second)
+#define PI_RATE_UP 10                                                           // max increase (0.1A per second), 0 = no limit
+#define PI_RATE_DOWN 0                                                          // max decrease (0.1A per second), 0 = no limit
+#define PI_GAIN_MAX 5000                                                        // highest gain that can be set (1/1000 (per second))
+#define PI_RATE_MAX 1000                                                        // highest rate limit that can be set (0.1A per second)
+#define PI_DT_MIN 100                                                           // time between controller steps is taken as 0.1 - 5 seconds
+#define PI_DT_MAX 5000
+#define SOLAR_ALPHA 0.3f                                                        // Solar import forecast, smoothing of the level
+#define SOLAR_BETA 0.05f                                                        // smoothing of the trend
+#define SOLAR_HORIZON 120                                                       // start and stop decisions look 120 seconds ahead
+#define SOLAR_SIGMAS 1.0f                                                       // and need the forecast to hold within 1 standard deviation
+#define SCHEDULE_POLICY 0                                                       // Which waiting EVSE gets a free slot, SCHEDULE_xxx (0 = first come)
+#define SCHEDULE_SLICE 30                                                       // A charging EVSE keeps its slot at least 30 minutes
+#define SCHEDULE_SLICE_MAX 1440                                                 // and at most a day
+#define CIRCUIT_MAX 200                                                         // Highest max current of a sub-circuit (A), as MaxMains
+#define MAINS_VOLTAGE 230                                                       // Power per Amp, per phase (charge plan, capacity tariff)
+#define DEMAND_TARGET 0                                                         // Max 15 minute average import (W), 0 = no limit
+#define DEMAND_TARGET_MAX 100000                                                // highest target that can be set (W)
+#define PLAN_ENERGY_MAX 200000                                                  // Max energy of a charge plan (Wh)
+#define PLAN_DEPARTURE_MAX (7 * 24 * 3600)                                      // Max time until the departure of a charge plan (s)
+#define EV_CURRENT_VALID 30                                                     // A current measured by an EV meter is used for 30 seconds
+#define RECLAIM_MARGIN 20                                                       // An EV that draws less than its current keeps 2A above its measurement (Amps *10)
+#define RECLAIM_DELAY 60                                                        // but not in the first 60 seconds of charging, while the EV ramps up
 #define MIN_METER_ADDRESS 10
 #define MAX_METER_ADDRESS 247
 #define EMCUSTOM_ENDIANESS 0
@@ -112,6 +168,7 @@
 #define EMCUSTOM_PDIVISOR 8
 #define EMCUSTOM_EREGISTER 0
 #define EMCUSTOM_EDIVISOR 8
+#define EMCUSTOM_READMAX 3
 #define RFID_READER 0
 #define WIFI_MODE 0
 #define AP_PASSWORD "00000000"
@@ -123,6 +180,7 @@
 #define MODE_SOLAR 2
 
 #define MODBUS_BAUDRATE 9600
+#define P1_BAUDRATE 115200                                                      // DSMR 4/5, 8N1
 #define MODBUS_TIMEOUT 4
 #define ACK_TIMEOUT 1000                                                        // 1000ms timeout
 #define NR_EVSES 8
@@ -140,6 +198,7 @@
 #define STATE_B1 9                                                              // J Vehicle connected / no PWM signal
 #define STATE_C1 10                                                             // K Vehicle charging / no PWM signal (temp state when stopping charge from EVSE)
 
+#define NR_STATES 11
 #define NOSTATE 255
 
 #define PILOT_12V 1
@@ -147,6 +206,20 @@
 #define PILOT_6V 3
 #define PILOT_DIODE 4
 #define PILOT_NOK 0
+#define PILOT_ANY 255                                                           // State transition on any pilot level
+
+#define PILOT_12V_MIN 3000                                                      // Pilot levels at the ADC input (mV)
+#define PILOT_9V_MIN 2700
+#define PILOT_9V_MAX 2930
+#define PILOT_6V_MIN 2400
+#define PILOT_6V_MAX 2600
+#define PILOT_DIODE_MIN 100
+#define PILOT_DIODE_MAX 300
+#define PILOT_HYSTERESIS 40                                                     // The confirmed level stays while the window is within 40mV outside its band
+#define PILOT_CONFIRM_N 2                                                       // A new pilot level needs 2 of the last 3 windows
+#define PILOT_CONFIRM_M 3
+
+#define ADC_RAW_MAX 1024                                                        // 10 bits ADC resolution
 
 
 #define NO_ERROR 0
@@ -166,11 +239,11 @@
 #define LCD_BRIGHTNESS 255
 
 
-#define CONTACTOR1_ON digitalWrite(PIN_SSR, HIGH);
-#define CONTACTOR1_OFF digitalWrite(PIN_SSR, LOW);
+#define CONTACTOR1_ON Hal->Contactor(1, true);
+#define CONTACTOR1_OFF Hal->Contactor(1, false);
 
-// #define CONTACTOR2_ON digitalWrite(PIN_SSR2, HIGH);
-// #define CONTACTOR2_OFF digitalWrite(PIN_SSR2, LOW);
+// #define CONTACTOR2_ON Hal->Contactor(2, true);
+// #define CONTACTOR2_OFF Hal->Contactor(2, false);
 
 // #define BACKLIGHT_ON digitalWrite(PIN_LCD_LED, HIGH);
 // #define BACKLIGHT_OFF digitalWrite(PIN_LCD_LED, LOW);
@@ -192,6 +265,9 @@
 #define MODBUS_RESPONSE 3
 #define MODBUS_EXCEPTION 4
 
+#define MODBUS_BLOCK_MAX 64                                                     // Max registers of a meter read that is split by ReadMax
+#define MODBUS_BLOCK_TOKEN 0x424C0000                                           // Token of a part of a split read, the register is in the low word
+
 #define MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS 0x02
 #define MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE 0x03
 
@@ -201,6 +277,8 @@
 #define MODBUS_EVSE_CONFIG_COUNT 10
 #define MODBUS_SYS_CONFIG_START  0x0200
 #define MODBUS_SYS_CONFIG_COUNT  26
+#define MODBUS_EVSE_MEASURE_START 0x0300                                        // Measurements (FC04 only, read from snapshot)
+#define MODBUS_EVSE_MEASURE_COUNT 48
 
 #define MODBUS_MAX_REGISTER_READ MODBUS_SYS_CONFIG_COUNT
 #define MODBUS_BUFFER_SIZE MODBUS_MAX_REGISTER_READ * 2 + 10
@@ -214,7 +292,7 @@
 #define STATUS_ACCESS 69                                                        // 0x0005: Access bit
 #define STATUS_CONFIG_CHANGED 70                                                // 0x0006: Configuration changed
 #define STATUS_MAX 71                                                           // 0x0007: Maximum charging current (RO)
-#define STATUS_PHASE_COUNT 72                                                   // 0x0008: Number of used phases (RO) (ToDo)
+#define STATUS_PHASES 72                                                        // 0x0008: Phases used by the EV, bit 0-2: L1-L3, 0 = unknown (RO)
 #define STATUS_REAL_CURRENT 73                                                  // 0x0009: Real charging current (RO) (ToDo)
 #define STATUS_TEMP 74                                                          // 0x000A: Temperature (RO)
 #define STATUS_SERIAL 75                                                        // 0x000B: Serial number (RO)
@@ -257,7 +335,7 @@
 #define MENU_EMCUSTOM_PDIVISOR 33                                               // 0x0215: Divisor for Power (W) of custom electric meter (10^x)
 #define MENU_EMCUSTOM_EREGISTER 34                                              // 0x0216: Register for Energy (kWh) of custom electric meter
 #define MENU_EMCUSTOM_EDIVISOR 35                                               // 0x0217: Divisor for Energy (kWh) of custom electric meter (10^x)
-#define MENU_EMCUSTOM_READMAX 36                                                // 0x0218: Maximum register read (ToDo)
+#define MENU_EMCUSTOM_READMAX 36                                                // 0x0218: Maximum register read
 #define MENU_WIFI 37                                                            // 0x0219: WiFi mode
 #define MENU_EXIT 38
 
@@ -295,6 +373,10 @@
 #define EM_SOLAREDGE 6
 #define EM_WAGO 7
 #define EM_CUSTOM 8
+#define EM_P1 9                                                                 // DSMR P1 port on PIN_P1_RX (mains only)
+#define EM_PROFILE_FIRST 10                                                     // Meter profiles loaded from SPIFFS (/em1.csv - /em8.csv)
+#define EM_PROFILES 8
+#define EM_MAX (EM_PROFILE_FIRST + EM_PROFILES)
 
 #define ENDIANESS_LBF_LWF 0
 #define ENDIANESS_LBF_HWF 1
@@ -310,6 +392,7 @@ typedef enum mb_datatype {
 } MBDataType;
 
 
+#ifdef ARDUINO                                                                  // Not available in the host tests of the charging logic
 extern portMUX_TYPE rtc_spinlock;   //TODO: Will be placed in the appropriate position after the rtc module is finished.
 
 #define RTC_ENTER_CRITICAL()    portENTER_CRITICAL(&rtc_spinlock)
@@ -319,6 +402,7 @@ extern portMUX_TYPE rtc_spinlock;   //TODO: Will be placed in the appropriate po
 extern IPAddress localIp;
 extern String APhostname;
 extern String APpassword;
+#endif
 extern struct tm timeinfo;
 
 extern uint8_t GLCDbuf[512];                                                    // GLCD buffer (half of the display)
@@ -343,21 +427,43 @@ extern uint8_t MainsMeterAddress;
 extern uint8_t MainsMeterMeasure;                                               // What does Mains electric meter measure (0: Mains (Home+EVSE+PV) / 1: Home+EVSE / 2: Home)
 extern uint8_t PVMeter;                                                         // Type of PV electric meter (0: Disabled / Constants EM_*)
 extern uint8_t PVMeterAddress;
+extern uint32_t MainsMeterIP;                                                   // Mains meter on the network (Modbus TCP), 0 = RS485
+extern uint32_t PVMeterIP;                                                      // PV meter on the network (Modbus TCP), 0 = RS485
+extern uint16_t MeterTCPPort;
+extern uint8_t ModbusTCPWrite;                                                  // Allow writes to the registers served over Modbus TCP
 extern uint8_t EVMeter;                                                         // Type of EV electric meter (0: Disabled / Constants EM_*)
 extern uint8_t EVMeterAddress;
+extern uint8_t EVPhases;                                                        // Phases the EV uses, bit 0-2: L1-L3 (0: learn from the EV meter)
+extern uint8_t EVPhasesUsed;                                                    // Phases on which the EV meter measured current while charging
+extern uint8_t SchedulePolicy;                                                  // Which waiting EVSE gets a free slot (SCHEDULE_xxx)
+extern uint16_t ScheduleSlice;                                                  // Minimal time an EVSE keeps its slot (minutes)
 extern uint8_t RFIDReader;
 extern uint8_t WIFImode;
 
 extern int32_t Irms[3];                                                         // Momentary current per Phase (Amps *10) (23 = 2.3A)
+extern int32_t CM[3];                                                           // Mains meter current per Phase (mA)
+extern int32_t MainsPower;                                                      // Mains power (W), delivered - returned (P1 only)
+extern int32_t PV[3];                                                           // PV meter current per Phase (mA)
+extern volatile uint8_t MainsUpdated;                                           // Set when new mains measurements are pushed (P1 / Modbus TCP)
+extern uint8_t timeout;                                                         // communication timeout (sec)
 
 extern uint8_t State;
 extern uint8_t ErrorFlags;
 extern uint8_t NextState;
+extern volatile uint8_t PilotLevel;                                             // Confirmed pilot level, updated when a window of CP samples is complete
+extern volatile uint8_t PilotDiodeOK;                                           // Low plateau of the PWM signal at -12V (CP_EDGE_SYNC)
+extern volatile int64_t PilotChangeTime;                                        // Time of the last change of PilotLevel (us)
+extern uint32_t PilotLatencyMax;                                                // Max time from pilot level change to handled by EVSEStates (us)
+extern struct PilotFilter CPFilter;
 
 extern uint16_t MaxCapacity;                                                    // Cable limit (Amps)(limited by the wire in the charge cable, set automatically, or manually if Config=Fixed Cable)
 extern int16_t Imeasured;                                                       // Max of all CT inputs (Amps * 10) (23 = 2.3A)
 extern int16_t Isum;
+extern uint16_t ChargeCurrent;                                                  // Calculated Charge Current (Amps *10)
 extern uint16_t Balanced[NR_EVSES];                                             // Amps value per EVSE
+extern uint16_t BalancedMax[NR_EVSES];                                          // Max Amps value per EVSE
+extern uint8_t BalancedState[NR_EVSES];                                         // State of all EVSE's
+extern int16_t IsetPhase[3];                                                    // Max calculated current per phase (Amps *10) for the EVSE's on that phase
 
 extern uint8_t menu;
 extern uint32_t ChargeTimer;                                                    // seconds counter
@@ -372,6 +478,16 @@ extern uint8_t SubMenu;
 extern uint32_t ScrollTimer;
 extern uint8_t LCDpos;
 extern uint8_t ChargeDelay;                                                     // Delays charging in seconds.
+extern uint8_t C1Timer;
+extern uint8_t AccessTimer;
+extern uint8_t ActivationMode;
+extern uint8_t ActivationTimer;
+extern uint8_t DiodeCheck;                                                      // EV diode found in State B
+extern uint8_t UnlockCable;
+extern uint8_t LockCable;
+extern uint8_t ModbusRequest;                                                   // Step of the Modbus poll cycle, 0 = idle
+extern uint8_t ExternalMaster;
+extern uint8_t ResetKwh;
 extern uint8_t TestState;
 extern uint8_t Access_bit;
 extern uint8_t GridActive;                                                      // When the CT's are used on Sensorbox2, it enables the GRID menu option.
@@ -379,9 +495,15 @@ extern uint8_t CalActive;
 extern uint16_t Iuncal;
 extern uint16_t SolarStopTimer;
 extern int32_t EnergyCharged;
+extern int32_t EnergyMeterStart;
+extern int32_t EnergyEV;
 extern int32_t PowerMeasured;
 extern uint8_t RFIDstatus;
 extern bool LocalTimeSet;
+extern uint32_t PlanTarget;
+extern uint32_t PlanDeparture;
+extern bool PlanWait;                                                           // Not charging in this slot of the plan
+extern uint32_t DemandTarget;
 
 extern uint8_t MenuItems[MENU_EXIT];
 
@@ -406,7 +528,7 @@ const struct {
     {"SW",     "SWITCH",  "Switch function control on pin SW",                  0, 4, SWITCH},
     {"RCMON",  "RCMON",   "Residual Current Monitor on pin RCM",                0, 1, RC_MON},
     {"RFID",   "RFID",    "RFID reader, learn/remove cards",                    0, 5, RFID_READER},
-    {"EVEM",   "EV METER","Type of EV electric meter",                          0, EM_CUSTOM, EV_METER},
+    {"EVEM",   "EV METER","Type of EV electric meter",                          0, EM_MAX - 1, EV_METER},
     {"EVAD",   "EV ADDR", "Address of EV electric meter",                       MIN_METER_ADDRESS, MAX_METER_ADDRESS, EV_METER_ADDRESS},
 
     // System configuration
@@ -419,10 +541,10 @@ const struct {
     {"START",  "START",   "Surplus energy start Current (sum of phases)",       0, 48, START_CURRENT},
     {"STOP",   "STOP",    "Stop solar charging at 6A after this time",          0, 60, STOP_TIME},
     {"IMPORT", "IMPORT",  "Allow grid power when solar charging (sum of phase)",0, 20, IMPORT_CURRENT},
-    {"MAINEM", "MAINSMET","Type of mains electric meter",                       1, EM_CUSTOM, MAINS_METER},
+    {"MAINEM", "MAINSMET","Type of mains electric meter",                       1, EM_MAX - 1, MAINS_METER},
     {"MAINAD", "MAINSADR","Address of mains electric meter",                    MIN_METER_ADDRESS, MAX_METER_ADDRESS, MAINS_METER_ADDRESS},
     {"MAINM",  "MAINSMES","Mains electric meter scope (What does it measure?)", 0, 1, MAINS_METER_MEASURE},
-    {"PVEM",   "PV METER","Type of PV electric meter",                          0, EM_CUSTOM, PV_METER},
+    {"PVEM",   "PV METER","Type of PV electric meter",                          0, EM_MAX - 1, PV_METER},
     {"PVAD",   "PV ADDR", "Address of PV electric meter",                       MIN_METER_ADDRESS, MAX_METER_ADDRESS, PV_METER_ADDRESS},
     {"EMBO",   "BYTE ORD","Byte order of custom electric meter",                0, 3, EMCUSTOM_ENDIANESS},
     {"EMDATA", "DATATYPE","Data type of custom electric meter",                 0, MB_DATATYPE_MAX - 1, EMCUSTOM_DATATYPE},
@@ -435,7 +557,7 @@ const struct {
     {"EMPDIV", "POW DIVI","Divisor for Power (W) of custom electric meter",     0, 7, EMCUSTOM_PDIVISOR},
     {"EMEREG", "ENE REGI","Register for Energy (kWh) of custom electric meter", 0, 65534, EMCUSTOM_EREGISTER},
     {"EMEDIV", "ENE DIVI","Divisor for Energy (kWh) of custom electric meter",  0, 7, EMCUSTOM_EDIVISOR},
-    {"EMREAD", "READ MAX","Max register read at once of custom electric meter", 3, 255, 3},
+    {"EMREAD", "READ MAX","Max register read at once of custom electric meter", 3, 255, EMCUSTOM_READMAX},
     {"WIFI",   "WIFI",    "Connect to WiFi access point",                       0, 2, WIFI_MODE},
 
     {"EXIT", "EXIT", "EXIT", 0, 0, 0}
@@ -450,6 +572,22 @@ struct NodeStatus {
     uint8_t MinCurrent;     // 0.1A
     uint8_t Phases;
     uint16_t Timer;         // 1s
+    uint8_t Priority;       // SCHEDULE_PRIORITY, higher goes first
+    uint32_t Connected;     // 1s
+    uint32_t Idle;          // 1s, not charging
+    uint32_t Run;           // 1s, charging since the last start
+    uint32_t Charged;       // 0.1A * 1s
+    uint16_t EVCurrent;     // 0.1A, highest phase current measured by the EV meter
+    uint8_t EVCurrentValid; // 1s, EVCurrent is used while > 0
+    uint8_t Circuit;        // sub-circuit 1-BALANCE_CIRCUITS (0: connected to the mains)
+};
+
+// State transition: in State, on a Pilot level, when Guard() returns true, run Action() and switch to Next
+struct StateTransition {
+    uint8_t Pilot;          // PILOT_xxx or PILOT_ANY
+    bool (*Guard)(void);    // NULL: always
+    void (*Action)(void);   // NULL: none, runs before the state change
+    uint8_t Next;           // NOSTATE: no state change
 };
 
 struct EMstruct {
@@ -465,21 +603,51 @@ struct EMstruct {
     uint8_t PDivisor;       // 10^x
     uint16_t ERegister;     // Total energy (kWh)
     uint8_t EDivisor;       // 10^x
+    uint8_t ReadMax;        // Max registers that can be read at once
+    uint8_t SignPos;        // Position of the signed phase power values in the current read block, used as sign for the currents (0: not used)
 };
 
-extern struct EMstruct EMConfig[EM_CUSTOM + 1];
+extern struct EMstruct EMConfig[EM_MAX];
+extern struct NodeStatus Node[NR_EVSES];
 
 void CheckAPpassword(void);
 void read_settings(bool write);
 void write_settings(void);
+const char * getStateName(uint8_t StateCode);
+void setMode(uint8_t NewMode);
 void setSolarStopTimer(uint16_t Timer);
 void setState(uint8_t NewState);
+void setErrorFlags(uint8_t flags);
+void clearErrorFlags(uint8_t flags);
 void setAccess(bool Access);
 uint8_t getMenuItems(void);
 uint8_t setItemValue(uint8_t nav, uint16_t val);
 uint16_t getItemValue(uint8_t nav);
 const char * getMenuItemOption(uint8_t nav);
 void ConfigureModbusMode(uint8_t newmode);
+uint8_t MainsMeterOnRS485(void);
+uint8_t getEVPhases(void);
+bool ScheduleAllowed(uint8_t NodeNr);
+void setCPSampleTiming(uint16_t time);
+uint16_t ADCSample(int channel);
+void UpdateMeasureRegisters(void);
+uint8_t readMeasureRegisters(uint16_t Register, uint16_t Count, uint16_t *values);
+void UpdateMainsCurrents(void);
+void UpdateCurrentData(void);
+void SetCurrent(uint16_t current);
+signed char TemperatureSensor(void);
+void ProximityPin(void);
+char IsCurrentAvailable(void);
+bool CircuitRoom(uint8_t NodeNr, int8_t Pause);
+bool CircuitAvailable(uint8_t NodeNr);
+void CalcBalancedCurrent(char mod);
+void ResetBalancedStates(void);
+void BroadcastCurrent(void);
+void requestNodeConfig(uint8_t NodeNr);
+void requestNodeStatus(uint8_t NodeNr);
+void processAllNodeStates(uint8_t NodeNr);
+void ScheduleStep(void);
+void PlanStep(void);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_HAL
+#define __EVSE_HAL
+
+#include <stdint.h>
+
+// Hardware, time and communication used by the charging logic (evselogic.cpp).
+// The ESP32 implementation is HalESP32, a host simulation can set Hal to its own implementation
+// and call the Step functions in virtual time.
+struct EVSEHal {
+    void (*Contactor)(uint8_t nr, bool on);     // Contactor 1 or 2
+    void (*CPDuty)(uint32_t duty);              // CP PWM duty cycle, CP_DUTY_MAX: +12V, 0: -12V
+    void (*CPSampleTiming)(uint16_t time);      // PWM_5 / PWM_95 / PWM_100
+    uint8_t (*Pilot)(void);                     // confirmed pilot level PILOT_xxx
+    uint16_t (*ADCSample)(int channel);         // raw (10 bits) sample of the PP or Temperature channel
+    uint32_t (*Millis)(void);
+    int64_t (*Micros)(void);
+    uint32_t (*Time)(void);                     // wall clock (Unix time), 0 when not known yet
+    uint32_t (*Cycles)(void);                   // CPU cycle counter, to measure the cost of a function
+    void (*Wake)(void);                         // run EVSEStatesStep soon, called on a state change
+    void (*Log)(const char *fmt, ...);          // printf to the serial port
+    void (*WebText)(const char *str);           // text to the webpage
+    void (*WebStatus)(void);                    // status (state, errors, currents) to the webpage, when connected to WiFi
+    void (*ModbusWrite)(uint8_t address, uint16_t reg, uint16_t value);    // write a register of a Node (or BROADCAST_ADR)
+    void (*RequestCurrent)(uint8_t meter, uint8_t address);                // read the currents of a meter on RS485
+    void (*RequestEnergy)(uint8_t meter, uint8_t address);                 // read the energy of an EV meter on RS485
+    void (*RequestPower)(uint8_t meter, uint8_t address);                  // read the power of an EV meter on RS485
+};
+
+extern const struct EVSEHal HalESP32;
+extern const struct EVSEHal *Hal;
+
+uint8_t StateDispatch(uint8_t pilot);
+void EVSEStatesStep(void);
+void Timer100msStep(void);
+void Timer1SStep(void);
+
+#endif
@@ -0,0 +1,29 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_ISRSTATS
+#define __EVSE_ISRSTATS
+
+#include <stdint.h>
+
+#define ISR_HIST_BUCKETS 16                                                     // Buckets per histogram, the last one also counts everything above
+#define ISR_CYCLES_US 240                                                       // CPU cycles per us (240MHz)
+
+// Fixed bucket histogram, written by one ISR, read by the webserver
+struct IsrHistogram {
+    uint32_t Bucket[ISR_HIST_BUCKETS];
+    uint32_t Width;                     // bucket width, in units of the value
+    uint32_t Count;                     // values added
+    uint32_t Worst;                     // largest value since the last reset
+    volatile uint8_t Reset;             // set by the reader, the writer clears the histogram
+};
+
+void IsrHistogramInit(struct IsrHistogram *h, uint32_t width);
+void IsrHistogramAdd(struct IsrHistogram *h, uint32_t value);
+void IsrHistogramReset(struct IsrHistogram *h);
+int IsrHistogramJson(struct IsrHistogram *h, const char *name, const char *unit, uint32_t divider, char *buf, int size);
+
+#endif
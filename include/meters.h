@@ -0,0 +1,14 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_METERS
+#define __EVSE_METERS
+
+#include <stdint.h>
+
+uint8_t LoadMeterProfiles(void);
+
+#endif
@@ -23,12 +23,24 @@ struct ModBus {
     uint8_t Exception;
 };
 
+// A meter read of more registers than the meter sends at once (ReadMax), requested in parts
+struct ModbusBlock {
+    uint8_t Address;
+    uint8_t Function;
+    uint16_t Register;      // first register
+    uint8_t Count;          // registers
+    uint8_t Part;           // registers per request
+    uint8_t Received;       // registers
+    uint8_t Data[MODBUS_BLOCK_MAX * 2];
+};
+
 // definition of MBserver / MBclient class is done in evse.cpp
 extern ModbusServerRTU MBserver;
 extern ModbusClientRTU MBclient; 
 
 void RS485SendBuf(uint8_t *buffer, uint8_t len);
-uint8_t mapModbusRegister2ItemID();
+uint8_t mapModbusRegister2ItemID(uint16_t Register, uint16_t Count);
+ModbusMessage MBItemRequest(ModbusMessage request);
 
 // ########################### Modbus main functions ###########################
 
@@ -40,6 +52,9 @@ void ModbusWriteMultipleRequest(uint8_t address, uint16_t reg, uint16_t *values,
 void ModbusWriteMultipleResponse(uint8_t address, uint16_t reg, uint16_t count);
 void ModbusException(uint8_t address, uint8_t function, uint8_t exception);
 void ModbusDecode(uint8_t *buf, uint8_t len);
+uint8_t ModbusBlockStart(struct ModbusBlock *b, uint8_t Address, uint8_t Function, uint16_t Register, uint16_t Count, uint8_t ReadMax, uint8_t Size);
+bool ModbusBlockAdd(struct ModbusBlock *b, uint16_t Register, const uint8_t *data, uint8_t bytes);
+ModbusMessage ModbusBlockResponse(struct ModbusBlock *b);
 
 // ########################### EVSE modbus functions ###########################
 
@@ -48,7 +63,9 @@ void requestEnergyMeasurement(uint8_t Meter, uint8_t Address);
 signed int receiveEnergyMeasurement(uint8_t *buf, uint8_t Meter);
 void requestPowerMeasurement(uint8_t Meter, uint8_t Address);
 signed int receivePowerMeasurement(uint8_t *buf, uint8_t Meter);
+uint8_t getCurrentMeasurementRequest(uint8_t Meter, uint8_t *Function, uint16_t *Register, uint16_t *Count);
 void requestCurrentMeasurement(uint8_t Meter, uint8_t Address);
+bool receiveCurrentBlock(ModbusMessage &msg, uint32_t token);
 uint8_t receiveCurrentMeasurement(uint8_t *buf, uint8_t Meter, signed int *var);
 
 void ReadItemValueResponse(void);
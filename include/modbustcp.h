@@ -0,0 +1,22 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_MODBUSTCP
+#define __EVSE_MODBUSTCP
+
+#define MODBUS_TCP_PORT 502
+#define MODBUS_TCP_POLL 2000                                                    // Poll interval of meters on the network (ms)
+#define MODBUS_TCP_TIMEOUT 1000                                                 // Response timeout (ms)
+
+#define MODBUS_TCP_UNIT 1                                                       // Unit ID of the registers served over Modbus TCP
+#define MODBUS_TCP_UNIT_ANY 255                                                 // Unit ID commonly used for devices directly on the network
+#define MODBUS_TCP_CLIENTS 4                                                    // Max concurrent Modbus TCP clients
+#define MODBUS_TCP_IDLE 20000                                                   // Disconnect idle clients after 20s
+
+void MeterTCPTask(void * parameter);
+void StartModbusTCPServer(void);
+
+#endif
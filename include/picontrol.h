@@ -0,0 +1,31 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_PICONTROL
+#define __EVSE_PICONTROL
+
+#include <stdint.h>
+
+struct PIGains {
+    uint16_t Kp;            // proportional gain (1/1000)
+    uint16_t Ki;            // integral gain (1/1000 per second)
+    uint16_t KiDown;        // integral gain when the error is negative (1/1000 per second), to remove an overload fast
+    uint16_t RateUp;        // max increase of the output (0.1A per second), 0 = no limit
+    uint16_t RateDown;      // max decrease of the output (0.1A per second), 0 = no limit
+};
+
+// Discrete PI controller in velocity form: the last output is the integrator,
+// so clamping the output also stops the integrator from winding up.
+struct PIControl {
+    int32_t Error;          // error of the last step (0.1A)
+    int32_t Rest;           // part of the change that was below 0.1A (1/1000 * 0.1A)
+    uint8_t Valid;          // Error is set
+};
+
+void PIControlReset(struct PIControl *pi);
+int32_t PIControlStep(const struct PIGains *g, struct PIControl *pi, int32_t output, int32_t error, uint32_t dt, int32_t min, int32_t max);
+
+#endif
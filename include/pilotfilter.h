@@ -0,0 +1,36 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_PILOTFILTER
+#define __EVSE_PILOTFILTER
+
+#include <stdint.h>
+
+#define PILOT_LEVELS 5                                                          // Level 0 is unknown, 1..4 are PILOT_12V..PILOT_DIODE
+#define PILOT_HISTORY 8                                                         // Max number of windows (M) in the N-of-M filter
+
+struct PilotBand {
+    uint16_t Min;           // window matches when Min <= window min
+    uint16_t Max;           // and window max < Max
+};
+
+// Pilot level classifier with hysteresis and N-of-M confirmation, fed with the min/max of each CP sample window
+struct PilotFilter {
+    struct PilotBand Enter[PILOT_LEVELS];   // bands to change to a level
+    struct PilotBand Hold[PILOT_LEVELS];    // wider bands, to stay at the confirmed level
+    uint8_t N;                              // windows needed to confirm a level
+    uint8_t M;                              // out of the last M windows
+    uint8_t History[PILOT_HISTORY];         // classification of the last M windows
+    uint8_t Idx;                            // next entry in History
+    uint8_t Level;                          // confirmed level
+    uint8_t Confidence;                     // % of the last M windows that match the confirmed level
+};
+
+void PilotFilterInit(struct PilotFilter *f, uint8_t n, uint8_t m);
+uint8_t PilotFilterClassify(struct PilotFilter *f, uint16_t Min, uint16_t Max);
+uint8_t PilotFilterAdd(struct PilotFilter *f, uint16_t Min, uint16_t Max);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_PLANNER
+#define __EVSE_PLANNER
+
+#include <stdint.h>
+
+#define PLAN_SLOT_TIME 900                                                      // 15 minutes per slot
+#define PLAN_SLOTS 192                                                          // 48 hours
+#define PLAN_NONE 0xFF                                                          // no planned current (outside the plan)
+#define PLAN_COST_UNKNOWN 0xFFFF                                                // not in the tariff table, used last
+
+// Price or CO2 per kWh for the next 48 hours, in any unit (lower is better)
+struct PlanTable {
+    uint32_t Start;                 // Unix time of slot 0, multiple of PLAN_SLOT_TIME
+    uint8_t Count;                  // slots in the table
+    uint16_t Cost[PLAN_SLOTS];
+};
+
+// Charge current per slot, from Start until the departure
+struct Plan {
+    uint32_t Start;                 // Unix time of slot 0, multiple of PLAN_SLOT_TIME
+    uint32_t Made;                  // Unix time the plan was made
+    uint32_t Departure;             // Unix time
+    uint16_t Watt;                  // power per Amp (W)
+    uint8_t Count;                  // slots in the plan
+    uint8_t Current[PLAN_SLOTS];    // A, 0 = not charging
+};
+
+void PlanMake(struct Plan *plan, const struct PlanTable *table, uint32_t now, uint32_t departure, uint32_t energy,
+              uint16_t watt, uint8_t min, uint8_t max);
+uint8_t PlanCurrent(const struct Plan *plan, uint32_t now);
+uint32_t PlanEnergy(const struct Plan *plan, uint32_t now);
+
+#endif
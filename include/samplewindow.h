@@ -0,0 +1,39 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_SAMPLEWINDOW
+#define __EVSE_SAMPLEWINDOW
+
+#include <stdint.h>
+
+#define SAMPLE_RING 32                                                          // Raw samples kept in the ring (power of 2)
+
+struct SampleStats {
+    uint16_t Min;
+    uint16_t Max;
+    uint32_t Sum;
+    uint16_t Count;         // samples in the window
+    uint32_t Window;        // number of the window, increments with every published window
+};
+
+// Single producer (ISR or sample task) / single consumer (EVSEStates)
+struct SampleWindow {
+    uint16_t Ring[SAMPLE_RING];
+    volatile uint32_t Head;             // total samples written, Ring[(Head - 1) % SAMPLE_RING] is the newest
+    uint16_t Size;                      // samples per window
+    volatile uint8_t Restart;           // set by the consumer, the producer drops the window being collected
+    struct SampleStats Acc;             // window being collected, producer only
+    volatile uint32_t Seq;              // odd while the producer publishes Stats
+    struct SampleStats Stats;           // last complete window
+};
+
+void SampleWindowInit(struct SampleWindow *w, uint16_t size);
+uint8_t SampleWindowPut(struct SampleWindow *w, uint16_t sample);
+uint8_t SampleWindowGet(struct SampleWindow *w, struct SampleStats *out);
+void SampleWindowRestart(struct SampleWindow *w);
+uint16_t SampleWindowLast(struct SampleWindow *w, uint16_t *buf, uint16_t count);
+
+#endif
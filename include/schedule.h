@@ -0,0 +1,33 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_SCHEDULE
+#define __EVSE_SCHEDULE
+
+#include <stdint.h>
+
+// Which EVSE gets a free slot, when there is not enough current for all EVSE's
+#define SCHEDULE_FIFO 0                                                         // First come, first served. A charging EVSE keeps its slot
+#define SCHEDULE_ROTATE 1                                                       // Take turns, a charging EVSE gives up its slot after the time slice
+#define SCHEDULE_ENERGY 2                                                       // Least charge delivered first
+#define SCHEDULE_PRIORITY 3                                                     // Highest priority first, then first come
+#define SCHEDULE_POLICIES 4
+
+struct ScheduleEVSE {
+    uint8_t Waiting;        // connected, and waiting for a slot
+    uint8_t Charging;
+    uint8_t Priority;       // higher goes first (SCHEDULE_PRIORITY)
+    uint32_t Connected;     // time connected (s)
+    uint32_t Idle;          // time since it stopped charging, or was connected (s)
+    uint32_t Run;           // time charging since the last start (s)
+    uint32_t Charged;       // charge delivered since it was connected (0.1A * s)
+    uint8_t Room;           // bit n: pausing this EVSE makes room for EVSE n (a shared full sub-circuit)
+};
+
+int8_t ScheduleNext(uint8_t policy, const struct ScheduleEVSE *evse, uint8_t count);
+int8_t SchedulePreempt(uint8_t policy, const struct ScheduleEVSE *evse, uint8_t count, uint32_t slice);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_SOLARFORECAST
+#define __EVSE_SOLARFORECAST
+
+#include <stdint.h>
+
+#define SOLAR_VARIANCE_INIT 10000.0f                                            // Forecast error at the start: 10A (0.1A ^2)
+#define SOLAR_VARIANCE_GAIN 0.1f                                                // Smoothing of the forecast error
+#define SOLAR_TREND_TIME 60                                                     // The trend is damped over 60 seconds
+
+// Short term forecast of the import (Holt: exponential smoothing of the level and the trend)
+struct SolarForecast {
+    float Alpha;            // smoothing of the level (0-1)
+    float Beta;             // smoothing of the trend (0-1)
+    float Level;            // import (0.1A)
+    float Trend;            // change of the import (0.1A per second)
+    float Variance;         // of the one step forecast error (0.1A ^2)
+    uint16_t Samples;
+};
+
+void SolarForecastInit(struct SolarForecast *f, float alpha, float beta);
+void SolarForecastAdd(struct SolarForecast *f, int32_t import, uint32_t dt);
+int32_t SolarForecastImport(const struct SolarForecast *f, uint16_t horizon, float sigmas);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_TRACE
+#define __EVSE_TRACE
+
+#include <stdint.h>
+
+#define TRACE_SIZE 256                                                          // Entries in the trace ring (16 bytes each)
+#define TRACE_MAGIC 0x52545645                                                  // "EVTR"
+#define TRACE_VERSION 1
+
+// Trace entry types, and the meaning of Cause / Old / New
+#define TRACE_STATE 1                                                           // Cause: pilot level, Old/New: state
+#define TRACE_ERROR 2                                                           // Cause: -, Old/New: ErrorFlags
+#define TRACE_CURRENT 3                                                         // Cause: state, Old/New: charge current of this EVSE (0.1A)
+#define TRACE_BALANCE 4                                                         // Cause: EVSE (0-7), Old/New: balanced current (0.1A)
+#define TRACE_OVERLOAD 5                                                        // Cause: -, Old: MaxMains (0.1A), New: Imeasured (0.1A)
+#define TRACE_PAUSE 6                                                           // Cause: EVSE (0-7) paused, Old: SCHEDULE_xxx, New: EVSE that gets the slot
+
+struct TraceEntry {
+    int64_t Time;           // monotonic (us)
+    uint8_t Type;           // TRACE_xxx
+    uint8_t Cause;
+    uint16_t Old;
+    uint16_t New;
+    uint16_t Seq;           // low 16 bits of the sequence number
+};
+
+// Header of the download, followed by Count entries, oldest first
+struct TraceHeader {
+    uint32_t Magic;
+    uint16_t Version;
+    uint16_t EntrySize;
+    uint32_t Count;
+    uint32_t Dropped;       // entries overwritten before this download
+    int64_t Now;            // time of the download (us)
+};
+
+void TraceAdd(uint8_t Type, uint8_t Cause, uint16_t Old, uint16_t New);
+uint32_t TraceSnapshot(struct TraceHeader *header, struct TraceEntry *entries);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+
+#include "balance.h"
+
+#define BALANCE_INSERTION_SORT 16                                           // Up to 16 EVSE's insertion sort is faster than heap sort
+#define BALANCE_LIMITS (4 + 3 * BALANCE_CIRCUITS)                            // 0: total, 1-3: phase L1-L3, then L1-L3 per circuit
+#define BALANCE_NOT_SET 0xFFFF
+
+// State of one BalanceFill(), passed to the helpers
+struct BalanceContext {
+    struct BalanceEVSE *EVSE;
+    uint16_t *Order;                    // EVSE's sorted by headroom
+    uint16_t Count;
+    int32_t Left[BALANCE_LIMITS];       // current left per limit (0.1A)
+};
+
+// Order by headroom (Max - Min) per weight, smallest first. Equal headroom keeps the index order.
+static int CompareHeadroom(const struct BalanceEVSE *evse, uint16_t a, uint16_t b) {
+    uint32_t ha = (uint32_t)(evse[a].Max - evse[a].Min) * evse[b].Weight;  // ha/wa < hb/wb  without division
+    uint32_t hb = (uint32_t)(evse[b].Max - evse[b].Min) * evse[a].Weight;
+
+    if (ha != hb) return ha < hb ? -1 : 1;
+    return (int)a - (int)b;
+}
+
+static void SiftDown(const struct BalanceEVSE *evse, uint16_t *order, uint16_t root, uint16_t count) {
+    uint16_t child, key = order[root];
+
+    while ((child = 2 * root + 1) < count) {
+        if (child + 1 < count && CompareHeadroom(evse, order[child], order[child + 1]) < 0) child++;
+        if (CompareHeadroom(evse, key, order[child]) >= 0) break;
+        order[root] = order[child];
+        root = child;
+    }
+    order[root] = key;
+}
+
+// Sort the EVSE's by headroom, insertion sort for a few EVSE's, heap sort for more
+static void SortHeadroom(struct BalanceContext *ctx) {
+    uint16_t *order = ctx->Order, i, n, key;
+
+    if (ctx->Count <= BALANCE_INSERTION_SORT) {
+        for (i = 1; i < ctx->Count; i++) {
+            key = order[i];
+            for (n = i; n && CompareHeadroom(ctx->EVSE, order[n - 1], key) > 0; n--) order[n] = order[n - 1];
+            order[n] = key;
+        }
+        return;
+    }
+    for (i = ctx->Count / 2; i--; ) SiftDown(ctx->EVSE, order, i, ctx->Count);
+    for (n = ctx->Count - 1; n; n--) {
+        key = order[0];
+        order[0] = order[n];
+        order[n] = key;
+        SiftDown(ctx->EVSE, order, 0, n);
+    }
+}
+
+// Limits used by an EVSE: bit 0 the total, bit 1-3 phase L1-L3, then the phases of its circuit and the circuits above it
+static uint16_t Uses(const struct BalanceEVSE *evse, const struct BalanceCircuit *circuit) {
+    uint16_t phases = evse->Phases & 7 ? evse->Phases & 7 : 7, uses = 1 | (phases << 1);
+    uint8_t c, depth;
+
+    if (!circuit) return uses;
+    for (c = evse->Circuit, depth = 0; c && c <= BALANCE_CIRCUITS && depth < BALANCE_CIRCUITS; c = circuit[c - 1].Parent, depth++) {
+        uses |= phases << (1 + 3 * c);
+    }
+    return uses;
+}
+
+// Current left for an EVSE in the other limits it uses
+static int32_t Room(const struct BalanceContext *ctx, uint16_t uses, uint8_t limit, int32_t current) {
+    uint8_t l;
+
+    for (l = 0; l < BALANCE_LIMITS; l++) if (l != limit && (uses & (1 << l)) && ctx->Left[l] < current) current = ctx->Left[l];
+    return current;
+}
+
+// An EVSE that gets a share of a limit, takes it from the other limits it uses as well
+static void Take(struct BalanceContext *ctx, uint16_t uses, uint8_t limit, int32_t current) {
+    uint8_t l;
+
+    for (l = 0; l < BALANCE_LIMITS; l++) if (l != limit && (uses & (1 << l))) {
+        ctx->Left[l] -= current;
+        if (ctx->Left[l] < 0) ctx->Left[l] = 0;
+    }
+}
+
+/**
+ * Fill the EVSE's that are not set yet and use this limit
+ * The EVSE's with a headroom below their share are capped, the rest is divided by Weight.
+ *
+ * @param pointer to BalanceContext ctx
+ * @param uint8_t limit
+ * @param bool set: false only calculates the water level, true sets the EVSE's
+ * @param pointer to int32_t level: current left for the EVSE's that are not capped (0.1A)
+ * @return uint32_t weight of the EVSE's that are not capped (0: the limit is not reached)
+ */
+static uint32_t Fill(struct BalanceContext *ctx, uint8_t limit, bool set, int32_t *level) {
+    struct BalanceEVSE *evse = ctx->EVSE;
+    int32_t rest = ctx->Left[limit], headroom;
+    uint32_t weight = 0, share;
+    uint16_t n, i;
+
+    for (n = 0; n < ctx->Count; n++) {
+        if (evse[n].Current == BALANCE_NOT_SET && (evse[n].Uses & (1 << limit))) weight += evse[n].Weight;
+    }
+
+    // Cap the EVSE's with a headroom below their share
+    for (i = 0; i < ctx->Count && weight; i++) {
+        n = ctx->Order[i];
+        if (evse[n].Current != BALANCE_NOT_SET || !(evse[n].Uses & (1 << limit))) continue;
+        share = (uint32_t)rest * evse[n].Weight / weight;
+        headroom = evse[n].Max - evse[n].Min;
+        if ((uint32_t)headroom > share) break;                             // sorted, all next EVSE's have more headroom
+        if (set) {
+            headroom = Room(ctx, evse[n].Uses, limit, headroom);            // a limit with the same level can round the other way
+            evse[n].Current = evse[n].Min + headroom;
+            Take(ctx, evse[n].Uses, limit, headroom);
+        }
+        rest -= headroom;
+        weight -= evse[n].Weight;
+    }
+    *level = rest;
+    if (!set) return weight;
+
+    // Divide the rest over the EVSE's that are not capped
+    for (n = 0; n < ctx->Count; n++) {
+        if (evse[n].Current != BALANCE_NOT_SET || !(evse[n].Uses & (1 << limit))) continue;
+        share = weight ? (uint32_t)rest * evse[n].Weight / weight : 0;
+        if (share > (uint32_t)(evse[n].Max - evse[n].Min)) share = evse[n].Max - evse[n].Min;  // the rest of an EVSE limited by Room()
+        share = Room(ctx, evse[n].Uses, limit, share);                      // limits with the same level can round the other way
+        evse[n].Current = evse[n].Min + share;
+        Take(ctx, evse[n].Uses, limit, share);
+        rest -= share;
+        weight -= evse[n].Weight;
+    }
+    ctx->Left[limit] = rest;
+    return 0;
+}
+
+/**
+ * Divide a total current over EVSE's (water-filling)
+ * Every EVSE gets its Min, the rest is divided by Weight. EVSE's that reach their Max are capped,
+ * and their share is divided over the others. The EVSE's are sorted once by headroom,
+ * so the capped EVSE's are found in one pass. The limits an EVSE uses are calculated once.
+ * With phase limits, the sum of the EVSE's on a phase is limited as well. The limit with the lowest
+ * level is filled first, then the EVSE's left over are divided over the next limit.
+ * The phases of the sub-circuits are limits in the same way. An EVSE on a circuit uses the limits
+ * of that circuit and of all circuits above it, so every level of the tree is met in one pass.
+ * When the total is below the sum of the minimums, every EVSE gets its Min.
+ * 
+ * @param pointer to BalanceEVSE evse[count]
+ * @param pointer to uint16_t order[count]: workspace
+ * @param uint16_t count
+ * @param int32_t total: current to divide (0.1A)
+ * @param pointer to int32_t phase[3]: current limit per phase L1-L3 (0.1A), NULL: no phase limits
+ * @param pointer to BalanceCircuit circuit[BALANCE_CIRCUITS], NULL: no sub-circuits
+ */
+void BalanceFill(struct BalanceEVSE *evse, uint16_t *order, uint16_t count, int32_t total, const int32_t *phase,
+                 const struct BalanceCircuit *circuit) {
+    struct BalanceContext ctx;
+    int32_t level, bestlevel = 0;
+    uint32_t weight, bestweight = 0;
+    uint16_t n, limited = 1;
+    uint8_t limit, best;
+
+    ctx.EVSE = evse;
+    ctx.Order = order;
+    ctx.Count = count;
+    ctx.Left[0] = total;
+    for (limit = 1; limit < BALANCE_LIMITS; limit++) {
+        if (limit < 4) ctx.Left[limit] = phase ? phase[limit - 1] : BALANCE_NO_LIMIT;
+        else ctx.Left[limit] = circuit ? circuit[(limit - 4) / 3].Phase[(limit - 4) % 3] : BALANCE_NO_LIMIT;
+        if (ctx.Left[limit] != BALANCE_NO_LIMIT) limited |= 1 << limit;
+    }
+
+    for (n = 0; n < count; n++) {
+        if (evse[n].Max < evse[n].Min) evse[n].Max = evse[n].Min;
+        evse[n].Current = BALANCE_NOT_SET;
+        evse[n].Uses = Uses(&evse[n], circuit);
+        Take(&ctx, evse[n].Uses, BALANCE_LIMITS, evse[n].Min);
+        order[n] = n;
+    }
+    SortHeadroom(&ctx);
+
+    do {
+        // Find the limit with the lowest level per weight
+        best = BALANCE_LIMITS;
+        for (limit = 0; limit < BALANCE_LIMITS; limit++) {
+            if (!(limited & (1 << limit))) continue;
+            weight = Fill(&ctx, limit, false, &level);
+            if (weight && (best == BALANCE_LIMITS || (int64_t)level * bestweight < (int64_t)bestlevel * weight)) {
+                best = limit;
+                bestlevel = level;
+                bestweight = weight;
+            }
+        }
+        if (best < BALANCE_LIMITS) Fill(&ctx, best, true, &level);
+    } while (best < BALANCE_LIMITS);
+
+    // EVSE's that reach none of the limits get their Max
+    for (n = 0; n < count; n++) if (evse[n].Current == BALANCE_NOT_SET) evse[n].Current = evse[n].Max;
+}
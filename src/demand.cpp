@@ -0,0 +1,138 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "demand.h"
+
+/**
+ * Start without measurements
+ *
+ * @param pointer to Demand d
+ * @param uint32_t now (s)
+ */
+void DemandInit(struct Demand *d, uint32_t now) {
+    memset(d, 0, sizeof(struct Demand));
+    d->Time = now;
+    d->Index = (now / DEMAND_BUCKET) % DEMAND_BUCKETS;
+}
+
+/**
+ * Move the rolling window to another time base, when the clock is set (uptime to Unix time)
+ * The minutes that were measured keep counting, the quarter hour of the clock starts over.
+ *
+ * @param pointer to Demand d
+ * @param uint32_t now: in the new time base (s)
+ */
+void DemandRebase(struct Demand *d, uint32_t now) {
+    struct Demand old = *d;
+    uint8_t n, from, to;
+
+    DemandInit(d, now);
+    for (n = 0; n < DEMAND_BUCKETS; n++) {                                      // the current minute stays the current minute
+        from = (old.Index + DEMAND_BUCKETS - n) % DEMAND_BUCKETS;
+        to = (d->Index + DEMAND_BUCKETS - n) % DEMAND_BUCKETS;
+        d->Bucket[to] = old.Bucket[from];
+        d->Measured[to] = old.Measured[from];
+    }
+    d->Sum = old.Sum;
+    d->Covered = old.Covered;
+    d->Power = old.Power;
+    d->Last = old.Last;
+}
+
+/**
+ * Add a measurement of the import power
+ * Minutes that have passed leave the rolling window, at most all 15 of them.
+ *
+ * @param pointer to Demand d
+ * @param int32_t power: import (W), negative is export
+ * @param uint32_t now: end of the measurement (s), Unix time for quarter hours of the clock
+ * @param uint32_t dt: length of the measurement (ms)
+ * @return bool true when a quarter hour was completed, its average is in d->Last
+ */
+bool DemandAdd(struct Demand *d, int32_t power, uint32_t now, uint32_t dt) {
+    uint32_t from = d->Time / DEMAND_BUCKET, to = now / DEMAND_BUCKET, n;
+    int32_t energy = (int64_t)power * dt / 1000;
+    bool quarter = false;
+
+    if (now < d->Time) DemandInit(d, now);                                      // clock was set back
+    else {
+        if (now / DEMAND_WINDOW != d->Time / DEMAND_WINDOW) {
+            d->Last = d->Quarter / DEMAND_WINDOW;
+            d->Quarter = 0;
+            quarter = true;
+        }
+        for (n = from; n < to && n < from + DEMAND_BUCKETS; n++) {
+            d->Index = (d->Index + 1) % DEMAND_BUCKETS;
+            d->Sum -= d->Bucket[d->Index];
+            d->Covered -= d->Measured[d->Index];
+            d->Bucket[d->Index] = 0;
+            d->Measured[d->Index] = 0;
+        }
+        d->Index = to % DEMAND_BUCKETS;
+    }
+
+    // Only the measured time is covered, a gap between the measurements counts as import at the target
+    if (dt > DEMAND_BUCKET * 1000u - d->Measured[d->Index]) dt = DEMAND_BUCKET * 1000u - d->Measured[d->Index];
+    d->Measured[d->Index] += dt;
+    d->Covered += dt;
+    d->Bucket[d->Index] += energy;
+    d->Sum += energy;
+    d->Quarter += energy;
+    d->Power = power;
+    d->Time = now;
+    return quarter;
+}
+
+/**
+ * Average import power of the last 15 minutes
+ *
+ * @param pointer to Demand d
+ * @return int32_t power (W)
+ */
+int32_t DemandAverage(const struct Demand *d) {
+    return d->Sum / DEMAND_WINDOW;
+}
+
+/**
+ * Average of the 15 minutes that end with this minute, when the import stays at the last measurement
+ *
+ * @param pointer to Demand d
+ * @return int32_t power (W)
+ */
+int32_t DemandProjected(const struct Demand *d) {
+    int32_t rest = DEMAND_BUCKET - d->Time % DEMAND_BUCKET;
+
+    return (d->Sum + d->Power * rest) / DEMAND_WINDOW;
+}
+
+/**
+ * Import power allowed from now on, so that none of the 15 minute windows that end in the next 15 minutes
+ * goes above the target. A window that ends k minutes later no longer holds the k oldest minutes.
+ * Time of the window without measurements (after a restart) counts as import at the target.
+ *
+ * @param pointer to Demand d
+ * @param int32_t target (W)
+ * @return int32_t power (W), can be negative when the target can not be met
+ */
+int32_t DemandAllowed(const struct Demand *d, int32_t target) {
+    int32_t rest = DEMAND_BUCKET - d->Time % DEMAND_BUCKET, allowed, power;
+    int64_t energy = (int64_t)target * ((int64_t)rest * 1000 + d->Covered) / 1000 - d->Sum;  // left for the window that ends with this minute
+    uint8_t k, n;
+
+    if (rest < DEMAND_REST_MIN) rest = DEMAND_REST_MIN;
+    allowed = energy / rest;
+    for (k = 1; k < DEMAND_BUCKETS; k++) {                                      // the minute n leaves the window, with its time without measurements
+        n = (d->Index + k) % DEMAND_BUCKETS;
+        energy += d->Bucket[n] + (int64_t)target * (DEMAND_BUCKET * 1000 - d->Measured[n]) / 1000;
+        power = energy / (rest + k * DEMAND_BUCKET);
+        if (power < allowed) allowed = power;
+    }
+    return allowed;
+}
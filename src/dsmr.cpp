@@ -0,0 +1,206 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Incremental parser for DSMR 4/5 P1 telegrams.
+// Characters are fed one by one as they are received, no buffering of the telegram and no allocations.
+// Only depends on <stdint.h>/<string.h>, so it can be fed with recorded telegrams on the host.
+//
+// /ISK5\2M550T-1012
+//
+// 1-0:32.7.0(230.1*V)
+// 1-0:31.7.0(002*A)
+// 1-0:21.7.0(00.403*kW)
+// 1-0:22.7.0(00.000*kW)
+// ...
+// !E3A1
+
+#include <stdint.h>
+#include <string.h>
+
+#include "dsmr.h"
+
+#define DSMR_WAIT_START 0
+#define DSMR_DATA 1
+#define DSMR_CRC 2
+
+
+/**
+ * Update CRC16 (ARC, poly 0xA001 reflected, init 0) with one byte
+ */
+static uint16_t DSMRCrc(uint16_t crc, uint8_t c) {
+    uint8_t i;
+
+    crc ^= c;
+    for (i = 0; i < 8; i++) {
+        if (crc & 1) crc = (crc >> 1) ^ 0xA001;
+        else crc >>= 1;
+    }
+    return crc;
+}
+
+/**
+ * Parse a decimal value with optional fraction into a fixed point integer
+ *
+ * @param pointer to string, ends at '*' or ')'
+ * @param uint8_t decimals of the result (3: "002.345" -> 2345)
+ * @return int32_t value
+ */
+static int32_t DSMRValue(const char *s, uint8_t decimals) {
+    int32_t value = 0;
+    uint8_t fraction = 0, frac = 0;
+
+    for (; *s && *s != '*' && *s != ')'; s++) {
+        if (*s == '.') {
+            fraction = 1;
+        } else if (*s >= '0' && *s <= '9') {
+            if (fraction) {
+                if (frac >= decimals) continue;                                 // more decimals than we need
+                frac++;
+            }
+            value = value * 10 + (*s - '0');
+        }
+    }
+    for (; frac < decimals; frac++) value *= 10;
+
+    return value;
+}
+
+/**
+ * Handle one complete line of the telegram
+ * Only the electricity instantaneous values 1-0:x.7.0 are used.
+ */
+static void DSMRLine(struct DSMRParser *p) {
+    char *s = p->Line, *value;
+    uint8_t obis = 0, phase;
+
+    if (strncmp(s, "1-0:", 4)) return;
+    s += 4;
+    while (*s >= '0' && *s <= '9') obis = obis * 10 + (*s++ - '0');
+    if (strncmp(s, ".7.0(", 5)) return;
+    value = s + 5;
+
+    switch (obis) {
+        case 1:                                                                 // 1-0:1.7.0 Power delivered (kW)
+            p->PowerDelivered = DSMRValue(value, 3);
+            p->Flags |= DSMR_POWER;
+            break;
+        case 2:                                                                 // 1-0:2.7.0 Power returned (kW)
+            p->PowerReturned = DSMRValue(value, 3);
+            break;
+        case 21: case 41: case 61:                                              // 1-0:21/41/61.7.0 Phase power delivered (kW)
+            phase = (obis - 21) / 20;
+            p->Delivered[phase] = DSMRValue(value, 3);
+            p->Flags |= DSMR_PHASE_POWER;
+            break;
+        case 22: case 42: case 62:                                              // 1-0:22/42/62.7.0 Phase power returned (kW)
+            phase = (obis - 22) / 20;
+            p->Returned[phase] = DSMRValue(value, 3);
+            break;
+        case 31: case 51: case 71:                                              // 1-0:31/51/71.7.0 Phase current (A)
+            phase = (obis - 31) / 20;
+            p->Current[phase] = DSMRValue(value, 3);
+            p->Flags |= DSMR_CURRENT;
+            break;
+        case 32: case 52: case 72:                                              // 1-0:32/52/72.7.0 Phase voltage (V)
+            phase = (obis - 32) / 20;
+            p->Voltage[phase] = DSMRValue(value, 1);
+            p->Flags |= DSMR_VOLTAGE;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Copy the parsed values of a complete telegram to the output
+ * The phase currents are calculated from power and voltage when available, as DSMR reports
+ * the currents in whole Amps and without sign.
+ */
+static void DSMRResult(struct DSMRParser *p, struct P1Data *out) {
+    uint8_t x;
+    int32_t power;
+
+    for (x = 0; x < 3; x++) {
+        power = p->Delivered[x] - p->Returned[x];
+        out->PhasePower[x] = power;
+        out->Voltage[x] = p->Voltage[x];
+        if ((p->Flags & DSMR_PHASE_POWER) && (p->Flags & DSMR_VOLTAGE) && p->Voltage[x] > 1000) {
+            out->Current[x] = power * 10000 / p->Voltage[x];                    // W / 0.1V -> mA
+        } else {
+            out->Current[x] = (power < 0) ? -p->Current[x] : p->Current[x];
+        }
+    }
+    out->Power = p->PowerDelivered - p->PowerReturned;
+    out->Flags = p->Flags;
+}
+
+/**
+ * Reset parser, wait for the start of a telegram
+ */
+void DSMRInit(struct DSMRParser *p) {
+    memset(p, 0, sizeof(struct DSMRParser));
+    p->State = DSMR_WAIT_START;
+}
+
+/**
+ * Feed one received character to the parser
+ *
+ * @param pointer to DSMRParser
+ * @param uint8_t received character
+ * @param pointer to P1Data, only written when a telegram is complete
+ * @return uint8_t 1: complete telegram with valid CRC, 0: not (yet)
+ */
+uint8_t DSMRFeed(struct DSMRParser *p, uint8_t c, struct P1Data *out) {
+
+    if (c == '/') {                                                             // Start of telegram, also resyncs after errors
+        DSMRInit(p);
+        p->State = DSMR_DATA;
+        p->Crc = DSMRCrc(0, c);
+        p->LineLen = 0xFF;                                                      // skip identification line
+        return 0;
+    }
+
+    switch (p->State) {
+        case DSMR_DATA:
+            p->Crc = DSMRCrc(p->Crc, c);
+            if (c == '!') {                                                     // End of data, CRC follows
+                p->State = DSMR_CRC;
+            } else if (c == '\n') {
+                if (p->LineLen != 0xFF) {
+                    p->Line[p->LineLen] = 0;
+                    DSMRLine(p);
+                }
+                p->LineLen = 0;
+            } else if (c != '\r' && p->LineLen != 0xFF) {
+                if (p->LineLen < DSMR_LINE_SIZE - 1) p->Line[p->LineLen++] = c;
+                else p->LineLen = 0xFF;                                         // line too long, not a value we need
+            }
+            break;
+
+        case DSMR_CRC:
+            if (c >= '0' && c <= '9') c -= '0';
+            else if (c >= 'A' && c <= 'F') c -= 'A' - 10;
+            else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+            else {                                                              // DSMR 2/3 telegrams have no CRC
+                p->State = DSMR_WAIT_START;
+                return 0;
+            }
+            p->RxCrc = (p->RxCrc << 4) | c;
+            if (++p->CrcLen == 4) {
+                p->State = DSMR_WAIT_START;
+                if (p->RxCrc == p->Crc) {
+                    DSMRResult(p, out);
+                    return 1;
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+    return 0;
+}
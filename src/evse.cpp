@@ -17,10 +17,27 @@
 #include "ModbusClientRTU.h"        // Master
 
 #include "time.h"
+#include <stdarg.h>
+#include <memory>
+#include <vector>
 
 #include "evse.h"
 #include "utils.h"
 #include "modbus.h"
+#include "meters.h"
+#include "dsmr.h"
+#include "modbustcp.h"
+#include "samplewindow.h"
+#include "isrstats.h"
+#include "pilotfilter.h"
+#include "hal.h"
+#include "trace.h"
+#include "balance.h"
+#include "picontrol.h"
+#include "solarforecast.h"
+#include "schedule.h"
+#include "planner.h"
+#include "demand.h"
 // #include "glcd.h"
 // #include "OneWire.h"
 
@@ -32,6 +49,9 @@
 #include "esp_adc_cal.h"
 
 #include "driver/uart.h"
+#if CP_SAMPLE_DMA
+#include "driver/i2s.h"
+#endif
 #include "soc/rtc_io_struct.h"
 
 const char* NTP_SERVER = "europe.pool.ntp.org";        // only one server is supported
@@ -73,6 +93,18 @@ static esp_adc_cal_characteristics_t * adc_chars_CP;
 static esp_adc_cal_characteristics_t * adc_chars_PP;
 static esp_adc_cal_characteristics_t * adc_chars_Temperature;
 
+uint16_t ADCmV_CP[ADC_RAW_MAX];                                             // raw ADC value to mV lookup tables, built at startup
+uint16_t ADCmV_PP[ADC_RAW_MAX];
+uint16_t ADCmV_Temperature[ADC_RAW_MAX];
+uint16_t CPDutyTable[CP_CURRENT_MAX - CP_CURRENT_MIN + 1];                  // current (0.1A) to CP duty cycle (CP_DUTY_MAX = 100%), built at startup
+
+struct PilotFilter CPFilter;                                                // Pilot level bands in raw ADC values, and the confirmed level
+
+TaskHandle_t EVSEStatesHandle = NULL;
+TaskHandle_t P1TaskHandle = NULL;                                           // Runs only when the Mains meter is set to EM_P1
+volatile uint8_t PilotLevel = PILOT_NOK;                                    // Confirmed pilot level, updated when a window of CP samples is complete
+volatile uint8_t PilotDiodeOK = 0;                                          // Low plateau of the PWM signal at -12V (CP_EDGE_SYNC)
+
 struct ModBus MB;          // Used by SmartEVSE fuctions
 
 // Text
@@ -94,7 +126,6 @@ const char StrMainsHomeEVSE[] = "Home+EVSE";
 const char StrRFIDReader[6][10] = {"Disabled", "EnableAll", "EnableOne", "Learn", "Delete", "DeleteAll"};
 const char StrWiFi[3][10] = {"Disabled", "Enabled", "SetupWifi"};
 
-const char StrStateName[11][10] = {"A", "B", "C", "D", "COMM_B", "COMM_B_OK", "COMM_C", "COMM_C_OK", "Activate", "B1", "C1"};
 const char StrStateNameWeb[11][17] = {"Ready to Charge", "Connected to EV", "Charging", "D", "Request State B", "State B OK", "Request State C", "State C OK", "Activate", "Charging Stopped", "Stop Charging" };
 const char StrErrorNameWeb[9][20] = {"None", "No Power Available", "Communication Error", "Temperature High", "Unused", "RCM Tripped", "Waiting for Solar", "Test IO", "Flash Error"};
 
@@ -122,17 +153,23 @@ uint8_t MainsMeterAddress = MAINS_METER_ADDRESS;
 uint8_t MainsMeterMeasure = MAINS_METER_MEASURE;                            // What does Mains electric meter measure (0: Mains (Home+EVSE+PV) / 1: Home+EVSE / 2: Home)
 uint8_t PVMeter = PV_METER;                                                 // Type of PV electric meter (0: Disabled / Constants EM_*)
 uint8_t PVMeterAddress = PV_METER_ADDRESS;
+uint32_t MainsMeterIP = MAINS_METER_IP;                                     // Mains meter on the network (Modbus TCP), 0 = RS485
+uint32_t PVMeterIP = PV_METER_IP;                                           // PV meter on the network (Modbus TCP), 0 = RS485
+uint16_t MeterTCPPort = METER_TCP_PORT;
+uint8_t ModbusTCPWrite = MODBUS_TCP_WRITE;                                  // Allow writes to the registers served over Modbus TCP
 uint8_t Grid = GRID;                                                        // Type of Grid connected to Sensorbox (0:4Wire / 1:3Wire )
 uint8_t EVMeter = EV_METER;                                                 // Type of EV electric meter (0: Disabled / Constants EM_*)
 uint8_t EVMeterAddress = EV_METER_ADDRESS;
+uint8_t EVPhases = EV_PHASES;                                               // Phases the EV uses, bit 0-2: L1-L3 (0: learn from the EV meter)
+uint8_t EVPhasesUsed = 0;                                                   // Phases on which the EV meter measured current while charging
+uint8_t SchedulePolicy = SCHEDULE_POLICY;                                   // Which waiting EVSE gets a free slot (SCHEDULE_xxx)
+uint16_t ScheduleSlice = SCHEDULE_SLICE;                                    // Minimal time an EVSE keeps its slot (minutes)
 uint8_t RFIDReader = RFID_READER;                                           // RFID Reader (0:Disabled / 1:Enabled / 2:Enable One / 3:Learn / 4:Delete / 5:Delete All)
 uint8_t WIFImode = WIFI_MODE;                                               // WiFi Mode (0:Disabled / 1:Enabled / 2:Start Portal)
 String APpassword = "00000000";
 
 int32_t Irms[3]={0, 0, 0};                                                  // Momentary current per Phase (23 = 2.3A) (resolution 100mA)
                                                                             // Max 3 phases supported
-uint8_t State = STATE_A;
-uint8_t ErrorFlags = NO_ERROR;
 uint8_t NextState;
 
 uint16_t MaxCapacity;                                                       // Cable limit (A) (limited by the wire in the charge cable, set automatically, or manually if Config=Fixed Cable)
@@ -143,6 +180,11 @@ int16_t Isum = 0;                                                           // S
 
 // Load Balance variables
 int16_t IsetBalanced = 0;                                                   // Max calculated current (Amps *10) available for all EVSE's
+int16_t IsetPhase[3] = {0, 0, 0};                                           // Max calculated current per phase (Amps *10) for the EVSE's on that phase (Smart mode)
+struct PIGains ControlGains = {PI_KP, PI_KI, PI_KI_DOWN, PI_RATE_UP, PI_RATE_DOWN};  // Gains of the mains current controllers
+struct PIControl PhaseControl[3];                                           // Controller per phase (Smart mode)
+struct PIControl SolarControl;                                              // Controller of the sum of all phases (Solar mode)
+struct SolarForecast SolarEstimate = {SOLAR_ALPHA, SOLAR_BETA, 0, 0, SOLAR_VARIANCE_INIT, 0};  // Forecast of the import without the EVSE's (Solar mode)
 uint16_t Balanced[NR_EVSES] = {0, 0, 0, 0, 0, 0, 0, 0};                     // Amps value per EVSE
 uint16_t BalancedMax[NR_EVSES] = {0, 0, 0, 0, 0, 0, 0, 0};                  // Max Amps value per EVSE
 uint8_t BalancedState[NR_EVSES] = {0, 0, 0, 0, 0, 0, 0, 0};                 // State of all EVSE's 0=not active (state A), 1=charge request (State B), 2= Charging (State C)
@@ -176,8 +218,6 @@ uint8_t SubMenu = 0;
 uint32_t ScrollTimer = 0;
 uint8_t LCDpos = 0;
 uint8_t LCDupdate = 0;                                                      // flag to update the LCD every 1000ms
-uint8_t ChargeDelay = 0;                                                    // Delays charging at least 60 seconds in case of not enough current available.
-uint8_t C1Timer = 0;
 uint8_t NoCurrent = 0;                                                      // counts overcurrent situations.
 uint8_t TestState = 0;
 uint8_t ModbusRequest = 0;                                                  // Flag to request Modbus information
@@ -197,30 +237,63 @@ int32_t PowerMeasured = 0;                                                  // M
 uint8_t RFIDstatus = 0;
 uint8_t ExternalMaster = 0;
 int32_t EnergyEV = 0;   
+struct PlanTable Tariff;                                                    // Price or CO2 per kWh, uploaded with /tariff
+struct Plan ChargePlan;                                                     // Charge current per 15 minutes until the departure
+uint32_t PlanTarget = 0;                                                    // Energy to charge before the departure (Wh), 0 = no plan
+uint32_t PlanDeparture = 0;                                                 // Unix time
+uint32_t PlanDone = 0;                                                      // Energy charged when the plan was made (Wh)
+uint16_t PlanLimit = 0;                                                     // Planned charge current (Amps *10), 0 = no limit
+uint8_t PlanMax = 0;                                                        // Max current used for the plan (A)
+bool PlanDirty = false;                                                     // Make a new plan
+bool PlanWait = false;                                                      // Not charging in this slot of the plan
+portMUX_TYPE plan_spinlock = portMUX_INITIALIZER_UNLOCKED;                  // Tariff, PlanTarget, PlanDeparture and PlanDirty are set by the web server
+struct Demand MainsDemand;                                                  // 15 minute average of the mains import (capacity tariff)
+uint32_t DemandTarget = DEMAND_TARGET;                                      // Max 15 minute average import (W), 0 = no limit
+int32_t DemandLimit = 0;                                                    // Isum allowed now to stay below DemandTarget (Amps *10)
+int32_t DemandPeak[12];                                                     // Highest quarter hour average per month (W)
+uint16_t DemandMonth = 0;                                                   // year * 12 + month of the peaks of this month
+uint8_t CircuitMax[BALANCE_CIRCUITS] = {0, 0, 0, 0};                        // Max current per phase of a sub-circuit (A), 0 = not limited
+uint8_t CircuitParent[BALANCE_CIRCUITS] = {0, 0, 0, 0};                     // Circuit a sub-circuit is connected to, always a lower number (0 = mains)
 int32_t CM[3]={0, 0, 0};
+int32_t MainsPower = 0;
+uint16_t MeasureRegs[MODBUS_EVSE_MEASURE_COUNT];                            // Snapshot of the measurement registers (0x0300)
+portMUX_TYPE measure_spinlock = portMUX_INITIALIZER_UNLOCKED;
+volatile uint8_t MainsUpdated = 0;                                          // Set when new mains measurements are pushed (P1 / Modbus TCP)
 int32_t PV[3]={0, 0, 0};
 uint8_t ResetKwh = 2;                                                       // if set, reset EV kwh meter at state transition B->C
                                                                             // cleared when charging, reset to 1 when disconnected (state A)
-uint8_t ActivationMode = 0, ActivationTimer = 0;
 volatile uint16_t adcsample = 0, ppsample = 0;
-volatile uint16_t ADCsamples[25];                                           // declared volatile, as they are used in a ISR
-volatile uint8_t sampleidx = 0;
+struct SampleWindow CPWindow;                                               // CP samples, written by the ISR (or CPSampleTask), min/max per 25 samples
+struct SampleWindow CPLowWindow;                                            // CP samples of the low plateau of the PWM signal (CP_EDGE_SYNC)
+volatile uint16_t CPDuty = PWM_100;                                         // PWM duty cycle (0.1%), also the falling edge in us
+volatile uint8_t CPPlateau = 0;                                             // Next sample: 0 high plateau, 1 low plateau
+volatile uint16_t CPAlarm = 0;                                              // Timer count of the pending CP sample alarm (us), 0 with autoreload
+struct IsrHistogram CPLatency;                                              // CP sample alarm to ISR entry (us)
+struct IsrHistogram CPConversion;                                           // ADC conversion time in the ISR (cycles)
+struct IsrHistogram CPIsrTime;                                              // CP sample ISR duration (cycles)
 volatile int adcchannel = ADC1_CHANNEL_3;
+volatile uint16_t CPSampleTime = PWM_100;                                   // Sample point in the PWM period (PWM_5 / PWM_95), or PWM_100 every 1ms
+#if CP_SAMPLE_DMA
+SemaphoreHandle_t ADCMutex;                                                 // PP and Temperature readings pause the CP sampling DMA
+volatile uint8_t CPSkipBlock = 0;                                           // Skip the DMA block with the gap after a pause
+#endif
 char str[20];
 int avgsamples = 0;
 bool LocalTimeSet = false;
 
-struct EMstruct EMConfig[EM_CUSTOM + 1] = {
-    /* DESC,      ENDIANNESS,      FCT, DATATYPE,            U_REG,DIV, I_REG,DIV, P_REG,DIV, E_REG,DIV */
-    {"Disabled",  ENDIANESS_LBF_LWF, 0, MB_DATATYPE_INT32,        0, 0,      0, 0,      0, 0,      0, 0}, // First entry!
-    {"Sensorbox", ENDIANESS_HBF_HWF, 4, MB_DATATYPE_FLOAT32, 0xFFFF, 0,      0, 0, 0xFFFF, 0, 0xFFFF, 0}, // Sensorbox (Own routine for request/receive)
-    {"Phoenix C", ENDIANESS_HBF_LWF, 4, MB_DATATYPE_INT32,      0x0, 1,    0xC, 3,   0x28, 1,   0x3E, 1}, // PHOENIX CONTACT EEM-350-D-MCB (0,1V / mA / 0,1W / 0,1kWh) max read count 11
-    {"Finder",    ENDIANESS_HBF_HWF, 4, MB_DATATYPE_FLOAT32, 0x1000, 0, 0x100E, 0, 0x1026, 0, 0x1106, 3}, // Finder 7E.78.8.400.0212 (V / A / W / Wh) max read count 127
-    {"Eastron",   ENDIANESS_HBF_HWF, 4, MB_DATATYPE_FLOAT32,    0x0, 0,    0x6, 0,   0x34, 0,  0x156, 0}, // Eastron SDM630 (V / A / W / kWh) max read count 80
-    {"ABB",       ENDIANESS_HBF_HWF, 3, MB_DATATYPE_INT32,   0x5B00, 1, 0x5B0C, 2, 0x5B14, 2, 0x5002, 2}, // ABB B23 212-100 (0.1V / 0.01A / 0.01W / 0.01kWh) RS485 wiring reversed / max read count 125
-    {"SolarEdge", ENDIANESS_HBF_HWF, 3, MB_DATATYPE_INT16,    40196, 0,  40191, 0,  40083, 0,  40226, 3}, // SolarEdge SunSpec (0.01V (16bit) / 0.1A (16bit) / 1W  (16bit) / 1 Wh (32bit))
-    {"WAGO",      ENDIANESS_HBF_HWF, 3, MB_DATATYPE_FLOAT32, 0x5002, 0, 0x500C, 0, 0x5012, 3, 0x6000, 0}, // WAGO 879-30x0 (V / A / kW / kWh)
-    {"Custom",    ENDIANESS_LBF_LWF, 4, MB_DATATYPE_INT32,        0, 0,      0, 0,      0, 0,      0, 0}  // Last entry!
+struct EMstruct EMConfig[EM_MAX] = {
+    /* DESC,      ENDIANNESS,      FCT, DATATYPE,            U_REG,DIV, I_REG,DIV, P_REG,DIV, E_REG,DIV, READMAX, SIGN */
+    {"Disabled",  ENDIANESS_LBF_LWF, 0, MB_DATATYPE_INT32,        0, 0,      0, 0,      0, 0,      0, 0,       0,    0}, // First entry!
+    {"Sensorbox", ENDIANESS_HBF_HWF, 4, MB_DATATYPE_FLOAT32, 0xFFFF, 0,      0, 0, 0xFFFF, 0, 0xFFFF, 0,      20,    0}, // Sensorbox (Own routine for request/receive)
+    {"Phoenix C", ENDIANESS_HBF_LWF, 4, MB_DATATYPE_INT32,      0x0, 1,    0xC, 3,   0x28, 1,   0x3E, 1,      11,    0}, // PHOENIX CONTACT EEM-350-D-MCB (0,1V / mA / 0,1W / 0,1kWh) max read count 11
+    {"Finder",    ENDIANESS_HBF_HWF, 4, MB_DATATYPE_FLOAT32, 0x1000, 0, 0x100E, 0, 0x1026, 0, 0x1106, 3,     127,    0}, // Finder 7E.78.8.400.0212 (V / A / W / Wh) max read count 127
+    {"Eastron",   ENDIANESS_HBF_HWF, 4, MB_DATATYPE_FLOAT32,    0x0, 0,    0x6, 0,   0x34, 0,  0x156, 0,      80,    3}, // Eastron SDM630 (V / A / W / kWh) max read count 80, sign from phase power 0x0C - 0x11
+    {"ABB",       ENDIANESS_HBF_HWF, 3, MB_DATATYPE_INT32,   0x5B00, 1, 0x5B0C, 2, 0x5B14, 2, 0x5002, 2,     125,    5}, // ABB B23 212-100 (0.1V / 0.01A / 0.01W / 0.01kWh) RS485 wiring reversed / max read count 125, sign from phase power 0x5B16 - 0x5B1B
+    {"SolarEdge", ENDIANESS_HBF_HWF, 3, MB_DATATYPE_INT16,    40196, 0,  40191, 0,  40083, 0,  40226, 3,     125,    0}, // SolarEdge SunSpec (0.01V (16bit) / 0.1A (16bit) / 1W  (16bit) / 1 Wh (32bit))
+    {"WAGO",      ENDIANESS_HBF_HWF, 3, MB_DATATYPE_FLOAT32, 0x5002, 0, 0x500C, 0, 0x5012, 3, 0x6000, 0,     125,    0}, // WAGO 879-30x0 (V / A / kW / kWh)
+    {"Custom",    ENDIANESS_LBF_LWF, 4, MB_DATATYPE_INT32,        0, 0,      0, 0,      0, 0,      0, 0,       3,    0}, // Custom
+    {"P1 DSMR",   ENDIANESS_LBF_LWF, 0, MB_DATATYPE_INT32,   0xFFFF, 0, 0xFFFF, 0, 0xFFFF, 0, 0xFFFF, 0,       0,    0}  // Last built-in entry! DSMR P1 telegrams on UART2 (Own routine for receive)
+                                                                                // EM_PROFILE_FIRST and up are filled by LoadMeterProfiles()
 };
 
 
@@ -266,13 +339,72 @@ uint16_t IRAM_ATTR local_adc1_read(int channel) {
 
 
 
+/**
+ * Wake up EVSEStates, the pilot level changed
+ * 
+ * @param bool isr: called from an interrupt
+ */
+void IRAM_ATTR NotifyEVSEStates(bool isr) {
+    BaseType_t woken = pdFALSE;
+
+    PilotChangeTime = esp_timer_get_time();
+    if (EVSEStatesHandle == NULL) return;
+
+    if (isr) {
+        vTaskNotifyGiveFromISR(EVSEStatesHandle, &woken);
+        if (woken) portYIELD_FROM_ISR();
+    } else xTaskNotifyGive(EVSEStatesHandle);
+}
+
+/**
+ * Wake up EVSEStates from another task, an input of the state transitions changed
+ * (a state set by the Master, or the timers and error flags updated by Timer1S)
+ */
+void WakeEVSEStates(void) {
+    if (EVSEStatesHandle == NULL || xTaskGetCurrentTaskHandle() == EVSEStatesHandle) return;
+    xTaskNotifyGive(EVSEStatesHandle);
+}
+
+/**
+ * A window of CP samples is complete, classify it and wake up EVSEStates when the confirmed level changed.
+ * Called by the producer of the CP samples.
+ * 
+ * @param bool isr: called from an interrupt
+ */
+void IRAM_ATTR CPWindowDone(bool isr) {
+    // producer side, Stats is stable
+    if (!PilotFilterAdd(&CPFilter, CPWindow.Stats.Min, CPWindow.Stats.Max)) return;
+    PilotLevel = CPFilter.Level;
+    NotifyEVSEStates(isr);
+}
+
+/**
+ * A window of low plateau samples is complete, check for the diode of the EV
+ * 
+ * @param bool isr: called from an interrupt
+ */
+void IRAM_ATTR CPLowWindowDone(bool isr) {
+    struct PilotBand *band = &CPFilter.Enter[PILOT_DIODE];
+    uint8_t diode = (CPLowWindow.Stats.Min >= band->Min) && (CPLowWindow.Stats.Max < band->Max);
+
+    if (diode == PilotDiodeOK) return;
+    PilotDiodeOK = diode;
+    NotifyEVSEStates(isr);
+}
+
+
 // CP pin low to high transition ISR
 //
 //
 void IRAM_ATTR onCPpulse() {
 
+  if (CPSampleTime == PWM_100) return;                          // No PWM, the timer samples every 1ms
+
   // reset timer, these functions are in IRAM !
+  CPPlateau = 0;                                                // first sample the high plateau
+  CPAlarm = PWM_5;
   timerWrite(timerA, 0);                                        
+  timerAlarmWrite(timerA, PWM_5, false);
   timerAlarmEnable(timerA);
 }
 
@@ -282,13 +414,139 @@ void IRAM_ATTR onCPpulse() {
 // in STATE A this is called every 1ms (autoreload)
 // in STATE B/C there is a PWM signal, and the Alarm is set to 5% after the low-> high transition of the PWM signal
 void IRAM_ATTR onTimerA() {
+  uint32_t entry = ESP.getCycleCount(), conversion;
+  uint32_t latency = (uint32_t)timerRead(timerA) - CPAlarm;     // us since the alarm, the counter runs on
 
   RTC_ENTER_CRITICAL();
+  conversion = ESP.getCycleCount();
   adcsample = local_adc1_read(adcchannel);
+  conversion = ESP.getCycleCount() - conversion;
   RTC_EXIT_CRITICAL();
 
-  ADCsamples[sampleidx++] = adcsample;
-  if (sampleidx == 25) sampleidx = 0;
+#if CP_EDGE_SYNC
+  if (CPSampleTime != PWM_100) {
+    if (CPPlateau == 0) {
+      // High plateau, PWM_5 after the rising edge. Rejected when the pulse is too short.
+      if (PWM_5 + CP_EDGE_GUARD < CPDuty) {
+        if (SampleWindowPut(&CPWindow, adcsample)) CPWindowDone(true);
+      }
+      // Then sample halfway the low plateau
+      if (CPDuty + 2 * CP_EDGE_GUARD <= PWM_100) {
+        CPPlateau = 1;
+        CPAlarm = (CPDuty + PWM_100) / 2;
+        timerAlarmWrite(timerA, CPAlarm, false);
+        timerAlarmEnable(timerA);
+      }
+    } else {
+      if (SampleWindowPut(&CPLowWindow, adcsample)) CPLowWindowDone(true);
+    }
+  } else
+#endif
+  if (SampleWindowPut(&CPWindow, adcsample)) CPWindowDone(true);
+
+  IsrHistogramAdd(&CPLatency, latency);
+  IsrHistogramAdd(&CPConversion, conversion);
+  IsrHistogramAdd(&CPIsrTime, ESP.getCycleCount() - entry);
+}
+
+
+/**
+ * Set the point in the PWM period where the CP signal is sampled
+ * 
+ * @param uint16_t time: PWM_5 / PWM_95 (after the rising edge of the PWM signal), or PWM_100 (no PWM, sample every 1ms)
+ */
+void setCPSampleTiming(uint16_t time) {
+    CPSampleTime = time;
+    SampleWindowRestart(&CPWindow);                                             // Do not mix samples from before and after the change
+    SampleWindowRestart(&CPLowWindow);
+    if (time == PWM_100) PilotDiodeOK = 0;                                      // No PWM, no low plateau
+#if !CP_SAMPLE_DMA
+    CPAlarm = (time == PWM_100) ? 0 : time;                                     // with autoreload the counter restarts at the alarm
+    timerAlarmWrite(timerA, time, time == PWM_100);                             // auto reload only without PWM
+#endif
+}
+
+
+#if CP_SAMPLE_DMA
+/**
+ * Task that takes the CP samples from the DMA blocks of the I2S ADC
+ * The ADC runs continuously at CP_DMA_RATE, there is only one interrupt per block (10ms).
+ * The PWM signal and the ADC run from the same crystal, the edges in the block are used to
+ * pick the high plateau sample at PWM_5 after the rising edge, and the low plateau sample halfway the low part.
+ */
+void CPSampleTask(void * parameter) {
+    uint16_t buf[CP_DMA_BLOCK], tmp;
+    size_t bytes;
+    uint16_t n, i, f, offset;
+    const uint16_t period = CP_DMA_RATE / 1000;                                // samples per PWM period
+    const uint16_t guard = (CP_EDGE_GUARD * period + PWM_100 - 1) / PWM_100;   // samples, rounded up
+
+    while(1) {
+        if (i2s_read(I2S_NUM_0, buf, sizeof(buf), &bytes, portMAX_DELAY) != ESP_OK) continue;
+        if (CPSkipBlock) {
+            CPSkipBlock = 0;
+            continue;
+        }
+        n = bytes / 2;
+
+        for (i = 0; i + 1 < n; i += 2) {
+            // The I2S stores the 16 bit samples swapped in pairs. Bits 15-12 hold the channel,
+            // the data is 12 bits, while the CP characterisation (adc_chars_CP) is 10 bits.
+            tmp = buf[i];
+            buf[i] = (buf[i + 1] & 0x0FFF) >> 2;
+            buf[i + 1] = (tmp & 0x0FFF) >> 2;
+        }
+
+        if (CPSampleTime == PWM_100) {
+            // No PWM, one sample every 1ms
+            for (i = 0; i < n; i += period) {
+                if (SampleWindowPut(&CPWindow, buf[i])) CPWindowDone(false);
+            }
+        } else {
+            offset = PWM_5 * period / PWM_100;
+            for (i = 1; i + period < n; i++) {
+                if (buf[i - 1] >= CP_DMA_EDGE || buf[i] < CP_DMA_EDGE) continue;   // rising edge?
+                // find the falling edge
+                for (f = i + 1; f < i + period && buf[f] >= CP_DMA_EDGE; f++);
+                // samples too close to an edge are rejected
+                if (i + offset + guard < f) {
+                    if (SampleWindowPut(&CPWindow, buf[i + offset])) CPWindowDone(false);
+                }
+                if (f + 2 * guard <= i + period) {
+                    if (SampleWindowPut(&CPLowWindow, buf[(f + i + period) / 2])) CPLowWindowDone(false);
+                }
+                i = f;
+            }
+        }
+    }
+}
+#endif
+
+
+/**
+ * Sample a ADC1 channel (PP or Temperature)
+ * In DMA mode, the I2S ADC is paused as it shares the ADC with the RTC controller.
+ * 
+ * @param int channel
+ * @return uint16_t raw sample (10 bits)
+ */
+uint16_t ADCSample(int channel) {
+    uint16_t sample;
+
+#if CP_SAMPLE_DMA
+    xSemaphoreTake(ADCMutex, portMAX_DELAY);
+    i2s_adc_disable(I2S_NUM_0);
+#endif
+    RTC_ENTER_CRITICAL();
+    sample = local_adc1_read(channel);
+    RTC_EXIT_CRITICAL();
+#if CP_SAMPLE_DMA
+    CPSkipBlock = 1;
+    i2s_adc_enable(I2S_NUM_0);
+    xSemaphoreGive(ADCMutex);
+#endif
+
+    return sample;
 }
 
 
@@ -395,15 +653,34 @@ void BlinkLed(void * parameter) {
 // Current in Amps * 10 (160 = 16A)
 void SetCurrent(uint16_t current) {
 
+    static uint16_t TracedCurrent = 0;
     uint32_t DutyCycle;
 
-    if ((current >= 60) && (current <= 510)) DutyCycle = current / 0.6;
-                                                                            // calculate DutyCycle from current
-    else if ((current > 510) && (current <= 800)) DutyCycle = (current / 2.5) + 640;
-    else DutyCycle = 100;                                                   // invalid, use 6A
+    if (current != TracedCurrent) {
+        TraceAdd(TRACE_CURRENT, State, TracedCurrent, current);
+        TracedCurrent = current;
+    }
+
+    if ((current >= CP_CURRENT_MIN) && (current <= CP_CURRENT_MAX)) DutyCycle = CPDutyTable[current - CP_CURRENT_MIN];
+    else DutyCycle = CPDutyTable[0];                                        // invalid, use 6A
+
+    CPDuty = DutyCycle * PWM_100 / CP_DUTY_MAX;                             // falling edge for the CP sampling
+    Hal->CPDuty(DutyCycle);                                                 // update PWM signal
+}
+
+
+/**
+ * Build the current to CP duty cycle table (IEC 61851, integer math, rounded)
+ * 6A - 51A:  duty = current / 0.6 (%)
+ * 51A - 80A: duty = current / 2.5 + 64 (%)
+ */
+void BuildDutyTable(void) {
+    uint32_t current;
 
-    DutyCycle = DutyCycle * 1024 / 1000;                                    // conversion to 1024 = 100%
-    ledcWrite(CP_CHANNEL, DutyCycle);                                       // update PWM signal
+    for (current = CP_CURRENT_MIN; current <= CP_CURRENT_MAX; current++) {
+        if (current <= 510) CPDutyTable[current - CP_CURRENT_MIN] = (current * CP_DUTY_MAX + 300) / 600;
+        else CPDutyTable[current - CP_CURRENT_MIN] = ((2 * current + 3200) * CP_DUTY_MAX + 2500) / 5000;
+    }
 }
 
 
@@ -413,13 +690,11 @@ signed char TemperatureSensor() {
     uint32_t sample, voltage;
     signed char Temperature;
 
-    RTC_ENTER_CRITICAL();
     // Sample Temperature Sensor
-    sample = local_adc1_read(ADC1_CHANNEL_0);
-    RTC_EXIT_CRITICAL();
+    sample = Hal->ADCSample(ADC1_CHANNEL_0);
 
     // voltage range is from 0-2200mV 
-    voltage = esp_adc_cal_raw_to_voltage(sample, adc_chars_Temperature);
+    voltage = ADCmV_Temperature[sample & (ADC_RAW_MAX - 1)];
 
     // The MCP9700A temperature sensor outputs 500mV at 0C, and has a 10mV/C change in output voltage.
     // so 750mV is 25C, 400mV = -10C
@@ -435,12 +710,10 @@ signed char TemperatureSensor() {
 void ProximityPin() {
     uint32_t sample, voltage;
 
-    RTC_ENTER_CRITICAL();
     // Sample Proximity Pilot (PP)
-    sample = local_adc1_read(ADC1_CHANNEL_6);
-    RTC_EXIT_CRITICAL();
+    sample = Hal->ADCSample(ADC1_CHANNEL_6);
 
-    voltage = esp_adc_cal_raw_to_voltage(sample, adc_chars_PP);
+    voltage = ADCmV_PP[sample & (ADC_RAW_MAX - 1)];
 
     Serial.printf("PP pin: %u (%u mV)\n", sample, voltage);
     MaxCapacity = 13;                                                       // No resistor, Max cable current = 13A
@@ -452,47 +725,75 @@ void ProximityPin() {
 }
 
 
-// Determine the state of the Pilot signal
-//
-uint8_t Pilot() {
-
-    uint32_t sample, Min = 3300, Max = 0;
-    uint32_t voltage;
-    uint8_t n;
+/**
+ * Build the raw ADC value to mV lookup table of a channel
+ * 
+ * @param pointer to lut
+ * @param pointer to chars: ADC characterisation of the channel
+ */
+void BuildADCTable(uint16_t *lut, esp_adc_cal_characteristics_t *chars) {
+    uint16_t raw;
 
-    // make sure we wait 100ms after each state change before calculating Average
-    //if ( (StateTimer + 100) > millis() ) return PILOT_WAIT;
+    for (raw = 0; raw < ADC_RAW_MAX; raw++) lut[raw] = esp_adc_cal_raw_to_voltage(raw, chars);
+}
 
-    // calculate Min/Max of last 25 CP measurements
-    for (n=0 ; n<25 ;n++) {
-        sample = ADCsamples[n];
-        voltage = esp_adc_cal_raw_to_voltage( sample, adc_chars_CP);        // convert adc reading to voltage
-        if (voltage < Min) Min = voltage;                                   // store lowest value
-        if (voltage > Max) Max = voltage;                                   // store highest value
-    }    
-    //Serial.printf("min:%u max:%u\n",Min ,Max);
+/**
+ * Find the lowest raw ADC value that converts to more than mV
+ * 
+ * @param pointer to lut (monotonic)
+ * @param uint16_t mV
+ * @return uint16_t raw value, ADC_RAW_MAX if there is none
+ */
+uint16_t ADCRawAbove(const uint16_t *lut, uint16_t mV) {
+    uint16_t raw;
 
-    // test Min/Max against fixed levels
-    if (Min > 3000 ) return PILOT_12V;                                      // Pilot at 12V (min 11.0V)
-    if ((Min > 2700) && (Max < 2930)) return PILOT_9V;                      // Pilot at 9V
-    if ((Min > 2400) && (Max < 2600)) return PILOT_6V;                      // Pilot at 6V
-    if ((Min > 100) && (Max < 300)) return PILOT_DIODE;                     // Diode Check OK
-    return PILOT_NOK;                                                       // Pilot NOT ok
+    for (raw = 0; raw < ADC_RAW_MAX; raw++) {
+        if (lut[raw] > mV) break;
+    }
+    return raw;
 }
 
+/**
+ * Set the raw ADC bands of a pilot level, the Hold band is PILOT_HYSTERESIS wider
+ * x > mV  becomes  raw >= ADCRawAbove(mV)
+ * x < mV  becomes  raw <  ADCRawAbove(mV - 1)
+ * 
+ * @param uint8_t level: PILOT_xxx
+ * @param uint16_t MinmV
+ * @param uint16_t MaxmV: 0 = no upper limit
+ */
+void SetupPilotBand(uint8_t level, uint16_t MinmV, uint16_t MaxmV) {
+    CPFilter.Enter[level].Min = ADCRawAbove(ADCmV_CP, MinmV);
+    CPFilter.Enter[level].Max = MaxmV ? ADCRawAbove(ADCmV_CP, MaxmV - 1) : 0xFFFF;
+    CPFilter.Hold[level].Min = ADCRawAbove(ADCmV_CP, MinmV - PILOT_HYSTERESIS);
+    CPFilter.Hold[level].Max = MaxmV ? ADCRawAbove(ADCmV_CP, MaxmV + PILOT_HYSTERESIS - 1) : 0xFFFF;
+}
 
 /**
- * Get name of a state
- *
- * @param uint8_t State
- * @return uint8_t[] Name
+ * Precompute the Pilot levels in raw ADC values, so the classifier only has to compare integers
  */
-const char * getStateName(uint8_t StateCode) {
-    if(StateCode < 11) return StrStateName[StateCode];
-    else return "NOSTATE";
+void SetupPilotLevels(void) {
+    SetupPilotBand(PILOT_12V, PILOT_12V_MIN, 0);                                // Pilot at 12V (min 11.0V)
+    SetupPilotBand(PILOT_9V, PILOT_9V_MIN, PILOT_9V_MAX);
+    SetupPilotBand(PILOT_6V, PILOT_6V_MIN, PILOT_6V_MAX);
+    SetupPilotBand(PILOT_DIODE, PILOT_DIODE_MIN, PILOT_DIODE_MAX);
+}
+
+
+// Determine the state of the Pilot signal
+// The level is classified by the producer of the CP samples (PilotFilterAdd), every complete window of 25 samples.
+// Only confirmed levels are returned: N of the last M windows, transient unknown windows keep the current level.
+//
+uint8_t Pilot() {
+
+    // make sure we wait 100ms after each state change before calculating Average
+    //if ( (StateTimer + 100) > millis() ) return PILOT_WAIT;
+
+    return PilotLevel;
 }
 
 
+
 const char * getStateNameWeb(uint8_t StateCode) {
     if(StateCode < 11) return StrStateNameWeb[StateCode];
     else return "NOSTATE";    
@@ -514,107 +815,271 @@ const char * getErrorNameWeb(uint8_t ErrorCode) {
 
 
 /**
- * Set EVSE mode
- * 
- * @param uint8_t Mode
+ * ESP32 hardware of the charging logic (see hal.h)
+ */
+void HalContactor(uint8_t nr, bool on) {
+    if (nr == 1) digitalWrite(PIN_SSR, on ? HIGH : LOW);
+    // else digitalWrite(PIN_SSR2, on ? HIGH : LOW);
+}
+
+void HalCPDuty(uint32_t duty) {
+    ledcWrite(CP_CHANNEL, duty);
+}
+
+uint32_t HalMillis(void) {
+    return millis();
+}
+
+int64_t HalMicros(void) {
+    return esp_timer_get_time();
+}
+
+uint32_t HalTime(void) {
+    return LocalTimeSet ? (uint32_t)time(NULL) : 0;
+}
+
+uint32_t HalCycles(void) {
+    return ESP.getCycleCount();
+}
+
+void HalLog(const char *fmt, ...) {
+    char buf[128];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    Serial.print(buf);
+}
+
+void HalWebText(const char *str) {
+    ws.textAll(str);
+}
+
+void HalWebStatus(void) {
+    // Connected to WiFi?
+    if (WiFi.status() == WL_CONNECTED) {
+        ws.printfAll("T:%d",TempEVSE);                                      // Send internal temperature to clients 
+        ws.printfAll("S:%s",getStateNameWeb(State));
+        ws.printfAll("E:%s",getErrorNameWeb(ErrorFlags));
+        ws.printfAll("C:%2.1f",(float)Balanced[0]/10);
+        ws.printfAll("I:%3.1f,%3.1f,%3.1f",(float)Irms[0]/10,(float)Irms[1]/10,(float)Irms[2]/10);
+        ws.printfAll("R:%u", esp_reset_reason() );
+
+        ws.cleanupClients();                                                // Cleanup old websocket clients
+    } 
+}
+
+const struct EVSEHal HalESP32 = {
+    HalContactor,
+    HalCPDuty,
+    setCPSampleTiming,
+    Pilot,
+    ADCSample,
+    HalMillis,
+    HalMicros,
+    HalTime,
+    HalCycles,
+    WakeEVSEStates,
+    HalLog,
+    HalWebText,
+    HalWebStatus,
+    ModbusWriteSingleRequest,
+    requestCurrentMeasurement,
+    requestEnergyMeasurement,
+    requestPowerMeasurement
+};
+const struct EVSEHal *Hal = &HalESP32;                                      // replaced by a host simulation
+
+
+
+/**
+ * Phases used by the EV on this EVSE
+ *
+ * @return uint8_t bit 0-2: L1-L3, 0 = unknown
  */
-void setMode(uint8_t NewMode) {
-    if (LoadBl == 1) ModbusWriteSingleRequest(BROADCAST_ADR, 0x0003, NewMode);
-    Mode = NewMode;
+uint8_t getEVPhases(void) {
+    return EVPhases ? EVPhases : EVPhasesUsed;
 }
 
 /**
- * Set the solar stop timer
- * 
- * @param unsigned int Timer (seconds)
+ * Store the current measured by the EV meter of an EVSE
+ *
+ * @param uint8_t NodeNr
+ * @param pointer to signed int EVCurrent[3] (mA)
  */
-void setSolarStopTimer(uint16_t Timer) {
-    if (LoadBl == 1 && SolarStopTimer != Timer) {
-        ModbusWriteSingleRequest(BROADCAST_ADR, 0x0004, Timer);
+void setEVCurrent(uint8_t NodeNr, signed int *EVCurrent) {
+    uint16_t Highest = 0, Current;
+    uint8_t x;
+
+    for (x = 0; x < 3; x++) {
+        Current = abs(EVCurrent[x]) / 100;
+        if (Current > Highest) Highest = Current;
     }
-    SolarStopTimer = Timer;
+    Node[NodeNr].EVCurrent = Highest;
+    Node[NodeNr].EVCurrentValid = BalancedState[NodeNr] == STATE_C ? EV_CURRENT_VALID : 0;
 }
 
+/**
+ * Current an EVSE draws: measured by its EV meter, or else the current it was set to
+ *
+ * @param uint8_t NodeNr
+ * @return uint16_t current (Amps *10)
+ */
+uint16_t getDrawnCurrent(uint8_t NodeNr) {
+    if (Node[NodeNr].EVCurrentValid) return Node[NodeNr].EVCurrent;
+    return Balanced[NodeNr];
+}
 
-void setState(uint8_t NewState) {
+/**
+ * Max current an EVSE can use
+ * An EV that draws less than it was set to (tapering, or a smaller onboard charger) keeps RECLAIM_MARGIN
+ * above its measurement, the rest can go to the other EVSE's. The pilot keeps the EV below this current,
+ * so when it picks up again, it grows by RECLAIM_MARGIN per measurement.
+ *
+ * @param uint8_t NodeNr
+ * @return uint16_t current (Amps *10)
+ */
+uint16_t getUsableCurrent(uint8_t NodeNr) {
+    uint16_t Usable;
+
+    if (!Node[NodeNr].EVCurrentValid || Node[NodeNr].Run < RECLAIM_DELAY) return BalancedMax[NodeNr];
+    Usable = Node[NodeNr].EVCurrent + RECLAIM_MARGIN;
+    if (Usable < MinCurrent * 10) Usable = MinCurrent * 10;
+    if (Usable > BalancedMax[NodeNr]) Usable = BalancedMax[NodeNr];
+    return Usable;
+}
 
-    if (State != NewState) {
-        
-        char Str[50];
-        snprintf(Str, 50, "#%02d:%02d:%02d STATE %s -> %s\n",timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec, getStateName(State), getStateName(NewState) ); 
+/**
+ * Sum the charging EVSE's per phase
+ * An EVSE of which the phases are not known, counts on all three phases.
+ *
+ * @param pointer to int Left[3]: number of charging EVSE's
+ * @param pointer to int Total[3]: sum of the currents the EVSE's draw (Amps *10)
+ * @param pointer to int Max[3]: sum of the max currents (Amps *10)
+ */
+void SumPhases(int *Left, int *Total, int *Max) {
+    uint8_t n, x, phases;
 
-#ifdef LOG_DEBUG_EVSE
-        // Log State change to webpage
-        ws.textAll(Str);    
-#endif                
-        Serial.print(Str+1);
-    }
-
-    switch (NewState) {
-        case STATE_B1:
-            if (!ChargeDelay) ChargeDelay = 3;                                  // When entering State B1, wait at least 3 seconds before switching to another state.
-            // fall through
-        case STATE_A:                                                           // State A1
-            CONTACTOR1_OFF;  
-            // CONTACTOR2_OFF;  
-            ledcWrite(CP_CHANNEL, 1024);                                        // PWM off,  channel 0, duty cycle 100%
-            timerAlarmWrite(timerA, PWM_100, true);                             // Alarm every 1ms, auto reload 
-            if (NewState == STATE_A) {
-                ErrorFlags &= ~NO_SUN;
-                ErrorFlags &= ~LESS_6A;
-                ChargeDelay = 0;
-                // Reset Node
-                Node[0].Timer = 0;
-                Node[0].Phases = 0;
-                Node[0].MinCurrent = 0;                                         // Clear ChargeDelay when disconnected.
-            }
-            break;
-        case STATE_B:
-            CONTACTOR1_OFF;
-            // CONTACTOR2_OFF;
-            timerAlarmWrite(timerA, PWM_95, false);                             // Enable Timer alarm, set to diode test (95%)
-            SetCurrent(ChargeCurrent);                                          // Enable PWM
-            break;      
-        case STATE_C:                                                           // State C2
-            ActivationMode = 255;                                               // Disable ActivationMode
-            CONTACTOR1_ON;                                                      // Contactor1 ON
-            // CONTACTOR2_ON;                                                      // Contactor2 ON
-            LCDTimer = 0;
-            break;
-        case STATE_C1:
-            ledcWrite(CP_CHANNEL, 1024);                                        // PWM off,  channel 0, duty cycle 100%
-            timerAlarmWrite(timerA, PWM_100, true);                             // Alarm every 1ms, auto reload 
-                                                                                // EV should detect and stop charging within 3 seconds
-            C1Timer = 6;                                                        // Wait maximum 6 seconds, before forcing the contactor off.
-            ChargeDelay = 15;
-            break;
-        default:
-            break;
+    for (x = 0; x < 3; x++) Left[x] = Total[x] = Max[x] = 0;
+    for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
+        phases = Node[n].Phases ? Node[n].Phases : PHASE_ALL;
+        for (x = 0; x < 3; x++) if (phases & (1 << x)) {
+            Left[x]++;
+            Total[x] += getDrawnCurrent(n);
+            Max[x] += BalancedMax[n];
+        }
     }
-    
-    BalancedState[0] = NewState;
-    State = NewState;
+}
+
+/**
+ * Does an EVSE ask for a slot?
+ * It asks to charge, or was refused because there was not enough current.
+ *
+ * @param uint8_t NodeNr (0-7)
+ * @return bool
+ */
+bool ScheduleAsks(uint8_t NodeNr) {
+    uint8_t state = BalancedState[NodeNr], error = NodeNr ? BalancedError[NodeNr] : ErrorFlags;
 
-    BacklightTimer = BACKLIGHT;                                                 // Backlight ON
+    return (NodeNr == 0 || Node[NodeNr].Online) && (state == STATE_COMM_B || state == STATE_COMM_C
+            || (state != STATE_A && state != STATE_C && (error & (LESS_6A | NO_SUN))));
 }
 
-void setAccess(bool Access) {
-    Access_bit = Access;
-    if (Access == 0) {
-        if (State == STATE_C) setState(STATE_C1);                               // Determine where to switch to.
-        else if (State == STATE_B) setState(STATE_B1);
+/**
+ * Fill the scheduler state of all EVSE's
+ * An EVSE waits for a free slot when it asks for one, and its sub-circuits have room for it.
+ * An EVSE held up by a full sub-circuit would otherwise keep the slot from the EVSE's that can use it.
+ *
+ * @param pointer to ScheduleEVSE evse[NR_EVSES]
+ */
+void ScheduleState(struct ScheduleEVSE *evse) {
+    uint8_t n;
+
+    for (n = 0; n < NR_EVSES; n++) {
+        evse[n].Charging = BalancedState[n] == STATE_C;
+        evse[n].Waiting = ScheduleAsks(n) && CircuitAvailable(n);
+        evse[n].Priority = Node[n].Priority;
+        evse[n].Connected = Node[n].Connected;
+        evse[n].Idle = Node[n].Idle;
+        evse[n].Run = Node[n].Run;
+        evse[n].Charged = Node[n].Charged;
+        evse[n].Room = 0xFF;
     }
 }
 
+/**
+ * May an EVSE that asks to charge take a free slot?
+ * Only when it is the next in line, otherwise the slot is kept for the EVSE that is.
+ *
+ * @param uint8_t NodeNr (0-7)
+ * @return bool
+ */
+bool ScheduleAllowed(uint8_t NodeNr) {
+    struct ScheduleEVSE evse[NR_EVSES];
+
+    if (LoadBl != 1) return true;                                               // Only the Master shares the current between EVSE's
+    ScheduleState(evse);
+    evse[NodeNr].Waiting = 1;
+    return ScheduleNext(SchedulePolicy, evse, NR_EVSES) == NodeNr;
+}
+
+/**
+ * Is an EVSE on this sub-circuit, or on a circuit below it?
+ *
+ * @param uint8_t NodeNr (0-7)
+ * @param uint8_t Circuit (1-BALANCE_CIRCUITS)
+ * @return bool
+ */
+bool OnCircuit(uint8_t NodeNr, uint8_t Circuit) {
+    uint8_t c;
+
+    for (c = Node[NodeNr].Circuit; c; c = CircuitParent[c - 1]) if (c == Circuit) return true;
+    return false;
+}
+
+/**
+ * Is there MinCurrent for one more EVSE, on every sub-circuit above it, when another EVSE is paused?
+ * The EVSE counts on all phases, as it is not known yet which phases the EV will use.
+ *
+ * @param uint8_t NodeNr (0-7)
+ * @param int8_t Pause: EVSE that is counted as not charging (0-7), -1 = none
+ * @return bool
+ */
+bool CircuitRoom(uint8_t NodeNr, int8_t Pause) {
+    uint8_t c, n, x, phases, Left[3];
+
+    if (LoadBl != 1) return true;                                               // Only the Master shares the current between EVSE's
+    for (c = Node[NodeNr].Circuit; c; c = CircuitParent[c - 1]) {
+        if (!CircuitMax[c - 1]) continue;
+        for (x = 0; x < 3; x++) Left[x] = 1;
+        for (n = 0; n < NR_EVSES; n++) if (n != NodeNr && n != Pause && BalancedState[n] == STATE_C && OnCircuit(n, c)) {
+            phases = Node[n].Phases ? Node[n].Phases : PHASE_ALL;
+            for (x = 0; x < 3; x++) if (phases & (1 << x)) Left[x]++;
+        }
+        for (x = 0; x < 3; x++) if (Left[x] * MinCurrent > CircuitMax[c - 1]) return false;
+    }
+    return true;
+}
 
+/**
+ * Is there MinCurrent for one more EVSE, on every sub-circuit above it?
+ *
+ * @param uint8_t NodeNr (0-7)
+ * @return bool
+ */
+bool CircuitAvailable(uint8_t NodeNr) {
+    return CircuitRoom(NodeNr, -1);
+}
 
 // Is there at least 6A(configurable MinCurrent) available for a EVSE?
 // returns 1 if there is 6A available
 // returns 0 if there is no current available
 //
 char IsCurrentAvailable(void) {
-    uint8_t n, ActiveEVSE = 0;
+    uint8_t n, x, ActiveEVSE = 0;
     int Baseload, TotalCurrent = 0;
+    int PhaseLeft[3], PhaseTotal[3], PhaseMax[3];
 
 
     for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C)             // must be in STATE_C
@@ -628,8 +1093,7 @@ char IsCurrentAvailable(void) {
         }
     } else {                                                                    // at least one active EVSE
         ActiveEVSE++;                                                           // Do calculations with one more EVSE
-        Baseload = Imeasured - TotalCurrent;                                    // Calculate Baseload (load without any active EVSE)
-        if (Baseload < 0) Baseload = 0;                                         // only relevant for Smart/Solar mode
+        SumPhases(PhaseLeft, PhaseTotal, PhaseMax);
 
         if (ActiveEVSE > NR_EVSES) ActiveEVSE = NR_EVSES;
         // When load balancing is active, and we are the Master, the Circuit option limits the max total current
@@ -639,24 +1103,81 @@ char IsCurrentAvailable(void) {
             }
         }
 
-        // Check if the lowest charge current(6A) x ActiveEV's + baseload would be higher then the MaxMains.
-        if ((ActiveEVSE * (MinCurrent * 10) + Baseload) > (MaxMains * 10)) {
-            return 0;                                                           // Not enough current available!, return with error
+        // Check if the lowest charge current(6A) x ActiveEV's + baseload would be higher then the MaxMains, on any phase.
+        // The new EVSE counts on all phases, as it is not known yet which phases the EV will use.
+        for (x = 0; x < 3; x++) {
+            Baseload = Mode ? Irms[x] - PhaseTotal[x] : 0;                      // Calculate Baseload (load without any active EVSE)
+            if (Baseload < 0) Baseload = 0;                                     // only relevant for Smart/Solar mode
+
+            if (((PhaseLeft[x] + 1) * (MinCurrent * 10) + Baseload) > (MaxMains * 10)) {
+                return 0;                                                       // Not enough current available!, return with error
+            }
         }
 
     }
 
+    // Capacity tariff: MinCurrent more on three phases has to fit in the 15 minute average import
+    if (Mode && DemandTarget) {
+        SumPhases(PhaseLeft, PhaseTotal, PhaseMax);
+        Baseload = Isum - PhaseTotal[0] - PhaseTotal[1] - PhaseTotal[2];
+        if (Baseload + (PhaseLeft[0] + PhaseLeft[1] + PhaseLeft[2] + 3) * MinCurrent * 10 > DemandLimit) return 0;
+    }
+
     // Allow solar Charging if surplus current is above 'StartCurrent' (sum of all phases)
     // Charging will start after the timeout (chargedelay) period has ended
      // Only when StartCurrent configured or Node MinCurrent detected or Node inactive
     if (Mode == MODE_SOLAR) {                                                   // no active EVSE yet?
         if (ActiveEVSE == 0 && Isum >= ((signed int)StartCurrent *-10)) return 0;
+                                                                                // and only if the surplus is expected to last
+        else if (ActiveEVSE == 0 && SolarEstimate.Samples > 1
+              && SolarForecastImport(&SolarEstimate, SOLAR_HORIZON, SOLAR_SIGMAS) >= ((signed int)StartCurrent *-10)) return 0;
         else if ((ActiveEVSE * MinCurrent * 10) > TotalCurrent) return 0;       // check if we can split the available current between all active EVSE's
     }
 
     return 1;
 }
 
+/**
+ * Pause a charging EVSE, when an EVSE that is waiting should have its slot
+ * An EVSE that waits for a full sub-circuit only takes the slot of an EVSE on that circuit.
+ * Called every second on the Master
+ */
+void ScheduleStep(void) {
+    struct ScheduleEVSE evse[NR_EVSES];
+    uint8_t n, m, flag = (Mode == MODE_SOLAR) ? NO_SUN : LESS_6A;
+    int8_t pause;
+    bool mains;
+
+    if (LoadBl != 1 || SchedulePolicy == SCHEDULE_FIFO) return;
+
+    for (n = 0; n < NR_EVSES; n++) {                                            // Wait until the last paused EVSE has stopped
+        if (BalancedState[n] == STATE_C && ((n ? BalancedError[n] : ErrorFlags) & (LESS_6A | NO_SUN))) return;
+    }
+
+    ScheduleState(evse);
+    mains = IsCurrentAvailable();
+    for (n = 0; n < NR_EVSES; n++) {
+        if (!CircuitAvailable(n)) evse[n].Waiting = ScheduleAsks(n);            // held up by its sub-circuit
+        else if (mains) evse[n].Waiting = 0;                                    // can start without pausing another one
+    }
+    for (n = 0; n < NR_EVSES; n++) {                                            // Pausing n makes room on the sub-circuits of m
+        evse[n].Room = 0;
+        for (m = 0; m < NR_EVSES; m++) if (evse[m].Waiting && CircuitRoom(m, n)) evse[n].Room |= 1 << m;
+    }
+    pause = SchedulePreempt(SchedulePolicy, evse, NR_EVSES, ScheduleSlice * 60);
+    if (pause < 0) return;
+
+    TraceAdd(TRACE_PAUSE, pause, SchedulePolicy, ScheduleNext(SchedulePolicy, evse, NR_EVSES));
+#ifdef LOG_INFO_EVSE
+    Serial.printf("Pause EVSE %i, slot for EVSE %i\n", pause, ScheduleNext(SchedulePolicy, evse, NR_EVSES));
+#endif
+    if (pause == 0) setErrorFlags(flag);                                        // Timer1S stops charging on this EVSE
+    else {
+        BalancedError[pause] |= flag;
+        ModbusWriteSingleRequest(pause + 1u, 0x0001, BalancedError[pause]);     // Node stops charging
+    }
+}
+
 void ResetBalancedStates(void) {
     uint8_t n;
 
@@ -671,37 +1192,71 @@ void ResetBalancedStates(void) {
 // mod =1 we have a new EVSE requesting to start charging.
 //
 void CalcBalancedCurrent(char mod) {
-    int Average, MaxBalanced, Idifference;
+    int Idifference;
     int BalancedLeft = 0;
-    signed int IsumImport;
+    signed int IsumImport, EVLoad, Forecast;
     int ActiveMax = 0, TotalCurrent = 0, Baseload;
-    char CurrentSet[NR_EVSES] = {0, 0, 0, 0, 0, 0, 0, 0};
-    uint8_t n;
+    int PhaseLeft[3], PhaseTotal[3], PhaseMax[3];
+    int32_t PhaseLimit[3], Limit;
+    static uint32_t ControlTime = 0;
+    uint32_t dt = 0;
+    struct BalanceEVSE Active[NR_EVSES];
+    uint16_t Order[NR_EVSES];
+    struct BalanceCircuit Circuit[BALANCE_CIRCUITS];
+    static uint16_t TracedBalanced[NR_EVSES] = {0, 0, 0, 0, 0, 0, 0, 0};
+    uint8_t n, x, count, CurrentShort = 0;
+    bool Reclaimed;
 
     if (!LoadBl) ResetBalancedStates();                                         // Load balancing disabled?, Reset States
                                                                                 // Do not modify MaxCurrent as it is a config setting. (fix 2.05)
     if (BalancedState[0] == STATE_C && MaxCurrent > MaxCapacity && !Config) ChargeCurrent = MaxCapacity * 10;
     else ChargeCurrent = MaxCurrent * 10;                                       // Instead use new variable ChargeCurrent.
 
+    // Charge plan, the current of this slot
+    if (PlanLimit && PlanLimit < ChargeCurrent) ChargeCurrent = PlanLimit;
+
     // Override current temporary if set (from Modbus)
     if (OverrideCurrent) ChargeCurrent = OverrideCurrent;
 
-    if (LoadBl < 2) BalancedMax[0] = ChargeCurrent;                             // Load Balancing Disabled or Master:
-                                                                                // update BalancedMax[0] if the MAX current was adjusted using buttons or CLI
+    if (LoadBl < 2) {                                                           // Load Balancing Disabled or Master:
+        BalancedMax[0] = ChargeCurrent;                                         // update BalancedMax[0] if the MAX current was adjusted using buttons or CLI
+        Node[0].Phases = getEVPhases();
+    }
 
     for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
             BalancedLeft++;                                                     // Count nr of Active (Charging) EVSE's
             ActiveMax += BalancedMax[n];                                        // Calculate total Max Amps for all active EVSEs
-            TotalCurrent += Balanced[n];                                        // Calculate total of all set charge currents
+            TotalCurrent += getDrawnCurrent(n);                                 // Calculate total current the EVSE's draw
         }
+    SumPhases(PhaseLeft, PhaseTotal, PhaseMax);                                 // The same per phase
 
-    if (!mod && Mode != MODE_SOLAR) {                                           // Normal and Smart mode
-        Idifference = (MaxMains * 10) - Imeasured;                              // Difference between MaxMains and Measured current (can be negative)
+    if (!mod) {                                                                 // The controllers run on every new measurement
+        dt = Hal->Millis() - ControlTime;
+        ControlTime += dt;
+        if (dt < PI_DT_MIN) dt = PI_DT_MIN;
+        if (dt > PI_DT_MAX) dt = PI_DT_MAX;
+    }
 
-        if (Idifference > 0) IsetBalanced += (Idifference / 4);                 // increase with 1/4th of difference (slowly increase current)
-        else IsetBalanced += (Idifference * 100 / TRANSFORMER_COMP);            // last PWM setting + difference (immediately decrease current)
-        if (IsetBalanced < 0) IsetBalanced = 0;
-        if (IsetBalanced > 800) IsetBalanced = 800;                             // hard limit 80A (added 11-11-2017)
+    if (Mode == MODE_SMART) {                                                   // Smart mode, every phase is regulated to MaxMains
+        for (x = 0; x < 3; x++) {
+            Limit = PhaseMax[x];                                                // limit to total maximum Amps of the active EVSE's on this phase
+            if (Limit > 800) Limit = 800;                                       // hard limit 80A (added 11-11-2017)
+            if (LoadBl == 1 && Limit > (MaxCircuit * 10)) Limit = MaxCircuit * 10;
+            if (mod) {                                                          // New EVSE charging
+                Baseload = Irms[x] - PhaseTotal[x];                             // Calculate Baseload of this phase (load without any active EVSE)
+                if (Baseload < 0) Baseload = 0;
+                IsetPhase[x] = (MaxMains * 10) - Baseload;                      // Set max charge current on this phase to MaxMains - Baseload
+                PIControlReset(&PhaseControl[x]);
+            } else {
+                Idifference = (MaxMains * 10) - Irms[x];                        // Difference between MaxMains and Measured current (can be negative)
+                                                                                // Capacity tariff: the sum of all phases, spread over the phases
+                if (DemandTarget && (DemandLimit - Isum) / 3 < Idifference) Idifference = (DemandLimit - Isum) / 3;
+                IsetPhase[x] = PIControlStep(&ControlGains, &PhaseControl[x], IsetPhase[x], Idifference, dt, 0, Limit);
+            }
+            if (IsetPhase[x] < 0) IsetPhase[x] = 0;
+            if (IsetPhase[x] > Limit) IsetPhase[x] = Limit;
+        }
+        IsetBalanced = ActiveMax;                                               // The total is only limited by MaxCircuit
     }
 
 
@@ -709,32 +1264,37 @@ void CalcBalancedCurrent(char mod) {
     if (Mode == MODE_SOLAR)                                                     // Solar version
     {
         IsumImport = Isum - (10 * ImportCurrent);                               // Allow Import of power from the grid when solar charging
+        EVLoad = PhaseTotal[0] + PhaseTotal[1] + PhaseTotal[2];                 // Current set for the active EVSE's, sum of all phases
+
+        // Regulate the import to zero. Isum is the sum of three phases, the controller works per phase.
+        // negative: we have surplus (solar) power available, positive: we use more power then is generated
+        if (!mod) {
+            // Forecast the import without the EVSE's, for the start and stop. The controller works on the measurement.
+            SolarForecastAdd(&SolarEstimate, Isum - EVLoad, dt);
+            Idifference = -IsumImport;
+            if (DemandTarget && Idifference > DemandLimit - Isum) Idifference = DemandLimit - Isum;  // Capacity tariff
+            IsetBalanced = PIControlStep(&ControlGains, &SolarControl, IsetBalanced, Idifference / 3, dt, 0, ActiveMax);
+        } else PIControlReset(&SolarControl);                                  // New EVSE charging, no proportional kick from an old error
 
-        if (IsumImport < 0)                                                     
-        {
-            // negative, we have surplus (solar) power available
-            if (IsumImport < -10) IsetBalanced = IsetBalanced + 5;              // more then 1A available, increase Balanced charge current with 0.5A
-            else IsetBalanced = IsetBalanced + 1;                               // less then 1A available, increase with 0.1A
-        } else {
-            // positive, we use more power then is generated
-            if (IsumImport > 20) IsetBalanced = IsetBalanced - (IsumImport / 2);// we use atleast 2A more then available, decrease Balanced charge current.
-            else if (IsumImport > 10) IsetBalanced = IsetBalanced - 5;          // we use 1A more then available, decrease with 0.5A     
-            else if (IsumImport > 3) IsetBalanced = IsetBalanced - 1;           // we still use > 0.3A more then available, decrease with 0.1A
-                                                                                // if we use <= 0.3A we do nothing
-        }
-        
                                                                                 // If IsetBalanced is below MinCurrent or negative, make sure it's set to MinCurrent.
         if ( (IsetBalanced < (BalancedLeft * MinCurrent * 10)) || (IsetBalanced < 0) ) {
             IsetBalanced = BalancedLeft * MinCurrent * 10;
                                                                                 // ----------- Check to see if we have to continue charging on solar power alone ----------
+            // Do not start the timer when the import is expected to go away (sun behind a passing cloud).
+            // A running timer is not stopped by the forecast, only when the import is gone.
+            Forecast = SolarForecastImport(&SolarEstimate, SOLAR_HORIZON, -SOLAR_SIGMAS) + EVLoad - (10 * ImportCurrent);
+            if (SolarEstimate.Samples < 2) Forecast = IsumImport;
             if (BalancedLeft && StopTime && (IsumImport > 10)) {
-                if (SolarStopTimer == 0) setSolarStopTimer(StopTime * 60);      // Convert minutes into seconds
+                if (SolarStopTimer == 0 && Forecast > 10) setSolarStopTimer(StopTime * 60);  // Convert minutes into seconds
             } else {
                 setSolarStopTimer(0);
             }
         } else {
             setSolarStopTimer(0);
         }
+    } else if (SolarEstimate.Samples) {                                         // Start over when Solar mode is selected again
+        SolarForecastInit(&SolarEstimate, SOLAR_ALPHA, SOLAR_BETA);
+        PIControlReset(&SolarControl);
     }
                                                                                 // When Load balancing = Master,  Limit total current of all EVSEs to MaxCircuit
     if (LoadBl == 1 && (IsetBalanced > (MaxCircuit * 10)) ) IsetBalanced = MaxCircuit * 10;
@@ -751,13 +1311,24 @@ void CalcBalancedCurrent(char mod) {
 
     if (BalancedLeft)                                                           // Only if we have active EVSE's
     {
-        // New EVSE charging, and no Solar mode
-        if (mod && Mode != MODE_SOLAR) IsetBalanced = (MaxMains * 10) - Baseload;// Set max combined charge current to MaxMains - Baseload
+        // New EVSE charging, in Normal mode
+        if (mod && Mode == MODE_NORMAL) IsetBalanced = (MaxMains * 10) - Baseload;// Set max combined charge current to MaxMains - Baseload
+
+        if (Mode == MODE_SMART) for (x = 0; x < 3; x++) {
+            if (IsetPhase[x] < (PhaseLeft[x] * MinCurrent * 10)) {
+                IsetPhase[x] = PhaseLeft[x] * MinCurrent * 10;                  // set minimal "MinCurrent" charge per active EVSE on this phase
+                CurrentShort = 1;
+            }
+            PhaseLimit[x] = IsetPhase[x];
+        }
 
         if (IsetBalanced < 0 || IsetBalanced < (BalancedLeft * MinCurrent * 10)
           || ( Mode == MODE_SOLAR && Isum > 10 && Imeasured > (MaxMains * 10)) )
         {
             IsetBalanced = BalancedLeft * MinCurrent * 10;                      // set minimal "MinCurrent" charge per active EVSE
+            CurrentShort = 1;
+        }
+        if (CurrentShort) {
             NoCurrent++;                                                        // Flag NoCurrent left
 #ifdef LOG_INFO_EVSE
             Serial.printf("No Current!!\n");
@@ -766,43 +1337,59 @@ void CalcBalancedCurrent(char mod) {
 
         if (IsetBalanced > ActiveMax) IsetBalanced = ActiveMax;                 // limit to total maximum Amps (of all active EVSE's)
 
-        MaxBalanced = IsetBalanced;                                             // convert to Amps
-
-        // Calculate average current per EVSE
-        n = 0;
-        do {
-            Average = MaxBalanced / BalancedLeft;                               // Average current for all active EVSE's
-
-        // Check for EVSE's that have a lower MAX current
-            if ((BalancedState[n] == STATE_C) && (!CurrentSet[n]) && (Average >= BalancedMax[n])) // Active EVSE, and current not yet calculated?
-            {
-                Balanced[n] = BalancedMax[n];                                   // Set current to Maximum allowed for this EVSE
-                CurrentSet[n] = 1;                                              // mark this EVSE as set.
-                BalancedLeft--;                                                 // decrease counter of active EVSE's
-                MaxBalanced -= Balanced[n];                                     // Update total current to new (lower) value
-                n = 0;                                                          // check all EVSE's again
-            } else n++;
-        } while (n < NR_EVSES && BalancedLeft);
-
-        // All EVSE's which had a Max current lower then the average are set.
-        // Now calculate the current for the EVSE's which had a higher Max current
-        n = 0;
-        if (BalancedLeft)                                                       // Any Active EVSE's left?
-        {
-            do {                                                                // Check for EVSE's that are not set yet
-                if ((BalancedState[n] == STATE_C) && (!CurrentSet[n]))          // Active EVSE, and current not yet calculated?
-                {
-                    Balanced[n] = MaxBalanced / BalancedLeft;                   // Set current to Average
-                    CurrentSet[n] = 1;                                          // mark this EVSE as set.
-                    BalancedLeft--;                                             // decrease counter of active EVSE's
-                    MaxBalanced -= Balanced[n];                                 // Update total current to new (lower) value
-                }
-            } while (++n < NR_EVSES && BalancedLeft);
+        // Divide IsetBalanced over the active EVSE's. EVSE's with a Max current below the average
+        // are set to their Max, the rest is divided equally.
+        // In Smart mode the EVSE's on a phase also share the current of that phase, so single phase EV's
+        // on different phases are not limited by the most loaded phase.
+        // Every sub-circuit limits the EVSE's on it, and on the circuits below it, per phase
+        for (x = 0; x < BALANCE_CIRCUITS; x++) {
+            Circuit[x].Phase[0] = Circuit[x].Phase[1] = Circuit[x].Phase[2] = CircuitMax[x] ? CircuitMax[x] * 10 : BALANCE_NO_LIMIT;
+            Circuit[x].Parent = CircuitParent[x];
+        }
+
+        // An EV that draws less than its share leaves the rest to the other EVSE's.
+        count = 0;
+        Reclaimed = false;
+        for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
+            Active[count].Min = 0;                                              // IsetBalanced already holds MinCurrent per EVSE
+            Active[count].Max = getUsableCurrent(n);
+            if (Active[count].Max < BalancedMax[n]) Reclaimed = true;
+            Active[count].Weight = 1;
+            Active[count].Phases = Node[n].Phases;
+            Active[count].Circuit = Node[n].Circuit;
+            count++;
         }
+        BalanceFill(Active, Order, count, IsetBalanced, Mode == MODE_SMART ? PhaseLimit : NULL, LoadBl == 1 ? Circuit : NULL);
+
+        // Current that none of the other EVSE's can use, goes back to those EV's, up to their Max
+        if (Reclaimed) {
+            count = 0;
+            for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
+                Active[count].Min = Active[count].Current;
+                Active[count].Max = BalancedMax[n];
+                count++;
+            }
+            BalanceFill(Active, Order, count, IsetBalanced, Mode == MODE_SMART ? PhaseLimit : NULL, LoadBl == 1 ? Circuit : NULL);
+        }
+
+        count = 0;
+        TotalCurrent = 0;
+        for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C) {
+            Balanced[n] = Active[count++].Current;
+            TotalCurrent += Balanced[n];
+        }
+        if (Mode == MODE_SMART) IsetBalanced = TotalCurrent;                    // Report the current that is actually divided
 
 
     } // BalancedLeft
 
+    for (n = 0; n < NR_EVSES; n++) {
+        if (Balanced[n] != TracedBalanced[n]) {
+            TraceAdd(TRACE_BALANCE, n, TracedBalanced[n], Balanced[n]);
+            TracedBalanced[n] = Balanced[n];
+        }
+    }
+
 #ifdef LOG_DEBUG_EVSE
     if (LoadBl == 1) {
         Serial.printf("Balance:");
@@ -854,7 +1441,7 @@ void receiveNodeConfig(uint8_t *buf, uint8_t NodeNr) {
  */
 void requestNodeStatus(uint8_t NodeNr) {
     Node[NodeNr].Online = false;
-    ModbusReadInputRequest(NodeNr + 1u, 4, 0x0000, 8);
+    ModbusReadInputRequest(NodeNr + 1u, 4, 0x0000, 9);
 }
 
 /**
@@ -871,6 +1458,7 @@ void receiveNodeStatus(uint8_t *buf, uint8_t NodeNr) {
     BalancedError[NodeNr] = buf[3];                                             // Node Error status
     Node[NodeNr].ConfigChanged = buf[13] | Node[NodeNr].ConfigChanged;
     BalancedMax[NodeNr] = buf[15] * 10;                                         // Node Max ChargeCurrent (0.1A)
+    Node[NodeNr].Phases = buf[17] & PHASE_ALL;                                  // Phases used by the EV on the Node
     //Serial.printf("ReceivedNode[%u]Status State:%u Error:%u, BalancedMax:%u\n", NodeNr, BalancedState[NodeNr], BalancedError[NodeNr], BalancedMax[NodeNr] );
 }
 
@@ -886,8 +1474,8 @@ void processAllNodeStates(uint8_t NodeNr) {
 
     values[0] = BalancedState[NodeNr];
 
-    current = IsCurrentAvailable();
-    if (current) {                                                              // Yes enough current
+    current = IsCurrentAvailable() && CircuitAvailable(NodeNr);
+    if (current && ScheduleAllowed(NodeNr)) {                                   // Yes enough current, and this Node is next in line
         if (BalancedError[NodeNr] & (LESS_6A|NO_SUN)) {
             BalancedError[NodeNr] &= ~(LESS_6A | NO_SUN);                       // Clear Error flags
             write = 1;
@@ -901,13 +1489,16 @@ void processAllNodeStates(uint8_t NodeNr) {
             Node[NodeNr].Timer = 0;
             Node[NodeNr].Phases = 0;
             Node[NodeNr].MinCurrent = 0;
+            Node[NodeNr].Connected = 0;
+            Node[NodeNr].Idle = 0;
+            Node[NodeNr].Charged = 0;
             break;
 
         case STATE_COMM_B:                                                      // Request to charge A->B
 #ifdef LOG_INFO_EVSE
             Serial.printf("Node %u State A->B request ", NodeNr);
 #endif
-            if (current) {                                                      // check if we have enough current
+            if (current && ScheduleAllowed(NodeNr)) {                           // check if we have enough current, and if it is our turn
                                                                                 // Yes enough current..
                 BalancedState[NodeNr] = STATE_B;                                // Mark Node EVSE as active (State B)
                 Balanced[NodeNr] = MinCurrent * 10;                             // Initially set current to lowest setting
@@ -1011,7 +1602,7 @@ uint8_t getMenuItems (void) {
                 if (GridActive == 1) MenuItems[m++] = MENU_GRID;
                 if (CalActive == 1) MenuItems[m++] = MENU_CAL;                  // - - - Sensorbox CT measurement calibration
             } else if(MainsMeter) {                                             // - - ? Other?
-                MenuItems[m++] = MENU_MAINSMETERADDRESS;                        // - - - Address of Mains electric meter (5 - 254)
+                if (MainsMeter != EM_P1) MenuItems[m++] = MENU_MAINSMETERADDRESS; // - - - Address of Mains electric meter (5 - 254)
                 MenuItems[m++] = MENU_MAINSMETERMEASURE;                        // - - - What does Mains electric meter measure (0: Mains (Home+EVSE+PV) / 1: Home+EVSE / 2: Home)
                 if (MainsMeterMeasure) {                                        // - - - ? PV not measured by Mains electric meter?
                     MenuItems[m++] = MENU_PVMETER;                              // - - - - Type of PV electric meter (0: Disabled / Constants EM_*)
@@ -1036,6 +1627,7 @@ uint8_t getMenuItems (void) {
                 MenuItems[m++] = MENU_EMCUSTOM_PDIVISOR;                        // - - Divisor for power of custom electric meter
                 MenuItems[m++] = MENU_EMCUSTOM_EREGISTER;                       // - - Starting register for energy of custom electric meter
                 MenuItems[m++] = MENU_EMCUSTOM_EDIVISOR;                        // - - Divisor for energy of custom electric meter
+                MenuItems[m++] = MENU_EMCUSTOM_READMAX;                         // - - Max register read at once of custom electric meter
             }
         }
     }
@@ -1162,6 +1754,9 @@ uint8_t setItemValue(uint8_t nav, uint16_t val) {
         case MENU_EMCUSTOM_EDIVISOR:
             EMConfig[EM_CUSTOM].EDivisor = val;
             break;
+        case MENU_EMCUSTOM_READMAX:
+            EMConfig[EM_CUSTOM].ReadMax = val;
+            break;
         case MENU_RFIDREADER:
             RFIDReader = val;
             break;
@@ -1174,6 +1769,7 @@ uint8_t setItemValue(uint8_t nav, uint16_t val) {
             setState(val);
             break;
         case STATUS_ERROR:
+            if (ErrorFlags != val) TraceAdd(TRACE_ERROR, 0, ErrorFlags, val);
             ErrorFlags = val;
             if (ErrorFlags) {                                                   // Is there an actual Error? Maybe the error got cleared?
                 if (State == STATE_C) setState(STATE_C1);                       // tell EV to stop charging
@@ -1284,6 +1880,8 @@ uint16_t getItemValue(uint8_t nav) {
             return EMConfig[EM_CUSTOM].ERegister;
         case MENU_EMCUSTOM_EDIVISOR:
             return EMConfig[EM_CUSTOM].EDivisor;
+        case MENU_EMCUSTOM_READMAX:
+            return EMConfig[EM_CUSTOM].ReadMax;
         case MENU_RFIDREADER:
             return RFIDReader;
         case MENU_WIFI:
@@ -1306,6 +1904,8 @@ uint16_t getItemValue(uint8_t nav) {
         // Status readonly
         case STATUS_MAX:
             return MaxCapacity;
+        case STATUS_PHASES:
+            return getEVPhases();
         case STATUS_TEMP:
             return (signed int)TempEVSE + 273;
         case STATUS_SERIAL:
@@ -1408,6 +2008,9 @@ const char * getMenuItemOption(uint8_t nav) {
         case MENU_EMCUSTOM_EDIVISOR:
             sprintf(Str, "%lu", pow_10[value]);
             return Str;
+        case MENU_EMCUSTOM_READMAX:
+            sprintf(Str, "%u", value);
+            return Str;
         case MENU_RFIDREADER:
             return StrRFIDReader[RFIDReader];
         case MENU_WIFI:
@@ -1422,18 +2025,58 @@ const char * getMenuItemOption(uint8_t nav) {
 
 
 /**
- * Update current data after received current measurement
+ * Keep the highest quarter hour average of the month, for the last 12 months
+ *
+ * @param int32_t power: average of the quarter hour that just ended (W)
  */
-void UpdateCurrentData(void) {
-    uint8_t x;
-    char Str[128];
-
+void setDemandPeak(int32_t power) {
+    time_t now = Hal->Time();
+    struct tm tm;
+
+    if (!now) return;                                                           // month not known
+    now = now - now % DEMAND_WINDOW - 1;                                        // last second of the quarter hour
+    localtime_r(&now, &tm);
+    if (DemandMonth != (tm.tm_year + 1900) * 12 + tm.tm_mon) {                  // new month
+        DemandMonth = (tm.tm_year + 1900) * 12 + tm.tm_mon;
+        DemandPeak[tm.tm_mon] = 0;
+    }
+    if (power > DemandPeak[tm.tm_mon]) {
+        DemandPeak[tm.tm_mon] = power;
+        write_settings();
+    }
+}
+
+/**
+ * Update current data after received current measurement
+ */
+void UpdateCurrentData(void) {
+    uint8_t x;
+    char Str[128];
+    static uint32_t DemandTime = 0;
+    static bool DemandClock = false;
+    uint32_t now, dt, clock;
+
+    // 15 minute average import, on the quarter hours of the clock when it is known
+    now = Hal->Millis();
+    dt = now - DemandTime;
+    DemandTime = now;
+    if (dt > 10000) dt = 10000;                                                 // no measurements for 10 seconds is a communication error
+    clock = Hal->Time();
+    now = clock ? clock : now / 1000;
+    if (DemandClock != (clock != 0)) {                                          // uptime <-> Unix time, keep the measured minutes
+        DemandClock = clock != 0;
+        DemandRebase(&MainsDemand, now);
+    }
+    if (DemandAdd(&MainsDemand, Isum * MAINS_VOLTAGE / 10, now, dt)) setDemandPeak(MainsDemand.Last);
+    if (DemandTarget) DemandLimit = (int64_t)DemandAllowed(&MainsDemand, DemandTarget) * 10 / MAINS_VOLTAGE;
+
     // reset Imeasured value (grid power used)
     Imeasured = 0;
     for (x=0; x<3; x++) {
         // Imeasured holds highest Irms of all channels
         if (Irms[x] > Imeasured) Imeasured = Irms[x];
     }
+    if (Imeasured > MaxMains * 10) TraceAdd(TRACE_OVERLOAD, 0, MaxMains * 10, Imeasured);
 
 
     // Load Balancing mode: Smart/Master or Disabled
@@ -1445,7 +2088,7 @@ void UpdateCurrentData(void) {
         if (NoCurrent > 2 || (Imeasured > (MaxMains * 20))) {
             // STOP charging for all EVSE's
             // Display error message
-            ErrorFlags |= LESS_6A; //NOCURRENT;
+            setErrorFlags(LESS_6A); //NOCURRENT;
             // Set all EVSE's to State A
             ResetBalancedStates();
 
@@ -1473,6 +2116,8 @@ void UpdateCurrentData(void) {
 #endif
 
     } else Imeasured = 0; // In case Sensorbox is connected in Normal mode. Clear measurement.
+
+    UpdateMeasureRegisters();                                                   // Publish new measurements and balanced currents
 }
 
 
@@ -1600,235 +2245,105 @@ void CheckSwitch(void)
 
 
 // Task that handles EVSE State Changes
-// Reads buttons, and updates the LCD.
 //
-// called every 10ms
+// runs on a pilot level change, a state change by another task, and after every Timer1S tick
 void EVSEStates(void * parameter) {
 
-  //uint8_t n;
-    uint8_t pilot, leftbutton = 5;
-    uint8_t DiodeCheck = 0; 
-   
-
     // infinite loop
     while(1) { 
-    
-        
-        // Sample the three < o > buttons.
-        // As the buttons are shared with the SPI lines going to the LCD,
-        // we have to make sure that this does not interfere by write actions to the LCD.
-        // Therefore updating the LCD is also done in this task.
-
-        // pinMatrixOutDetach(PIN_LCD_SDO_B3, false, false);       // disconnect MOSI pin
-        // pinMode(PIN_LCD_SDO_B3, INPUT);
-        // pinMode(PIN_LCD_A0_B2, INPUT);
-        // sample buttons                                       < o >
-        // if (digitalRead(PIN_LCD_SDO_B3)) ButtonState = 4;       // > (right)
-        // else ButtonState = 0;
-        // if (digitalRead(PIN_LCD_A0_B2)) ButtonState |= 2;       // o (middle)
-        // if (digitalRead(PIN_IO0_B1)) ButtonState |= 1;          // < (left)
-
-        // pinMode(PIN_LCD_SDO_B3, OUTPUT);
-        // pinMatrixOutAttach(PIN_LCD_SDO_B3, VSPID_IN_IDX, false, false); // re-attach MOSI pin
-        // pinMode(PIN_LCD_A0_B2, OUTPUT);
-
-
-        // When one or more button(s) are pressed, we call GLCDMenu
-        if ((ButtonState != 0x07) || (ButtonState != OldButtonState)) 
-          //GLCDMenu(ButtonState);
-          ;
-
-        // Update/Show Helpmenu
-        if (LCDNav > MENU_ENTER && LCDNav < MENU_EXIT && (ScrollTimer + 5000 < millis() ) && (!SubMenu)) 
-            // GLCDHelp();
-            ;
-
-        // Left button pressed, Loadbalancing is Master or Disabled, switch is set to "Sma-Sol B" and Mode is Smart or Solar?
-        if (!LCDNav && ButtonState == 0x6 && Mode && !leftbutton && (LoadBl < 2) && Switch == 3) {
-            setMode(~Mode & 0x3);                                           // Change from Solar to Smart mode and vice versa.
-            ErrorFlags &= ~(NO_SUN | LESS_6A);                              // Clear All errors
-            ChargeDelay = 0;                                                // Clear any Chargedelay
-            setSolarStopTimer(0);                                           // Also make sure the SolarTimer is disabled.
-            LCDTimer = 0;
-            leftbutton = 5;
-        } else if (leftbutton && ButtonState == 0x7) leftbutton--;
-
-        // Check the external switch and RCM sensor
-        // CheckSwitch();
-
-        // sample the Pilot line
-        pilot = Pilot();
-
-        // ############### EVSE State A #################
-
-        if (State == STATE_A || State == STATE_COMM_B || State == STATE_B1)
-        {
-
-            if (pilot == PILOT_12V) {                                           // Check if we are disconnected, or forced to State A, but still connected to the EV
-
-                // If the RFID reader is set to EnableOne mode, and the Charging cable is disconnected
-                // We start a timer to re-lock the EVSE (and unlock the cable) after 60 seconds.
-                if (RFIDReader == 2 && AccessTimer == 0 && Access_bit == 1) AccessTimer = RFIDLOCKTIME;
+        EVSEStatesStep();
 
-                if (State != STATE_A) setState(STATE_A);                        // reset state, incase we were stuck in STATE_COMM_B
-                ChargeDelay = 0;                                                // Clear ChargeDelay when disconnected.
-
-                if (!ResetKwh) ResetKwh = 1;                                    // when set, reset EV kWh meter on state B->C change.
-            } else if ( pilot == PILOT_9V && ErrorFlags == NO_ERROR 
-                && ChargeDelay == 0 && Access_bit
-                && State != STATE_COMM_B) {                                     // switch to State B ?
-                                                                                // Allow to switch to state C directly if STATE_A_TO_C is set to PILOT_6V (see EVSE.h)
-                DiodeCheck = 0;
+        // Wait until woken by NotifyEVSEStates or WakeEVSEStates
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    } // while(1) loop
+}
 
-                ProximityPin();                                                 // Sample Proximity Pin
 
-#ifdef LOG_DEBUG_EVSE
-                Serial.printf("Cable limit: %uA  Max: %uA\n", MaxCapacity, MaxCurrent);
-#endif
-                if (MaxCurrent > MaxCapacity) ChargeCurrent = MaxCapacity * 10; // Do not modify Max Cable Capacity or MaxCurrent (fix 2.05)
-                else ChargeCurrent = MaxCurrent * 10;                           // Instead use new variable ChargeCurrent
-
-                // Load Balancing : Node
-                if (LoadBl > 1) {                                               // Send command to Master, followed by Max Charge Current
-                    setState(STATE_COMM_B);                                     // Node wants to switch to State B
-
-                // Load Balancing: Master or Disabled
-                } else if (IsCurrentAvailable()) {                             
-                    BalancedMax[0] = MaxCapacity * 10;
-                    Balanced[0] = ChargeCurrent;                                // Set pilot duty cycle to ChargeCurrent (v2.15)
-                    setState(STATE_B);                                          // switch to State B
-                    ActivationMode = 30;                                        // Activation mode is triggered if state C is not entered in 30 seconds.
-                    AccessTimer = 0;
-                } else if (Mode == MODE_SOLAR) {                                // Not enough power:
-                    ErrorFlags |= NO_SUN;                                       // Not enough solar power
-                } else ErrorFlags |= LESS_6A;                                   // Not enough power available
-            }
-        }
+/**
+ * Task that receives DSMR telegrams from the P1 port of the Mains meter.
+ * The meter pushes a telegram every second (DSMR 5), which is parsed while it comes in.
+ * Only runs when the Mains meter is set to EM_P1, it removes the UART driver and itself when that changes.
+ */
+void P1Task(void * parameter) {
+    QueueHandle_t uart_queue;
+    uart_event_t event;
+    struct DSMRParser parser;
+    struct P1Data data;
+    uint8_t buf[128];
+    int len, i;
+    uint8_t x;
 
-        if (State == STATE_COMM_B_OK) {
-            setState(STATE_B);
-            ActivationMode = 30;                                                // Activation mode is triggered if state C is not entered in 30 seconds.
-            AccessTimer = 0;
+    uart_config_t uart_config = {
+        .baud_rate = P1_BAUDRATE,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .rx_flow_ctrl_thresh = 0,
+    };
+    uart_param_config(UART_NUM_2, &uart_config);
+    uart_set_pin(UART_NUM_2, UART_PIN_NO_CHANGE, PIN_P1_RX, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    // The P1 port is an open collector output with inverted logic.
+    if (!P1_INVERTED) uart_set_line_inverse(UART_NUM_2, UART_SIGNAL_RXD_INV);
+    // A complete telegram (~1kB) fits in the rx buffer, the driver signals us when data is available.
+    uart_driver_install(UART_NUM_2, 2048, 0, 16, &uart_queue, 0);
+
+    DSMRInit(&parser);
+
+    while(1) {
+        if (MainsMeter != EM_P1) {                                              // Release UART2 and the pin
+            uart_driver_delete(UART_NUM_2);
+            gpio_reset_pin((gpio_num_t)PIN_P1_RX);
+            P1TaskHandle = NULL;
+            vTaskDelete(NULL);
         }
-
-        // ############### EVSE State B #################
-        
-        if (State == STATE_B || State == STATE_COMM_C) {
-        
-            if (pilot == PILOT_12V) {                                           // Disconnected?
-                setState(STATE_A);                                              // switch to STATE_A
-
-            } else if (pilot == PILOT_6V) {
-
-                if ((DiodeCheck == 1) && (ErrorFlags == NO_ERROR) && (ChargeDelay == 0)) {
-                    if (EVMeter && ResetKwh) {
-                        EnergyMeterStart = EnergyEV;                            // store kwh measurement at start of charging.
-                        ResetKwh = 0;                                           // clear flag, will be set when disconnected from EVSE (State A)
-                    }
-
-                    // Load Balancing : Node
-                    if (LoadBl > 1) {                                           
-                        if (State != STATE_COMM_C) setState(STATE_COMM_C);      // Send command to Master, followed by Charge Current
-
-                    // Load Balancing: Master or Disabled
-                    } else { 
-                        BalancedMax[0] = ChargeCurrent;
-                        if (IsCurrentAvailable()) {
-
-                            Balanced[0] = 0;                                    // For correct baseload calculation set current to zero
-                            CalcBalancedCurrent(1);                             // Calculate charge current for all connected EVSE's
-
-                            DiodeCheck = 0;                                     // (local variable)
-                            setState(STATE_C);                                  // switch to STATE_C
-                            if (!LCDNav) 
-                            //GLCD();                                // Don't update the LCD if we are navigating the menu
-                            ;                                                    // immediately update LCD (20ms)
-                        }
-                        else if (Mode == MODE_SOLAR) {                          // Not enough power:
-                            ErrorFlags |= NO_SUN;                               // Not enough solar power
-                        } else ErrorFlags |= LESS_6A;                           // Not enough power available
+        if (!xQueueReceive(uart_queue, &event, pdMS_TO_TICKS(1000))) continue;
+
+        switch (event.type) {
+            case UART_DATA:
+                while ((len = uart_read_bytes(UART_NUM_2, buf, sizeof(buf), 0)) > 0) {
+                    for (i = 0; i < len; i++) {
+                        if (!DSMRFeed(&parser, buf[i], &data)) continue;
+                        if (!(data.Flags & (DSMR_CURRENT | DSMR_PHASE_POWER))) continue;
+
+                        for (x = 0; x < 3; x++) CM[x] = data.Current[x];
+                        UpdateMainsCurrents();
+                        MainsPower = data.Power;
+                        if (LoadBl < 2) timeout = 10;                           // only reset timeout when data is ok, and Master/Disabled
+                        MainsUpdated = 1;                                       // Let Timer100ms process the new data
+#ifdef LOG_DEBUG_MODBUS
+                        Serial.printf("P1: L1 %d L2 %d L3 %d mA, %d W\n", CM[0], CM[1], CM[2], MainsPower);
+#endif
                     }
                 }
-
-            // PILOT_9V
-            } else {
-
-                if (ActivationMode == 0) {
-                    setState(STATE_ACTSTART);
-                    ActivationTimer = 3;
-
-                    ledcWrite(CP_CHANNEL, 0);                                   // PWM off,  channel 0, duty cycle 0%
-                                                                                // Control pilot static -12V
-                }
-            }
-            if (pilot == PILOT_DIODE) {
-                DiodeCheck = 1;                                                 // Diode found, OK
-                Serial.printf("Diode OK\n");
-                timerAlarmWrite(timerA, PWM_5, false);                          // Enable Timer alarm, set to start of CP signal (5%)
-            }    
-
-        }
-
-        // ############### EVSE State C1 #################
-
-        if (State == STATE_C1)
-        {
-            if (pilot == PILOT_12V) 
-            {                                                                   // Disconnected or connected to EV without PWM
-                setState(STATE_A);                                              // switch to STATE_A
-                // GLCD_init();                                                    // Re-init LCD
-            }
-            else if (pilot == PILOT_9V)
-            {
-                setState(STATE_B1);                                             // switch to State B1
-                //GLCD_init();                                                    // Re-init LCD
-            }
-        }
-
-
-        if (State == STATE_ACTSTART && ActivationTimer == 0) {
-            setState(STATE_B);                                                  // Switch back to State B
-            ActivationMode = 255;                                               // Disable ActivationMode
-        }
-
-        if (State == STATE_COMM_C_OK) {
-            DiodeCheck = 0;
-            setState(STATE_C);                                                  // switch to STATE_C
-                                                                                // Don't update the LCD if we are navigating the menu
-            if (!LCDNav) 
-            //GLCD();                                                // immediately update LCD
-            ;
+                break;
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                // We lost data, the current telegram will fail the CRC check anyway. Start over.
+                uart_flush_input(UART_NUM_2);
+                xQueueReset(uart_queue);
+                DSMRInit(&parser);
+                break;
+            default:
+                break;
         }
+    }
+}
 
-        // ############### EVSE State C #################
-
-        if (State == STATE_C) {
-        
-            if (pilot == PILOT_12V) {                                           // Disconnected ?
-                setState(STATE_A);                                              // switch back to STATE_A
-                // GLCD_init();                                                    // Re-init LCD
-    
-            } else if (pilot == PILOT_9V) {
-                setState(STATE_B);                                              // switch back to STATE_B
-                DiodeCheck = 0;
-                //GLCD_init();                                                    // Re-init LCD (200ms delay)
-                                                                                // Mark EVSE as inactive (still State B)
-            }  
-    
-        } // end of State C code
-
-        // update LCD (every 1000ms) when not in the setup menu
-        if (LCDupdate) {
-            //Serial.printf("States task free ram: %u\n", uxTaskGetStackHighWaterMark( NULL ));
-            // GLCD();
-            LCDupdate = 0;
-        }    
-
-        if ((ErrorFlags & CT_NOCOMM) && timeout == 10) ErrorFlags &= ~CT_NOCOMM;          // Clear communication error, if present
-        
-        // Pause the task for 10ms
-        vTaskDelay(10 / portTICK_PERIOD_MS);
-    } // while(1) loop
+/**
+ * Start the P1 task when the Mains meter is set to EM_P1
+ * The task stops by itself when the Mains meter is changed.
+ */
+void ConfigureP1(void) {
+    if (MainsMeter != EM_P1 || P1TaskHandle != NULL) return;
+    xTaskCreate(
+        P1Task,         // Function that should be called
+        "P1Task",       // Name of the task (for debugging)
+        3072,           // Stack size (bytes)
+        NULL,           // Parameter to pass
+        1,              // Task priority
+        &P1TaskHandle   // Task handle
+    );
 }
 
 
@@ -1838,131 +2353,9 @@ void EVSEStates(void * parameter) {
 //
 void Timer100ms(void * parameter) {
 
-unsigned int locktimer = 0, unlocktimer = 0;
-uint8_t PollEVNode = NR_EVSES;
-
-
     while(1)  // infinite loop
     {
-        // Check if the cable lock is used
-        if (Lock) {                                                 // Cable lock enabled?
-
-            // UnlockCable takes precedence over LockCable
-            if (UnlockCable) {
-                // if (unlocktimer < 6) {                              // 600ms pulse
-                //     ACTUATOR_UNLOCK;
-                // } else ACTUATOR_OFF;
-                if (unlocktimer++ > 7) {
-                    // if (digitalRead(PIN_LOCK_IN) == lock1 )         // still locked...
-                    // {
-                    //     if (unlocktimer > 50) unlocktimer = 0;      // try to unlock again in 5 seconds
-                    // } else unlocktimer = 7;
-                }
-                locktimer = 0;
-            // Lock Cable    
-            } else if (LockCable) { 
-                // if (locktimer < 6) {                                // 600ms pulse
-                //     ACTUATOR_LOCK;
-                // } else ACTUATOR_OFF;
-                if (locktimer++ > 7) {
-                    // if (digitalRead(PIN_LOCK_IN) == lock2 )         // still unlocked...
-                    // {
-                    //     if (locktimer > 50) locktimer = 0;          // try to lock again in 5 seconds
-                    // } else locktimer = 7;
-                }
-                unlocktimer = 0;
-            }
-        }
-
-       
-
-        // Every 2 seconds, request measurements from modbus meters
-        if (ModbusRequest) {
-
-            switch (ModbusRequest++) {                                          // State
-                case 1:                                                         // PV kwh meter
-                    if (PVMeter) {
-                        requestCurrentMeasurement(PVMeter, PVMeterAddress);
-                        break;
-                    }
-                    ModbusRequest++;
-                case 2:                                                         // Sensorbox or kWh meter that measures -all- currents
-#ifdef LOG_INFO_MODBUS
-                    Serial.printf("ModbusRequest %u: Request MainsMeter Measurement\n", ModbusRequest);
-#endif
-                    requestCurrentMeasurement(MainsMeter, MainsMeterAddress);
-                    break;
-                case 3:
-                    // Find next online SmartEVSE
-                    do {
-                        PollEVNode++;
-                        if (PollEVNode >= NR_EVSES) PollEVNode = 0;
-                    } while(Node[PollEVNode].Online == false);
-
-                    // Request Configuration if changed
-                    if (Node[PollEVNode].ConfigChanged) {
-#ifdef LOG_INFO_MODBUS
-                        Serial.printf("ModbusRequest %u: Request Configuration Node %u\n", ModbusRequest, PollEVNode);
-#endif
-                        requestNodeConfig(PollEVNode);
-                        break;
-                    }
-                    ModbusRequest++;
-                case 4:                                                         // EV kWh meter, Energy measurement (total charged kWh)
-                    // Request Energy if EV meter is configured
-                    if (Node[PollEVNode].EVMeter) {
-#ifdef LOG_INFO_MODBUS
-                        Serial.printf("ModbusRequest %u: Request Energy Node %u\n", ModbusRequest, PollEVNode);
-#endif
-                        requestEnergyMeasurement(Node[PollEVNode].EVMeter, Node[PollEVNode].EVAddress);
-                        break;
-                    }
-                    ModbusRequest++;
-                case 5:                                                         // EV kWh meter, Power measurement (momentary power in Watt)
-                    // Request Power if EV meter is configured
-                    if (Node[PollEVNode].EVMeter) {
-                        requestPowerMeasurement(Node[PollEVNode].EVMeter, Node[PollEVNode].EVAddress);
-                        break;
-                    }
-                    ModbusRequest++;
-                case 6:                                                         // Node 1
-                case 7:
-                case 8:
-                case 9:
-                case 10:
-                case 11:
-                case 12:
-                    if (LoadBl == 1) {
-                        requestNodeStatus(ModbusRequest - 6u);                   // Master, Request Node 1-8 status
-                        break;
-                    }
-                    ModbusRequest = 12;
-                case 13:
-                case 14:
-                case 15:
-                case 16:
-                case 17:
-                case 18:
-                case 19:
-                    if (LoadBl == 1) {
-                        processAllNodeStates(ModbusRequest - 13u);
-                        break;
-                    }
-                default:
-                    if (Mode) {                                                 // Smart/Solar mode
-                        if ((ErrorFlags & CT_NOCOMM) == 0) UpdateCurrentData();      // No communication error with Sensorbox /Kwh meter?
-                                                                                // then update the data and send broadcast to all connected EVSE's
-                    } else {                                                    // Normal Mode
-                        CalcBalancedCurrent(0);                                 // Calculate charge current for connected EVSE's
-                        if (LoadBl == 1) BroadcastCurrent();                    // Send to all EVSE's (only in Master mode)
-                        if ((State == STATE_B) || (State == STATE_C)) SetCurrent(Balanced[0]); // set PWM output for Master
-                    }
-                    ModbusRequest = 0;
-                    //Serial.printf("Task free ram: %u\n", uxTaskGetStackHighWaterMark( NULL ));
-                    break;
-            }
-        }
-
+        Timer100msStep();
 
         // Pause the task for 100ms
         vTaskDelay(100 / portTICK_PERIOD_MS);
@@ -1972,166 +2365,97 @@ uint8_t PollEVNode = NR_EVSES;
 }
 
 
-// task 1000msTimer
-void Timer1S(void * parameter) {
-
-    uint8_t Broadcast = 1;
-    uint8_t Timer5sec = 0;
-    uint8_t x;
-
-
-    while(1) { // infinite loop
-
-        if (BacklightTimer) BacklightTimer--;                               // Decrease backlight counter every second.
-
-        // wait for Activation mode to start
-        if (ActivationMode && ActivationMode != 255) {
-            ActivationMode--;                                               // Decrease ActivationMode every second.
-        }
-
-        // activation Mode is active
-        if (ActivationTimer) ActivationTimer--;                             // Decrease ActivationTimer every second.
-        
-        if (State == STATE_C1) {
-            if (C1Timer) C1Timer--;                                         // if the EV does not stop charging in 6 seconds, we will open the contactor.
-            else {
-                Serial.printf("State C1 timeout!\n");
-                setState(STATE_B1);                                         // switch back to STATE_B1
-                // GLCD_init();                                                // Re-init LCD (200ms delay)
-                ChargeTimer = 15;
-            }
-        }
-
-
-
-
-        // once a second, measure temperature
-        // range -40 .. +125C
-        TempEVSE = TemperatureSensor();                                                             
-
-
-        // Check if there is a RFID card in front of the reader
-        // CheckRFID();
-
-                 
-        // When Solar Charging, once the current drops to MINcurrent a timer is started.
-        // Charging is stopped when the timer reaches the time set in 'StopTime' (in minutes)
-        // Except when Stoptime =0, then charging will continue.
-
-        if (SolarStopTimer) {
-            SolarStopTimer--;
-            if (SolarStopTimer == 0) {
-
-                if (State == STATE_C) setState(STATE_C1);                   // tell EV to stop charging
-                ErrorFlags |= NO_SUN;                                       // Set error: NO_SUN
-
-                ResetBalancedStates();                                      // reset all states
-            }
-        }
-
-        if (ChargeDelay) ChargeDelay--;                                     // Decrease Charge Delay counter
-
-        if (AccessTimer && State == STATE_A) {
-            if (--AccessTimer == 0) {
-                setAccess(false);                                           // re-lock EVSE
-            }
-        } else AccessTimer = 0;                                             // Not in state A, then disable timer
-
-
-        if ((TempEVSE < 55) && (ErrorFlags & TEMP_HIGH)) {                  // Temperature below limit?
-            ErrorFlags &= ~TEMP_HIGH; // clear Error
-        }
-
-        if ( (ErrorFlags & (LESS_6A|NO_SUN) ) && (LoadBl < 2) && (IsCurrentAvailable())) {
-            ErrorFlags &= ~LESS_6A;                                         // Clear Errors if there is enough current available, and Load Balancing is disabled or we are Master
-            ErrorFlags &= ~NO_SUN;
-#ifdef LOG_DEBUG_EVSE
-            Serial.printf("No sun/current Errors Cleared.\n");
-#endif
-            ModbusWriteSingleRequest(BROADCAST_ADR, 0x0001, ErrorFlags);    // Broadcast
-        }
-
-        if (ExternalMaster) {
-            ExternalMaster--;
-        }
+/**
+ * Stop charging when the charge plan does not charge in this slot
+ *
+ * @param bool wait
+ */
+void setPlanWait(bool wait) {
+    if (wait && !PlanWait) {
+        if (State == STATE_C) setState(STATE_C1);                               // tell EV to stop charging
+        else if (State == STATE_B) setState(STATE_B1);
+    }
+    PlanWait = wait;
+}
 
-        // Charge timer
-        for (x = 0; x < NR_EVSES; x++) {
-            if (BalancedState[x] == STATE_C) Node[x].Timer++;
-        }
+/**
+ * Energy charged in this session
+ * Without an EV meter it is calculated from the charge current.
+ *
+ * @param uint16_t watt: power per Amp
+ * @return uint32_t energy (Wh)
+ */
+uint32_t PlanCharged(uint16_t watt) {
+    if (EVMeter) return EnergyCharged > 0 ? EnergyCharged : 0;
+    return (uint64_t)Node[0].Charged * watt / 36000;
+}
 
-        if ((timeout == 0) && !(ErrorFlags & CT_NOCOMM))                    // timeout if CT current measurement takes > 10 secs
-        {
-            ErrorFlags |= CT_NOCOMM;
-            if (State == STATE_C) setState(STATE_C1);                       // tell EV to stop charging
-            else setState(STATE_B1);                                        // when we are not charging switch to State B1
-#ifdef LOG_WARN_EVSE
-            Serial.printf("Error, communication error!\n");
-#endif
-            // Try to broadcast communication error to Nodes if we are Master
-            if (LoadBl < 2) ModbusWriteSingleRequest(BROADCAST_ADR, 0x0001, ErrorFlags);         
-            ResetBalancedStates();
-        } else if (timeout) timeout--;
+/**
+ * Follow the charge plan, called every second
+ * A new plan is only made when the inputs change: the target, the tariffs, the max current or the phases,
+ * or when less was charged than planned (Smart or Solar mode, or the EV charges slower).
+ */
+void PlanStep(void) {
+    static struct PlanTable Table;                                              // Copy of Tariff, the plan is made without the lock
+    static uint32_t Slot = 0;
+    uint32_t now = Hal->Time(), charged, energy, target, departure;
+    uint16_t watt;
+    uint8_t x, max, phases = getEVPhases(), current;
+    bool dirty;
+
+    portENTER_CRITICAL(&plan_spinlock);
+    if (PlanTarget && now && now >= PlanDeparture) PlanTarget = 0;              // Departure time passed, charge as usual
+    target = PlanTarget;
+    departure = PlanDeparture;
+    dirty = PlanDirty;
+    if (dirty) Table = Tariff;
+    PlanDirty = false;
+    portEXIT_CRITICAL(&plan_spinlock);
+
+    if (!target || !now || LoadBl > 1) {                                        // No plan (the Master does not know the time of a Node)
+        PlanLimit = 0;
+        setPlanWait(false);
+        return;
+    }
 
-        if (TempEVSE >= 65 && !(ErrorFlags & TEMP_HIGH))                         // Temperature too High?
-        {
-            ErrorFlags |= TEMP_HIGH;
-            setState(STATE_A);                                              // ERROR, switch back to STATE_A
-#ifdef LOG_WARN_EVSE
-            Serial.printf("Error, temperature %i C !\n", TempEVSE);
-#endif
-            ResetBalancedStates();
-        }
+    for (x = 0, watt = 0; x < 3; x++) if (!phases || (phases & (1 << x))) watt += MAINS_VOLTAGE;
+    max = MaxCurrent;
+    if (State != STATE_A && MaxCapacity < max && !Config) max = MaxCapacity;   // cable limit
+    if (Mode && MaxMains < max) max = MaxMains;
+    if (LoadBl == 1 && MaxCircuit < max) max = MaxCircuit;
+    if (max != PlanMax || watt != ChargePlan.Watt) dirty = true;
+
+    charged = PlanCharged(watt);
+    if (now / PLAN_SLOT_TIME != Slot) {                                         // New slot, is the EV behind the plan?
+        Slot = now / PLAN_SLOT_TIME;
+        if (charged - PlanDone + MinCurrent * watt / 4 < PlanEnergy(&ChargePlan, now)) dirty = true;
+    }
+    if (PlanCurrent(&ChargePlan, now) == PLAN_NONE) dirty = true;               // More than 48 hours before the departure
 
-        if (ErrorFlags & (NO_SUN | LESS_6A)) {
+    if (dirty) {
+        energy = charged < target ? target - charged : 0;
+        PlanMake(&ChargePlan, &Table, now, departure, energy, watt, MinCurrent, max);
+        PlanDone = charged;
+        PlanMax = max;
 #ifdef LOG_INFO_EVSE
-            if (Mode == MODE_SOLAR) {
-                if (ChargeDelay == 0) Serial.printf("Waiting for Solar power...\n");
-            } else {
-                if (ChargeDelay == 0) Serial.printf("Not enough current available!\n");
-            }
+        Serial.printf("Charge plan: %u Wh in %u slots, %uA max\n", energy, ChargePlan.Count, max);
 #endif
-            if (State == STATE_C) setState(STATE_C1);                       // If we are charging, tell EV to stop charging
-            else if (State != STATE_C1) setState(STATE_B1);                 // If we are not in State C1, switch to State B1
-            ChargeDelay = CHARGEDELAY;                                      // Set Chargedelay
-        }
+    }
 
-        // set flag to update the LCD once every second
-        LCDupdate = 1;
-
-        // Every two seconds request measurement data from sensorbox/kwh meters.
-        // and send broadcast to Node controllers.
-        if (LoadBl < 2 && !ExternalMaster && !Broadcast--) {                // Load Balancing mode: Master or Disabled
-            if (Mode) {                                                     // Smart or Solar mode
-                ModbusRequest = 1;                                          // Start with state 1
-            } else {                                                        // Normal mode
-                Imeasured = 0;                                              // No measurements, so we set it to zero
-                ModbusRequest = 6;                                          // Start with state 5 (poll Nodes)
-                timeout = 10;                                               // reset timeout counter (not checked for Master)
-            }
-            Broadcast = 1;                                                  // repeat every two seconds
-        }
+    current = PlanCurrent(&ChargePlan, now);
+    if (current == PLAN_NONE) current = max;
+    PlanLimit = current * 10;
+    setPlanWait(current == 0);
+}
 
-          
 
-        // this will run every 5 seconds
-        if (Timer5sec++ >= 5) {
-            // Connected to WiFi?
-            if (WiFi.status() == WL_CONNECTED) {
-                ws.printfAll("T:%d",TempEVSE);                              // Send internal temperature to clients 
-                ws.printfAll("S:%s",getStateNameWeb(State));
-                ws.printfAll("E:%s",getErrorNameWeb(ErrorFlags));
-                ws.printfAll("C:%2.1f",(float)Balanced[0]/10);
-                ws.printfAll("I:%3.1f,%3.1f,%3.1f",(float)Irms[0]/10,(float)Irms[1]/10,(float)Irms[2]/10);
-                ws.printfAll("R:%u", esp_reset_reason() );
-
-                ws.cleanupClients();                                        // Cleanup old websocket clients
-            } 
-            Timer5sec = 0;
-        }
+// task 1000msTimer
+void Timer1S(void * parameter) {
 
-        //Serial.printf("Task 1s free ram: %u\n", uxTaskGetStackHighWaterMark( NULL ));
+    while(1) { // infinite loop
 
+        Timer1SStep();
+        WakeEVSEStates();                                               // ChargeDelay, ActivationTimer and the error flags changed
 
         // Pause the task for 1 Sec
         vTaskDelay(1000 / portTICK_PERIOD_MS);
@@ -2147,7 +2471,9 @@ void Timer1S(void * parameter) {
 // Does not send any data back.
 //
 ModbusMessage MBEVMeterResponse(ModbusMessage request) {
-    
+    signed int EVCurrent[3];                                                // mA
+    uint8_t x;
+
     ModbusDecode( (uint8_t*)request.data(), request.size());
 
     if (MB.Type == MODBUS_RESPONSE) {
@@ -2162,6 +2488,14 @@ ModbusMessage MBEVMeterResponse(ModbusMessage request) {
         } else if (MB.Register == EMConfig[EVMeter].PRegister) {
             // Power measurement
             PowerMeasured = receivePowerMeasurement(MB.Data, EVMeter);
+
+        } else if (MB.Register == EMConfig[EVMeter].IRegister) {
+            // Current measurement, learn on which phases the EV is charging
+            receiveCurrentMeasurement(MB.Data, EVMeter, EVCurrent);
+            if (State == STATE_C) {
+                for (x = 0; x < 3; x++) if (abs(EVCurrent[x]) > PHASE_CURRENT * 100) EVPhasesUsed |= 1 << x;
+                if (LoadBl < 2) setEVCurrent(0, EVCurrent);
+            }
         }
     }
     // As this is a response to an earlier request, do not send response.
@@ -2174,6 +2508,7 @@ ModbusMessage MBEVMeterResponse(ModbusMessage request) {
 //
 ModbusMessage MBPVMeterResponse(ModbusMessage request) {
 
+    if (PVMeterIP) return NIL_RESPONSE;                                         // Read over the network
     ModbusDecode( (uint8_t*)request.data(), request.size());
 
     if (MB.Type == MODBUS_RESPONSE) {
@@ -2187,6 +2522,95 @@ ModbusMessage MBPVMeterResponse(ModbusMessage request) {
     return NIL_RESPONSE;  
 }
 
+/**
+ * Update the snapshot of the measurement registers (0x0300 - 0x032F)
+ * All values are taken at the same moment, so a single FC04 read returns a consistent set.
+ *
+ * 0x00: State                  0x08: Temperature (C)
+ * 0x01: Error flags            0x09: Charge delay (s)
+ * 0x02: Irms L1 (0.1A)         0x0A: Power measured by EV meter (W, 32 bit, high word first)
+ * 0x03: Irms L2 (0.1A)         0x0C: Energy charged (Wh, 32 bit)
+ * 0x04: Irms L3 (0.1A)         0x0E: Mains power (W, 32 bit)
+ * 0x05: Isum (0.1A)            0x10: Balanced current per EVSE (0.1A) x8
+ * 0x06: Imeasured (0.1A)       0x18: Max current per EVSE (0.1A) x8
+ * 0x07: IsetBalanced (0.1A)    0x20: State per EVSE x8
+ *                              0x28: Solar timer per EVSE (s) x8
+ */
+void UpdateMeasureRegisters(void) {
+    uint16_t regs[MODBUS_EVSE_MEASURE_COUNT];
+    uint8_t x;
+
+    regs[0x00] = State;
+    regs[0x01] = ErrorFlags;
+    for (x = 0; x < 3; x++) regs[0x02 + x] = (uint16_t)Irms[x];
+    regs[0x05] = (uint16_t)Isum;
+    regs[0x06] = (uint16_t)Imeasured;
+    regs[0x07] = (uint16_t)IsetBalanced;
+    regs[0x08] = (uint16_t)TempEVSE;
+    regs[0x09] = ChargeDelay;
+    regs[0x0A] = (uint32_t)PowerMeasured >> 16;
+    regs[0x0B] = (uint32_t)PowerMeasured & 0xFFFF;
+    regs[0x0C] = (uint32_t)EnergyCharged >> 16;
+    regs[0x0D] = (uint32_t)EnergyCharged & 0xFFFF;
+    regs[0x0E] = (uint32_t)MainsPower >> 16;
+    regs[0x0F] = (uint32_t)MainsPower & 0xFFFF;
+    for (x = 0; x < NR_EVSES; x++) {
+        regs[0x10 + x] = Balanced[x];
+        regs[0x18 + x] = BalancedMax[x];
+        regs[0x20 + x] = BalancedState[x];
+        regs[0x28 + x] = Node[x].Timer;
+    }
+
+    portENTER_CRITICAL(&measure_spinlock);
+    memcpy(MeasureRegs, regs, sizeof(MeasureRegs));
+    portEXIT_CRITICAL(&measure_spinlock);
+}
+
+/**
+ * Read from the snapshot of the measurement registers
+ *
+ * @param uint16_t Register
+ * @param uint16_t Count
+ * @param pointer to values
+ * @return uint8_t 0 when the register range is not in the measurement bank
+ */
+uint8_t readMeasureRegisters(uint16_t Register, uint16_t Count, uint16_t *values) {
+
+    if (Register < MODBUS_EVSE_MEASURE_START || !Count) return 0;
+    Register -= MODBUS_EVSE_MEASURE_START;
+    if (Register + Count > MODBUS_EVSE_MEASURE_COUNT) return 0;
+
+    portENTER_CRITICAL(&measure_spinlock);
+    memcpy(values, &MeasureRegs[Register], Count * sizeof(uint16_t));
+    portEXIT_CRITICAL(&measure_spinlock);
+    return 1;
+}
+
+/**
+ * Is the Mains meter read over the RS485 bus?
+ * (Not when the meter pushes P1 telegrams, or is polled over the network)
+ * 
+ * @return uint8_t 1 when read over RS485
+ */
+uint8_t MainsMeterOnRS485(void) {
+    return MainsMeter && MainsMeter != EM_P1 && !MainsMeterIP;
+}
+
+/**
+ * Calculate Irms and Isum (for nodes and master) from new mains meter currents in CM[]
+ */
+void UpdateMainsCurrents(void) {
+    uint8_t x;
+
+    Isum = 0;
+    for (x = 0; x < 3; x++) {
+        // Calculate difference of Mains and PV electric meter
+        if (PVMeter) CM[x] = CM[x] - PV[x];                 // CurrentMeter and PV resolution are 1mA
+        Irms[x] = (signed int)(CM[x] / 100);                // reduce resolution of Irms to 100mA
+        Isum = Isum + Irms[x];                              // Isum has a resolution of 100mA
+    }
+}
+
 //
 // Monitor Mains Meter responses, and update Irms values
 // Does not send any data back.
@@ -2194,6 +2618,7 @@ ModbusMessage MBMainsMeterResponse(ModbusMessage request) {
     uint8_t x;
     ModbusMessage response;     // response message to be sent back
 
+    if (!MainsMeterOnRS485()) return NIL_RESPONSE;                              // Read over the network, or P1
     ModbusDecode( (uint8_t*)request.data(), request.size());
 
     // process only Responses, as otherwise MB.Data is unitialized, and it will throw an exception
@@ -2203,14 +2628,7 @@ ModbusMessage MBMainsMeterResponse(ModbusMessage request) {
         x = receiveCurrentMeasurement(MB.Data, MainsMeter, CM);
         if (x && LoadBl <2) timeout = 10;                   // only reset timeout when data is ok, and Master/Disabled
 
-        // Calculate Isum (for nodes and master)
-        Isum = 0;
-        for (x = 0; x < 3; x++) {
-            // Calculate difference of Mains and PV electric meter
-            if (PVMeter) CM[x] = CM[x] - PV[x];             // CurrentMeter and PV resolution are 1mA
-            Irms[x] = (signed int)(CM[x] / 100);            // reduce resolution of Irms to 100mA
-            Isum = Isum + Irms[x];                          // Isum has a resolution of 100mA
-        }
+        UpdateMainsCurrents();
     }
 
     // As this is a response to an earlier request, do not send response.
@@ -2222,79 +2640,11 @@ ModbusMessage MBMainsMeterResponse(ModbusMessage request) {
 // Sends response back to Master
 //
 ModbusMessage MBNodeRequest(ModbusMessage request) {
-    ModbusMessage response;     // response message to be sent back
-    uint8_t ItemID;
-    uint8_t i, OK = 0;
-    uint16_t value, values[MODBUS_MAX_REGISTER_READ];
     
     // Check if the call is for our current ServerID, or maybe for an old ServerID?
     if (LoadBl != request.getServerID()) return NIL_RESPONSE;
-    
-
-    ModbusDecode( (uint8_t*)request.data(), request.size());
-    ItemID = mapModbusRegister2ItemID();
-
-    switch (MB.Function) {
-        case 0x03: // (Read holding register)
-        case 0x04: // (Read input register)
-            //     ReadItemValueResponse();
-            if (ItemID) {
-                response.add(MB.Address, MB.Function, (uint8_t)(MB.RegisterCount * 2));
-
-                for (i = 0; i < MB.RegisterCount; i++) {
-                    values[i] = getItemValue(ItemID + i);
-                    response.add(values[i]);
-                }
-                //ModbusReadInputResponse(MB.Address, MB.Function, values, MB.RegisterCount);
-            } else {
-                response.setError(MB.Address, MB.Function, ILLEGAL_DATA_ADDRESS);
-            }
-            break;
-        case 0x06: // (Write single register)
-            //WriteItemValueResponse();
-            if (ItemID) {
-                OK = setItemValue(ItemID, MB.Value);
-            }
 
-            if (OK && ItemID < STATUS_STATE) write_settings();
-
-            if (MB.Address != BROADCAST_ADR || LoadBl == 0) {
-                if (!ItemID) {
-                    response.setError(MB.Address, MB.Function, ILLEGAL_DATA_ADDRESS);
-                } else if (!OK) {
-                    response.setError(MB.Address, MB.Function, ILLEGAL_DATA_VALUE);
-                } else {
-                    return ECHO_RESPONSE;
-                }
-            }
-            break;
-        case 0x10: // (Write multiple register))
-            //      WriteMultipleItemValueResponse();
-            if (ItemID) {
-                for (i = 0; i < MB.RegisterCount; i++) {
-                    value = (MB.Data[i * 2] <<8) | MB.Data[(i * 2) + 1];
-                    OK += setItemValue(ItemID + i, value);
-                }
-            }
-
-            if (OK && ItemID < STATUS_STATE) write_settings();
-
-            if (MB.Address != BROADCAST_ADR || LoadBl == 0) {
-                if (!ItemID) {
-                    response.setError(MB.Address, MB.Function, ILLEGAL_DATA_ADDRESS);
-                } else if (!OK) {
-                    response.setError(MB.Address, MB.Function, ILLEGAL_DATA_VALUE);
-                } else  {
-                    //ModbusWriteMultipleResponse(MB.Address, MB.Register, OK);
-                    response.add(MB.Address, MB.Function, (uint16_t)MB.Register, (uint16_t)OK);
-                }
-            }
-            break;
-        default:
-            break;
-    }
-
-  return response;
+    return MBItemRequest(request);
 }
 
 // The Node/Server receives a broadcast message from the Master
@@ -2304,7 +2654,7 @@ ModbusMessage MBbroadcast(ModbusMessage request) {
     uint16_t value;
 
     ModbusDecode( (uint8_t*)request.data(), request.size());
-    ItemID = mapModbusRegister2ItemID();
+    ItemID = mapModbusRegister2ItemID(MB.Register, MB.RegisterCount);
 
     if (MB.Type == MODBUS_REQUEST) {
 
@@ -2360,7 +2710,10 @@ ModbusMessage MBbroadcast(ModbusMessage request) {
 // Responses from Slaves/Nodes are handled here
 void MBhandleData(ModbusMessage msg, uint32_t token) 
 {
-   uint8_t Address = msg.getServerID();
+   uint8_t Address = msg.getServerID(), n;
+   signed int EVCurrent[3];                                                    // mA
+
+    if (!receiveCurrentBlock(msg, token)) return;                              // part of a read that was split by ReadMax
 
     if (Address == MainsMeterAddress) {
         //Serial.print("MainsMeter data\n");
@@ -2387,6 +2740,14 @@ void MBhandleData(ModbusMessage msg, uint32_t token)
             //    Serial.print("Node EV Meter settings received\n");
                 receiveNodeConfig(MB.Data, MB.Address - 1u);
             }
+        } else if (MB.Type == MODBUS_RESPONSE) {
+            // Packet from the EV meter of a Node, the current it draws
+            for (n = 1; n < NR_EVSES; n++) {
+                if (Node[n].EVMeter && Node[n].EVAddress == MB.Address && MB.Register == EMConfig[Node[n].EVMeter].IRegister) {
+                    receiveCurrentMeasurement(MB.Data, Node[n].EVMeter, EVCurrent);
+                    setEVCurrent(n, EVCurrent);
+                }
+            }
         }
     }
 
@@ -2423,7 +2784,8 @@ void ConfigureModbusMode(uint8_t newmode) {
             // Also add handler for all broadcast messages from Master.
             MBserver.registerWorker(BROADCAST_ADR, ANY_FUNCTION_CODE, &MBbroadcast);
 
-            if (MainsMeter) MBserver.registerWorker(MainsMeterAddress, ANY_FUNCTION_CODE, &MBMainsMeterResponse);
+            // The meter handlers check at runtime if the meter is read over RS485 (it can be moved to the network and back)
+            if (MainsMeter && MainsMeter != EM_P1) MBserver.registerWorker(MainsMeterAddress, ANY_FUNCTION_CODE, &MBMainsMeterResponse);
             if (EVMeter) MBserver.registerWorker(EVMeterAddress, ANY_FUNCTION_CODE, &MBEVMeterResponse);
             if (PVMeter) MBserver.registerWorker(PVMeterAddress, ANY_FUNCTION_CODE, &MBPVMeterResponse);
 
@@ -2492,12 +2854,22 @@ void validate_settings(void) {
     if (RFIDReader == 2) Access_bit = 0;
     // Enable access if no access switch used
     else if (Switch != 1 && Switch != 2) Access_bit = 1;
+    // Meter profile selected that was not loaded from SPIFFS? Fall back to default
+    if (MainsMeter >= EM_PROFILE_FIRST && !EMConfig[MainsMeter].Desc[0]) MainsMeter = MAINS_METER;
+    if ((PVMeter >= EM_PROFILE_FIRST && !EMConfig[PVMeter].Desc[0]) || PVMeter == EM_P1) PVMeter = PV_METER;
+    if ((EVMeter >= EM_PROFILE_FIRST && !EMConfig[EVMeter].Desc[0]) || EVMeter == EM_P1) EVMeter = EV_METER;
     // Sensorbox v2 has always address 0x0A
     if (MainsMeter == EM_SENSORBOX) MainsMeterAddress = 0x0A;
     // Disable modbus reception on normal mode
     if (Mode == MODE_NORMAL) { MainsMeter = 0; PVMeter = 0; }
     // Disable PV reception if not configured
     if (MainsMeterMeasure == 0) PVMeter = 0;
+    // Sensorbox and P1 port can not be read over the network
+    if (MainsMeter == EM_SENSORBOX || MainsMeter == EM_P1) MainsMeterIP = 0;
+    if (PVMeter == EM_SENSORBOX) PVMeterIP = 0;
+    if (MeterTCPPort == 0) MeterTCPPort = METER_TCP_PORT;
+    if (SchedulePolicy >= SCHEDULE_POLICIES) SchedulePolicy = SCHEDULE_POLICY;
+    if (ScheduleSlice == 0 || ScheduleSlice > SCHEDULE_SLICE_MAX) ScheduleSlice = SCHEDULE_SLICE;
     // set Lock variables for Solenoid or Motor
     if (Lock == 1) { lock1 = LOW; lock2 = HIGH; }
     else if (Lock == 2) { lock1 = HIGH; lock2 = LOW; }
@@ -2529,7 +2901,8 @@ void validate_settings(void) {
 }
 
 void read_settings(bool write) {
-    
+    uint8_t x, Priority[NR_EVSES] = {0, 0, 0, 0, 0, 0, 0, 0}, Circuit[NR_EVSES] = {0, 0, 0, 0, 0, 0, 0, 0};
+
     if (preferences.begin("settings", false) == true) {
 
         Config = preferences.getUChar("Config", CONFIG); 
@@ -2554,8 +2927,32 @@ void read_settings(bool write) {
         MainsMeterMeasure = preferences.getUChar("MainsMMeasure",MAINS_METER_MEASURE);
         PVMeter = preferences.getUChar("PVMeter",PV_METER);
         PVMeterAddress = preferences.getUChar("PVMAddress",PV_METER_ADDRESS);
+        MainsMeterIP = preferences.getUInt("MainsMeterIP",MAINS_METER_IP);
+        PVMeterIP = preferences.getUInt("PVMeterIP",PV_METER_IP);
+        MeterTCPPort = preferences.getUShort("MeterTCPPort",METER_TCP_PORT);
+        ModbusTCPWrite = preferences.getUChar("MBTCPWrite",MODBUS_TCP_WRITE);
         EVMeter = preferences.getUChar("EVMeter",EV_METER);
         EVMeterAddress = preferences.getUChar("EVMeterAddress",EV_METER_ADDRESS);
+        EVPhases = preferences.getUChar("EVPhases",EV_PHASES) & PHASE_ALL;
+        SchedulePolicy = preferences.getUChar("SchedPolicy",SCHEDULE_POLICY);
+        ScheduleSlice = preferences.getUShort("SchedSlice",SCHEDULE_SLICE);
+        preferences.getBytes("SchedPrio", Priority, NR_EVSES);
+        DemandTarget = preferences.getUInt("DemandTarget",DEMAND_TARGET);
+        if (DemandTarget > DEMAND_TARGET_MAX) DemandTarget = DEMAND_TARGET;
+        preferences.getBytes("DemandPeak", DemandPeak, sizeof(DemandPeak));
+        DemandMonth = preferences.getUShort("DemandMonth",0);
+        for (x = 0; x < NR_EVSES; x++) Node[x].Priority = Priority[x];
+        preferences.getBytes("CircuitMax", CircuitMax, BALANCE_CIRCUITS);
+        preferences.getBytes("CircuitParent", CircuitParent, BALANCE_CIRCUITS);
+        preferences.getBytes("CircuitNode", Circuit, NR_EVSES);
+        for (x = 0; x < BALANCE_CIRCUITS; x++) if (CircuitParent[x] > x) CircuitParent[x] = 0;   // a tree, no loops
+        for (x = 0; x < BALANCE_CIRCUITS; x++) if (CircuitMax[x] > CIRCUIT_MAX) CircuitMax[x] = CIRCUIT_MAX;
+        for (x = 0; x < NR_EVSES; x++) Node[x].Circuit = Circuit[x] <= BALANCE_CIRCUITS ? Circuit[x] : 0;
+        ControlGains.Kp = preferences.getUShort("PIKp",PI_KP);
+        ControlGains.Ki = preferences.getUShort("PIKi",PI_KI);
+        ControlGains.KiDown = preferences.getUShort("PIKiDown",PI_KI_DOWN);
+        ControlGains.RateUp = preferences.getUShort("PIRateUp",PI_RATE_UP);
+        ControlGains.RateDown = preferences.getUShort("PIRateDown",PI_RATE_DOWN);
         EMConfig[EM_CUSTOM].Endianness = preferences.getUChar("EMEndianness",EMCUSTOM_ENDIANESS);
         EMConfig[EM_CUSTOM].IRegister = preferences.getUShort("EMIRegister",EMCUSTOM_IREGISTER);
         EMConfig[EM_CUSTOM].IDivisor = preferences.getUChar("EMIDivisor",EMCUSTOM_IDIVISOR);
@@ -2567,6 +2964,7 @@ void read_settings(bool write) {
         EMConfig[EM_CUSTOM].EDivisor = preferences.getUChar("EMEDivisor",EMCUSTOM_EDIVISOR);
         EMConfig[EM_CUSTOM].DataType = (mb_datatype)preferences.getUChar("EMDataType",EMCUSTOM_DATATYPE);
         EMConfig[EM_CUSTOM].Function = preferences.getUChar("EMFunction",EMCUSTOM_FUNCTION);
+        EMConfig[EM_CUSTOM].ReadMax = preferences.getUChar("EMReadMax",EMCUSTOM_READMAX);
         WIFImode = preferences.getUChar("WIFImode",WIFI_MODE);
         APpassword = preferences.getString("APpassword",AP_PASSWORD);
         
@@ -2578,6 +2976,7 @@ void read_settings(bool write) {
 }
 
 void write_settings(void) {
+    uint8_t x, Priority[NR_EVSES], Circuit[NR_EVSES];
 
     validate_settings();
 
@@ -2605,8 +3004,29 @@ void write_settings(void) {
     preferences.putUChar("MainsMMeasure", MainsMeterMeasure);
     preferences.putUChar("PVMeter", PVMeter);
     preferences.putUChar("PVMAddress", PVMeterAddress);
+    preferences.putUInt("MainsMeterIP", MainsMeterIP);
+    preferences.putUInt("PVMeterIP", PVMeterIP);
+    preferences.putUShort("MeterTCPPort", MeterTCPPort);
+    preferences.putUChar("MBTCPWrite", ModbusTCPWrite);
     preferences.putUChar("EVMeter", EVMeter);
     preferences.putUChar("EVMeterAddress", EVMeterAddress);
+    preferences.putUChar("EVPhases", EVPhases);
+    preferences.putUChar("SchedPolicy", SchedulePolicy);
+    preferences.putUShort("SchedSlice", ScheduleSlice);
+    for (x = 0; x < NR_EVSES; x++) Priority[x] = Node[x].Priority;
+    preferences.putBytes("SchedPrio", Priority, NR_EVSES);
+    preferences.putBytes("CircuitMax", CircuitMax, BALANCE_CIRCUITS);
+    preferences.putBytes("CircuitParent", CircuitParent, BALANCE_CIRCUITS);
+    for (x = 0; x < NR_EVSES; x++) Circuit[x] = Node[x].Circuit;
+    preferences.putBytes("CircuitNode", Circuit, NR_EVSES);
+    preferences.putUInt("DemandTarget", DemandTarget);
+    preferences.putBytes("DemandPeak", DemandPeak, sizeof(DemandPeak));
+    preferences.putUShort("DemandMonth", DemandMonth);
+    preferences.putUShort("PIKp", ControlGains.Kp);
+    preferences.putUShort("PIKi", ControlGains.Ki);
+    preferences.putUShort("PIKiDown", ControlGains.KiDown);
+    preferences.putUShort("PIRateUp", ControlGains.RateUp);
+    preferences.putUShort("PIRateDown", ControlGains.RateDown);
     preferences.putUChar("EMEndianness", EMConfig[EM_CUSTOM].Endianness);
     preferences.putUShort("EMIRegister", EMConfig[EM_CUSTOM].IRegister);
     preferences.putUChar("EMIDivisor", EMConfig[EM_CUSTOM].IDivisor);
@@ -2618,6 +3038,7 @@ void write_settings(void) {
     preferences.putUChar("EMEDivisor", EMConfig[EM_CUSTOM].EDivisor);
     preferences.putUChar("EMDataType", EMConfig[EM_CUSTOM].DataType);
     preferences.putUChar("EMFunction", EMConfig[EM_CUSTOM].Function);
+    preferences.putUChar("EMReadMax", EMConfig[EM_CUSTOM].ReadMax);
     preferences.putUChar("WIFImode", WIFImode);
     preferences.putString("APpassword", APpassword);
 
@@ -2639,6 +3060,7 @@ void write_settings(void) {
         ModbusWriteMultipleRequest(BROADCAST_ADR, MODBUS_SYS_CONFIG_START, values, MODBUS_SYS_CONFIG_COUNT);
     }
 
+    ConfigureP1();                                                              // Start the P1 task when the Mains meter was set to P1
     ConfigChanged = 1;
 }
 
@@ -2714,6 +3136,29 @@ void onRequest(AsyncWebServerRequest *request){
     request->send(404);
 }
 
+/**
+ * Read a numeric parameter of a web request
+ * 
+ * @param pointer to AsyncWebServerRequest
+ * @param const char *name
+ * @param long min
+ * @param long max
+ * @param pointer to long value: only written when the parameter is valid
+ * @return int8_t 1: valid, 0: not present, -1: not a number or out of range
+ */
+int8_t getParamRange(AsyncWebServerRequest *request, const char *name, long min, long max, long *value) {
+    const char *str;
+    char *end;
+    long val;
+
+    if (!request->hasParam(name)) return 0;
+    str = request->getParam(name)->value().c_str();
+    val = strtol(str, &end, 10);
+    if (end == str || *end || val < min || val > max) return -1;
+    *value = val;
+    return 1;
+}
+
 
 
 void StopwebServer(void) {
@@ -2759,6 +3204,289 @@ void StartwebServer(void) {
         ESP.restart();
     });
 
+    // Mains/PV electric meters on the network (Modbus TCP)
+    // /modbustcp?mainsip=192.168.1.20&pvip=0.0.0.0&port=502  (0.0.0.0 = read meter over RS485)
+    webServer.on("/modbustcp", HTTP_GET, [](AsyncWebServerRequest *request) {
+        IPAddress ip;
+        uint32_t MainsIP = MainsMeterIP, PVIP = PVMeterIP;
+        long Port = MeterTCPPort, Write = ModbusTCPWrite;
+
+        if (request->hasParam("mainsip")) {
+            if (!ip.fromString(request->getParam("mainsip")->value())) return request->send(400, "text/plain", "invalid mainsip\n");
+            MainsIP = (uint32_t)ip;
+        }
+        if (request->hasParam("pvip")) {
+            if (!ip.fromString(request->getParam("pvip")->value())) return request->send(400, "text/plain", "invalid pvip\n");
+            PVIP = (uint32_t)ip;
+        }
+        if (getParamRange(request, "port", 1, 65535, &Port) < 0) return request->send(400, "text/plain", "invalid port, 1-65535\n");
+        if (getParamRange(request, "write", 0, 1, &Write) < 0) return request->send(400, "text/plain", "invalid write, 0-1\n");
+
+        if (MainsIP != MainsMeterIP || PVIP != PVMeterIP || Port != MeterTCPPort || Write != ModbusTCPWrite) {
+            MainsMeterIP = MainsIP;
+            PVMeterIP = PVIP;
+            MeterTCPPort = Port;
+            ModbusTCPWrite = Write;
+            write_settings();                                                   // validates the settings (no IP for Sensorbox/P1)
+            timeout = 10;                                                       // give the meter on its new address time to respond
+        }
+
+        request->send(200, "text/plain", "mainsip=" + IPAddress(MainsMeterIP).toString() + "\npvip=" + IPAddress(PVMeterIP).toString() + "\nport=" + String(MeterTCPPort) + "\nwrite=" + String(ModbusTCPWrite) + "\n");
+    });
+
+    // Phases used by the EV on this EVSE, bit 0-2: L1-L3 of the mains meter
+    // /evphases?mask=1  (0 = learn from the EV meter, when it measures more than 1A on a phase)
+    // Learning needs the L1-L3 of the EV meter to be the L1-L3 of the mains, so not where the phases are rotated per EVSE
+    webServer.on("/evphases", HTTP_GET, [](AsyncWebServerRequest *request) {
+        long Mask = EVPhases;
+
+        if (getParamRange(request, "mask", 0, PHASE_ALL, &Mask) < 0) return request->send(400, "text/plain", "invalid mask, 0-" + String(PHASE_ALL) + "\n");
+        if (Mask != EVPhases) {
+            EVPhases = Mask;
+            write_settings();
+        }
+
+        request->send(200, "text/plain", "mask=" + String(EVPhases) + "\nused=" + String(getEVPhases()) + "\n");
+    });
+
+    // Gains of the mains current controllers (Smart and Solar mode)
+    // /picontrol?kp=500&ki=300&kidown=1000&up=10&down=0  (gains in 1/1000 (per second), rate limits in 0.1A per second)
+    webServer.on("/picontrol", HTTP_GET, [](AsyncWebServerRequest *request) {
+        long Kp = ControlGains.Kp, Ki = ControlGains.Ki, KiDown = ControlGains.KiDown;
+        long RateUp = ControlGains.RateUp, RateDown = ControlGains.RateDown;
+
+        if (getParamRange(request, "kp", 0, PI_GAIN_MAX, &Kp) < 0) return request->send(400, "text/plain", "invalid kp, 0-" + String(PI_GAIN_MAX) + "\n");
+        if (getParamRange(request, "ki", 0, PI_GAIN_MAX, &Ki) < 0) return request->send(400, "text/plain", "invalid ki, 0-" + String(PI_GAIN_MAX) + "\n");
+        // without KiDown an overload is never removed
+        if (getParamRange(request, "kidown", 1, PI_GAIN_MAX, &KiDown) < 0) return request->send(400, "text/plain", "invalid kidown, 1-" + String(PI_GAIN_MAX) + "\n");
+        if (getParamRange(request, "up", 0, PI_RATE_MAX, &RateUp) < 0) return request->send(400, "text/plain", "invalid up, 0-" + String(PI_RATE_MAX) + "\n");
+        if (getParamRange(request, "down", 0, PI_RATE_MAX, &RateDown) < 0) return request->send(400, "text/plain", "invalid down, 0-" + String(PI_RATE_MAX) + "\n");
+
+        if (Kp != ControlGains.Kp || Ki != ControlGains.Ki || KiDown != ControlGains.KiDown || RateUp != ControlGains.RateUp || RateDown != ControlGains.RateDown) {
+            ControlGains.Kp = Kp;
+            ControlGains.Ki = Ki;
+            ControlGains.KiDown = KiDown;
+            ControlGains.RateUp = RateUp;
+            ControlGains.RateDown = RateDown;
+            write_settings();
+        }
+
+        request->send(200, "text/plain", "kp=" + String(ControlGains.Kp) + "\nki=" + String(ControlGains.Ki) + "\nkidown=" + String(ControlGains.KiDown)
+                                         + "\nup=" + String(ControlGains.RateUp) + "\ndown=" + String(ControlGains.RateDown) + "\n");
+    });
+
+    // Which waiting EVSE gets a free slot, when there is not enough current for all EVSE's (Master only)
+    // /schedule?policy=3&slice=30&node=1&priority=2  (policy 0: first come, 1: rotate, 2: least charged, 3: priority; slice in minutes)
+    webServer.on("/schedule", HTTP_GET, [](AsyncWebServerRequest *request) {
+        long Policy = SchedulePolicy, Slice = ScheduleSlice, Nr = 0, Priority = 0;
+        int8_t node, priority;
+        bool changed = false;
+        uint8_t n;
+        String str;
+
+        if (getParamRange(request, "policy", 0, SCHEDULE_POLICIES - 1, &Policy) < 0) return request->send(400, "text/plain", "invalid policy, 0-" + String(SCHEDULE_POLICIES - 1) + "\n");
+        if (getParamRange(request, "slice", 1, SCHEDULE_SLICE_MAX, &Slice) < 0) return request->send(400, "text/plain", "invalid slice, 1-" + String(SCHEDULE_SLICE_MAX) + "\n");
+        node = getParamRange(request, "node", 0, NR_EVSES - 1, &Nr);
+        if (node < 0) return request->send(400, "text/plain", "invalid node, 0-" + String(NR_EVSES - 1) + "\n");
+        priority = getParamRange(request, "priority", 0, 255, &Priority);
+        if (priority < 0) return request->send(400, "text/plain", "invalid priority, 0-255\n");
+        if (node != priority) return request->send(400, "text/plain", "node and priority go together\n");
+
+        if (Policy != SchedulePolicy || Slice != ScheduleSlice) {
+            SchedulePolicy = Policy;
+            ScheduleSlice = Slice;
+            changed = true;
+        }
+        if (node && Priority != Node[Nr].Priority) {
+            Node[Nr].Priority = Priority;
+            changed = true;
+        }
+        if (changed) write_settings();
+
+        str = "policy=" + String(SchedulePolicy) + "\nslice=" + String(ScheduleSlice) + "\n";
+        for (n = 0; n < NR_EVSES; n++) {
+            str = str + "node" + String(n) + ": priority=" + String(Node[n].Priority) + " connected=" + String(Node[n].Connected)
+                      + " idle=" + String(Node[n].Idle) + " charged=" + String(Node[n].Charged / 36000) + "Ah\n";
+        }
+        request->send(200, "text/plain", str);
+    });
+
+    // Sub-circuits (distribution boards) with their own breaker, max current per phase in A (0 = not limited)
+    // /circuit?circuit=2&max=40&parent=1  (parent: a circuit with a lower number, 0 = mains)
+    // /circuit?node=3&circuit=2  (the EVSE is on circuit 2, 0 = mains)
+    webServer.on("/circuit", HTTP_GET, [](AsyncWebServerRequest *request) {
+        long Nr = 0, Circuit = 0, Max, Parent;
+        int8_t node, circuit;
+        bool changed = false;
+        uint8_t n, c, x;
+        int Total[3];
+        String str;
+
+        node = getParamRange(request, "node", 0, NR_EVSES - 1, &Nr);
+        if (node < 0) return request->send(400, "text/plain", "invalid node, 0-" + String(NR_EVSES - 1) + "\n");
+        circuit = getParamRange(request, "circuit", node ? 0 : 1, BALANCE_CIRCUITS, &Circuit);
+        if (circuit < 0) return request->send(400, "text/plain", "invalid circuit, " + String(node ? 0 : 1) + "-" + String(BALANCE_CIRCUITS) + "\n");
+        if (node && !circuit) return request->send(400, "text/plain", "node and circuit go together\n");
+
+        if (node) {
+            if (Node[Nr].Circuit != Circuit) {
+                Node[Nr].Circuit = Circuit;
+                changed = true;
+            }
+        } else if (circuit) {
+            Max = CircuitMax[Circuit - 1];
+            Parent = CircuitParent[Circuit - 1];
+            if (getParamRange(request, "max", 0, CIRCUIT_MAX, &Max) < 0) return request->send(400, "text/plain", "invalid max, 0-" + String(CIRCUIT_MAX) + "\n");
+            if (getParamRange(request, "parent", 0, Circuit - 1, &Parent) < 0) {     // a tree, no loops
+                return request->send(400, "text/plain", "invalid parent, 0-" + String(Circuit - 1) + "\n");
+            }
+            if (Max != CircuitMax[Circuit - 1] || Parent != CircuitParent[Circuit - 1]) {
+                CircuitMax[Circuit - 1] = Max;
+                CircuitParent[Circuit - 1] = Parent;
+                changed = true;
+            }
+        } else if (request->hasParam("max") || request->hasParam("parent")) {
+            return request->send(400, "text/plain", "max and parent go with a circuit\n");
+        }
+        if (changed) write_settings();
+
+        for (c = 1; c <= BALANCE_CIRCUITS; c++) {
+            for (x = 0; x < 3; x++) Total[x] = 0;
+            for (n = 0; n < NR_EVSES; n++) if (BalancedState[n] == STATE_C && OnCircuit(n, c)) {
+                for (x = 0; x < 3; x++) if (!Node[n].Phases || (Node[n].Phases & (1 << x))) Total[x] += Balanced[n];
+            }
+            str = str + "circuit" + String(c) + ": max=" + String(CircuitMax[c - 1]) + " parent=" + String(CircuitParent[c - 1])
+                      + " current=" + String(Total[0] / 10) + "," + String(Total[1] / 10) + "," + String(Total[2] / 10) + "\n";
+        }
+        for (n = 0; n < NR_EVSES; n++) str = str + "node" + String(n) + ": circuit=" + String(Node[n].Circuit) + "\n";
+        request->send(200, "text/plain", str);
+    });
+
+    // Capacity tariff: max 15 minute average import in W (0 = no limit), and the peaks per month
+    // /demand?target=7000
+    webServer.on("/demand", HTTP_GET, [](AsyncWebServerRequest *request) {
+        String str;
+        long Target = DemandTarget;
+        uint8_t n;
+
+        if (getParamRange(request, "target", 0, DEMAND_TARGET_MAX, &Target) < 0) return request->send(400, "text/plain", "invalid target, 0-" + String(DEMAND_TARGET_MAX) + "\n");
+        if (Target != (long)DemandTarget) {
+            DemandTarget = Target;                                              // one word, read by the other tasks without the lock
+            write_settings();
+        }
+
+        str = "target=" + String(DemandTarget) + "\naverage=" + String(DemandAverage(&MainsDemand)) + "\nprojected=" + String(DemandProjected(&MainsDemand))
+            + "\nallowed=" + String(DemandTarget ? DemandAllowed(&MainsDemand, DemandTarget) : 0) + "\nlast=" + String(MainsDemand.Last) + "\npeaks=";
+        for (n = 0; n < 12; n++) str = str + (n ? "," : "") + String(DemandPeak[n]);     // January - December
+        request->send(200, "text/plain", str + "\n");
+    });
+
+    // Price or CO2 per kWh, per 15 minutes for up to 48 hours (any unit, lower is better)
+    // /tariff?start=1700000000&cost=210,205,180,...  (start: Unix time of the first 15 minutes)
+    webServer.on("/tariff", HTTP_GET, [](AsyncWebServerRequest *request) {
+        struct PlanTable table;
+        String cost;
+        const char *str;
+        char *end;
+        long start, value;
+        int from, to;
+
+        if (request->hasParam("start") || request->hasParam("cost")) {
+            if (getParamRange(request, "start", 1, INT32_MAX, &start) < 1) return request->send(400, "text/plain", "invalid start, Unix time\n");
+            if (!request->hasParam("cost")) return request->send(400, "text/plain", "invalid cost\n");
+            table.Start = start - start % PLAN_SLOT_TIME;
+            cost = request->getParam("cost")->value();
+            // Build the table here, Tariff is only replaced when all of it is valid
+            for (table.Count = 0, from = 0; from < (int)cost.length(); from = to + 1) {
+                to = cost.indexOf(',', from);
+                if (to < 0) to = cost.length();
+                str = cost.c_str() + from;
+                value = strtol(str, &end, 10);
+                if (end == str || end != cost.c_str() + to || value < 0 || value >= PLAN_COST_UNKNOWN) {
+                    return request->send(400, "text/plain", "invalid cost " + String(table.Count + 1) + ", 0-" + String(PLAN_COST_UNKNOWN - 1) + "\n");
+                }
+                if (table.Count == PLAN_SLOTS) return request->send(400, "text/plain", "invalid cost, max " + String(PLAN_SLOTS) + " values\n");
+                table.Cost[table.Count++] = value;
+            }
+            if (!table.Count) return request->send(400, "text/plain", "invalid cost\n");
+
+            portENTER_CRITICAL(&plan_spinlock);
+            Tariff = table;
+            PlanDirty = true;
+            portEXIT_CRITICAL(&plan_spinlock);
+        }
+
+        request->send(200, "text/plain", "start=" + String(Tariff.Start) + "\ncount=" + String(Tariff.Count) + "\n");
+    });
+
+    // Charge plan for the connected EV: energy in Wh before the departure (Unix time), energy=0 cancels the plan
+    // /plan?energy=20000&departure=1700040000
+    webServer.on("/plan", HTTP_GET, [](AsyncWebServerRequest *request) {
+        String str;
+        uint32_t now = Hal->Time();
+        long Energy = 0, Departure = PlanDeparture;
+        uint8_t n;
+
+        if (request->hasParam("energy")) {
+            if (getParamRange(request, "energy", 0, PLAN_ENERGY_MAX, &Energy) < 0) return request->send(400, "text/plain", "invalid energy, 0-" + String(PLAN_ENERGY_MAX) + "\n");
+            if (Energy) {                                                       // a plan needs the time, and a departure in the future
+                if (State == STATE_A) return request->send(400, "text/plain", "no EV connected\n");   // the plan is cleared on disconnect
+                if (!now) return request->send(400, "text/plain", "no time, the plan needs the time\n");
+                if (getParamRange(request, "departure", now + 1, now + PLAN_DEPARTURE_MAX, &Departure) < 0 || Departure <= (long)now) {
+                    return request->send(400, "text/plain", "invalid departure, Unix time within " + String(PLAN_DEPARTURE_MAX / 3600) + " hours\n");
+                }
+            }
+            portENTER_CRITICAL(&plan_spinlock);
+            PlanTarget = Energy;
+            PlanDeparture = Departure;
+            PlanDirty = true;
+            portEXIT_CRITICAL(&plan_spinlock);
+        }
+
+        str = "energy=" + String(PlanTarget) + "\ndeparture=" + String(PlanDeparture) + "\nstart=" + String(ChargePlan.Start) + "\ncurrent=";
+        for (n = 0; PlanTarget && n < ChargePlan.Count; n++) str = str + (n ? "," : "") + String(ChargePlan.Current[n]);
+        request->send(200, "text/plain", str + "\n");
+    });
+
+    // Timing of the CP sample interrupt, histograms in us. /isrstats?reset=1 clears them.
+    // (not used with CP_SAMPLE_DMA)
+    webServer.on("/isrstats", HTTP_GET, [](AsyncWebServerRequest *request) {
+        char buf[1024];
+        int n;
+
+        if (request->hasParam("reset")) {
+            IsrHistogramReset(&CPLatency);
+            IsrHistogramReset(&CPConversion);
+            IsrHistogramReset(&CPIsrTime);
+        }
+        n = snprintf(buf, sizeof(buf), "{\"sampletime\":%u,", CPSampleTime);
+        n += IsrHistogramJson(&CPLatency, "latency", "us", 1, buf + n, sizeof(buf) - n);
+        n += snprintf(buf + n, sizeof(buf) - n, ",");
+        n += IsrHistogramJson(&CPConversion, "conversion", "us", ISR_CYCLES_US, buf + n, sizeof(buf) - n);
+        n += snprintf(buf + n, sizeof(buf) - n, ",");
+        n += IsrHistogramJson(&CPIsrTime, "isr", "us", ISR_CYCLES_US, buf + n, sizeof(buf) - n);
+        snprintf(buf + n, sizeof(buf) - n, "}");
+
+        request->send(200, "application/json", buf);
+    });
+
+    // Binary trace of state transitions, error flag and allocation changes (see trace.h)
+    webServer.on("/trace", HTTP_GET, [](AsyncWebServerRequest *request) {
+        std::shared_ptr<std::vector<uint8_t>> buf = std::make_shared<std::vector<uint8_t>>(sizeof(struct TraceHeader) + TRACE_SIZE * sizeof(struct TraceEntry));
+        uint32_t count = TraceSnapshot((struct TraceHeader *)buf->data(), (struct TraceEntry *)(buf->data() + sizeof(struct TraceHeader)));
+        size_t len = sizeof(struct TraceHeader) + count * sizeof(struct TraceEntry);
+
+        // the response owns the snapshot until it is sent
+        AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", len, [buf, len](uint8_t *out, size_t maxLen, size_t index) -> size_t {
+            if (index >= len) return 0;
+            if (maxLen > len - index) maxLen = len - index;
+            memcpy(out, buf->data() + index, maxLen);
+            return maxLen;
+        });
+        response->addHeader("Content-Disposition", "attachment; filename=trace.bin");
+        request->send(response);
+    });
+
     webServer.on("/update", HTTP_POST, [](AsyncWebServerRequest *request) {
        bool shouldReboot = !Update.hasError();
         AsyncWebServerResponse *response = request->beginResponse(200, "text/plain", shouldReboot?"OK":"FAIL");
@@ -2856,6 +3584,7 @@ void SetupNetworkTask(void * parameter) {
 
   WiFiSetup();
   StartwebServer();
+  StartModbusTCPServer();
 
   while(1) {
 
@@ -2954,6 +3683,14 @@ void setup() {
     // we use an i/o interrupt at the CP pin output, and a one shot timer interrupt to start the ADC conversion.
     // would be nice if there was an easier way...
 
+    SampleWindowInit(&CPWindow, 25);
+    SampleWindowInit(&CPLowWindow, 25);
+    PilotFilterInit(&CPFilter, PILOT_CONFIRM_N, PILOT_CONFIRM_M);               // bands are set by SetupPilotLevels()
+    IsrHistogramInit(&CPLatency, 2);                                            // 2us buckets
+    IsrHistogramInit(&CPConversion, 2 * ISR_CYCLES_US);
+    IsrHistogramInit(&CPIsrTime, 4 * ISR_CYCLES_US);                            // 4us buckets
+
+#if !CP_SAMPLE_DMA
     // setup timer, and one shot timer interrupt to 50us
     timerA = timerBegin(0, 80, true);
     timerAttachInterrupt(timerA, &onTimerA, false);
@@ -2962,6 +3699,7 @@ void setup() {
     timerAlarmWrite(timerA, PWM_100, true);
     // when PWM is active, we sample the CP pin after 5% 
     timerAlarmEnable(timerA);
+#endif
 
 
     // Setup ADC on CP, PP and Temperature pin
@@ -2977,10 +3715,46 @@ void setup() {
     esp_adc_cal_value_t val_type = esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_10, 1100, adc_chars_CP);
     esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_6, ADC_WIDTH_BIT_10, 1100, adc_chars_PP);
     esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_6, ADC_WIDTH_BIT_10, 1100, adc_chars_Temperature);
+
+    // Every channel has only 1024 possible readings, convert them to mV once.
+    BuildADCTable(ADCmV_CP, adc_chars_CP);
+    BuildADCTable(ADCmV_PP, adc_chars_PP);
+    BuildADCTable(ADCmV_Temperature, adc_chars_Temperature);
+    SetupPilotLevels();
+
+#if CP_SAMPLE_DMA
+    // Sample the CP pin continuously with the I2S ADC, into two DMA buffers of 10ms each
+    i2s_config_t i2s_config = {
+        .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN),
+        .sample_rate = CP_DMA_RATE,
+        .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
+        .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
+        .communication_format = I2S_COMM_FORMAT_STAND_I2S,
+        .intr_alloc_flags = 0,
+        .dma_buf_count = 2,
+        .dma_buf_len = CP_DMA_BLOCK,
+        .use_apll = false,
+    };
+    ADCMutex = xSemaphoreCreateMutex();
+    i2s_driver_install(I2S_NUM_0, &i2s_config, 0, NULL);
+    i2s_set_adc_mode(ADC_UNIT_1, (adc1_channel_t)adcchannel);
+    i2s_adc_enable(I2S_NUM_0);
+
+    // Create Task CPSample, gets the CP samples from the DMA buffers
+    xTaskCreate(
+        CPSampleTask,   // Function that should be called
+        "CPSampleTask", // Name of the task (for debugging)
+        2048,           // Stack size (bytes)
+        NULL,           // Parameter to pass
+        2,              // Task priority
+        NULL            // Task handle
+    );
+#endif
           
     
-    // Setup PWM on channel 0, 1000Hz, 10 bits resolution
-    ledcSetup(CP_CHANNEL, 1000, 10);            // channel 0  => Group: 0, Channel: 0, Timer: 0
+    // Setup PWM on channel 0, 1000Hz, 16 bits resolution (CP_PWM_BITS)
+    BuildDutyTable();
+    ledcSetup(CP_CHANNEL, 1000, CP_PWM_BITS);   // channel 0  => Group: 0, Channel: 0, Timer: 0
     // setup the RGB led PWM channels
     // as PWM channel 1 is used by the same timer as the CP timer (channel 0), we start with channel 2
     ledcSetup(RED_CHANNEL, 5000, 8);            // R channel 2, 5kHz, 8 bit
@@ -2998,7 +3772,7 @@ void setup() {
     ledcAttachPin(PIN_LEDB, BLUE_CHANNEL);
     // ledcAttachPin(PIN_LCD_LED, LCD_CHANNEL);
 
-    ledcWrite(CP_CHANNEL, 1024);                // channel 0, duty cycle 100%
+    ledcWrite(CP_CHANNEL, CP_DUTY_MAX);         // channel 0, duty cycle 100%
     ledcWrite(RED_CHANNEL, 255);
     ledcWrite(GREEN_CHANNEL, 0);
     ledcWrite(BLUE_CHANNEL, 255);
@@ -3007,7 +3781,9 @@ void setup() {
 
     // Setup PIN interrupt on rising edge
     // the timer interrupt will be reset in the ISR.
-    // attachInterrupt(PIN_CP_OUT, onCPpulse, RISING);   
+#if CP_EDGE_IRQ && !CP_SAMPLE_DMA
+    attachInterrupt(PIN_CP_OUT, onCPpulse, RISING);
+#endif
    
     // Uart 1 is used for Modbus @ 9600 8N1
     Serial1.begin(MODBUS_BAUDRATE, SERIAL_8N1, PIN_RS485_RX, PIN_RS485_TX);
@@ -3032,6 +3808,9 @@ void setup() {
     }
     Serial.printf("Total SPIFFS bytes: %u, Bytes used: %u\n",SPIFFS.totalBytes(),SPIFFS.usedBytes());
 
+    // Load additional electric meter profiles, before the settings are validated
+    LoadMeterProfiles();
+
 
    // Read all settings from non volatile memory
     read_settings(true);                                                        // initialize with default data when starting for the first time
@@ -3062,7 +3841,7 @@ void setup() {
         4096,           // Stack size (bytes)                              // printf needs atleast 1kb
         NULL,           // Parameter to pass
         1,              // Task priority
-        NULL            // Task handle
+        &EVSEStatesHandle // Task handle
     );
 
     // Create Task BlinkLed (10ms)
@@ -3095,6 +3874,19 @@ void setup() {
         NULL            // Task handle
     );
 
+    // Create Task MeterTCP, polls Mains/PV electric meters on the network
+    xTaskCreate(
+        MeterTCPTask,   // Function that should be called
+        "MeterTCPTask", // Name of the task (for debugging)
+        3072,           // Stack size (bytes)
+        NULL,           // Parameter to pass
+        1,              // Task priority
+        NULL            // Task handle
+    );
+
+    // Create Task P1, receives DSMR telegrams from the Mains meter (only when selected)
+    ConfigureP1();
+
     // Setup WiFi, webserver and firmware OTA
     // Please be aware that after doing a OTA update, its possible that the active partition is set to OTA1.
     // Uploading a new firmware through USB will however update OTA0, and you will not notice any changes...
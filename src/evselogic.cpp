@@ -0,0 +1,799 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "evse.h"
+#include "hal.h"
+#include "pilotfilter.h"
+#include "trace.h"
+
+// The charging logic: state machine, and the 100ms and 1s timer steps.
+// Hardware, time, logging, Modbus and the webpage are only used through Hal, so this file
+// does not depend on Arduino, and a host simulation can run it in virtual time.
+
+const char StrStateName[11][10] = {"A", "B", "C", "D", "COMM_B", "COMM_B_OK", "COMM_C", "COMM_C_OK", "Activate", "B1", "C1"};
+
+uint8_t State = STATE_A;
+uint8_t ErrorFlags = NO_ERROR;
+uint8_t ChargeDelay = 0;                                                    // Delays charging at least 60 seconds in case of not enough current available.
+uint8_t C1Timer = 0;
+uint8_t ActivationMode = 0, ActivationTimer = 0;
+uint8_t DiodeCheck = 0;                                                     // EV diode found in State B, cleared when entering State B or C
+volatile int64_t PilotChangeTime = 0;                                       // Time of the last change of PilotLevel (us)
+uint32_t PilotLatencyMax = 0;                                               // Max time from pilot level change to handled by EVSEStates (us)
+
+
+/**
+ * Get name of a state
+ *
+ * @param uint8_t State
+ * @return uint8_t[] Name
+ */
+const char * getStateName(uint8_t StateCode) {
+    if(StateCode < 11) return StrStateName[StateCode];
+    else return "NOSTATE";
+}
+
+
+/**
+ * Set EVSE mode
+ * 
+ * @param uint8_t Mode
+ */
+void setMode(uint8_t NewMode) {
+    if (LoadBl == 1) Hal->ModbusWrite(BROADCAST_ADR, 0x0003, NewMode);
+    Mode = NewMode;
+}
+
+/**
+ * Set the solar stop timer
+ * 
+ * @param unsigned int Timer (seconds)
+ */
+void setSolarStopTimer(uint16_t Timer) {
+    if (LoadBl == 1 && SolarStopTimer != Timer) {
+        Hal->ModbusWrite(BROADCAST_ADR, 0x0004, Timer);
+    }
+    SolarStopTimer = Timer;
+}
+
+
+void setState(uint8_t NewState) {
+
+    if (State != NewState) {
+        
+        char Str[50];
+        snprintf(Str, 50, "#%02d:%02d:%02d STATE %s -> %s\n",timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec, getStateName(State), getStateName(NewState) ); 
+
+#ifdef LOG_DEBUG_EVSE
+        // Log State change to webpage
+        Hal->WebText(Str);
+#endif                
+        Hal->Log("%s", Str + 1);
+
+        TraceAdd(TRACE_STATE, PilotLevel, State, NewState);
+
+        // Exit actions
+        switch (State) {
+            case STATE_ACTSTART:
+                ActivationMode = 255;                                           // Disable ActivationMode
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Entry actions
+    switch (NewState) {
+        case STATE_B1:
+            if (!ChargeDelay) ChargeDelay = 3;                                  // When entering State B1, wait at least 3 seconds before switching to another state.
+            // fall through
+        case STATE_A:                                                           // State A1
+            CONTACTOR1_OFF;  
+            // CONTACTOR2_OFF;  
+            Hal->CPDuty(CP_DUTY_MAX);                                           // PWM off,  channel 0, duty cycle 100%
+            Hal->CPSampleTiming(PWM_100);                                       // Sample every 1ms
+            if (NewState == STATE_A) {
+                clearErrorFlags(NO_SUN);
+                clearErrorFlags(LESS_6A);
+                ChargeDelay = 0;
+                // Reset Node
+                Node[0].Timer = 0;
+                Node[0].Phases = 0;
+                EVPhasesUsed = 0;                                               // Learn the phases of the next EV
+                Node[0].MinCurrent = 0;                                         // Clear ChargeDelay when disconnected.
+                Node[0].Connected = 0;
+                Node[0].Idle = 0;
+                Node[0].Charged = 0;
+            }
+            break;
+        case STATE_B:
+            CONTACTOR1_OFF;
+            // CONTACTOR2_OFF;
+            DiodeCheck = 0;
+            Hal->CPSampleTiming(PWM_95);                                        // Sample at 95%, diode test
+            SetCurrent(ChargeCurrent);                                          // Enable PWM
+            break;      
+        case STATE_C:                                                           // State C2
+            DiodeCheck = 0;
+            ActivationMode = 255;                                               // Disable ActivationMode
+            CONTACTOR1_ON;                                                      // Contactor1 ON
+            // CONTACTOR2_ON;                                                      // Contactor2 ON
+            LCDTimer = 0;
+            break;
+        case STATE_C1:
+            Hal->CPDuty(CP_DUTY_MAX);                                           // PWM off,  channel 0, duty cycle 100%
+            Hal->CPSampleTiming(PWM_100);                                       // Sample every 1ms
+                                                                                // EV should detect and stop charging within 3 seconds
+            C1Timer = 6;                                                        // Wait maximum 6 seconds, before forcing the contactor off.
+            ChargeDelay = 15;
+            break;
+        case STATE_ACTSTART:
+            ActivationTimer = 3;
+            Hal->CPDuty(0);                                                     // PWM off,  channel 0, duty cycle 0%
+                                                                                // Control pilot static -12V
+            break;
+        default:
+            break;
+    }
+    
+    BalancedState[0] = NewState;
+    State = NewState;
+
+    BacklightTimer = BACKLIGHT;                                                 // Backlight ON
+    Hal->Wake();                                                                // States set by the Master (COMM_B_OK/COMM_C_OK) continue right away
+}
+
+/**
+ * Set error flags, changes are traced
+ * 
+ * @param uint8_t flags
+ */
+void setErrorFlags(uint8_t flags) {
+    if ((ErrorFlags | flags) != ErrorFlags) TraceAdd(TRACE_ERROR, 0, ErrorFlags, ErrorFlags | flags);
+    ErrorFlags |= flags;
+}
+
+/**
+ * Clear error flags, changes are traced
+ * 
+ * @param uint8_t flags
+ */
+void clearErrorFlags(uint8_t flags) {
+    if (ErrorFlags & flags) TraceAdd(TRACE_ERROR, 0, ErrorFlags, ErrorFlags & ~flags);
+    ErrorFlags &= ~flags;
+}
+
+void setAccess(bool Access) {
+    Access_bit = Access;
+    if (Access == 0) {
+        if (State == STATE_C) setState(STATE_C1);                               // Determine where to switch to.
+        else if (State == STATE_B) setState(STATE_B1);
+    }
+}
+
+
+
+
+
+// Guards and actions of the state transitions
+// Guards only read the state, everything that changes it is done in the actions
+
+// Ready to switch to State B: no errors, no charge delay, and access granted
+bool GuardConnect(void) {
+    return ErrorFlags == NO_ERROR && ChargeDelay == 0 && Access_bit && !PlanWait;
+}
+
+bool GuardConnectNode(void) {
+    return GuardConnect() && LoadBl > 1;                                        // Load Balancing : Node
+}
+
+bool GuardConnectMaster(void) {
+    return GuardConnect() && LoadBl < 2 && IsCurrentAvailable() && CircuitAvailable(0) && ScheduleAllowed(0);  // Load Balancing: Master or Disabled
+}
+
+// Ready to switch to State C: EV diode found, no errors, no charge delay
+bool GuardCharge(void) {
+    return DiodeCheck == 1 && ErrorFlags == NO_ERROR && ChargeDelay == 0;
+}
+
+bool GuardChargeNode(void) {
+    return GuardCharge() && LoadBl > 1;                                         // Load Balancing : Node
+}
+
+bool GuardChargeMaster(void) {
+    return GuardCharge() && LoadBl < 2 && IsCurrentAvailable() && CircuitAvailable(0);  // Load Balancing: Master or Disabled
+}
+
+bool GuardActivation(void) {
+    return ActivationMode == 0;                                                 // Activation mode is triggered if state C is not entered in 30 seconds.
+}
+
+bool GuardActivationDone(void) {
+    return ActivationTimer == 0;
+}
+
+// Disconnected, or forced to State A, but still connected to the EV
+void ActionDisconnect(void) {
+    // If the RFID reader is set to EnableOne mode, and the Charging cable is disconnected
+    // We start a timer to re-lock the EVSE (and unlock the cable) after 60 seconds.
+    if (RFIDReader == 2 && AccessTimer == 0 && Access_bit == 1) AccessTimer = RFIDLOCKTIME;
+
+    ChargeDelay = 0;                                                            // Clear ChargeDelay when disconnected.
+    if (!ResetKwh) ResetKwh = 1;                                                // when set, reset EV kWh meter on state B->C change.
+    PlanTarget = 0;                                                             // The charge plan was for this EV
+}
+
+// EV connected, determine the charge current
+void ActionConnect(void) {
+    ProximityPin();                                                             // Sample Proximity Pin
+
+#ifdef LOG_DEBUG_EVSE
+    Hal->Log("Cable limit: %uA  Max: %uA\n", MaxCapacity, MaxCurrent);
+#endif
+    if (MaxCurrent > MaxCapacity) ChargeCurrent = MaxCapacity * 10;             // Do not modify Max Cable Capacity or MaxCurrent (fix 2.05)
+    else ChargeCurrent = MaxCurrent * 10;                                       // Instead use new variable ChargeCurrent
+}
+
+void ActionConnectMaster(void) {
+    ActionConnect();
+    BalancedMax[0] = MaxCapacity * 10;
+    Balanced[0] = ChargeCurrent;                                                // Set pilot duty cycle to ChargeCurrent (v2.15)
+    ActivationMode = 30;                                                        // Activation mode is triggered if state C is not entered in 30 seconds.
+    AccessTimer = 0;
+}
+
+void ActionStateB(void) {
+    ActivationMode = 30;                                                        // Activation mode is triggered if state C is not entered in 30 seconds.
+    AccessTimer = 0;
+}
+
+// Not enough power available
+void ActionNoPower(void) {
+    if (Mode == MODE_SOLAR) setErrorFlags(NO_SUN);                              // Not enough solar power
+    else setErrorFlags(LESS_6A);
+}
+
+void ActionConnectNoPower(void) {
+    ActionConnect();
+    ActionNoPower();
+}
+
+// EV wants to charge
+void ActionCharge(void) {
+    if (EVMeter && ResetKwh) {
+        EnergyMeterStart = EnergyEV;                                            // store kwh measurement at start of charging.
+        ResetKwh = 0;                                                           // clear flag, will be set when disconnected from EVSE (State A)
+    }
+}
+
+void ActionChargeMaster(void) {
+    ActionCharge();
+    BalancedMax[0] = ChargeCurrent;
+    Balanced[0] = 0;                                                            // For correct baseload calculation set current to zero
+    CalcBalancedCurrent(1);                                                     // Calculate charge current for all connected EVSE's
+}
+
+void ActionChargeNoPower(void) {
+    ActionCharge();
+    ActionNoPower();
+}
+
+// Transitions per state, the first matching transition is taken.
+// Entry and exit actions of the states are in setState()
+constexpr struct StateTransition TransA[] = {
+    { PILOT_12V,    NULL,                   ActionDisconnect,       NOSTATE },
+    { PILOT_9V,     GuardConnectNode,       ActionConnect,          STATE_COMM_B },     // Node wants to switch to State B
+    { PILOT_9V,     GuardConnectMaster,     ActionConnectMaster,    STATE_B },
+    { PILOT_9V,     GuardConnect,           ActionConnectNoPower,   NOSTATE },
+};
+
+constexpr struct StateTransition TransB[] = {
+    { PILOT_12V,    NULL,                   NULL,                   STATE_A },          // Disconnected?
+    { PILOT_6V,     GuardChargeNode,        ActionCharge,           STATE_COMM_C },     // Send command to Master, followed by Charge Current
+    { PILOT_6V,     GuardChargeMaster,      ActionChargeMaster,     STATE_C },
+    { PILOT_6V,     GuardCharge,            ActionChargeNoPower,    NOSTATE },
+    { PILOT_6V,     NULL,                   NULL,                   NOSTATE },
+    { PILOT_ANY,    GuardActivation,        NULL,                   STATE_ACTSTART },   // PILOT_9V
+};
+
+constexpr struct StateTransition TransC[] = {
+    { PILOT_12V,    NULL,                   NULL,                   STATE_A },          // Disconnected ?
+    { PILOT_9V,     NULL,                   NULL,                   STATE_B },          // Mark EVSE as inactive (still State B)
+};
+
+constexpr struct StateTransition TransCommB[] = {
+    { PILOT_12V,    NULL,                   ActionDisconnect,       STATE_A },          // reset state, incase we were stuck in STATE_COMM_B
+};
+
+constexpr struct StateTransition TransCommBOK[] = {
+    { PILOT_ANY,    NULL,                   ActionStateB,           STATE_B },
+};
+
+constexpr struct StateTransition TransCommC[] = {
+    { PILOT_12V,    NULL,                   NULL,                   STATE_A },
+    { PILOT_6V,     GuardChargeNode,        ActionCharge,           NOSTATE },          // Wait for the Master
+    { PILOT_6V,     GuardChargeMaster,      ActionChargeMaster,     STATE_C },
+    { PILOT_6V,     GuardCharge,            ActionChargeNoPower,    NOSTATE },
+    { PILOT_6V,     NULL,                   NULL,                   NOSTATE },
+    { PILOT_ANY,    GuardActivation,        NULL,                   STATE_ACTSTART },
+};
+
+constexpr struct StateTransition TransCommCOK[] = {
+    { PILOT_ANY,    NULL,                   NULL,                   STATE_C },
+};
+
+constexpr struct StateTransition TransActStart[] = {
+    { PILOT_ANY,    GuardActivationDone,    NULL,                   STATE_B },          // Switch back to State B
+};
+
+constexpr struct StateTransition TransB1[] = {
+    { PILOT_12V,    NULL,                   ActionDisconnect,       STATE_A },
+    { PILOT_9V,     GuardConnectNode,       ActionConnect,          STATE_COMM_B },
+    { PILOT_9V,     GuardConnectMaster,     ActionConnectMaster,    STATE_B },
+    { PILOT_9V,     GuardConnect,           ActionConnectNoPower,   NOSTATE },
+};
+
+constexpr struct StateTransition TransC1[] = {
+    { PILOT_12V,    NULL,                   NULL,                   STATE_A },          // Disconnected or connected to EV without PWM
+    { PILOT_9V,     NULL,                   NULL,                   STATE_B1 },
+};
+
+struct StateTransitions {
+    const struct StateTransition *Table;
+    uint8_t Count;
+};
+
+#define TRANSITIONS(t) { t, sizeof(t) / sizeof(t[0]) }
+
+constexpr struct StateTransitions StateTable[NR_STATES] = {
+    TRANSITIONS(TransA),                                                        // STATE_A
+    TRANSITIONS(TransB),                                                        // STATE_B
+    TRANSITIONS(TransC),                                                        // STATE_C
+    { NULL, 0 },                                                                // STATE_D (not implemented)
+    TRANSITIONS(TransCommB),                                                    // STATE_COMM_B
+    TRANSITIONS(TransCommBOK),                                                  // STATE_COMM_B_OK
+    TRANSITIONS(TransCommC),                                                    // STATE_COMM_C
+    TRANSITIONS(TransCommCOK),                                                  // STATE_COMM_C_OK
+    TRANSITIONS(TransActStart),                                                 // STATE_ACTSTART
+    TRANSITIONS(TransB1),                                                       // STATE_B1
+    TRANSITIONS(TransC1),                                                       // STATE_C1
+};
+
+/**
+ * Take the state transition of the current state for a pilot level
+ * 
+ * @param uint8_t pilot: PILOT_xxx
+ * @return uint8_t 1 when a transition was taken
+ */
+uint8_t StateDispatch(uint8_t pilot) {
+    const struct StateTransition *t;
+    uint8_t n;
+
+    if (State >= NR_STATES) return 0;
+
+    for (n = 0, t = StateTable[State].Table; n < StateTable[State].Count; n++, t++) {
+        if (t->Pilot != PILOT_ANY && t->Pilot != pilot) continue;
+        if (t->Guard && !t->Guard()) continue;
+
+        if (t->Action) t->Action();
+        if (t->Next != NOSTATE) setState(t->Next);
+        return 1;
+    }
+    return 0;
+}
+
+
+
+// One pass of the EVSE state handling
+// Reads buttons, and updates the LCD.
+//
+void EVSEStatesStep(void) {
+
+    static uint8_t leftbutton = 5;
+    uint8_t pilot;
+    uint32_t latency;
+#ifdef LOG_DEBUG_EVSE
+    static uint32_t PilotCycles = 0, PilotCyclesMax = 0, PilotCalls = 0;  // Cost of Pilot() in CPU cycles
+    uint32_t cycles;
+#endif
+
+    // Sample the three < o > buttons.
+    // As the buttons are shared with the SPI lines going to the LCD,
+    // we have to make sure that this does not interfere by write actions to the LCD.
+    // Therefore updating the LCD is also done in this task.
+
+    // pinMatrixOutDetach(PIN_LCD_SDO_B3, false, false);       // disconnect MOSI pin
+    // pinMode(PIN_LCD_SDO_B3, INPUT);
+    // pinMode(PIN_LCD_A0_B2, INPUT);
+    // sample buttons                                       < o >
+    // if (digitalRead(PIN_LCD_SDO_B3)) ButtonState = 4;       // > (right)
+    // else ButtonState = 0;
+    // if (digitalRead(PIN_LCD_A0_B2)) ButtonState |= 2;       // o (middle)
+    // if (digitalRead(PIN_IO0_B1)) ButtonState |= 1;          // < (left)
+
+    // pinMode(PIN_LCD_SDO_B3, OUTPUT);
+    // pinMatrixOutAttach(PIN_LCD_SDO_B3, VSPID_IN_IDX, false, false); // re-attach MOSI pin
+    // pinMode(PIN_LCD_A0_B2, OUTPUT);
+
+
+    // When one or more button(s) are pressed, we call GLCDMenu
+    // if ((ButtonState != 0x07) || (ButtonState != OldButtonState)) GLCDMenu(ButtonState);
+
+    // Update/Show Helpmenu
+    // if (LCDNav > MENU_ENTER && LCDNav < MENU_EXIT && (ScrollTimer + 5000 < Hal->Millis() ) && (!SubMenu)) GLCDHelp();
+
+    // Left button pressed, Loadbalancing is Master or Disabled, switch is set to "Sma-Sol B" and Mode is Smart or Solar?
+    if (!LCDNav && ButtonState == 0x6 && Mode && !leftbutton && (LoadBl < 2) && Switch == 3) {
+        setMode(~Mode & 0x3);                                           // Change from Solar to Smart mode and vice versa.
+        clearErrorFlags(NO_SUN | LESS_6A);                              // Clear All errors
+        ChargeDelay = 0;                                                // Clear any Chargedelay
+        setSolarStopTimer(0);                                           // Also make sure the SolarTimer is disabled.
+        LCDTimer = 0;
+        leftbutton = 5;
+    } else if (leftbutton && ButtonState == 0x7) leftbutton--;
+
+    // Check the external switch and RCM sensor
+    // CheckSwitch();
+
+    // sample the Pilot line
+#ifdef LOG_DEBUG_EVSE
+    cycles = Hal->Cycles();
+    pilot = Hal->Pilot();
+    cycles = Hal->Cycles() - cycles;
+    PilotCycles += cycles;
+    if (cycles > PilotCyclesMax) PilotCyclesMax = cycles;
+    if (++PilotCalls == 1000) {                                         // every 1000 passes
+        Hal->Log("Pilot() cycles avg:%u max:%u\n", PilotCycles / PilotCalls, PilotCyclesMax);
+        PilotCycles = PilotCyclesMax = PilotCalls = 0;
+    }
+#else
+    pilot = Hal->Pilot();
+#endif
+
+    // The diode of the EV is checked in State B, before switching to State C
+    if ((State == STATE_B || State == STATE_COMM_C) && !DiodeCheck && (pilot == PILOT_DIODE || PilotDiodeOK)) {
+        DiodeCheck = 1;                                                     // Diode found, OK (PilotDiodeOK: low plateau measured separately, CP_EDGE_SYNC)
+        Hal->Log("Diode OK\n");
+        Hal->CPSampleTiming(PWM_5);                                         // Sample at start of CP signal (5%)
+    }
+
+    // State transition on the pilot level (see StateTable)
+    StateDispatch(pilot);
+
+    // update LCD (every 1000ms) when not in the setup menu
+    if (LCDupdate) {
+        //Serial.printf("States task free ram: %u\n", uxTaskGetStackHighWaterMark( NULL ));
+        // GLCD();
+        LCDupdate = 0;
+    }    
+
+    // Time from the pilot level change until it was handled
+    if (PilotChangeTime) {
+        latency = Hal->Micros() - PilotChangeTime;
+        PilotChangeTime = 0;
+        if (latency > PilotLatencyMax) PilotLatencyMax = latency;
+#ifdef LOG_DEBUG_EVSE
+        Hal->Log("Pilot change handled in %u us (max %u us) confidence %u%%\n", latency, PilotLatencyMax, CPFilter.Confidence);
+#endif
+    }
+}
+
+
+
+
+// 100ms of the Cable Lock and modbus task
+//
+void Timer100msStep(void) {
+
+    static unsigned int locktimer = 0, unlocktimer = 0;
+    static uint8_t PollEVNode = NR_EVSES;
+
+    // Check if the cable lock is used
+    if (Lock) {                                                 // Cable lock enabled?
+
+        // UnlockCable takes precedence over LockCable
+        if (UnlockCable) {
+            // if (unlocktimer < 6) {                              // 600ms pulse
+            //     ACTUATOR_UNLOCK;
+            // } else ACTUATOR_OFF;
+            if (unlocktimer++ > 7) {
+                // if (digitalRead(PIN_LOCK_IN) == lock1 )         // still locked...
+                // {
+                //     if (unlocktimer > 50) unlocktimer = 0;      // try to unlock again in 5 seconds
+                // } else unlocktimer = 7;
+            }
+            locktimer = 0;
+        // Lock Cable    
+        } else if (LockCable) { 
+            // if (locktimer < 6) {                                // 600ms pulse
+            //     ACTUATOR_LOCK;
+            // } else ACTUATOR_OFF;
+            if (locktimer++ > 7) {
+                // if (digitalRead(PIN_LOCK_IN) == lock2 )         // still unlocked...
+                // {
+                //     if (locktimer > 50) locktimer = 0;          // try to lock again in 5 seconds
+                // } else locktimer = 7;
+            }
+            unlocktimer = 0;
+        }
+    }
+
+    // New P1 telegram received? Update the data right away, without waiting for the modbus poll cycle.
+    if (MainsUpdated && !ModbusRequest) {
+        MainsUpdated = 0;
+        if (Mode && (ErrorFlags & CT_NOCOMM) == 0) UpdateCurrentData();
+    }
+
+    // Every 2 seconds, request measurements from modbus meters
+    if (ModbusRequest) {
+
+        switch (ModbusRequest++) {                                          // State
+            case 1:                                                         // PV kwh meter
+                if (PVMeter && !PVMeterIP) {
+                    Hal->RequestCurrent(PVMeter, PVMeterAddress);
+                    break;
+                }
+                ModbusRequest++;
+            case 2:                                                         // Sensorbox or kWh meter that measures -all- currents
+#ifdef LOG_INFO_MODBUS
+                Hal->Log("ModbusRequest %u: Request MainsMeter Measurement\n", ModbusRequest);
+#endif
+                if (MainsMeterOnRS485()) Hal->RequestCurrent(MainsMeter, MainsMeterAddress);
+                break;
+            case 3:
+                // Find next online SmartEVSE
+                do {
+                    PollEVNode++;
+                    if (PollEVNode >= NR_EVSES) PollEVNode = 0;
+                } while(Node[PollEVNode].Online == false);
+
+                // Request Configuration if changed
+                if (Node[PollEVNode].ConfigChanged) {
+#ifdef LOG_INFO_MODBUS
+                    Hal->Log("ModbusRequest %u: Request Configuration Node %u\n", ModbusRequest, PollEVNode);
+#endif
+                    requestNodeConfig(PollEVNode);
+                    break;
+                }
+                ModbusRequest++;
+            case 4:                                                         // EV kWh meter, Energy measurement (total charged kWh)
+                // Request Energy if EV meter is configured
+                if (Node[PollEVNode].EVMeter) {
+#ifdef LOG_INFO_MODBUS
+                    Hal->Log("ModbusRequest %u: Request Energy Node %u\n", ModbusRequest, PollEVNode);
+#endif
+                    Hal->RequestEnergy(Node[PollEVNode].EVMeter, Node[PollEVNode].EVAddress);
+                    break;
+                }
+                ModbusRequest++;
+            case 5:                                                         // EV kWh meter, Power measurement (momentary power in Watt)
+                // Request Power if EV meter is configured
+                if (Node[PollEVNode].EVMeter) {
+                    Hal->RequestPower(Node[PollEVNode].EVMeter, Node[PollEVNode].EVAddress);
+                    break;
+                }
+                ModbusRequest++;
+            case 6:                                                         // EV kWh meter, Current measurement (phases used by the EV)
+                // Request Currents while charging, if EV meter is configured
+                if (Node[PollEVNode].EVMeter && BalancedState[PollEVNode] == STATE_C) {
+                    Hal->RequestCurrent(Node[PollEVNode].EVMeter, Node[PollEVNode].EVAddress);
+                    break;
+                }
+                ModbusRequest++;
+            case 7:                                                         // Node 1
+            case 8:
+            case 9:
+            case 10:
+            case 11:
+            case 12:
+            case 13:
+                if (LoadBl == 1) {
+                    requestNodeStatus(ModbusRequest - 7u);                   // Master, Request Node 1-8 status
+                    break;
+                }
+                ModbusRequest = 13;
+            case 14:
+            case 15:
+            case 16:
+            case 17:
+            case 18:
+            case 19:
+            case 20:
+                if (LoadBl == 1) {
+                    processAllNodeStates(ModbusRequest - 14u);
+                    break;
+                }
+            default:
+                if (Mode) {                                                 // Smart/Solar mode
+                    // P1 telegrams and Modbus TCP responses trigger their own update
+                    if (MainsMeterOnRS485() && (ErrorFlags & CT_NOCOMM) == 0) UpdateCurrentData();      // No communication error with Sensorbox /Kwh meter?
+                                                                            // then update the data and send broadcast to all connected EVSE's
+                } else {                                                    // Normal Mode
+                    CalcBalancedCurrent(0);                                 // Calculate charge current for connected EVSE's
+                    if (LoadBl == 1) BroadcastCurrent();                    // Send to all EVSE's (only in Master mode)
+                    if ((State == STATE_B) || (State == STATE_C)) SetCurrent(Balanced[0]); // set PWM output for Master
+                }
+                ModbusRequest = 0;
+                //Serial.printf("Task free ram: %u\n", uxTaskGetStackHighWaterMark( NULL ));
+                break;
+        }
+    }
+}
+
+
+
+
+// One second of the 1000ms timer task
+//
+void Timer1SStep(void) {
+
+    static uint8_t Broadcast = 1;
+    static uint8_t Timer5sec = 0;
+    uint8_t x;
+
+    if (BacklightTimer) BacklightTimer--;                               // Decrease backlight counter every second.
+
+    // wait for Activation mode to start
+    if (ActivationMode && ActivationMode != 255) {
+        ActivationMode--;                                               // Decrease ActivationMode every second.
+    }
+
+    // activation Mode is active
+    if (ActivationTimer) ActivationTimer--;                             // Decrease ActivationTimer every second.
+    
+    if (State == STATE_C1) {
+        if (C1Timer) C1Timer--;                                         // if the EV does not stop charging in 6 seconds, we will open the contactor.
+        else {
+            Hal->Log("State C1 timeout!\n");
+            setState(STATE_B1);                                         // switch back to STATE_B1
+            // GLCD_init();                                                // Re-init LCD (200ms delay)
+            ChargeTimer = 15;
+        }
+    }
+
+
+
+
+    // once a second, measure temperature
+    // range -40 .. +125C
+    TempEVSE = TemperatureSensor();                                                             
+
+    // and update the measurement registers
+    UpdateMeasureRegisters();
+
+
+    // Check if there is a RFID card in front of the reader
+    // CheckRFID();
+
+             
+    // When Solar Charging, once the current drops to MINcurrent a timer is started.
+    // Charging is stopped when the timer reaches the time set in 'StopTime' (in minutes)
+    // Except when Stoptime =0, then charging will continue.
+
+    if (SolarStopTimer) {
+        SolarStopTimer--;
+        if (SolarStopTimer == 0) {
+
+            if (State == STATE_C) setState(STATE_C1);                   // tell EV to stop charging
+            setErrorFlags(NO_SUN);                                      // Set error: NO_SUN
+
+            ResetBalancedStates();                                      // reset all states
+        }
+    }
+
+    if (ChargeDelay) ChargeDelay--;                                     // Decrease Charge Delay counter
+
+    if (AccessTimer && State == STATE_A) {
+        if (--AccessTimer == 0) {
+            setAccess(false);                                           // re-lock EVSE
+        }
+    } else AccessTimer = 0;                                             // Not in state A, then disable timer
+
+
+    if ((TempEVSE < 55) && (ErrorFlags & TEMP_HIGH)) {                  // Temperature below limit?
+        clearErrorFlags(TEMP_HIGH); // clear Error
+    }
+
+    if ( (ErrorFlags & (LESS_6A|NO_SUN) ) && (LoadBl < 2) && (IsCurrentAvailable()) && CircuitAvailable(0) && ScheduleAllowed(0)) {
+        clearErrorFlags(LESS_6A);                                       // Clear Errors if there is enough current available, and Load Balancing is disabled or we are Master
+        clearErrorFlags(NO_SUN);
+#ifdef LOG_DEBUG_EVSE
+        Hal->Log("No sun/current Errors Cleared.\n");
+#endif
+        Hal->ModbusWrite(BROADCAST_ADR, 0x0001, ErrorFlags);    // Broadcast
+    }
+
+    if (ExternalMaster) {
+        ExternalMaster--;
+    }
+
+    // Charge timer, and the times the scheduler uses
+    for (x = 0; x < NR_EVSES; x++) {
+        if (BalancedState[x] == STATE_C) {
+            Node[x].Timer++;
+            Node[x].Run++;
+            Node[x].Charged += Balanced[x];
+            Node[x].Idle = 0;
+            if (Node[x].EVCurrentValid) Node[x].EVCurrentValid--;
+        } else {
+            Node[x].Run = 0;
+            Node[x].EVCurrentValid = 0;
+            if (BalancedState[x] != STATE_A) Node[x].Idle++;
+        }
+        if (BalancedState[x] != STATE_A) Node[x].Connected++;
+    }
+    ScheduleStep();
+    PlanStep();
+
+    if ((ErrorFlags & CT_NOCOMM) && timeout == 10) clearErrorFlags(CT_NOCOMM);  // Clear communication error, if present (before the timeout is decreased)
+
+    if ((timeout == 0) && !(ErrorFlags & CT_NOCOMM))                    // timeout if CT current measurement takes > 10 secs
+    {
+        setErrorFlags(CT_NOCOMM);
+        if (State == STATE_C) setState(STATE_C1);                       // tell EV to stop charging
+        else setState(STATE_B1);                                        // when we are not charging switch to State B1
+#ifdef LOG_WARN_EVSE
+        Hal->Log("Error, communication error!\n");
+#endif
+        // Try to broadcast communication error to Nodes if we are Master
+        if (LoadBl < 2) Hal->ModbusWrite(BROADCAST_ADR, 0x0001, ErrorFlags);         
+        ResetBalancedStates();
+    } else if (timeout) timeout--;
+
+    if (TempEVSE >= 65 && !(ErrorFlags & TEMP_HIGH))                         // Temperature too High?
+    {
+        setErrorFlags(TEMP_HIGH);
+        setState(STATE_A);                                              // ERROR, switch back to STATE_A
+#ifdef LOG_WARN_EVSE
+        Hal->Log("Error, temperature %i C !\n", TempEVSE);
+#endif
+        ResetBalancedStates();
+    }
+
+    if (ErrorFlags & (NO_SUN | LESS_6A)) {
+#ifdef LOG_INFO_EVSE
+        if (Mode == MODE_SOLAR) {
+            if (ChargeDelay == 0) Hal->Log("Waiting for Solar power...\n");
+        } else {
+            if (ChargeDelay == 0) Hal->Log("Not enough current available!\n");
+        }
+#endif
+        if (State == STATE_C) setState(STATE_C1);                       // If we are charging, tell EV to stop charging
+        else if (State != STATE_C1) setState(STATE_B1);                 // If we are not in State C1, switch to State B1
+        ChargeDelay = CHARGEDELAY;                                      // Set Chargedelay
+    }
+
+    // set flag to update the LCD once every second
+    LCDupdate = 1;
+
+    // Every two seconds request measurement data from sensorbox/kwh meters.
+    // and send broadcast to Node controllers.
+    if (LoadBl < 2 && !ExternalMaster && !Broadcast--) {                // Load Balancing mode: Master or Disabled
+        if (Mode) {                                                     // Smart or Solar mode
+            ModbusRequest = 1;                                          // Start with state 1
+        } else {                                                        // Normal mode
+            Imeasured = 0;                                              // No measurements, so we set it to zero
+            ModbusRequest = 7;                                          // Start with state 7 (poll Nodes)
+            timeout = 10;                                               // reset timeout counter (not checked for Master)
+        }
+        Broadcast = 1;                                                  // repeat every two seconds
+    }
+
+      
+
+    // this will run every 5 seconds
+    if (Timer5sec++ >= 5) {
+        Hal->WebStatus();                                               // Send the status to the webpage, when connected to WiFi
+        Timer5sec = 0;
+    }
+
+    //Serial.printf("Task 1s free ram: %u\n", uxTaskGetStackHighWaterMark( NULL ));
+}
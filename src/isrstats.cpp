@@ -0,0 +1,91 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "isrstats.h"
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+/**
+ * Initialize a histogram
+ * 
+ * @param pointer to IsrHistogram
+ * @param uint32_t width: bucket width
+ */
+void IsrHistogramInit(struct IsrHistogram *h, uint32_t width) {
+    memset(h, 0, sizeof(struct IsrHistogram));
+    h->Width = width;
+}
+
+/**
+ * Add a value (writer, called from the ISR)
+ * 
+ * @param pointer to IsrHistogram
+ * @param uint32_t value
+ */
+void IRAM_ATTR IsrHistogramAdd(struct IsrHistogram *h, uint32_t value) {
+    uint32_t i;
+
+    if (h->Reset) {
+        memset(h->Bucket, 0, sizeof(h->Bucket));
+        h->Count = 0;
+        h->Worst = 0;
+        h->Reset = 0;
+    }
+
+    i = value / h->Width;
+    if (i >= ISR_HIST_BUCKETS) i = ISR_HIST_BUCKETS - 1;
+    h->Bucket[i]++;
+    h->Count++;
+    if (value > h->Worst) h->Worst = value;
+}
+
+/**
+ * Clear the histogram and worst case (reader)
+ * Done by the writer on the next value, so the ISR never sees a half cleared histogram.
+ * 
+ * @param pointer to IsrHistogram
+ */
+void IsrHistogramReset(struct IsrHistogram *h) {
+    h->Reset = 1;
+}
+
+/**
+ * Write the histogram as a JSON object member: "name":{"unit":..,"width":..,"count":..,"worst":..,"buckets":[..]}
+ * Width and worst are divided by divider (f.e. cycles to us).
+ * 
+ * @param pointer to IsrHistogram
+ * @param const char *name
+ * @param const char *unit
+ * @param uint32_t divider
+ * @param char *buf
+ * @param int size of buf
+ * @return int characters written (excluding the terminating 0)
+ */
+int IsrHistogramJson(struct IsrHistogram *h, const char *name, const char *unit, uint32_t divider, char *buf, int size) {
+    uint32_t bucket[ISR_HIST_BUCKETS];
+    uint32_t count, worst;
+    int n, i;
+
+    // Copy first, the ISR keeps updating the histogram
+    memcpy(bucket, h->Bucket, sizeof(bucket));
+    count = h->Count;
+    worst = h->Worst;
+
+    n = snprintf(buf, size, "\"%s\":{\"unit\":\"%s\",\"width\":%.2f,\"count\":%u,\"worst\":%.2f,\"buckets\":[",
+                 name, unit, (float)h->Width / divider, count, (float)worst / divider);
+    for (i = 0; i < ISR_HIST_BUCKETS && n < size; i++) {
+        n += snprintf(buf + n, size - n, "%s%u", i ? "," : "", bucket[i]);
+    }
+    if (n < size) n += snprintf(buf + n, size - n, "]}");
+    return n < size ? n : size - 1;
+}
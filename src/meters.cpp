@@ -0,0 +1,136 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "FS.h"
+#include <SPIFFS.h>
+
+#include "evse.h"
+#include "meters.h"
+
+
+// Electric meter profiles stored on the SPIFFS partition.
+// Profile n (1-8) is read from /em<n>.csv, and becomes meter type EM_PROFILE_FIRST + n - 1.
+// The first line that is not empty or a comment (#) holds the profile, with the same columns as the EMConfig[] table:
+//
+// # DESC,  ENDIANNESS, FCT, DATATYPE, U_REG, DIV, I_REG, DIV, P_REG, DIV, E_REG, DIV, READMAX, S_REG
+// SDM72,   3,          4,   1,        0x0,   0,   0x6,   0,   0x34,  0,   0x156, 0,   80,      0xC
+//
+// ENDIANNESS: 0-3 (see combineBytes), DATATYPE: 0:INT32, 1:FLOAT32, 2:INT16, DIV: 10^x
+// S_REG (optional) is the first register of the signed phase 1-3 power, read in the same request as the currents
+// to get the sign of the currents. Use 0xFFFF (or leave out) when the meter reports signed currents.
+
+
+/**
+ * Parse a meter profile line into an EMConfig entry
+ *
+ * @param pointer to line (modified)
+ * @param pointer to EMstruct
+ * @return uint8_t success
+ */
+static uint8_t parseMeterProfile(char *line, struct EMstruct *em) {
+    char *token, *next, *end;
+    long field[13];
+    uint8_t n = 0, regsize;
+
+    memset(em, 0, sizeof(struct EMstruct));
+
+    // Description, spaces are stripped
+    token = strtok_r(line, ",", &next);
+    if (token == NULL) return 0;
+    while (*token == ' ' || *token == '\t') token++;
+    end = token + strlen(token);
+    while (end > token && (end[-1] == ' ' || end[-1] == '\t')) *--end = 0;
+    if (!*token) return 0;
+    strncpy((char *)em->Desc, token, sizeof(em->Desc) - 1);
+
+    field[11] = 125;                                                            // Modbus limit
+    field[12] = 0xFFFF;                                                         // No sign register
+    while (n < 13 && (token = strtok_r(NULL, ",", &next)) != NULL) {
+        field[n] = strtol(token, &end, 0);
+        while (*end == ' ' || *end == '\t' || *end == '\r') end++;
+        if (end == token || *end) return 0;                                     // not a number
+        n++;
+    }
+    if (n < 11) return 0;                                                       // READMAX and S_REG are optional
+
+    if (field[0] < 0 || field[0] > ENDIANESS_HBF_HWF) return 0;
+    if (field[1] != 3 && field[1] != 4) return 0;
+    if (field[2] < 0 || field[2] >= MB_DATATYPE_MAX) return 0;
+    for (n = 3; n < 11; n += 2) {
+        if (field[n] < 0 || field[n] > 0xFFFF) return 0;                        // register
+        if (field[n + 1] < 0 || field[n + 1] > 7) return 0;                     // divisor
+    }
+    if (field[11] < 3 || field[11] > 125) return 0;
+
+    em->Endianness = field[0];
+    em->Function = field[1];
+    em->DataType = (MBDataType)field[2];
+    em->URegister = field[3];
+    em->UDivisor = field[4];
+    em->IRegister = field[5];
+    em->IDivisor = field[6];
+    em->PRegister = field[7];
+    em->PDivisor = field[8];
+    em->ERegister = field[9];
+    em->EDivisor = field[10];
+    em->ReadMax = field[11];
+
+    // Convert the sign register into a position in the current read block, so it does not have to be done per read.
+    if (field[12] != 0xFFFF) {
+        regsize = (em->DataType == MB_DATATYPE_INT16) ? 1 : 2;
+        if (field[12] < em->IRegister + 3 * regsize || (field[12] - em->IRegister) % regsize) return 0;
+        em->SignPos = (field[12] - em->IRegister) / regsize;
+        if ((em->SignPos + 3u) * regsize > MODBUS_BLOCK_MAX) return 0;          // too large, also when split by READMAX
+    }
+
+    return 1;
+}
+
+/**
+ * Load electric meter profiles /em1.csv - /em8.csv from SPIFFS into EMConfig[]
+ * Should be called once at powerup, after SPIFFS is mounted and before the settings are validated.
+ *
+ * @return uint8_t number of loaded profiles
+ */
+uint8_t LoadMeterProfiles(void) {
+    char path[12], line[128];
+    struct EMstruct em;
+    uint8_t n, count = 0;
+    size_t len;
+    File file;
+
+    for (n = 0; n < EM_PROFILES; n++) {
+        snprintf(path, sizeof(path), "/em%u.csv", n + 1);
+        if (!SPIFFS.exists(path)) continue;
+        file = SPIFFS.open(path, FILE_READ);
+        if (!file) continue;
+
+        while (file.available()) {
+            String str = file.readStringUntil('\n');
+            len = str.length() < sizeof(line) - 1 ? str.length() : sizeof(line) - 1;
+            memcpy(line, str.c_str(), len);
+            line[len] = 0;
+            if (len == 0 || line[0] == '#' || line[0] == '\r') continue;        // skip empty lines and comments
+
+            if (parseMeterProfile(line, &em)) {
+                EMConfig[EM_PROFILE_FIRST + n] = em;
+                count++;
+                Serial.printf("Meter profile %u loaded from %s: %s\n", EM_PROFILE_FIRST + n, path, em.Desc);
+            } else {
+                Serial.printf("Invalid meter profile in %s\n", path);
+            }
+            break;
+        }
+        file.close();
+    }
+
+    return count;
+}
@@ -8,6 +8,7 @@
 #include <Arduino.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "ModbusServerRTU.h"
 #include "ModbusClientRTU.h"
 #include "driver/uart.h"
@@ -18,6 +19,8 @@
 
 extern struct ModBus MB;
 
+struct ModbusBlock CurrentBlock;                                                // Current read of a meter on the RS485 bus, split by ReadMax
+
 
 // ########################## Modbus helper functions ##########################
 
@@ -364,6 +367,69 @@ void ModbusDecode(uint8_t * buf, uint8_t len) {
 }
 
 
+/**
+ * Start a read that is split in parts of at most ReadMax registers
+ * A part never ends halfway a 32 bit value.
+ * 
+ * @param pointer to ModbusBlock b
+ * @param uint8_t Address
+ * @param uint8_t Function
+ * @param uint16_t Register: first register
+ * @param uint16_t Count: registers
+ * @param uint8_t ReadMax: registers the meter sends at once, 0 = no limit
+ * @param uint8_t Size: registers per value (1 or 2)
+ * @return uint8_t registers per request, 0 when the read is too large
+ */
+uint8_t ModbusBlockStart(struct ModbusBlock *b, uint8_t Address, uint8_t Function, uint16_t Register, uint16_t Count, uint8_t ReadMax, uint8_t Size) {
+    if (!Count || Count > MODBUS_BLOCK_MAX) return 0;
+    b->Address = Address;
+    b->Function = Function;
+    b->Register = Register;
+    b->Count = Count;
+    b->Part = (ReadMax && ReadMax < Count) ? ReadMax - ReadMax % Size : Count;
+    if (!b->Part) b->Part = Size;
+    b->Received = 0;
+    return b->Part;
+}
+
+/**
+ * Store a part of a split read
+ * 
+ * @param pointer to ModbusBlock b
+ * @param uint16_t Register: first register of the part
+ * @param pointer to data
+ * @param uint8_t bytes
+ * @return bool true when all parts are received
+ */
+bool ModbusBlockAdd(struct ModbusBlock *b, uint16_t Register, const uint8_t *data, uint8_t bytes) {
+    uint16_t offset = Register - b->Register;
+
+    if (Register < b->Register || offset >= b->Count || offset % b->Part) return false;
+    if (bytes != 2 * (b->Count - offset < b->Part ? b->Count - offset : b->Part)) return false;
+    memcpy(b->Data + offset * 2, data, bytes);
+    b->Received += bytes / 2;
+    return b->Received >= b->Count;
+}
+
+/**
+ * The parts of a split read as one response, as if the meter had sent all registers at once
+ * The request in the MB struct is set to the first register, so ModbusDecode() finds it.
+ * 
+ * @param pointer to ModbusBlock b
+ * @return ModbusMessage
+ */
+ModbusMessage ModbusBlockResponse(struct ModbusBlock *b) {
+    ModbusMessage msg;
+
+    msg.add(b->Address, b->Function, (uint8_t)(b->Count * 2u));
+    msg.add(b->Data, (uint16_t)(b->Count * 2u));
+    MB.RequestAddress = b->Address;
+    MB.RequestFunction = b->Function;
+    MB.RequestRegister = b->Register;
+    b->Received = 0;
+    return msg;
+}
+
 
 // ########################### EVSE modbus functions ###########################
 
@@ -494,35 +560,81 @@ signed int receivePowerMeasurement(uint8_t *buf, uint8_t Meter) {
 }
 
 /**
- * Send current measurement request over modbus
+ * Get the function, register and register count needed to read the currents of a meter
  * 
  * @param uint8_t Meter
- * @param uint8_t Address
+ * @param pointer to Function
+ * @param pointer to Register
+ * @param pointer to Count (registers)
+ * @return uint8_t 0 when the meter is not read over modbus
  */
-void requestCurrentMeasurement(uint8_t Meter, uint8_t Address) {
+uint8_t getCurrentMeasurementRequest(uint8_t Meter, uint8_t *Function, uint16_t *Register, uint16_t *Count) {
+    *Function = EMConfig[Meter].Function;
+    *Register = EMConfig[Meter].IRegister;
+
     switch(Meter) {
         case EM_SENSORBOX:
-            ModbusReadInputRequest(Address, 4, 0, 20);
-            break;
-        case EM_EASTRON:
-            // Phase 1-3 current: Register 0x06 - 0x0B (unsigned)
-            // Phase 1-3 power:   Register 0x0C - 0x11 (signed)
-            ModbusReadInputRequest(Address, 4, 0x06, 12);
-            break;
-        case EM_ABB:
-            // Phase 1-3 current: Register 0x5B0C - 0x5B11 (unsigned)
-            // Phase 1-3 power:   Register 0x5B16 - 0x5B1B (signed)
-            ModbusReadInputRequest(Address, 3, 0x5B0C, 16);
+            *Function = 4;
+            *Register = 0;
+            *Count = 20;
             break;
+        case EM_P1:
+            // Telegrams are pushed by the P1 port every second, nothing to request
+            return 0;
         case EM_SOLAREDGE:
             // Read 3 Current values + scaling factor
-            ModbusReadInputRequest(Address, EMConfig[Meter].Function, EMConfig[Meter].IRegister, 4);
+            *Count = 4;
             break;
         default:
-            // Read 3 Current values
-            requestMeasurement(Meter, Address, EMConfig[Meter].IRegister, 3);
+            // Read 3 Current values, and the 3 signed power values after them if the meter has no signed currents
+            // Eastron: Phase 1-3 current 0x06 - 0x0B (unsigned), Phase 1-3 power 0x0C - 0x11 (signed)
+            // ABB: Phase 1-3 current 0x5B0C - 0x5B11 (unsigned), Phase 1-3 power 0x5B16 - 0x5B1B (signed)
+            *Count = EMConfig[Meter].SignPos ? EMConfig[Meter].SignPos + 3u : 3u;
+            if (EMConfig[Meter].DataType != MB_DATATYPE_INT16) *Count = *Count * 2u;
             break;
-    }  
+    }
+    return 1;
+}
+
+/**
+ * Send current measurement request over modbus
+ * 
+ * @param uint8_t Meter
+ * @param uint8_t Address
+ */
+void requestCurrentMeasurement(uint8_t Meter, uint8_t Address) {
+    uint8_t Function, Part;
+    uint16_t Register, Count, n;
+
+    if (!getCurrentMeasurementRequest(Meter, &Function, &Register, &Count)) return;
+    Part = ModbusBlockStart(&CurrentBlock, Address, Function, Register, Count, EMConfig[Meter].ReadMax,
+                            EMConfig[Meter].DataType == MB_DATATYPE_INT16 ? 1 : 2);
+    if (!Part || Part >= Count) {
+        ModbusReadInputRequest(Address, Function, Register, Count);
+        return;
+    }
+    // More registers than the meter sends at once, receiveCurrentBlock() combines the parts
+    for (n = 0; n < Count; n += Part) {
+        MBclient.addRequest(MODBUS_BLOCK_TOKEN | (uint16_t)(Register + n), Address, Function, (uint16_t)(Register + n),
+                            (uint16_t)(Count - n < Part ? Count - n : Part));
+    }
+}
+
+/**
+ * Combine the parts of a current read that was split by ReadMax
+ * 
+ * @param ModbusMessage msg: a part, replaced by the whole response when all parts are received
+ * @param uint32_t token
+ * @return bool true when msg has to be handled: not a part, or all parts are received
+ */
+bool receiveCurrentBlock(ModbusMessage &msg, uint32_t token) {
+    uint8_t *buf = (uint8_t*)msg.data();
+
+    if ((token & 0xFFFF0000) != MODBUS_BLOCK_TOKEN) return true;
+    if (msg.size() < 3 || buf[0] != CurrentBlock.Address || buf[1] != CurrentBlock.Function || buf[2] != msg.size() - 3) return false;
+    if (!ModbusBlockAdd(&CurrentBlock, token & 0xFFFF, buf + 3, buf[2])) return false;
+    msg = ModbusBlockResponse(&CurrentBlock);
+    return true;
 }
 
 /**
@@ -602,18 +714,11 @@ uint8_t receiveCurrentMeasurement(uint8_t *buf, uint8_t Meter, signed int *var)
             break;
     }
 
-    // Get sign from power measurement on some electric meters
-    switch(Meter) {
-        case EM_EASTRON:
-            for (x = 0; x < 3; x++) {
-                if (receiveMeasurement(buf, x + 3u, EMConfig[Meter].Endianness, EMConfig[Meter].DataType, EMConfig[Meter].PDivisor) < 0) var[x] = -var[x];
-            }
-            break;
-        case EM_ABB:
-            for (x = 0; x < 3; x++) {
-                if (receiveMeasurement(buf, x + 5u, EMConfig[Meter].Endianness, EMConfig[Meter].DataType, EMConfig[Meter].PDivisor) < 0) var[x] = -var[x];
-            }
-            break;
+    // Get sign from power measurement on some electric meters (Eastron, ABB, and profiles with a sign register)
+    if (EMConfig[Meter].SignPos) {
+        for (x = 0; x < 3; x++) {
+            if (receiveMeasurement(buf, x + EMConfig[Meter].SignPos, EMConfig[Meter].Endianness, EMConfig[Meter].DataType, EMConfig[Meter].PDivisor) < 0) var[x] = -var[x];
+        }
     }
 
     // all OK
@@ -623,40 +728,126 @@ uint8_t receiveCurrentMeasurement(uint8_t *buf, uint8_t Meter, signed int *var)
 /**
  * Map a Modbus register to an item ID (MENU_xxx or STATUS_xxx)
  * 
- * @return uint8_t ItemID
+ * @param uint16_t Register
+ * @param uint16_t Count (registers)
+ * @return uint8_t ItemID, 0 when the register range is not mapped
  */
-uint8_t mapModbusRegister2ItemID() {
-    uint16_t RegisterStart, ItemStart, Count;
+uint8_t mapModbusRegister2ItemID(uint16_t Register, uint16_t Count) {
+    uint16_t RegisterStart, ItemStart, BankCount;
 
     // Register 0x00*: Status
-    if (MB.Register >= MODBUS_EVSE_STATUS_START && MB.Register < (MODBUS_EVSE_STATUS_START + MODBUS_EVSE_STATUS_COUNT)) {
+    if (Register >= MODBUS_EVSE_STATUS_START && Register < (MODBUS_EVSE_STATUS_START + MODBUS_EVSE_STATUS_COUNT)) {
         RegisterStart = MODBUS_EVSE_STATUS_START;
         ItemStart = STATUS_STATE;
-        Count = MODBUS_EVSE_STATUS_COUNT;
+        BankCount = MODBUS_EVSE_STATUS_COUNT;
 
     // Register 0x01*: Node specific configuration
-    } else if (MB.Register >= MODBUS_EVSE_CONFIG_START && MB.Register < (MODBUS_EVSE_CONFIG_START + MODBUS_EVSE_CONFIG_COUNT)) {
+    } else if (Register >= MODBUS_EVSE_CONFIG_START && Register < (MODBUS_EVSE_CONFIG_START + MODBUS_EVSE_CONFIG_COUNT)) {
         RegisterStart = MODBUS_EVSE_CONFIG_START;
         ItemStart = MENU_CONFIG;
-        Count = MODBUS_EVSE_CONFIG_COUNT;
+        BankCount = MODBUS_EVSE_CONFIG_COUNT;
 
     // Register 0x02*: System configuration (same on all SmartEVSE in a LoadBalancing setup)
-    } else if (MB.Register >= MODBUS_SYS_CONFIG_START && MB.Register < (MODBUS_SYS_CONFIG_START + MODBUS_SYS_CONFIG_COUNT)) {
+    } else if (Register >= MODBUS_SYS_CONFIG_START && Register < (MODBUS_SYS_CONFIG_START + MODBUS_SYS_CONFIG_COUNT)) {
         RegisterStart = MODBUS_SYS_CONFIG_START;
         ItemStart = MENU_MODE;
-        Count = MODBUS_SYS_CONFIG_COUNT;
+        BankCount = MODBUS_SYS_CONFIG_COUNT;
 
     } else {
         return 0;
     }
     
-    if (MB.RegisterCount <= (RegisterStart + Count) - MB.Register) {
-        return (MB.Register - RegisterStart + ItemStart);
+    if (Count <= (RegisterStart + BankCount) - Register) {
+        return (Register - RegisterStart + ItemStart);
     } else {
         return 0;
     }
 }
 
+/**
+ * Handle a read/write request for the EVSE registers, and build the response
+ * Only uses the request itself (not the MB struct), so it can be called from the RTU and TCP servers.
+ * 
+ * @param ModbusMessage request
+ * @return ModbusMessage response
+ */
+ModbusMessage MBItemRequest(ModbusMessage request) {
+    ModbusMessage response;     // response message to be sent back
+    uint8_t Address = request.getServerID();
+    uint8_t Function = request.getFunctionCode();
+    uint8_t ItemID = 0;
+    uint16_t Register = 0, Count = 0, value, i, OK = 0;
+    uint16_t values[MODBUS_EVSE_MEASURE_COUNT];
+
+    request.get(2, Register);
+    request.get(4, Count);                                                      // FC06: value
+
+    switch (Function) {
+        case 0x04: // (Read input register)
+            // Register 0x03*: Measurements, served from the snapshot
+            if (request.size() == 6 && readMeasureRegisters(Register, Count, values)) {
+                response.add(Address, Function, (uint8_t)(Count * 2));
+                for (i = 0; i < Count; i++) {
+                    response.add(values[i]);
+                }
+                break;
+            }
+            // no break
+        case 0x03: // (Read holding register)
+            if (request.size() == 6 && Count <= MODBUS_MAX_REGISTER_READ) ItemID = mapModbusRegister2ItemID(Register, Count);
+            if (ItemID) {
+                response.add(Address, Function, (uint8_t)(Count * 2));
+                for (i = 0; i < Count; i++) {
+                    response.add(getItemValue(ItemID + i));
+                }
+            } else {
+                response.setError(Address, Function, ILLEGAL_DATA_ADDRESS);
+            }
+            break;
+        case 0x06: // (Write single register)
+            if (request.size() == 6) ItemID = mapModbusRegister2ItemID(Register, 1);
+            if (ItemID) {
+                OK = setItemValue(ItemID, Count);
+            }
+
+            if (OK && ItemID < STATUS_STATE) write_settings();
+
+            if (!ItemID) {
+                response.setError(Address, Function, ILLEGAL_DATA_ADDRESS);
+            } else if (!OK) {
+                response.setError(Address, Function, ILLEGAL_DATA_VALUE);
+            } else {
+                return ECHO_RESPONSE;
+            }
+            break;
+        case 0x10: // (Write multiple register))
+            // Address, Function, Register, Count, Bytecount, Data
+            if (request.size() == 7u + Count * 2u && request[6] == Count * 2u) ItemID = mapModbusRegister2ItemID(Register, Count);
+            if (ItemID) {
+                for (i = 0; i < Count; i++) {
+                    request.get(7 + i * 2, value);
+                    OK += setItemValue(ItemID + i, value);
+                }
+            }
+
+            if (OK && ItemID < STATUS_STATE) write_settings();
+
+            if (!ItemID) {
+                response.setError(Address, Function, ILLEGAL_DATA_ADDRESS);
+            } else if (!OK) {
+                response.setError(Address, Function, ILLEGAL_DATA_VALUE);
+            } else  {
+                response.add(Address, Function, Register, OK);
+            }
+            break;
+        default:
+            response.setError(Address, Function, ILLEGAL_FUNCTION);
+            break;
+    }
+
+    return response;
+}
+
 /**
  * Read item values and send modbus response
  */
@@ -665,7 +856,7 @@ void ReadItemValueResponse(void) {
     uint8_t i;
     uint16_t values[MODBUS_MAX_REGISTER_READ];
 
-    ItemID = mapModbusRegister2ItemID();
+    ItemID = mapModbusRegister2ItemID(MB.Register, MB.RegisterCount);
     if (ItemID) {
         for (i = 0; i < MB.RegisterCount; i++) {
             values[i] = getItemValue(ItemID + i);
@@ -683,7 +874,7 @@ void WriteItemValueResponse(void) {
     uint8_t ItemID;
     uint8_t OK = 0;
 
-    ItemID = mapModbusRegister2ItemID();
+    ItemID = mapModbusRegister2ItemID(MB.Register, MB.RegisterCount);
     if (ItemID) {
         OK = setItemValue(ItemID, MB.Value);
     }
@@ -708,7 +899,7 @@ void WriteMultipleItemValueResponse(void) {
     uint8_t ItemID;
     uint16_t i, OK = 0, value;
 
-    ItemID = mapModbusRegister2ItemID();
+    ItemID = mapModbusRegister2ItemID(MB.Register, MB.RegisterCount);
     if (ItemID) {
         for (i = 0; i < MB.RegisterCount; i++) {
             value = (MB.Data[i * 2] <<8) | MB.Data[(i * 2) + 1];
@@ -0,0 +1,168 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include "ModbusServerRTU.h"
+#include "ModbusClientRTU.h"
+#include "ModbusClientTCPasync.h"
+#include "ModbusServerTCPasync.h"
+
+#include "evse.h"
+#include "modbus.h"
+#include "modbustcp.h"
+
+#define MBTCP_MAINS 0
+#define MBTCP_PV 1
+
+// The token of a request holds the meter role (high word) and the requested register (low word),
+// so responses can be decoded without the shared MB struct of the RS485 bus.
+#define MBTCP_TOKEN(role, reg) (((uint32_t)(role) << 16) | (reg))
+
+struct MeterTCP {
+    ModbusClientTCPasync *Client;
+    uint32_t IP;                                                                // IP address the client is connected to
+    uint16_t Port;
+    struct ModbusBlock Block;                                                   // Current read, in parts of at most ReadMax registers
+};
+
+struct MeterTCP MeterTCP[2];                                                    // Mains and PV meter
+
+ModbusServerTCPasync MBTCPserver;                                               // Serves the EVSE registers on the network
+
+
+/**
+ * Handle responses from electric meters on the network
+ * Called from the AsyncTCP task.
+ * 
+ * @param ModbusMessage msg
+ * @param uint32_t token
+ */
+void MBTCPhandleData(ModbusMessage msg, uint32_t token) {
+    uint8_t *buf = (uint8_t*)msg.data();
+    uint8_t Function, role = token >> 16;
+    uint16_t Register, Count;
+    struct ModbusBlock *b = &MeterTCP[role ? MBTCP_PV : MBTCP_MAINS].Block;
+
+    // Response: Address, Function, Bytecount, Data
+    if (msg.size() < 3 || buf[2] != msg.size() - 3) return;
+
+    if (role == MBTCP_MAINS) {
+        if (!MainsMeterIP || !getCurrentMeasurementRequest(MainsMeter, &Function, &Register, &Count)) return;
+        if (buf[1] != Function || b->Register != Register || b->Count != Count) return;
+        if (!ModbusBlockAdd(b, token & 0xFFFF, buf + 3, buf[2])) return;        // wait for the other parts
+        b->Received = 0;
+
+        if (receiveCurrentMeasurement(b->Data, MainsMeter, CM) && LoadBl < 2) timeout = 10;  // only reset timeout when data is ok, and Master/Disabled
+        UpdateMainsCurrents();
+        MainsUpdated = 1;                                                       // Let Timer100ms process the new data
+    } else {
+        if (!PVMeterIP || !getCurrentMeasurementRequest(PVMeter, &Function, &Register, &Count)) return;
+        if (buf[1] != Function || b->Register != Register || b->Count != Count) return;
+        if (!ModbusBlockAdd(b, token & 0xFFFF, buf + 3, buf[2])) return;        // wait for the other parts
+        b->Received = 0;
+
+        receiveCurrentMeasurement(b->Data, PVMeter, PV);
+    }
+}
+
+void MBTCPhandleError(Error error, uint32_t token) {
+#ifdef LOG_WARN_MODBUS
+    ModbusError me(error);
+    Serial.printf("Modbus TCP %s meter error: %02X - %s\n", (token >> 16) == MBTCP_MAINS ? "Mains" : "PV", error, (const char *)me);
+#endif
+}
+
+/**
+ * Request current measurement from a meter on the network
+ * (Re)connects when the IP address or port was changed.
+ * 
+ * @param uint8_t role (MBTCP_MAINS / MBTCP_PV)
+ * @param uint8_t Meter
+ * @param uint8_t Address (Unit ID)
+ * @param uint32_t IP
+ */
+void requestMeterTCP(uint8_t role, uint8_t Meter, uint8_t Address, uint32_t IP) {
+    struct MeterTCP *m = &MeterTCP[role];
+    uint8_t Function, Part;
+    uint16_t Register, Count, n;
+
+    if (!Meter || Meter == EM_SENSORBOX || !IP) return;                         // Sensorbox is only supported on RS485
+    if (!getCurrentMeasurementRequest(Meter, &Function, &Register, &Count)) return;
+
+    if (m->Client == NULL) {
+        m->Client = new ModbusClientTCPasync(IPAddress(IP), MeterTCPPort);
+        m->Client->onDataHandler(&MBTCPhandleData);
+        m->Client->onErrorHandler(&MBTCPhandleError);
+        m->Client->setTimeout(MODBUS_TCP_TIMEOUT);
+        m->Client->setIdleTimeout(MODBUS_TCP_POLL * 5);
+        m->Client->setMaxInflightRequests(1);
+    } else if (m->IP != IP || m->Port != MeterTCPPort) {
+        m->Client->disconnect(true);
+        m->Client->clearQueue();
+        m->Client->connect(IPAddress(IP), MeterTCPPort);
+    }
+    m->IP = IP;
+    m->Port = MeterTCPPort;
+
+    // The meter may send fewer registers at once than needed (ReadMax), then the read is split
+    Part = ModbusBlockStart(&m->Block, Address, Function, Register, Count, EMConfig[Meter].ReadMax,
+                            EMConfig[Meter].DataType == MB_DATATYPE_INT16 ? 1 : 2);
+    for (n = 0; Part && n < Count; n += Part) {
+        m->Client->addRequest(MBTCP_TOKEN(role, Register + n), Address, Function, (uint16_t)(Register + n),
+                              (uint16_t)(Count - n < Part ? Count - n : Part));
+    }
+}
+
+/**
+ * Task that polls the Mains and PV electric meters on the network (Modbus TCP)
+ * Runs independent of the RS485 bus, which is then only used for the Nodes.
+ */
+void MeterTCPTask(void * parameter) {
+
+    while(1) {
+        // Only the Master (or standalone EVSE) reads the meters
+        if (LoadBl < 2 && Mode && WiFi.status() == WL_CONNECTED) {
+            requestMeterTCP(MBTCP_PV, PVMeter, PVMeterAddress, PVMeterIP);
+            requestMeterTCP(MBTCP_MAINS, MainsMeter, MainsMeterAddress, MainsMeterIP);
+        }
+
+        vTaskDelay(MODBUS_TCP_POLL / portTICK_PERIOD_MS);
+    }
+}
+
+/**
+ * Handle a request of a Modbus TCP client
+ * Anyone on the network can connect, so writes are refused unless they are enabled (/modbustcp?write=1)
+ * 
+ * @param ModbusMessage request
+ * @return ModbusMessage response
+ */
+ModbusMessage MBTCPRequest(ModbusMessage request) {
+    ModbusMessage response;
+    uint8_t Function = request.getFunctionCode();
+
+    if ((Function == 0x06 || Function == 0x10) && !ModbusTCPWrite) {
+        response.setError(request.getServerID(), Function, ILLEGAL_FUNCTION);
+        return response;
+    }
+    return MBItemRequest(request);
+}
+
+/**
+ * Serve the EVSE registers (status, node and system configuration) over Modbus TCP
+ * The requests are handled in the AsyncTCP task, the RS485 bus is not involved.
+ */
+void StartModbusTCPServer(void) {
+
+    MBTCPserver.registerWorker(MODBUS_TCP_UNIT, ANY_FUNCTION_CODE, &MBTCPRequest);
+    MBTCPserver.registerWorker(MODBUS_TCP_UNIT_ANY, ANY_FUNCTION_CODE, &MBTCPRequest);
+
+    if (MBTCPserver.start(MODBUS_TCP_PORT, MODBUS_TCP_CLIENTS, MODBUS_TCP_IDLE)) {
+        Serial.printf("Modbus TCP server started on port %u\n", MODBUS_TCP_PORT);
+    } else Serial.print("Modbus TCP server failed to start!\n");
+}
@@ -0,0 +1,72 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+
+#include "picontrol.h"
+
+/**
+ * Reset the controller, the next step has no proportional part
+ *
+ * @param pointer to PIControl pi
+ */
+void PIControlReset(struct PIControl *pi) {
+    pi->Error = 0;
+    pi->Rest = 0;
+    pi->Valid = 0;
+}
+
+/**
+ * One step of the PI controller
+ * The change of the output is Kp * (change of the error) + Ki * error * dt,
+ * limited to RateUp / RateDown, and the output is clamped between min and max.
+ * A negative error (overload) uses KiDown, but is never corrected more than once.
+ *
+ * @param pointer to PIGains g
+ * @param pointer to PIControl pi
+ * @param int32_t output: output that was used since the last step (0.1A)
+ * @param int32_t error: setpoint - measurement (0.1A)
+ * @param uint32_t dt: time since the last step (ms)
+ * @param int32_t min: lowest output (0.1A)
+ * @param int32_t max: highest output (0.1A)
+ * @return int32_t new output (0.1A)
+ */
+int32_t PIControlStep(const struct PIGains *g, struct PIControl *pi, int32_t output, int32_t error, uint32_t dt, int32_t min, int32_t max) {
+    int64_t delta;
+    int32_t limit, change;
+
+    if (error < 0) delta = (int64_t)g->KiDown * error * dt / 1000;          // 1/1000 * 0.1A
+    else delta = (int64_t)g->Ki * error * dt / 1000;
+    if (error < 0 && delta < (int64_t)error * 1000) delta = (int64_t)error * 1000;  // never correct an overload more than once
+    delta += pi->Rest;
+    if (pi->Valid) delta += (int64_t)g->Kp * (error - pi->Error);
+    pi->Error = error;
+    pi->Valid = 1;
+
+    if (g->RateUp) {
+        limit = (int32_t)((uint32_t)g->RateUp * dt);                        // 0.1A/s * ms = 1/1000 * 0.1A
+        if (delta > limit) delta = limit;
+    }
+    if (g->RateDown) {
+        limit = (int32_t)((uint32_t)g->RateDown * dt);
+        if (delta < -limit) delta = -limit;
+    }
+
+    change = (int32_t)(delta / 1000);
+    pi->Rest = (int32_t)(delta - (int64_t)change * 1000);                   // keep the part below 0.1A for the next step
+
+    output += change;
+    if (output > max) {
+        output = max;
+        pi->Rest = 0;
+    }
+    if (output < min) {
+        output = min;
+        pi->Rest = 0;
+    }
+    return output;
+}
@@ -0,0 +1,78 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pilotfilter.h"
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+/**
+ * Initialize a pilot filter, the bands have to be set by the caller
+ * The filter starts at level 0 (unknown).
+ * 
+ * @param pointer to PilotFilter
+ * @param uint8_t n: windows needed to confirm a level
+ * @param uint8_t m: out of the last m windows (max PILOT_HISTORY)
+ */
+void PilotFilterInit(struct PilotFilter *f, uint8_t n, uint8_t m) {
+    memset(f, 0, sizeof(struct PilotFilter));
+    if (m > PILOT_HISTORY) m = PILOT_HISTORY;
+    if (n > m) n = m;
+    f->N = n;
+    f->M = m;
+}
+
+/**
+ * Classify one window
+ * The confirmed level is tested first against its wider Hold band, then all levels in order against the Enter bands.
+ * 
+ * @param pointer to PilotFilter
+ * @param uint16_t Min: lowest sample of the window
+ * @param uint16_t Max: highest sample of the window
+ * @return uint8_t level, 0 when the window does not match any level
+ */
+uint8_t IRAM_ATTR PilotFilterClassify(struct PilotFilter *f, uint16_t Min, uint16_t Max) {
+    uint8_t level;
+
+    if (f->Level && Min >= f->Hold[f->Level].Min && Max < f->Hold[f->Level].Max) return f->Level;
+
+    for (level = 1; level < PILOT_LEVELS; level++) {
+        if (Min >= f->Enter[level].Min && Max < f->Enter[level].Max) return level;
+    }
+    return 0;
+}
+
+/**
+ * Add a window, and update the confirmed level
+ * A level is confirmed when N of the last M windows match it. Unknown windows only confirm level 0 (not ok)
+ * when N of the last M windows are unknown, so a few noisy windows keep the current level.
+ * 
+ * @param pointer to PilotFilter
+ * @param uint16_t Min: lowest sample of the window
+ * @param uint16_t Max: highest sample of the window
+ * @return uint8_t 1 when the confirmed level changed
+ */
+uint8_t IRAM_ATTR PilotFilterAdd(struct PilotFilter *f, uint16_t Min, uint16_t Max) {
+    uint8_t count[PILOT_LEVELS] = {0};
+    uint8_t i, level, old = f->Level;
+
+    f->History[f->Idx] = PilotFilterClassify(f, Min, Max);
+    if (++f->Idx >= f->M) f->Idx = 0;
+
+    for (i = 0; i < f->M; i++) count[f->History[i]]++;
+
+    // The newest window decides which level may be confirmed
+    level = f->History[(f->Idx + f->M - 1) % f->M];
+    if (level != f->Level && count[level] >= f->N) f->Level = level;
+
+    f->Confidence = count[f->Level] * 100 / f->M;
+    return f->Level != old;
+}
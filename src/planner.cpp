@@ -0,0 +1,118 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "planner.h"
+
+// Cost of a slot of the plan, slots outside the tariff table are used last
+static uint16_t Cost(const struct PlanTable *table, uint32_t start) {
+    uint32_t slot;
+
+    if (start < table->Start) return PLAN_COST_UNKNOWN;
+    slot = (start - table->Start) / PLAN_SLOT_TIME;
+    if (slot >= table->Count) return PLAN_COST_UNKNOWN;
+    return table->Cost[slot];
+}
+
+// Seconds of slot n between 'from' and 'to'
+static uint32_t Overlap(const struct Plan *plan, uint8_t n, uint32_t from, uint32_t to) {
+    uint32_t begin = plan->Start + (uint32_t)n * PLAN_SLOT_TIME, end = begin + PLAN_SLOT_TIME;
+
+    if (begin < from) begin = from;
+    if (end > to) end = to;
+    return end > begin ? end - begin : 0;
+}
+
+/**
+ * Plan the charge current until the departure
+ * The cheapest slots are charged at the max current, the last one at the current that is still needed.
+ * When the energy does not fit before the departure, all slots are charged at the max current.
+ *
+ * @param pointer to Plan plan
+ * @param pointer to PlanTable table
+ * @param uint32_t now (Unix time)
+ * @param uint32_t departure (Unix time)
+ * @param uint32_t energy: to charge (Wh)
+ * @param uint16_t watt: power per Amp (W), 230V * phases
+ * @param uint8_t min: current (A)
+ * @param uint8_t max: current (A)
+ */
+void PlanMake(struct Plan *plan, const struct PlanTable *table, uint32_t now, uint32_t departure, uint32_t energy,
+              uint16_t watt, uint8_t min, uint8_t max) {
+    uint8_t order[PLAN_SLOTS], n, i, j, count;
+    uint16_t cost[PLAN_SLOTS];
+    uint32_t seconds, slot, current;
+
+    memset(plan->Current, 0, sizeof(plan->Current));
+    plan->Start = now - now % PLAN_SLOT_TIME;
+    plan->Made = now;
+    plan->Departure = departure;
+    plan->Watt = watt;
+    plan->Count = 0;
+    if (departure <= now || !watt) return;
+
+    slot = (departure - plan->Start + PLAN_SLOT_TIME - 1) / PLAN_SLOT_TIME;
+    count = slot > PLAN_SLOTS ? PLAN_SLOTS : slot;
+    plan->Count = count;
+
+    // Order the slots by cost, equal costs keep the time order (insertion sort, at most 192 slots)
+    for (n = 0; n < count; n++) {
+        cost[n] = Cost(table, plan->Start + (uint32_t)n * PLAN_SLOT_TIME);
+        for (i = n; i > 0 && cost[order[i - 1]] > cost[n]; i--) order[i] = order[i - 1];
+        order[i] = n;
+    }
+
+    for (j = 0; j < count && energy; j++) {
+        n = order[j];
+        seconds = Overlap(plan, n, now, departure);
+        if (!seconds) continue;
+        slot = (uint32_t)max * watt * seconds / 3600;                            // Wh in this slot at the max current
+        if (slot <= energy) {
+            plan->Current[n] = max;
+            energy -= slot;
+        } else {
+            current = (energy * 3600 + (uint32_t)watt * seconds - 1) / ((uint32_t)watt * seconds);
+            plan->Current[n] = current < min ? min : current;
+            energy = 0;
+        }
+    }
+}
+
+/**
+ * Planned current
+ *
+ * @param pointer to Plan plan
+ * @param uint32_t now (Unix time)
+ * @return uint8_t current (A), PLAN_NONE outside the plan
+ */
+uint8_t PlanCurrent(const struct Plan *plan, uint32_t now) {
+    uint32_t slot;
+
+    if (now < plan->Start || now >= plan->Departure) return PLAN_NONE;
+    slot = (now - plan->Start) / PLAN_SLOT_TIME;
+    if (slot >= plan->Count) return PLAN_NONE;
+    return plan->Current[slot];
+}
+
+/**
+ * Energy planned from the moment the plan was made until now
+ *
+ * @param pointer to Plan plan
+ * @param uint32_t now (Unix time)
+ * @return uint32_t energy (Wh)
+ */
+uint32_t PlanEnergy(const struct Plan *plan, uint32_t now) {
+    uint32_t energy = 0;
+    uint8_t n;
+
+    for (n = 0; n < plan->Count; n++) {
+        energy += (uint32_t)plan->Current[n] * plan->Watt * Overlap(plan, n, plan->Made, now) / 3600;
+    }
+    return energy;
+}
@@ -0,0 +1,119 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "samplewindow.h"
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+/**
+ * Initialize a sample window
+ * 
+ * @param pointer to SampleWindow
+ * @param uint16_t size: samples per window
+ */
+void SampleWindowInit(struct SampleWindow *w, uint16_t size) {
+    memset(w, 0, sizeof(struct SampleWindow));
+    w->Size = size;
+    w->Acc.Min = 0xFFFF;
+}
+
+/**
+ * Add a sample (producer)
+ * Keeps min/max/sum of the window, and publishes them when the window is complete.
+ * 
+ * @param pointer to SampleWindow
+ * @param uint16_t sample
+ * @return uint8_t 1 when a window was completed and published
+ */
+uint8_t IRAM_ATTR SampleWindowPut(struct SampleWindow *w, uint16_t sample) {
+    struct SampleStats *a = &w->Acc;
+
+    w->Ring[w->Head % SAMPLE_RING] = sample;
+    __atomic_store_n(&w->Head, w->Head + 1, __ATOMIC_RELEASE);
+
+    if (w->Restart) {
+        w->Restart = 0;
+        a->Min = 0xFFFF;
+        a->Max = 0;
+        a->Sum = 0;
+        a->Count = 0;
+    }
+
+    if (sample < a->Min) a->Min = sample;
+    if (sample > a->Max) a->Max = sample;
+    a->Sum += sample;
+
+    if (++a->Count >= w->Size) {
+        a->Window = w->Stats.Window + 1;
+        // Seqlock: Seq is odd while Stats is written
+        __atomic_store_n(&w->Seq, w->Seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        w->Stats = *a;
+        __atomic_store_n(&w->Seq, w->Seq + 1, __ATOMIC_RELEASE);
+
+        a->Min = 0xFFFF;
+        a->Max = 0;
+        a->Sum = 0;
+        a->Count = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Get the stats of the last complete window (consumer)
+ * 
+ * @param pointer to SampleWindow
+ * @param pointer to SampleStats
+ * @return uint8_t 0 when no window was completed yet
+ */
+uint8_t SampleWindowGet(struct SampleWindow *w, struct SampleStats *out) {
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&w->Seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;                                                  // producer is writing (on the other core)
+        *out = w->Stats;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&w->Seq, __ATOMIC_RELAXED));
+
+    return out->Count != 0;
+}
+
+/**
+ * Drop the samples collected so far, for example after the sample timing changed (consumer)
+ * The next published window only contains samples taken after this call.
+ * 
+ * @param pointer to SampleWindow
+ */
+void SampleWindowRestart(struct SampleWindow *w) {
+    w->Restart = 1;
+}
+
+/**
+ * Copy the newest raw samples (consumer, for logging)
+ * 
+ * @param pointer to SampleWindow
+ * @param pointer to buf
+ * @param uint16_t count: max samples to copy (<= SAMPLE_RING)
+ * @return uint16_t samples copied, oldest first
+ */
+uint16_t SampleWindowLast(struct SampleWindow *w, uint16_t *buf, uint16_t count) {
+    uint32_t head = __atomic_load_n(&w->Head, __ATOMIC_ACQUIRE);
+    uint16_t n;
+
+    if (count > SAMPLE_RING / 2) count = SAMPLE_RING / 2;                       // leave room for the producer
+    if (count > head) count = head;
+    for (n = 0; n < count; n++) buf[n] = w->Ring[(head - count + n) % SAMPLE_RING];
+
+    return count;
+}
@@ -0,0 +1,77 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+
+#include "schedule.h"
+
+// Returns true when EVSE a should have a slot before EVSE b. Equal EVSE's keep the index order.
+static bool Before(uint8_t policy, const struct ScheduleEVSE *a, const struct ScheduleEVSE *b) {
+    switch (policy) {
+        case SCHEDULE_ROTATE:
+            if (a->Idle != b->Idle) return a->Idle > b->Idle;                   // longest without a slot
+            break;
+        case SCHEDULE_ENERGY:
+            if (a->Charged != b->Charged) return a->Charged < b->Charged;
+            break;
+        case SCHEDULE_PRIORITY:
+            if (a->Priority != b->Priority) return a->Priority > b->Priority;
+            break;
+        default:
+            break;
+    }
+    return a->Connected > b->Connected;                                         // first come
+}
+
+/**
+ * The waiting EVSE that gets the next free slot
+ *
+ * @param uint8_t policy: SCHEDULE_xxx
+ * @param pointer to ScheduleEVSE evse[count]
+ * @param uint8_t count
+ * @return int8_t EVSE, -1 = none waiting
+ */
+int8_t ScheduleNext(uint8_t policy, const struct ScheduleEVSE *evse, uint8_t count) {
+    int8_t next = -1;
+    uint8_t n;
+
+    for (n = 0; n < count; n++) {
+        if (!evse[n].Waiting) continue;
+        if (next < 0 || Before(policy, &evse[n], &evse[next])) next = n;
+    }
+    return next;
+}
+
+/**
+ * The charging EVSE that should give up its slot to the next waiting EVSE
+ * An EVSE always keeps its slot for the time slice, so the contactors do not switch more often.
+ * Only an EVSE that makes room for the next one (Room) is paused.
+ *
+ * @param uint8_t policy: SCHEDULE_xxx
+ * @param pointer to ScheduleEVSE evse[count]
+ * @param uint8_t count
+ * @param uint32_t slice: minimal time charging (s)
+ * @return int8_t EVSE, -1 = none
+ */
+int8_t SchedulePreempt(uint8_t policy, const struct ScheduleEVSE *evse, uint8_t count, uint32_t slice) {
+    int8_t next, last = -1;
+    uint8_t n;
+
+    if (policy == SCHEDULE_FIFO) return -1;
+    next = ScheduleNext(policy, evse, count);
+    if (next < 0) return -1;
+
+    for (n = 0; n < count; n++) {
+        if (!evse[n].Charging || evse[n].Run < slice || !(evse[n].Room & (1 << next))) continue;
+        if (policy == SCHEDULE_ROTATE) {                                        // the one that charged longest
+            if (last < 0 || evse[n].Run > evse[last].Run) last = n;
+        } else if (last < 0 || Before(policy, &evse[last], &evse[n])) last = n;
+    }
+    if (last < 0) return -1;
+    if (policy != SCHEDULE_ROTATE && !Before(policy, &evse[next], &evse[last])) return -1;
+    return last;
+}
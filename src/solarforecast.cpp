@@ -0,0 +1,69 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdint.h>
+#include <math.h>
+
+#include "solarforecast.h"
+
+/**
+ * Initialize the forecast, without samples
+ *
+ * @param pointer to SolarForecast f
+ * @param float alpha: smoothing of the level (0-1), higher follows the measurements faster
+ * @param float beta: smoothing of the trend (0-1)
+ */
+void SolarForecastInit(struct SolarForecast *f, float alpha, float beta) {
+    f->Alpha = alpha;
+    f->Beta = beta;
+    f->Level = 0;
+    f->Trend = 0;
+    f->Variance = SOLAR_VARIANCE_INIT;
+    f->Samples = 0;
+}
+
+/**
+ * Add a measurement of the import
+ *
+ * @param pointer to SolarForecast f
+ * @param int32_t import (0.1A)
+ * @param uint32_t dt: time since the last measurement (ms)
+ */
+void SolarForecastAdd(struct SolarForecast *f, int32_t import, uint32_t dt) {
+    float seconds = dt / 1000.0f, predicted, error, level;
+
+    if (f->Samples == 0 || seconds <= 0) {
+        f->Level = import;
+        f->Trend = 0;
+    } else {
+        predicted = f->Level + f->Trend * seconds;
+        error = import - predicted;
+        if (f->Samples > 1) f->Variance += SOLAR_VARIANCE_GAIN * (error * error - f->Variance);
+
+        level = predicted + f->Alpha * error;
+        f->Trend += f->Beta * ((level - f->Level) / seconds - f->Trend);
+        f->Level = level;
+    }
+    if (f->Samples < UINT16_MAX) f->Samples++;
+}
+
+/**
+ * Forecast of the import
+ * The trend is damped, a trend does not go on for ever. The bound widens with the horizon.
+ *
+ * @param pointer to SolarForecast f
+ * @param uint16_t horizon (s)
+ * @param float sigmas: 0 = expected import, > 0 = high bound, < 0 = low bound (forecast error standard deviations)
+ * @return int32_t import (0.1A)
+ */
+int32_t SolarForecastImport(const struct SolarForecast *f, uint16_t horizon, float sigmas) {
+    float h = horizon, import;
+
+    import = f->Level + f->Trend * h / (1.0f + h / SOLAR_TREND_TIME);
+    import += sigmas * sqrtf(f->Variance * (1.0f + h / SOLAR_TREND_TIME));
+    return (int32_t)lroundf(import);
+}
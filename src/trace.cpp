@@ -0,0 +1,72 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <Arduino.h>
+
+#include "hal.h"
+#include "trace.h"
+
+// Trace of state transitions, error flag and allocation changes.
+// Entries are stored binary, formatting is left to the reader of the download.
+struct TraceEntry TraceRing[TRACE_SIZE];
+uint32_t TraceSeq = 0;                                                      // total entries written
+portMUX_TYPE trace_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Add an entry to the trace ring
+ * 
+ * @param uint8_t Type: TRACE_xxx
+ * @param uint8_t Cause
+ * @param uint16_t Old
+ * @param uint16_t New
+ */
+void TraceAdd(uint8_t Type, uint8_t Cause, uint16_t Old, uint16_t New) {
+    int64_t time = Hal->Micros();
+    struct TraceEntry *e;
+
+    portENTER_CRITICAL(&trace_spinlock);
+    e = &TraceRing[TraceSeq % TRACE_SIZE];
+    e->Time = time;
+    e->Type = Type;
+    e->Cause = Cause;
+    e->Old = Old;
+    e->New = New;
+    e->Seq = TraceSeq++;
+    portEXIT_CRITICAL(&trace_spinlock);
+}
+
+/**
+ * Copy the trace ring, oldest entry first
+ * 
+ * @param pointer to TraceHeader
+ * @param pointer to TraceEntry entries[TRACE_SIZE]
+ * @return uint32_t number of entries copied
+ */
+uint32_t TraceSnapshot(struct TraceHeader *header, struct TraceEntry *entries) {
+    uint32_t n, seq, first, count = 0;
+
+    portENTER_CRITICAL(&trace_spinlock);
+    seq = TraceSeq;
+    portEXIT_CRITICAL(&trace_spinlock);
+    first = seq < TRACE_SIZE ? 0 : seq - TRACE_SIZE;
+
+    // One entry per critical section, entries that were overwritten meanwhile are skipped
+    for (n = first; n < seq; n++) {
+        portENTER_CRITICAL(&trace_spinlock);
+        entries[count] = TraceRing[n % TRACE_SIZE];
+        portEXIT_CRITICAL(&trace_spinlock);
+        if (entries[count].Seq == (uint16_t)n) count++;
+    }
+
+    header->Magic = TRACE_MAGIC;
+    header->Version = TRACE_VERSION;
+    header->EntrySize = sizeof(struct TraceEntry);
+    header->Count = count;
+    header->Dropped = seq - count;
+    header->Now = Hal->Micros();
+    return count;
+}
@@ -0,0 +1,229 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests and benchmark of the current allocator: pio test -e native -f test_balance
+
+#include <chrono>
+#include <stdio.h>
+#include <unity.h>
+
+#include "balance.h"
+
+#define MAX_EVSES 256
+
+static struct BalanceEVSE EVSE[MAX_EVSES];
+static uint16_t Order[MAX_EVSES];
+static uint32_t Seed;
+
+// Reproducible pseudo random numbers
+static uint32_t Random(uint32_t range) {
+    Seed = Seed * 1103515245 + 12345;
+    return (Seed >> 8) % range;
+}
+
+static void SetEVSE(uint16_t n, uint16_t min, uint16_t max, uint8_t weight, uint8_t phases, uint8_t circuit) {
+    EVSE[n].Min = min;
+    EVSE[n].Max = max;
+    EVSE[n].Weight = weight;
+    EVSE[n].Phases = phases;
+    EVSE[n].Circuit = circuit;
+}
+
+static void RandomEVSEs(uint16_t count) {
+    uint16_t n, min;
+
+    for (n = 0; n < count; n++) {
+        min = Random(3) ? 0 : 60;
+        SetEVSE(n, min, min + Random(320), 1 + Random(3), Random(8), Random(BALANCE_CIRCUITS + 1));
+    }
+}
+
+// Four sub-circuits: 1 and 2 on the mains, 3 below 2, 4 below 3
+static void RandomCircuits(struct BalanceCircuit *circuit, uint16_t count) {
+    static const uint8_t parent[BALANCE_CIRCUITS] = { 0, 0, 2, 3 };
+    uint8_t c, x;
+
+    for (c = 0; c < BALANCE_CIRCUITS; c++) {
+        for (x = 0; x < 3; x++) circuit[c].Phase[x] = Random(4) ? Random(count * 100) : BALANCE_NO_LIMIT;
+        circuit[c].Parent = parent[c];
+    }
+}
+
+static uint8_t Phases(const struct BalanceEVSE *evse) {
+    return evse->Phases & 7 ? evse->Phases & 7 : 7;
+}
+
+/**
+ * Check the result of BalanceFill(): every EVSE between its Min and Max, and no limit exceeded,
+ * unless the minimums of the EVSE's on it exceed it already
+ */
+static void CheckLimits(uint16_t count, int32_t total, const int32_t *phase, const struct BalanceCircuit *circuit) {
+    int64_t sum = 0, min = 0, psum[3] = {0, 0, 0}, pmin[3] = {0, 0, 0};
+    int64_t csum[BALANCE_CIRCUITS][3] = {{0}}, cmin[BALANCE_CIRCUITS][3] = {{0}};
+    uint16_t n;
+    uint8_t c, x, depth;
+
+    for (n = 0; n < count; n++) {
+        TEST_ASSERT_GREATER_OR_EQUAL(EVSE[n].Min, EVSE[n].Current);
+        TEST_ASSERT_LESS_OR_EQUAL(EVSE[n].Max, EVSE[n].Current);
+        sum += EVSE[n].Current;
+        min += EVSE[n].Min;
+        for (x = 0; x < 3; x++) if (Phases(&EVSE[n]) & (1 << x)) {
+            psum[x] += EVSE[n].Current;
+            pmin[x] += EVSE[n].Min;
+            if (!circuit) continue;
+            for (c = EVSE[n].Circuit, depth = 0; c && depth < BALANCE_CIRCUITS; c = circuit[c - 1].Parent, depth++) {
+                csum[c - 1][x] += EVSE[n].Current;
+                cmin[c - 1][x] += EVSE[n].Min;
+            }
+        }
+    }
+    if (min <= total) TEST_ASSERT_LESS_OR_EQUAL(total, sum);
+    for (x = 0; x < 3; x++) {
+        if (phase && pmin[x] <= phase[x]) TEST_ASSERT_LESS_OR_EQUAL(phase[x], psum[x]);
+        if (!circuit) continue;
+        for (c = 0; c < BALANCE_CIRCUITS; c++) {
+            if (circuit[c].Phase[x] != BALANCE_NO_LIMIT && cmin[c][x] <= circuit[c].Phase[x]) {
+                TEST_ASSERT_LESS_OR_EQUAL(circuit[c].Phase[x], csum[c][x]);
+            }
+        }
+    }
+}
+
+void setUp(void) {
+    Seed = 1;
+}
+
+void tearDown(void) {
+}
+
+static void test_equal_share(void) {
+    uint16_t n;
+
+    for (n = 0; n < 4; n++) SetEVSE(n, 0, 320, 1, 0, 0);
+    BalanceFill(EVSE, Order, 4, 400, NULL, NULL);
+    for (n = 0; n < 4; n++) TEST_ASSERT_EQUAL(100, EVSE[n].Current);
+}
+
+// An EVSE below its share gets its Max, the rest is divided over the others
+static void test_capped(void) {
+    SetEVSE(0, 60, 320, 1, 0, 0);
+    SetEVSE(1, 60, 100, 1, 0, 0);
+    SetEVSE(2, 60, 320, 1, 0, 0);
+    BalanceFill(EVSE, Order, 3, 600, NULL, NULL);
+    TEST_ASSERT_EQUAL(250, EVSE[0].Current);
+    TEST_ASSERT_EQUAL(100, EVSE[1].Current);
+    TEST_ASSERT_EQUAL(250, EVSE[2].Current);
+}
+
+static void test_weight(void) {
+    SetEVSE(0, 0, 320, 1, 0, 0);
+    SetEVSE(1, 0, 320, 3, 0, 0);
+    BalanceFill(EVSE, Order, 2, 400, NULL, NULL);
+    TEST_ASSERT_EQUAL(100, EVSE[0].Current);
+    TEST_ASSERT_EQUAL(300, EVSE[1].Current);
+}
+
+// Not enough for the minimums, every EVSE gets its Min
+static void test_below_minimum(void) {
+    uint16_t n;
+
+    for (n = 0; n < 3; n++) SetEVSE(n, 60, 160, 1, 0, 0);
+    BalanceFill(EVSE, Order, 3, 100, NULL, NULL);
+    for (n = 0; n < 3; n++) TEST_ASSERT_EQUAL(60, EVSE[n].Current);
+}
+
+// Two single phase EVSE's share the L1 limit, the EVSE on L2 is not limited by it
+static void test_phase_limit(void) {
+    int32_t phase[3] = { 200, 320, 320 };
+
+    SetEVSE(0, 0, 320, 1, 1, 0);
+    SetEVSE(1, 0, 320, 1, 1, 0);
+    SetEVSE(2, 0, 320, 1, 2, 0);
+    BalanceFill(EVSE, Order, 3, 1000, phase, NULL);
+    TEST_ASSERT_EQUAL(100, EVSE[0].Current);
+    TEST_ASSERT_EQUAL(100, EVSE[1].Current);
+    TEST_ASSERT_EQUAL(320, EVSE[2].Current);
+}
+
+// 100A for the site. Board 1: 40A, board 2: 63A with board 3 below it on 20A
+static void test_circuit_tree(void) {
+    static const uint8_t on[8] = { 1, 1, 1, 1, 2, 2, 3, 3 };
+    struct BalanceCircuit circuit[BALANCE_CIRCUITS] = {
+        { { 400, 400, 400 }, 0 },
+        { { 630, 630, 630 }, 0 },
+        { { 200, 200, 200 }, 2 },
+        { { BALANCE_NO_LIMIT, BALANCE_NO_LIMIT, BALANCE_NO_LIMIT }, 0 }
+    };
+    uint16_t n;
+
+    for (n = 0; n < 8; n++) SetEVSE(n, 0, 320, 1, 0, on[n]);
+    BalanceFill(EVSE, Order, 8, 1000, NULL, circuit);
+    for (n = 0; n < 4; n++) TEST_ASSERT_EQUAL(100, EVSE[n].Current);
+    TEST_ASSERT_EQUAL(200, EVSE[4].Current);                                    // site limit: 1000 - 400 - 200 left for board 2
+    TEST_ASSERT_EQUAL(200, EVSE[5].Current);
+    TEST_ASSERT_EQUAL(100, EVSE[6].Current);
+    TEST_ASSERT_EQUAL(100, EVSE[7].Current);
+    CheckLimits(8, 1000, NULL, circuit);
+}
+
+static void test_random_limits(void) {
+    struct BalanceCircuit circuit[BALANCE_CIRCUITS];
+    int32_t phase[3], total;
+    uint16_t count, i;
+    uint8_t x;
+
+    for (i = 0; i < 20000; i++) {
+        count = 1 + Random(i % 10 ? 8 : MAX_EVSES);
+        RandomEVSEs(count);
+        RandomCircuits(circuit, count);
+        for (x = 0; x < 3; x++) phase[x] = Random(count * 200);
+        total = Random(count * 300);
+        BalanceFill(EVSE, Order, count, total, i & 1 ? phase : NULL, circuit);
+        CheckLimits(count, total, i & 1 ? phase : NULL, circuit);
+    }
+}
+
+// Time of one BalanceFill() with phase limits and sub-circuits, for 8 to 256 EVSE's
+static void test_benchmark(void) {
+    struct BalanceCircuit circuit[BALANCE_CIRCUITS];
+    int32_t phase[3], total;
+    uint16_t count, i, runs;
+    uint8_t x;
+    double us;
+    char msg[80];
+
+    for (count = 8; count <= MAX_EVSES; count *= 2) {
+        RandomEVSEs(count);
+        RandomCircuits(circuit, count);
+        for (x = 0; x < 3; x++) phase[x] = count * 100;
+        total = count * 150;
+        runs = 20000 / count;
+
+        auto start = std::chrono::steady_clock::now();
+        for (i = 0; i < runs; i++) BalanceFill(EVSE, Order, count, total, phase, circuit);
+        us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / runs;
+
+        CheckLimits(count, total, phase, circuit);
+        snprintf(msg, sizeof(msg), "%3u EVSE's: %8.2f us per BalanceFill()", count, us);
+        TEST_MESSAGE(msg);
+        TEST_ASSERT_LESS_THAN(10000, us);                                       // 10ms, far above the expected time
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_equal_share);
+    RUN_TEST(test_capped);
+    RUN_TEST(test_weight);
+    RUN_TEST(test_below_minimum);
+    RUN_TEST(test_phase_limit);
+    RUN_TEST(test_circuit_tree);
+    RUN_TEST(test_random_limits);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,130 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests of the 15 minute average import (capacity tariff): pio test -e native -f test_demand
+
+#include <unity.h>
+
+#include "demand.h"
+
+#define CLOCK 1700000100                                                        // Unix time, the start of a quarter hour
+#define TARGET 7000                                                             // W
+
+static struct Demand Demand;
+
+/**
+ * Measurements of a constant import
+ *
+ * @param uint32_t from (s)
+ * @param uint32_t seconds
+ * @param uint32_t every: time between the measurements (s)
+ * @param uint32_t dt: length of each measurement (ms), less than 'every' when measurements are lost
+ * @param int32_t power (W)
+ * @return uint32_t time of the last measurement (s)
+ */
+static uint32_t Import(uint32_t from, uint32_t seconds, uint32_t every, uint32_t dt, int32_t power) {
+    uint32_t t;
+
+    for (t = from + every; t <= from + seconds; t += every) DemandAdd(&Demand, power, t, dt);
+    return t - every;
+}
+
+void setUp(void) {
+    DemandInit(&Demand, CLOCK);
+}
+
+void tearDown(void) {
+}
+
+static void test_average(void) {
+    Import(CLOCK - 1, DEMAND_WINDOW, 1, 1000, 6000);
+    TEST_ASSERT_EQUAL(DEMAND_WINDOW * 1000, Demand.Covered);
+    TEST_ASSERT_INT_WITHIN(1, 6000, DemandAverage(&Demand));
+    TEST_ASSERT_INT_WITHIN(10, 6000, DemandProjected(&Demand));
+}
+
+// The average of every quarter hour of the clock
+static void test_quarter(void) {
+    uint32_t t;
+
+    t = Import(CLOCK - 1, DEMAND_WINDOW, 1, 1000, 3000);
+    TEST_ASSERT_TRUE(DemandAdd(&Demand, 5000, t + 1, 1000));                   // the first second of the next quarter
+    TEST_ASSERT_EQUAL(3000, Demand.Last);
+    t = Import(t + 1, DEMAND_WINDOW - 1, 1, 1000, 5000);
+    TEST_ASSERT_TRUE(DemandAdd(&Demand, 5000, t + 1, 1000));
+    TEST_ASSERT_EQUAL(5000, Demand.Last);
+}
+
+// Without measurements the import counts as at the target
+static void test_no_measurements(void) {
+    TEST_ASSERT_EQUAL(0, Demand.Covered);
+    TEST_ASSERT_EQUAL(TARGET, DemandAllowed(&Demand, TARGET));
+}
+
+// Import at the allowed power, after 10 minutes at 9kW: no 15 minute window goes above the target
+static void test_allowed(void) {
+    uint32_t t;
+    int32_t allowed, highest = 0;
+
+    t = Import(CLOCK - 1, 600, 1, 1000, 9000);
+    for (t++; t < CLOCK + 3 * 3600; t++) {
+        allowed = DemandAllowed(&Demand, TARGET);
+        if (allowed < 0) allowed = 0;
+        if (allowed > 20000) allowed = 20000;
+        DemandAdd(&Demand, allowed, t, 1000);
+        if (t % DEMAND_BUCKET == DEMAND_BUCKET - 1 && DemandAverage(&Demand) > highest) highest = DemandAverage(&Demand);
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(TARGET, highest);
+    TEST_ASSERT_GREATER_THAN(TARGET - 100, DemandAverage(&Demand));            // and the target is used
+}
+
+// Lost measurements: only the measured time is covered, the rest counts as import at the target
+static void test_lost_measurements(void) {
+    Import(CLOCK, DEMAND_WINDOW, 30, 10000, 12000);
+    TEST_ASSERT_INT_WITHIN(DEMAND_BUCKET * 1000, DEMAND_WINDOW * 1000 / 3, Demand.Covered);
+    TEST_ASSERT_INT_WITHIN(300, 4000, DemandAverage(&Demand));
+    TEST_ASSERT_LESS_THAN(0, DemandAllowed(&Demand, TARGET));                   // 4kW measured + 2/3 of the time at 7kW
+}
+
+// 14 minutes at 12kW on the uptime, then the clock is set: the measured minutes still count
+static void test_clock_set(void) {
+    DemandInit(&Demand, 20);
+    Import(20, 14 * 60, 1, 1000, 12000);
+    TEST_ASSERT_LESS_THAN(0, DemandAllowed(&Demand, TARGET));
+
+    DemandRebase(&Demand, CLOCK);
+    TEST_ASSERT_FALSE(DemandAdd(&Demand, 12000, CLOCK + 1, 1000));              // no quarter of the uptime as a peak
+    TEST_ASSERT_INT_WITHIN(1000, 14 * 60 * 1000, Demand.Covered);
+    TEST_ASSERT_LESS_THAN(0, DemandAllowed(&Demand, TARGET));
+
+    // Without DemandRebase() the window is gone, and so is the time it covered
+    DemandInit(&Demand, 20);
+    Import(20, 14 * 60, 1, 1000, 12000);
+    DemandAdd(&Demand, 12000, CLOCK, 1000);
+    TEST_ASSERT_EQUAL(1000, Demand.Covered);
+    TEST_ASSERT_LESS_OR_EQUAL(TARGET, DemandAllowed(&Demand, TARGET));
+}
+
+// The clock was set back: start over
+static void test_clock_back(void) {
+    Import(CLOCK, 300, 1, 1000, 12000);
+    DemandAdd(&Demand, 1000, CLOCK - 3600, 1000);
+    TEST_ASSERT_EQUAL(1000, Demand.Sum);
+    TEST_ASSERT_EQUAL(1000, Demand.Covered);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_average);
+    RUN_TEST(test_quarter);
+    RUN_TEST(test_no_measurements);
+    RUN_TEST(test_allowed);
+    RUN_TEST(test_lost_measurements);
+    RUN_TEST(test_clock_set);
+    RUN_TEST(test_clock_back);
+    return UNITY_END();
+}
@@ -0,0 +1,108 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests of the DSMR P1 parser, with recorded telegrams: pio test -e native -f test_dsmr
+
+#include <string.h>
+#include <unity.h>
+
+#include "dsmr.h"
+
+// ISKRA AM550, DSMR 5.0. Returns 232W on L2.
+static const char Telegram5[] =
+    "/ISK5\\2M550T-1012\r\n\r\n1-3:0.2.8(50)\r\n0-0:1.0.0(231019143012S)\r\n"
+    "0-0:96.1.1(4530303434303037313331363530353137)\r\n1-0:1.8.1(012345.678*kWh)\r\n"
+    "1-0:1.7.0(01.193*kW)\r\n1-0:2.7.0(00.000*kW)\r\n1-0:32.7.0(230.0*V)\r\n1-0:52.7.0(232.0*V)\r\n"
+    "1-0:72.7.0(229.0*V)\r\n1-0:31.7.0(003*A)\r\n1-0:51.7.0(001*A)\r\n1-0:71.7.0(002*A)\r\n"
+    "1-0:21.7.0(00.690*kW)\r\n1-0:41.7.0(00.000*kW)\r\n1-0:61.7.0(00.503*kW)\r\n"
+    "1-0:22.7.0(00.000*kW)\r\n1-0:42.7.0(00.232*kW)\r\n1-0:62.7.0(00.000*kW)\r\n!1352\r\n";
+
+// Kaifa MA105, DSMR 4.2. No phase power, the currents have no sign.
+static const char Telegram4[] =
+    "/KFM5KAIFA-METER\r\n\r\n1-3:0.2.8(42)\r\n1-0:1.7.0(00.000*kW)\r\n1-0:2.7.0(02.400*kW)\r\n"
+    "1-0:31.7.0(004*A)\r\n1-0:51.7.0(003*A)\r\n1-0:71.7.0(003*A)\r\n!72DC\r\n";
+
+static struct DSMRParser Parser;
+static struct P1Data Data;
+
+void setUp(void) {
+    DSMRInit(&Parser);
+    memset(&Data, 0, sizeof(Data));
+}
+
+void tearDown(void) {
+}
+
+// Feed a telegram, return the number of complete telegrams
+static int Feed(const char *s, size_t len) {
+    int n = 0;
+
+    while (len--) n += DSMRFeed(&Parser, (uint8_t)*s++, &Data);
+    return n;
+}
+
+static void test_dsmr5_signed_currents(void) {
+    TEST_ASSERT_EQUAL(1, Feed(Telegram5, sizeof(Telegram5) - 1));
+    TEST_ASSERT_EQUAL(DSMR_VOLTAGE | DSMR_CURRENT | DSMR_PHASE_POWER | DSMR_POWER, Data.Flags);
+    TEST_ASSERT_EQUAL(3000, Data.Current[0]);                                   // 690W / 230.0V
+    TEST_ASSERT_EQUAL(-1000, Data.Current[1]);                                  // returned on L2
+    TEST_ASSERT_EQUAL(2196, Data.Current[2]);                                   // 503W / 229.0V
+    TEST_ASSERT_EQUAL(1193, Data.Power);
+    TEST_ASSERT_EQUAL(-232, Data.PhasePower[1]);
+    TEST_ASSERT_EQUAL(2320, Data.Voltage[1]);
+}
+
+static void test_dsmr4_unsigned_currents(void) {
+    TEST_ASSERT_EQUAL(1, Feed(Telegram4, sizeof(Telegram4) - 1));
+    TEST_ASSERT_EQUAL(DSMR_CURRENT | DSMR_POWER, Data.Flags);
+    TEST_ASSERT_EQUAL(4000, Data.Current[0]);
+    TEST_ASSERT_EQUAL(3000, Data.Current[1]);
+    TEST_ASSERT_EQUAL(-2400, Data.Power);
+}
+
+static void test_crc_error(void) {
+    char t[sizeof(Telegram5)];
+
+    memcpy(t, Telegram5, sizeof(t));
+    t[strstr(t, "01.193") - t + 4] = '4';                                       // 01.194 kW
+    TEST_ASSERT_EQUAL(0, Feed(t, sizeof(t) - 1));
+    TEST_ASSERT_EQUAL(0, Data.Flags);
+}
+
+static void test_resync(void) {
+    static const char noise[] = "1-0:31.7.0(099*A)\r\n!FFFF\r\n\x00\xff garbage";
+
+    // Line noise, a telegram that is cut off, then two complete ones
+    TEST_ASSERT_EQUAL(0, Feed(noise, sizeof(noise) - 1));
+    TEST_ASSERT_EQUAL(0, Feed(Telegram5, 200));
+    TEST_ASSERT_EQUAL(1, Feed(Telegram4, sizeof(Telegram4) - 1));
+    TEST_ASSERT_EQUAL(4000, Data.Current[0]);
+    TEST_ASSERT_EQUAL(1, Feed(Telegram5, sizeof(Telegram5) - 1));
+    TEST_ASSERT_EQUAL(3000, Data.Current[0]);
+}
+
+static void test_split_feed(void) {
+    size_t n;
+    int count = 0;
+
+    // The UART driver hands over the telegram in chunks, the parser keeps its state in between
+    for (n = 0; n < sizeof(Telegram5) - 1; n += 7) {
+        count += Feed(Telegram5 + n, sizeof(Telegram5) - 1 - n < 7 ? sizeof(Telegram5) - 1 - n : 7);
+    }
+    TEST_ASSERT_EQUAL(1, count);
+    TEST_ASSERT_EQUAL(-1000, Data.Current[1]);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_dsmr5_signed_currents);
+    RUN_TEST(test_dsmr4_unsigned_currents);
+    RUN_TEST(test_crc_error);
+    RUN_TEST(test_resync);
+    RUN_TEST(test_split_feed);
+    return UNITY_END();
+}
@@ -0,0 +1,289 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "evse.h"
+#include "hal.h"
+#include "trace.h"
+#include "sim.h"
+
+struct SimEV EV;
+uint32_t SimTime;
+bool SimContactor;
+uint32_t SimDuty;
+bool SimCurrentAvailable;
+bool SimMeterOnline;
+int8_t SimTemperature;
+uint16_t SimBroadcasts;
+struct SimTransition SimTransitions[SIM_TRANSITIONS];
+uint8_t SimTransitionCount;
+
+static bool SimWake, SimInStates;
+
+// Firmware data used by the charging logic, defined in evse.cpp on the ESP32
+uint8_t AccessTimer, Access_bit, ButtonState, EVMeter, EVPhasesUsed, ExternalMaster;
+uint8_t LCDNav, LCDTimer, LCDupdate, LoadBl, Lock, LockCable, UnlockCable, MainsMeter, MainsMeterAddress;
+uint8_t ModbusRequest, Mode, PVMeter, PVMeterAddress, RFIDReader, ResetKwh, SubMenu, Switch, timeout;
+uint16_t BacklightTimer, ChargeCurrent, MaxCapacity, MaxCurrent, SolarStopTimer;
+uint16_t Balanced[NR_EVSES], BalancedMax[NR_EVSES];
+uint8_t BalancedState[NR_EVSES];
+uint32_t ChargeTimer, PVMeterIP, PlanTarget, ScrollTimer;
+int32_t EnergyEV, EnergyMeterStart;
+int16_t Imeasured;
+int8_t TempEVSE;
+bool PlanWait;
+volatile uint8_t MainsUpdated, PilotDiodeOK, PilotLevel;
+struct NodeStatus Node[NR_EVSES];
+struct tm timeinfo;
+
+// Pilot level of the EV model, for the CP signal the EVSE generates now
+static uint8_t SimLevel(void) {
+    if (!EV.Connected) return PILOT_12V;
+    if (SimDuty == 0) return PILOT_NOK;                                         // static -12V (activation mode)
+    if (EV.Charge && (SimPWM() || EV.IgnorePWM)) return PILOT_6V;
+    return PILOT_9V;
+}
+
+bool SimPWM(void) {
+    return SimDuty != 0 && SimDuty != CP_DUTY_MAX;
+}
+
+// Virtual hardware
+static void SimContactorSet(uint8_t nr, bool on) {
+    if (nr == 1) SimContactor = on;
+}
+
+static void SimCPDuty(uint32_t duty) {
+    SimDuty = duty;
+}
+
+static void SimCPSampleTiming(uint16_t time) {
+    (void)time;
+}
+
+static uint8_t SimPilot(void) {
+    return PilotLevel;
+}
+
+static uint16_t SimADCSample(int channel) {
+    (void)channel;
+    return 0;
+}
+
+static uint32_t SimMillis(void) {
+    return SimTime;
+}
+
+static int64_t SimMicros(void) {
+    return (int64_t)SimTime * 1000;
+}
+
+static uint32_t SimClock(void) {
+    return 1700000000u + SimTime / 1000;
+}
+
+static uint32_t SimCycles(void) {
+    return 0;
+}
+
+static void SimWakeStates(void) {
+    if (!SimInStates) SimWake = true;                                           // WakeEVSEStates() does not wake the running task
+}
+
+static void SimLog(const char *fmt, ...) {
+    va_list args;
+
+    if (!getenv("SIM_LOG")) return;
+    printf("%7u.%03u ", SimTime / 1000, SimTime % 1000);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+static void SimWebText(const char *str) {
+    (void)str;
+}
+
+static void SimWebStatus(void) {
+}
+
+static void SimModbusWrite(uint8_t address, uint16_t reg, uint16_t value) {
+    (void)reg;
+    (void)value;
+    if (address == BROADCAST_ADR) SimBroadcasts++;
+}
+
+// The mains meter responds right away, the Master resets the timeout on valid data
+static void SimRequestCurrent(uint8_t meter, uint8_t address) {
+    if (meter == MainsMeter && address == MainsMeterAddress && SimMeterOnline && LoadBl < 2) timeout = 10;
+}
+
+static void SimRequestMeter(uint8_t meter, uint8_t address) {
+    (void)meter;
+    (void)address;
+}
+
+static const struct EVSEHal HalSim = {
+    SimContactorSet, SimCPDuty, SimCPSampleTiming, SimPilot, SimADCSample, SimMillis, SimMicros, SimClock,
+    SimCycles, SimWakeStates, SimLog, SimWebText, SimWebStatus, SimModbusWrite,
+    SimRequestCurrent, SimRequestMeter, SimRequestMeter
+};
+const struct EVSEHal *Hal = &HalSim;
+
+// Model of the rest of the firmware: one EVSE, the available current is set by the test
+void SetCurrent(uint16_t current) {
+    Hal->CPDuty((uint32_t)current * CP_DUTY_MAX / 600);                         // duty cycle = current / 0.6A
+}
+
+signed char TemperatureSensor(void) {
+    return SimTemperature;
+}
+
+char IsCurrentAvailable(void) {
+    return SimCurrentAvailable;
+}
+
+bool CircuitAvailable(uint8_t NodeNr) {
+    (void)NodeNr;
+    return true;
+}
+
+bool ScheduleAllowed(uint8_t NodeNr) {
+    (void)NodeNr;
+    return true;
+}
+
+void CalcBalancedCurrent(char mod) {
+    (void)mod;
+    Balanced[0] = ChargeCurrent;
+}
+
+uint8_t MainsMeterOnRS485(void) {
+    return MainsMeter != 0;
+}
+
+void TraceAdd(uint8_t Type, uint8_t Cause, uint16_t Old, uint16_t New) {
+    (void)Cause;
+    if (Type != TRACE_STATE || SimTransitionCount >= SIM_TRANSITIONS) return;
+    SimTransitions[SimTransitionCount].Time = SimTime;
+    SimTransitions[SimTransitionCount].From = Old;
+    SimTransitions[SimTransitionCount].To = New;
+    SimTransitionCount++;
+}
+
+void ProximityPin(void) {}
+void ResetBalancedStates(void) {}
+void BroadcastCurrent(void) {}
+void requestNodeConfig(uint8_t NodeNr) { (void)NodeNr; }
+void requestNodeStatus(uint8_t NodeNr) { (void)NodeNr; }
+void processAllNodeStates(uint8_t NodeNr) { (void)NodeNr; }
+void UpdateCurrentData(void) {}
+void UpdateMeasureRegisters(void) {}
+void ScheduleStep(void) {}
+void PlanStep(void) {}
+
+/**
+ * Reset the firmware data and the model, standalone EVSE in Normal mode, no EV connected
+ */
+void SimInit(void) {
+    memset(&EV, 0, sizeof(EV));
+    memset(Node, 0, sizeof(Node));
+    memset(Balanced, 0, sizeof(Balanced));
+    memset(BalancedMax, 0, sizeof(BalancedMax));
+    memset(BalancedState, 0, sizeof(BalancedState));
+    Node[0].Online = true;
+
+    SimTime = 0;
+    SimCurrentAvailable = true;
+    SimMeterOnline = true;
+    SimTemperature = 25;
+    SimBroadcasts = 0;
+    SimWake = SimInStates = false;
+
+    Mode = MODE_NORMAL;
+    LoadBl = 0;
+    MainsMeter = 0;
+    MainsMeterAddress = MAINS_METER_ADDRESS;
+    MaxCurrent = 16;
+    MaxCapacity = 32;
+    Access_bit = 1;
+    ButtonState = 0x07;                                                         // no buttons pressed
+    ResetKwh = 2;
+    timeout = 5;
+    ModbusRequest = 0;
+    ErrorFlags = NO_ERROR;
+    ChargeDelay = C1Timer = AccessTimer = 0;
+    ActivationMode = ActivationTimer = 0;
+    SolarStopTimer = 0;
+    TempEVSE = SimTemperature;
+    PlanWait = false;
+    PilotLevel = PILOT_12V;
+    PilotDiodeOK = 0;
+
+    State = STATE_B;                                                            // force the entry actions of State A
+    setState(STATE_A);
+    SimTransitionCount = 0;
+}
+
+// One tick of virtual time
+static void SimTick(void) {
+    uint8_t level;
+
+    SimTime += SIM_TICK;
+
+    // The CP sampling confirms a new level, and wakes EVSEStates (NotifyEVSEStates)
+    level = SimLevel();
+    PilotDiodeOK = EV.Connected && SimPWM();
+    if (level != PilotLevel) {
+        PilotLevel = level;
+        PilotChangeTime = SimMicros();
+        SimWake = true;
+    }
+
+    if (SimTime % 100 == 0) Timer100msStep();
+    if (SimTime % 1000 == 0) {
+        Timer1SStep();
+        SimWake = true;
+    }
+
+    while (SimWake) {
+        SimWake = false;
+        SimInStates = true;
+        EVSEStatesStep();
+        SimInStates = false;
+    }
+}
+
+/**
+ * Run the firmware tasks for some time
+ * 
+ * @param uint32_t ms
+ */
+void SimRun(uint32_t ms) {
+    uint32_t end = SimTime + ms;
+
+    while (SimTime < end) SimTick();
+}
+
+/**
+ * Run until the EVSE is in a state
+ * 
+ * @param uint8_t state
+ * @param uint32_t max: ms
+ * @return uint32_t ms it took, or max when the state was not reached
+ */
+uint32_t SimRunUntilState(uint8_t state, uint32_t max) {
+    uint32_t start = SimTime;
+
+    while (State != state && SimTime - start < max) SimTick();
+    return SimTime - start;
+}
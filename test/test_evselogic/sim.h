@@ -0,0 +1,50 @@
+/*
+;    Project:       Smart EVSE
+;
+
+ */
+
+#ifndef __EVSE_SIM
+#define __EVSE_SIM
+
+#include <stdint.h>
+
+// Virtual time simulation of the charging logic (evselogic.cpp).
+// The tasks of the firmware are run in 10ms ticks: Timer100msStep every 100ms, Timer1SStep every second,
+// and EVSEStatesStep when it is woken (pilot level change, state change by another task, after Timer1SStep).
+// The rest of the firmware (balancing, meters, Modbus) is replaced by a simple model.
+
+#define SIM_TICK 10                                                             // ms
+
+// The EV on the charge cable
+struct SimEV {
+    bool Connected;
+    bool Charge;            // wants to charge, shows 6V when there is a PWM signal
+    bool IgnorePWM;         // keeps 6V when the PWM signal stops (does not stop charging)
+};
+
+struct SimTransition {
+    uint32_t Time;          // ms
+    uint8_t From;
+    uint8_t To;
+};
+
+#define SIM_TRANSITIONS 64
+
+extern struct SimEV EV;
+extern uint32_t SimTime;                                                        // ms since SimInit
+extern bool SimContactor;
+extern uint32_t SimDuty;                                                        // CP duty cycle, CP_DUTY_MAX: +12V (no PWM)
+extern bool SimCurrentAvailable;                                                // result of IsCurrentAvailable()
+extern bool SimMeterOnline;                                                     // the mains meter responds to requests
+extern int8_t SimTemperature;
+extern uint16_t SimBroadcasts;                                                  // Modbus writes to BROADCAST_ADR
+extern struct SimTransition SimTransitions[SIM_TRANSITIONS];
+extern uint8_t SimTransitionCount;
+
+void SimInit(void);
+void SimRun(uint32_t ms);
+uint32_t SimRunUntilState(uint8_t state, uint32_t max);
+bool SimPWM(void);
+
+#endif
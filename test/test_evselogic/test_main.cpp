@@ -0,0 +1,350 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests of the charging logic, in virtual time: pio test -e native_logic
+// Set SIM_LOG=1 to see the log of the firmware with the virtual time.
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "evse.h"
+#include "hal.h"
+#include "sim.h"
+
+void setUp(void) {
+    SimInit();
+}
+
+void tearDown(void) {
+}
+
+// Connect, charge, stop charging and disconnect
+static void test_charge_session(void) {
+    SimRun(1000);
+    TEST_ASSERT_EQUAL(STATE_A, State);
+    TEST_ASSERT_FALSE(SimPWM());
+
+    EV.Connected = true;
+    TEST_ASSERT_LESS_OR_EQUAL(20, SimRunUntilState(STATE_B, 1000));
+    TEST_ASSERT_TRUE(SimPWM());
+    TEST_ASSERT_FALSE(SimContactor);
+    TEST_ASSERT_EQUAL(160, ChargeCurrent);                                      // MaxCurrent, below the cable limit
+
+    EV.Charge = true;
+    TEST_ASSERT_LESS_OR_EQUAL(20, SimRunUntilState(STATE_C, 1000));
+    TEST_ASSERT_TRUE(SimContactor);
+    SimRun(60000);
+    TEST_ASSERT_EQUAL(STATE_C, State);
+
+    EV.Charge = false;
+    SimRunUntilState(STATE_B, 1000);
+    TEST_ASSERT_EQUAL(STATE_B, State);
+    TEST_ASSERT_FALSE(SimContactor);
+
+    EV.Connected = false;
+    TEST_ASSERT_LESS_OR_EQUAL(20, SimRunUntilState(STATE_A, 1000));
+    TEST_ASSERT_FALSE(SimPWM());
+    TEST_ASSERT_EQUAL(4, SimTransitionCount);
+}
+
+// An EV that does not start charging within 30 seconds gets a static -12V for 3 seconds
+static void test_activation_mode(void) {
+    EV.Connected = true;
+    SimRunUntilState(STATE_B, 1000);
+
+    SimRun(28000);
+    TEST_ASSERT_EQUAL(STATE_B, State);
+    SimRunUntilState(STATE_ACTSTART, 3000);
+    TEST_ASSERT_EQUAL(STATE_ACTSTART, State);
+    TEST_ASSERT_EQUAL(0, SimDuty);
+
+    TEST_ASSERT_INT_WITHIN(1000, 3000, SimRunUntilState(STATE_B, 5000));
+    TEST_ASSERT_EQUAL(STATE_B, State);
+    SimRun(60000);                                                              // only once
+    TEST_ASSERT_EQUAL(STATE_B, State);
+}
+
+// Without enough current the EVSE waits in B1, and connects CHARGEDELAY seconds after the current is available
+static void test_charge_delay(void) {
+    uint32_t start;
+
+    SimCurrentAvailable = false;
+    EV.Connected = true;
+    EV.Charge = true;
+    SimRun(100);
+    TEST_ASSERT_TRUE(ErrorFlags & LESS_6A);
+    SimRunUntilState(STATE_B1, 1000);
+    TEST_ASSERT_EQUAL(STATE_B1, State);
+
+    SimRun(5000);
+    TEST_ASSERT_EQUAL(STATE_B1, State);
+    SimCurrentAvailable = true;
+    start = SimTime;
+    SimRunUntilState(STATE_C, 2 * CHARGEDELAY * 1000);
+    TEST_ASSERT_EQUAL(STATE_C, State);
+    TEST_ASSERT_INT_WITHIN(2000, CHARGEDELAY * 1000, SimTime - start);
+    TEST_ASSERT_EQUAL(NO_ERROR, ErrorFlags);
+}
+
+// An EV that keeps charging after the PWM stopped, is disconnected by the contactor after 6 seconds
+static void test_c1_timeout(void) {
+    uint32_t start;
+
+    EV.Connected = true;
+    EV.Charge = true;
+    SimRunUntilState(STATE_C, 1000);
+    SimRun(1000);
+    EV.IgnorePWM = true;
+
+    setAccess(false);                                                           // stop charging
+    TEST_ASSERT_EQUAL(STATE_C1, State);
+    TEST_ASSERT_FALSE(SimPWM());
+    start = SimTime;
+    SimRunUntilState(STATE_B1, 10000);
+    TEST_ASSERT_EQUAL(STATE_B1, State);
+    TEST_ASSERT_FALSE(SimContactor);
+    TEST_ASSERT_INT_WITHIN(1000, 7000, SimTime - start);
+}
+
+// Too hot: stop right away, charge again when cooled down
+static void test_temperature(void) {
+    EV.Connected = true;
+    EV.Charge = true;
+    SimRunUntilState(STATE_C, 1000);
+
+    SimTemperature = 70;
+    TEST_ASSERT_LESS_OR_EQUAL(1000, SimRunUntilState(STATE_A, 2000));
+    TEST_ASSERT_FALSE(SimContactor);
+    TEST_ASSERT_TRUE(ErrorFlags & TEMP_HIGH);
+    SimRun(10000);
+    TEST_ASSERT_EQUAL(STATE_A, State);
+
+    SimTemperature = 50;
+    SimRunUntilState(STATE_C, 3000);
+    TEST_ASSERT_EQUAL(STATE_C, State);
+    TEST_ASSERT_EQUAL(NO_ERROR, ErrorFlags);
+}
+
+// Smart mode: no mains meter data for 10 seconds stops charging, and it resumes when the meter is back
+static void test_meter_timeout(void) {
+    uint32_t start;
+
+    Mode = MODE_SMART;
+    MainsMeter = EM_SENSORBOX;
+    EV.Connected = true;
+    EV.Charge = true;
+    SimRunUntilState(STATE_C, 1000);
+    SimRun(20000);
+    TEST_ASSERT_EQUAL(STATE_C, State);
+
+    SimMeterOnline = false;
+    start = SimTime;
+    SimRunUntilState(STATE_B1, 15000);
+    TEST_ASSERT_EQUAL(STATE_B1, State);
+    TEST_ASSERT_TRUE(ErrorFlags & CT_NOCOMM);
+    TEST_ASSERT_INT_WITHIN(1500, 9500, SimTime - start);                       // the last response was 0-2 seconds ago
+    TEST_ASSERT_GREATER_THAN(0, SimBroadcasts);                                 // the Nodes are told
+
+    SimMeterOnline = true;
+    SimRun(3000);
+    TEST_ASSERT_FALSE(ErrorFlags & CT_NOCOMM);
+    SimRunUntilState(STATE_C, 2 * CHARGEDELAY * 1000);
+    TEST_ASSERT_EQUAL(STATE_C, State);
+}
+
+// Guards of the state transitions (evselogic.cpp)
+bool GuardConnect(void);
+bool GuardConnectNode(void);
+bool GuardConnectMaster(void);
+bool GuardCharge(void);
+bool GuardChargeNode(void);
+bool GuardChargeMaster(void);
+bool GuardActivation(void);
+bool GuardActivationDone(void);
+
+// Inputs of the guards, every combination is tested
+struct Inputs {
+    uint8_t LoadBl;         // 0: standalone, 1: Master, 2: Node
+    bool Error;             // LESS_6A set
+    bool Delay;             // ChargeDelay running
+    bool Access;
+    bool PlanWait;
+    bool Available;         // IsCurrentAvailable()
+    bool Diode;             // DiodeCheck
+    bool Activation;        // ActivationMode reached 0
+    bool ActivationDone;    // ActivationTimer reached 0
+};
+
+#define INPUT_COMBINATIONS (3 << 8)
+
+static struct Inputs GetInputs(uint16_t n) {
+    struct Inputs in;
+
+    in.LoadBl = n >> 8;
+    in.Error = n & 1;
+    in.Delay = n & 2;
+    in.Access = n & 4;
+    in.PlanWait = n & 8;
+    in.Available = n & 16;
+    in.Diode = n & 32;
+    in.Activation = n & 64;
+    in.ActivationDone = n & 128;
+    return in;
+}
+
+static void SetInputs(uint8_t state, const struct Inputs *in) {
+    SimInit();
+    LoadBl = in->LoadBl;
+    ErrorFlags = in->Error ? LESS_6A : NO_ERROR;
+    ChargeDelay = in->Delay ? 5 : 0;
+    Access_bit = in->Access;
+    PlanWait = in->PlanWait;
+    SimCurrentAvailable = in->Available;
+    DiodeCheck = in->Diode;
+    ActivationMode = in->Activation ? 0 : 30;
+    ActivationTimer = in->ActivationDone ? 0 : 3;
+    State = state;
+}
+
+// The state transitions as specified, written out per state and pilot level
+static uint8_t ExpectedState(uint8_t state, uint8_t pilot, const struct Inputs *in) {
+    bool connect = !in->Error && !in->Delay && in->Access && !in->PlanWait;
+    bool charge = in->Diode && !in->Error && !in->Delay;
+    bool node = in->LoadBl > 1;
+
+    switch (state) {
+        case STATE_A:
+        case STATE_B1:
+            if (pilot == PILOT_12V) return STATE_A;
+            if (pilot == PILOT_9V && connect) {
+                if (node) return STATE_COMM_B;
+                if (in->Available) return STATE_B;
+            }
+            return state;
+        case STATE_B:
+        case STATE_COMM_C:
+            if (pilot == PILOT_12V) return STATE_A;
+            if (pilot == PILOT_6V) {
+                if (charge && node) return STATE_COMM_C;
+                if (charge && in->Available) return STATE_C;
+                return state;
+            }
+            if (in->Activation) return STATE_ACTSTART;
+            return state;
+        case STATE_C:
+            if (pilot == PILOT_12V) return STATE_A;
+            if (pilot == PILOT_9V) return STATE_B;
+            return state;
+        case STATE_C1:
+            if (pilot == PILOT_12V) return STATE_A;
+            if (pilot == PILOT_9V) return STATE_B1;
+            return state;
+        case STATE_COMM_B:
+            if (pilot == PILOT_12V) return STATE_A;
+            return state;
+        case STATE_COMM_B_OK:
+            return STATE_B;
+        case STATE_COMM_C_OK:
+            return STATE_C;
+        case STATE_ACTSTART:
+            return in->ActivationDone ? STATE_B : state;
+        default:
+            return state;                                                       // STATE_D is not implemented
+    }
+}
+
+// Every state, pilot level and combination of guard inputs
+static void test_state_table(void) {
+    static const uint8_t pilots[] = { PILOT_12V, PILOT_9V, PILOT_6V, PILOT_DIODE, PILOT_NOK };
+    struct Inputs in;
+    uint8_t state, p, expected, taken;
+    uint16_t n;
+    uint32_t cases = 0;
+    char msg[80];
+
+    for (state = 0; state < NR_STATES; state++) {
+        for (p = 0; p < sizeof(pilots); p++) {
+            for (n = 0; n < INPUT_COMBINATIONS; n++) {
+                in = GetInputs(n);
+                SetInputs(state, &in);
+                expected = ExpectedState(state, pilots[p], &in);
+                taken = StateDispatch(pilots[p]);
+
+                snprintf(msg, sizeof(msg), "state %s pilot %u inputs 0x%03x", getStateName(state), pilots[p], n);
+                TEST_ASSERT_EQUAL_MESSAGE(expected, State, msg);
+                if (expected != state) TEST_ASSERT_TRUE_MESSAGE(taken, msg);
+                cases++;
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL(NR_STATES * sizeof(pilots) * INPUT_COMBINATIONS, cases);
+}
+
+// Not enough current when connecting or charging sets the error, without a state change
+static void test_state_table_no_power(void) {
+    struct Inputs in = GetInputs(4);                                            // standalone, access, no current available
+
+    SetInputs(STATE_A, &in);
+    TEST_ASSERT_TRUE(StateDispatch(PILOT_9V));
+    TEST_ASSERT_EQUAL(STATE_A, State);
+    TEST_ASSERT_EQUAL(LESS_6A, ErrorFlags);
+
+    in.Diode = true;
+    SetInputs(STATE_B, &in);
+    Mode = MODE_SOLAR;
+    TEST_ASSERT_TRUE(StateDispatch(PILOT_6V));
+    TEST_ASSERT_EQUAL(STATE_B, State);
+    TEST_ASSERT_EQUAL(NO_SUN, ErrorFlags);
+}
+
+// The guards only read the state
+static void test_guards_are_pure(void) {
+    static bool (* const guards[])(void) = {
+        GuardConnect, GuardConnectNode, GuardConnectMaster, GuardCharge,
+        GuardChargeNode, GuardChargeMaster, GuardActivation, GuardActivationDone
+    };
+    struct Inputs in;
+    uint16_t n, max[NR_EVSES], balanced[NR_EVSES], current;
+    uint8_t g, state, errors, delay, mode, timer;
+
+    for (n = 0; n < INPUT_COMBINATIONS; n++) {
+        in = GetInputs(n);
+        SetInputs(STATE_B, &in);
+        ChargeCurrent = 130;
+        memcpy(max, BalancedMax, sizeof(max));
+        memcpy(balanced, Balanced, sizeof(balanced));
+        state = State, errors = ErrorFlags, delay = ChargeDelay, current = ChargeCurrent;
+        mode = ActivationMode, timer = ActivationTimer;
+
+        for (g = 0; g < sizeof(guards) / sizeof(guards[0]); g++) guards[g]();
+
+        TEST_ASSERT_EQUAL_MEMORY(max, BalancedMax, sizeof(max));
+        TEST_ASSERT_EQUAL_MEMORY(balanced, Balanced, sizeof(balanced));
+        TEST_ASSERT_EQUAL(state, State);
+        TEST_ASSERT_EQUAL(errors, ErrorFlags);
+        TEST_ASSERT_EQUAL(delay, ChargeDelay);
+        TEST_ASSERT_EQUAL(current, ChargeCurrent);
+        TEST_ASSERT_EQUAL(mode, ActivationMode);
+        TEST_ASSERT_EQUAL(timer, ActivationTimer);
+        TEST_ASSERT_FALSE(SimContactor);
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_charge_session);
+    RUN_TEST(test_activation_mode);
+    RUN_TEST(test_charge_delay);
+    RUN_TEST(test_c1_timeout);
+    RUN_TEST(test_temperature);
+    RUN_TEST(test_meter_timeout);
+    RUN_TEST(test_state_table);
+    RUN_TEST(test_state_table_no_power);
+    RUN_TEST(test_guards_are_pure);
+    return UNITY_END();
+}
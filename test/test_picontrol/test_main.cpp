@@ -0,0 +1,226 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests and step response of the mains current controller: pio test -e native -f test_picontrol
+
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include "evse.h"
+#include "picontrol.h"
+
+static struct PIGains Gains;
+static struct PIControl Control;
+
+void setUp(void) {
+    struct PIGains g = {PI_KP, PI_KI, PI_KI_DOWN, PI_RATE_UP, PI_RATE_DOWN};
+
+    Gains = g;
+    PIControlReset(&Control);
+}
+
+void tearDown(void) {
+}
+
+// A small error is corrected by the integral part, not all at once
+static void test_integral_step(void) {
+    Gains.RateUp = 0;
+    TEST_ASSERT_EQUAL(100 + 100 * PI_KI / 1000, PIControlStep(&Gains, &Control, 100, 100, 1000, 0, 320));
+}
+
+// An overload uses KiDown, but is never corrected by more than the error
+static void test_overload_once(void) {
+    TEST_ASSERT_EQUAL(200, PIControlStep(&Gains, &Control, 300, -100, PI_DT_MAX, 0, 320));
+}
+
+static void test_rate_limit(void) {
+    Gains.Ki = PI_GAIN_MAX;
+    TEST_ASSERT_EQUAL(100 + PI_RATE_UP, PIControlStep(&Gains, &Control, 100, 200, 1000, 0, 320));
+    Gains.RateDown = 20;
+    TEST_ASSERT_EQUAL(80, PIControlStep(&Gains, &Control, 100, -200, 1000, 0, 320));
+}
+
+// Changes below 0.1A add up over the steps
+static void test_rest(void) {
+    int32_t output = 100;
+    uint8_t n;
+
+    Gains.Kp = 0;
+    Gains.Ki = 10;
+    for (n = 0; n < 10; n++) output = PIControlStep(&Gains, &Control, output, 10, 1000, 0, 320);
+    TEST_ASSERT_EQUAL(101, output);
+}
+
+// The output is the integrator, a clamped output does not wind up
+static void test_clamp(void) {
+    int32_t output = 300;
+    uint8_t n;
+
+    Gains.Kp = 0;
+    for (n = 0; n < 50; n++) output = PIControlStep(&Gains, &Control, output, 100, 1000, 0, 320);
+    TEST_ASSERT_EQUAL(320, output);
+    TEST_ASSERT_EQUAL(319, PIControlStep(&Gains, &Control, output, -1, 1000, 0, 320));
+}
+
+#define TRANSFORMER_COMP 100                                                    // of the controller before the PI controller
+
+enum Law { LAW_OLD, LAW_PI };
+
+struct StepResponse {
+    float Settle;           // time until the EV current stays within 0.5A of the end value (s)
+    float Overload;         // highest current above the target: MaxMains, or zero import in Solar mode (0.1A)
+    float OverloadTime;     // time above the target + 0.5A (s)
+};
+
+/**
+ * The controller before the PI controller, as a reference.
+ * Smart mode: a quarter of the headroom up, Idifference * 100 / TRANSFORMER_COMP down.
+ * Solar mode: 0.1A or 0.5A steps on the import of all phases, half of it down above 2A.
+ *
+ * @param bool solar
+ * @param int32_t output
+ * @param int32_t error: MaxMains - current (Smart), or -import (Solar), per phase (0.1A)
+ * @param int32_t min
+ * @param int32_t max
+ * @return int32_t new output
+ */
+static int32_t OldStep(bool solar, int32_t output, int32_t error, int32_t min, int32_t max) {
+    int32_t import = -3 * error;                                                // IsumImport, a 3 phase EV
+
+    if (!solar) {
+        if (error > 0) output += error / 4;
+        else output += error * 100 / TRANSFORMER_COMP;
+    } else if (import < 0) {
+        if (import < -10) output += 5;
+        else output += 1;
+    } else {
+        if (import > 20) output -= import / 2;
+        else if (import > 10) output -= 5;
+        else if (import > 3) output -= 1;
+    }
+    if (output < min) output = min;
+    if (output > max) output = max;
+    return output;
+}
+
+/**
+ * One phase of a 3 phase EV, the load steps from load0 to load1 at 100s.
+ * Smart mode: MaxMains 25A, the load is the house load.
+ * Solar mode: zero import, the load is the house load minus the PV (negative: surplus), Min 6A.
+ * The EV follows the output with a first order lag.
+ *
+ * @param Law law
+ * @param bool solar
+ * @param float lag: time constant of the EV (s)
+ * @param uint32_t dt: time between the measurements (ms)
+ * @param int32_t load0: load before the step (0.1A)
+ * @param int32_t load1: load after the step (0.1A)
+ * @return StepResponse
+ */
+static struct StepResponse RunStep(enum Law law, bool solar, float lag, uint32_t dt, int32_t load0, int32_t load1) {
+    const int32_t max = 320, step = 100000, end = 300000;
+    const int32_t mains = solar ? 0 : 250, min = solar ? MIN_CURRENT * 10 : 0;
+    struct StepResponse r = {0, 0, 0};
+    int32_t output = mains - load0, target = mains - load1, error;
+    float ev, y, last = 0;
+    uint32_t t, next = 0;
+
+    if (output < min) output = min;
+    if (output > max) output = max;
+    if (target < min) target = min;
+    if (target > max) target = max;
+    ev = output;
+    PIControlReset(&Control);
+    for (t = 0; t < end; t += 10) {
+        ev += (output - ev) * 0.01f / lag;
+        y = (t < step ? load0 : load1) + ev;
+        if (t >= step) {
+            if (y - mains > r.Overload) r.Overload = y - mains;
+            if (y > mains + 5) r.OverloadTime += 0.01f;
+            if (fabsf(ev - target) > 5) last = t;
+        }
+        if (t >= next) {
+            next += dt;
+            error = (int32_t)lroundf(mains - y);
+            if (law == LAW_OLD) output = OldStep(solar, output, error, min, max);
+            else output = PIControlStep(&Gains, &Control, output, error, dt, min, max);
+        }
+    }
+    r.Settle = last > step ? (last - step) / 1000 : 0;
+    return r;
+}
+
+/**
+ * Step response of both laws, load up and down, EV lag 1s and 3s, measurements every 1s and 2s
+ *
+ * @param bool solar
+ * @param int32_t load0: low load (0.1A)
+ * @param int32_t load1: high load (0.1A)
+ * @param StepResponse up[law][lag * 2 + dt]: result with the load up
+ * @param StepResponse down[law][lag * 2 + dt]: result with the load down
+ */
+static void StepResponses(bool solar, int32_t load0, int32_t load1, struct StepResponse up[][4], struct StepResponse down[][4]) {
+    static const float lag[] = { 1, 3 };
+    static const uint32_t dt[] = { 1000, 2000 };
+    static const char * const name[] = { "old", "PI " };
+    struct StepResponse *u, *d;
+    uint8_t l, m, law;
+    char msg[160];
+
+    for (l = 0; l < 2; l++) for (m = 0; m < 2; m++) for (law = LAW_OLD; law <= LAW_PI; law++) {
+        u = &up[law][l * 2 + m];
+        d = &down[law][l * 2 + m];
+        *u = RunStep((enum Law)law, solar, lag[l], dt[m], load0, load1);
+        *d = RunStep((enum Law)law, solar, lag[l], dt[m], load1, load0);
+        snprintf(msg, sizeof(msg), "%s EV lag %.0fs, dt %us %s: load up: settle %5.1fs overload %4.1fA %4.1fs | load down: settle %5.1fs overshoot %3.1fA",
+                 solar ? "Solar" : "Smart", lag[l], dt[m] / 1000, name[law], u->Settle, u->Overload / 10, u->OverloadTime, d->Settle, d->Overload / 10);
+        TEST_MESSAGE(msg);
+    }
+}
+
+// Smart mode, house load 5A -> 15A and back
+static void test_step_response(void) {
+    struct StepResponse up[2][4], down[2][4];
+    uint8_t n;
+
+    StepResponses(false, 50, 150, up, down);
+    for (n = 0; n < 4; n++) {
+        TEST_ASSERT_LESS_THAN(5, up[LAW_PI][n].OverloadTime);                  // the overload is removed in one step, plus the EV lag
+        TEST_ASSERT_LESS_OR_EQUAL(up[LAW_OLD][n].OverloadTime, up[LAW_PI][n].OverloadTime);
+        TEST_ASSERT_LESS_THAN(20, up[LAW_PI][n].Settle);
+        TEST_ASSERT_LESS_THAN(20, down[LAW_PI][n].Settle);                      // 10A up at PI_RATE_UP takes 10s
+        TEST_ASSERT_LESS_THAN(5, down[LAW_PI][n].Overload);                     // no overshoot above MaxMains
+    }
+}
+
+// Solar mode, a surplus of 20A -> 10A per phase and back
+static void test_solar_step_response(void) {
+    struct StepResponse up[2][4], down[2][4];
+    uint8_t n;
+
+    StepResponses(true, -200, -100, up, down);
+    for (n = 0; n < 4; n++) {
+        TEST_ASSERT_LESS_THAN(5, up[LAW_PI][n].OverloadTime);                  // import from the grid
+        TEST_ASSERT_LESS_THAN(20, up[LAW_PI][n].Settle);
+        TEST_ASSERT_LESS_THAN(20, down[LAW_PI][n].Settle);                      // 0.5A steps take 20s and more
+        TEST_ASSERT_LESS_OR_EQUAL(down[LAW_OLD][n].Settle, down[LAW_PI][n].Settle);
+        TEST_ASSERT_LESS_THAN(5, down[LAW_PI][n].Overload);
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_integral_step);
+    RUN_TEST(test_overload_once);
+    RUN_TEST(test_rate_limit);
+    RUN_TEST(test_rest);
+    RUN_TEST(test_clamp);
+    RUN_TEST(test_step_response);
+    RUN_TEST(test_solar_step_response);
+    return UNITY_END();
+}
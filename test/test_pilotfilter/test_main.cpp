@@ -0,0 +1,174 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests of the pilot level filter (hysteresis and N-of-M confirmation): pio test -e native -f test_pilotfilter
+
+#include <stdlib.h>
+#include <unity.h>
+
+#include "pilotfilter.h"
+
+// Levels as used by the filter (PILOT_12V .. PILOT_DIODE)
+#define L12V 1
+#define L9V 2
+#define L6V 3
+#define LDIODE 4
+
+#define HOLD 10                                                                 // Hold bands are 10 raw units wider
+
+static struct PilotFilter Filter;
+
+// Raw bands, similar to what setup() derives from the mV thresholds
+static const struct PilotBand Bands[PILOT_LEVELS] = {
+    { 0, 0 }, { 900, 0xFFFF }, { 800, 860 }, { 700, 760 }, { 30, 90 }
+};
+
+static void Init(uint8_t n, uint8_t m) {
+    uint8_t l;
+
+    PilotFilterInit(&Filter, n, m);
+    for (l = 1; l < PILOT_LEVELS; l++) {
+        Filter.Enter[l] = Bands[l];
+        Filter.Hold[l].Min = Bands[l].Min - HOLD;
+        Filter.Hold[l].Max = Bands[l].Max == 0xFFFF ? 0xFFFF : Bands[l].Max + HOLD;
+    }
+}
+
+// Add the same window a number of times, return the number of confirmed level changes
+static int Add(uint16_t Min, uint16_t Max, int times) {
+    int changes = 0;
+
+    while (times--) changes += PilotFilterAdd(&Filter, Min, Max);
+    return changes;
+}
+
+void setUp(void) {
+    Init(2, 3);
+}
+
+void tearDown(void) {
+}
+
+static void test_classify_enter_bands(void) {
+    TEST_ASSERT_EQUAL(L12V, PilotFilterClassify(&Filter, 950, 1000));
+    TEST_ASSERT_EQUAL(L9V, PilotFilterClassify(&Filter, 810, 850));
+    TEST_ASSERT_EQUAL(L6V, PilotFilterClassify(&Filter, 710, 750));
+    TEST_ASSERT_EQUAL(LDIODE, PilotFilterClassify(&Filter, 40, 80));
+    TEST_ASSERT_EQUAL(0, PilotFilterClassify(&Filter, 500, 850));               // window spans two levels
+    TEST_ASSERT_EQUAL(L9V, PilotFilterClassify(&Filter, 800, 859));             // Min inclusive, Max exclusive
+    TEST_ASSERT_EQUAL(0, PilotFilterClassify(&Filter, 800, 860));
+}
+
+static void test_hysteresis_holds_confirmed_level(void) {
+    TEST_ASSERT_EQUAL(1, Add(810, 850, 2));
+    TEST_ASSERT_EQUAL(L9V, Filter.Level);
+
+    // Just outside the Enter band, inside the Hold band: stays 9V
+    TEST_ASSERT_EQUAL(L9V, PilotFilterClassify(&Filter, 795, 865));
+    TEST_ASSERT_EQUAL(0, Add(795, 865, 10));
+    TEST_ASSERT_EQUAL(L9V, Filter.Level);
+    TEST_ASSERT_EQUAL(100, Filter.Confidence);
+
+    // Outside the Hold band as well
+    TEST_ASSERT_EQUAL(0, PilotFilterClassify(&Filter, 810, 870));
+}
+
+static void test_hold_band_only_for_confirmed_level(void) {
+    TEST_ASSERT_EQUAL(0, PilotFilterClassify(&Filter, 795, 850));               // not confirmed yet, Enter band applies
+    Add(710, 750, 2);
+    TEST_ASSERT_EQUAL(L6V, Filter.Level);
+    TEST_ASSERT_EQUAL(0, PilotFilterClassify(&Filter, 795, 850));               // 9V hold band is not used at 6V
+    TEST_ASSERT_EQUAL(L6V, PilotFilterClassify(&Filter, 695, 765));
+}
+
+static void test_n_of_m_confirmation(void) {
+    Add(810, 850, 3);
+    TEST_ASSERT_EQUAL(L9V, Filter.Level);
+
+    TEST_ASSERT_EQUAL(0, Add(710, 750, 1));                                     // 1 of 3: not confirmed
+    TEST_ASSERT_EQUAL(L9V, Filter.Level);
+    TEST_ASSERT_EQUAL(1, Add(710, 750, 1));                                     // 2 of 3: confirmed
+    TEST_ASSERT_EQUAL(L6V, Filter.Level);
+}
+
+static void test_single_spike_is_ignored(void) {
+    int i, changes = 0;
+
+    Add(810, 850, 3);
+    for (i = 0; i < 100; i++) {
+        changes += PilotFilterAdd(&Filter, (i % 3) ? 810 : 710, (i % 3) ? 850 : 750);   // every third window a 6V spike
+    }
+    TEST_ASSERT_EQUAL(0, changes);
+    TEST_ASSERT_EQUAL(L9V, Filter.Level);
+    TEST_ASSERT_EQUAL(66, Filter.Confidence);
+}
+
+static void test_unknown_windows_confirm_level_0(void) {
+    Add(810, 850, 3);
+    TEST_ASSERT_EQUAL(0, Add(0, 1000, 1));
+    TEST_ASSERT_EQUAL(L9V, Filter.Level);
+    TEST_ASSERT_EQUAL(1, Add(0, 1000, 1));
+    TEST_ASSERT_EQUAL(0, Filter.Level);
+}
+
+static void test_larger_m(void) {
+    Init(3, 5);
+    Add(810, 850, 5);
+    TEST_ASSERT_EQUAL(0, Add(710, 750, 2));
+    TEST_ASSERT_EQUAL(1, Add(710, 750, 1));
+    TEST_ASSERT_EQUAL(L6V, Filter.Level);
+    TEST_ASSERT_EQUAL(60, Filter.Confidence);
+}
+
+static void test_init_limits(void) {
+    Init(12, 12);
+    TEST_ASSERT_EQUAL(PILOT_HISTORY, Filter.M);
+    TEST_ASSERT_EQUAL(PILOT_HISTORY, Filter.N);
+    Init(4, 2);
+    TEST_ASSERT_EQUAL(2, Filter.N);
+}
+
+// A 9V stream where one of every three windows can be disturbed (unknown, 6V, or just over the Enter band).
+// The confirmed level must never change, where a filter without hysteresis and confirmation would.
+static void test_noisy_stream(void) {
+    int i, r, changes = 0, raw = 0, last = L9V, level;
+    uint16_t Min, Max;
+
+    srand(1);
+    Add(810, 850, 3);
+    for (i = 0; i < 10000; i++) {
+        Min = 810;
+        Max = 850;
+        r = (i % 3) ? 3 : rand() % 4;                                           // never two disturbed windows out of three
+        if (r == 0) Min = 500;
+        else if (r == 1) { Min = 710; Max = 750; }
+        else if (r == 2) Max = 862;
+        changes += PilotFilterAdd(&Filter, Min, Max);
+
+        level = 0;                                                              // unfiltered, Enter bands only
+        for (r = 1; r < PILOT_LEVELS && !level; r++) if (Min >= Bands[r].Min && Max < Bands[r].Max) level = r;
+        if (level != last) raw++;
+        last = level;
+    }
+    TEST_ASSERT_EQUAL(L9V, Filter.Level);
+    TEST_ASSERT_GREATER_THAN(1000, raw);
+    TEST_ASSERT_EQUAL(0, changes);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_classify_enter_bands);
+    RUN_TEST(test_hysteresis_holds_confirmed_level);
+    RUN_TEST(test_hold_band_only_for_confirmed_level);
+    RUN_TEST(test_n_of_m_confirmation);
+    RUN_TEST(test_single_spike_is_ignored);
+    RUN_TEST(test_unknown_windows_confirm_level_0);
+    RUN_TEST(test_larger_m);
+    RUN_TEST(test_init_limits);
+    RUN_TEST(test_noisy_stream);
+    return UNITY_END();
+}
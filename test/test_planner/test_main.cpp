@@ -0,0 +1,155 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests of the charge planner: pio test -e native -f test_planner
+
+#include <string.h>
+#include <unity.h>
+
+#include "planner.h"
+
+#define NOW 1700000100                                                          // 100s into a slot
+#define SLOT0 (NOW - NOW % PLAN_SLOT_TIME)
+#define WATT 690                                                                // 3 phases
+#define MIN 6
+#define MAX 16
+#define SLOT_WH (MAX * WATT * PLAN_SLOT_TIME / 3600)                            // a whole slot at the max current (Wh)
+
+static struct PlanTable Table;
+static struct Plan Plan;
+
+static void SetTable(uint32_t start, const uint16_t *cost, uint8_t count) {
+    Table.Start = start;
+    Table.Count = count;
+    memcpy(Table.Cost, cost, count * sizeof(uint16_t));
+}
+
+void setUp(void) {
+    memset(&Table, 0, sizeof(Table));
+    memset(&Plan, 0, sizeof(Plan));
+}
+
+void tearDown(void) {
+}
+
+// The cheapest slots at the max current, equal costs in time order
+static void test_cheapest_first(void) {
+    static const uint16_t cost[8] = { 5, 1, 4, 1, 3, 2, 6, 7 };
+    static const uint8_t expected[8] = { 0, MAX, 0, MAX, 0, MAX, 0, 0 };
+
+    SetTable(SLOT0, cost, 8);
+    PlanMake(&Plan, &Table, SLOT0, SLOT0 + 8 * PLAN_SLOT_TIME, 3 * SLOT_WH, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL(SLOT0, Plan.Start);
+    TEST_ASSERT_EQUAL(8, Plan.Count);
+    TEST_ASSERT_EQUAL_MEMORY(expected, Plan.Current, 8);
+}
+
+// The last slot at the current that is still needed, but not below the min current
+static void test_partial_slot(void) {
+    static const uint16_t cost[4] = { 3, 1, 2, 4 };
+
+    SetTable(SLOT0, cost, 4);
+    PlanMake(&Plan, &Table, SLOT0, SLOT0 + 4 * PLAN_SLOT_TIME, SLOT_WH + SLOT_WH / 2, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL(MAX, Plan.Current[1]);
+    TEST_ASSERT_EQUAL(MAX / 2, Plan.Current[2]);
+    TEST_ASSERT_EQUAL(0, Plan.Current[0]);
+    TEST_ASSERT_EQUAL(0, Plan.Current[3]);
+
+    PlanMake(&Plan, &Table, SLOT0, SLOT0 + 4 * PLAN_SLOT_TIME, SLOT_WH + 100, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL(MIN, Plan.Current[2]);
+}
+
+// Only the part of the first slot after 'now' counts
+static void test_first_slot(void) {
+    static const uint16_t cost[2] = { 1, 2 };
+
+    SetTable(SLOT0, cost, 2);
+    PlanMake(&Plan, &Table, SLOT0 + PLAN_SLOT_TIME / 2, SLOT0 + 2 * PLAN_SLOT_TIME, SLOT_WH, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL(MAX, Plan.Current[0]);
+    TEST_ASSERT_EQUAL(MAX / 2, Plan.Current[1]);
+}
+
+// Slots outside the tariff table are used last, in time order, even when the table is expensive
+static void test_unknown_cost(void) {
+    static const uint16_t cost[4] = { 900, 900, 900, 900 };
+    static const uint8_t expected[8] = { MAX, 0, MAX, MAX, MAX, MAX, 0, 0 };
+
+    SetTable(SLOT0 + 2 * PLAN_SLOT_TIME, cost, 4);                              // slots 2-5
+    PlanMake(&Plan, &Table, SLOT0, SLOT0 + 8 * PLAN_SLOT_TIME, 5 * SLOT_WH, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL_MEMORY(expected, Plan.Current, 8);
+}
+
+// Energy that does not fit before the departure: every slot at the max current
+static void test_does_not_fit(void) {
+    uint8_t n;
+
+    PlanMake(&Plan, &Table, NOW, SLOT0 + 4 * PLAN_SLOT_TIME, 10 * SLOT_WH, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL(4, Plan.Count);
+    for (n = 0; n < 4; n++) TEST_ASSERT_EQUAL(MAX, Plan.Current[n]);
+}
+
+// The plan covers 48 hours, after that there is no planned current
+static void test_far_departure(void) {
+    uint32_t departure = SLOT0 + 72 * 3600;
+
+    PlanMake(&Plan, &Table, SLOT0, departure, SLOT_WH, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL(PLAN_SLOTS, Plan.Count);
+    TEST_ASSERT_EQUAL(MAX, PlanCurrent(&Plan, SLOT0));
+    TEST_ASSERT_EQUAL(0, PlanCurrent(&Plan, SLOT0 + PLAN_SLOT_TIME));
+    TEST_ASSERT_EQUAL(0, PlanCurrent(&Plan, SLOT0 + PLAN_SLOTS * PLAN_SLOT_TIME - 1));
+    TEST_ASSERT_EQUAL(PLAN_NONE, PlanCurrent(&Plan, SLOT0 + PLAN_SLOTS * PLAN_SLOT_TIME));
+    TEST_ASSERT_EQUAL(PLAN_NONE, PlanCurrent(&Plan, departure - 1));
+}
+
+static void test_no_plan(void) {
+    PlanMake(&Plan, &Table, NOW, NOW, SLOT_WH, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL(0, Plan.Count);
+    TEST_ASSERT_EQUAL(PLAN_NONE, PlanCurrent(&Plan, NOW));
+
+    PlanMake(&Plan, &Table, NOW, NOW + 3600, SLOT_WH, 0, MIN, MAX);           // no power per Amp
+    TEST_ASSERT_EQUAL(0, Plan.Count);
+}
+
+// Outside the plan: before the start, and from the departure on
+static void test_current(void) {
+    uint32_t departure = SLOT0 + 2 * PLAN_SLOT_TIME + 300;
+
+    PlanMake(&Plan, &Table, NOW, departure, 100 * SLOT_WH, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL(3, Plan.Count);
+    TEST_ASSERT_EQUAL(PLAN_NONE, PlanCurrent(&Plan, SLOT0 - 1));
+    TEST_ASSERT_EQUAL(MAX, PlanCurrent(&Plan, NOW));
+    TEST_ASSERT_EQUAL(MAX, PlanCurrent(&Plan, departure - 1));
+    TEST_ASSERT_EQUAL(PLAN_NONE, PlanCurrent(&Plan, departure));
+}
+
+// The planned energy adds up to the target, from the moment the plan was made
+static void test_energy(void) {
+    static const uint16_t cost[8] = { 8, 7, 6, 5, 4, 3, 2, 1 };
+    uint32_t energy = 2 * SLOT_WH + 1000;
+
+    SetTable(SLOT0, cost, 8);
+    PlanMake(&Plan, &Table, NOW, SLOT0 + 8 * PLAN_SLOT_TIME, energy, WATT, MIN, MAX);
+    TEST_ASSERT_EQUAL(0, PlanEnergy(&Plan, NOW));
+    TEST_ASSERT_EQUAL(0, PlanEnergy(&Plan, SLOT0 + 5 * PLAN_SLOT_TIME));
+    TEST_ASSERT_EQUAL(MIN * WATT * PLAN_SLOT_TIME / 3600 + SLOT_WH, PlanEnergy(&Plan, SLOT0 + 7 * PLAN_SLOT_TIME));   // 1000Wh at the min current
+    TEST_ASSERT_GREATER_OR_EQUAL(energy, PlanEnergy(&Plan, Plan.Departure));
+    TEST_ASSERT_LESS_THAN(energy + WATT * PLAN_SLOT_TIME / 3600, PlanEnergy(&Plan, Plan.Departure));   // the last slot is rounded up
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_cheapest_first);
+    RUN_TEST(test_partial_slot);
+    RUN_TEST(test_first_slot);
+    RUN_TEST(test_unknown_cost);
+    RUN_TEST(test_does_not_fit);
+    RUN_TEST(test_far_departure);
+    RUN_TEST(test_no_plan);
+    RUN_TEST(test_current);
+    RUN_TEST(test_energy);
+    return UNITY_END();
+}
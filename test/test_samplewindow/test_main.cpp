@@ -0,0 +1,108 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests of the sample window, with a producer and consumer on two threads: pio test -e native -f test_samplewindow
+
+#include <atomic>
+#include <thread>
+#include <unity.h>
+
+#include "samplewindow.h"
+
+#define WINDOW 25
+
+static struct SampleWindow Window;
+
+void setUp(void) {
+    SampleWindowInit(&Window, WINDOW);
+}
+
+void tearDown(void) {
+}
+
+static void test_window_stats(void) {
+    struct SampleStats s;
+    uint16_t i;
+
+    TEST_ASSERT_FALSE(SampleWindowGet(&Window, &s));                            // nothing published yet
+    for (i = 1; i < WINDOW; i++) TEST_ASSERT_FALSE(SampleWindowPut(&Window, i));
+    TEST_ASSERT_TRUE(SampleWindowPut(&Window, WINDOW));
+
+    TEST_ASSERT_TRUE(SampleWindowGet(&Window, &s));
+    TEST_ASSERT_EQUAL(1, s.Min);
+    TEST_ASSERT_EQUAL(WINDOW, s.Max);
+    TEST_ASSERT_EQUAL(WINDOW * (WINDOW + 1) / 2, s.Sum);
+    TEST_ASSERT_EQUAL(WINDOW, s.Count);
+    TEST_ASSERT_EQUAL(1, s.Window);
+}
+
+static void test_restart_drops_collected_samples(void) {
+    struct SampleStats s;
+    uint16_t i;
+
+    for (i = 0; i < 10; i++) SampleWindowPut(&Window, 4000);                    // samples before the timing changed
+    SampleWindowRestart(&Window);
+    for (i = 0; i < WINDOW - 1; i++) TEST_ASSERT_FALSE(SampleWindowPut(&Window, 1000));
+    TEST_ASSERT_TRUE(SampleWindowPut(&Window, 1000));
+
+    SampleWindowGet(&Window, &s);
+    TEST_ASSERT_EQUAL(1000, s.Max);
+    TEST_ASSERT_EQUAL(1000 * WINDOW, s.Sum);
+}
+
+static void test_last_samples(void) {
+    uint16_t buf[SAMPLE_RING], i;
+
+    TEST_ASSERT_EQUAL(0, SampleWindowLast(&Window, buf, 8));
+    for (i = 0; i < 100; i++) SampleWindowPut(&Window, i);
+    TEST_ASSERT_EQUAL(8, SampleWindowLast(&Window, buf, 8));
+    TEST_ASSERT_EQUAL(92, buf[0]);                                              // oldest first
+    TEST_ASSERT_EQUAL(99, buf[7]);
+    TEST_ASSERT_EQUAL(SAMPLE_RING / 2, SampleWindowLast(&Window, buf, SAMPLE_RING));
+}
+
+// The producer gives every sample of a window the same value, derived from the window number.
+// A torn read of the published stats shows up as Min != Max, a wrong Sum or Count, or a value
+// that does not belong to the window number.
+static void test_seqlock_stress(void) {
+    std::atomic<bool> stop(false);
+    struct SampleStats s;
+    uint32_t last = 0, reads = 0, torn = 0, i;
+
+    std::thread producer([&stop]() {
+        uint32_t n = 0;
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            SampleWindowPut(&Window, (uint16_t)((n / WINDOW) % 1000));
+            n++;
+        }
+    });
+
+    for (i = 0; i < 2000000 && last < 20000; i++) {
+        if (!SampleWindowGet(&Window, &s)) continue;
+        reads++;
+        if (s.Min != s.Max || s.Sum != (uint32_t)s.Min * WINDOW || s.Count != WINDOW) torn++;
+        else if (s.Min != (s.Window - 1) % 1000) torn++;
+        TEST_ASSERT_GREATER_OR_EQUAL(last, s.Window);                           // windows are never read out of order
+        last = s.Window;
+    }
+    stop = true;
+    producer.join();
+
+    TEST_ASSERT_GREATER_THAN(0, reads);
+    TEST_ASSERT_GREATER_THAN(1, last);
+    TEST_ASSERT_EQUAL(0, torn);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_window_stats);
+    RUN_TEST(test_restart_drops_collected_samples);
+    RUN_TEST(test_last_samples);
+    RUN_TEST(test_seqlock_stress);
+    return UNITY_END();
+}
@@ -0,0 +1,204 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests of the slot scheduler: pio test -e native -f test_schedule
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "schedule.h"
+
+#define EVSES 4
+#define SLICE 1800                                                              // 30 minutes (s)
+
+static struct ScheduleEVSE EVSE[EVSES];
+
+static void SetEVSE(uint8_t n, uint8_t waiting, uint8_t charging, uint8_t priority, uint32_t connected, uint32_t idle, uint32_t run, uint32_t charged) {
+    EVSE[n].Waiting = waiting;
+    EVSE[n].Charging = charging;
+    EVSE[n].Priority = priority;
+    EVSE[n].Connected = connected;
+    EVSE[n].Idle = idle;
+    EVSE[n].Run = run;
+    EVSE[n].Charged = charged;
+    EVSE[n].Room = 0xFF;
+}
+
+void setUp(void) {
+    memset(EVSE, 0, sizeof(EVSE));
+}
+
+void tearDown(void) {
+}
+
+static void test_none_waiting(void) {
+    uint8_t policy;
+
+    SetEVSE(0, 0, 1, 0, 3600, 0, 3600, 1000);
+    for (policy = 0; policy < SCHEDULE_POLICIES; policy++) {
+        TEST_ASSERT_EQUAL(-1, ScheduleNext(policy, EVSE, EVSES));
+        TEST_ASSERT_EQUAL(-1, SchedulePreempt(policy, EVSE, EVSES, SLICE));
+    }
+}
+
+// First come, first served, and a charging EVSE is never paused
+static void test_fifo(void) {
+    SetEVSE(0, 0, 1, 0, 7200, 0, 7200, 100000);
+    SetEVSE(1, 1, 0, 3, 600, 600, 0, 0);
+    SetEVSE(2, 1, 0, 0, 1200, 1200, 0, 0);
+    TEST_ASSERT_EQUAL(2, ScheduleNext(SCHEDULE_FIFO, EVSE, EVSES));
+    TEST_ASSERT_EQUAL(-1, SchedulePreempt(SCHEDULE_FIFO, EVSE, EVSES, SLICE));
+}
+
+// The longest waiting EVSE goes next, the one that charged longest gives up its slot after the time slice
+static void test_rotate(void) {
+    SetEVSE(0, 0, 1, 0, 7200, 0, 3600, 0);
+    SetEVSE(1, 0, 1, 0, 7200, 0, 5400, 0);
+    SetEVSE(2, 1, 0, 0, 7200, 1800, 0, 0);
+    SetEVSE(3, 1, 0, 0, 600, 600, 0, 0);
+    TEST_ASSERT_EQUAL(2, ScheduleNext(SCHEDULE_ROTATE, EVSE, EVSES));
+    TEST_ASSERT_EQUAL(1, SchedulePreempt(SCHEDULE_ROTATE, EVSE, EVSES, SLICE));
+
+    EVSE[0].Run = EVSE[1].Run = SLICE - 1;                                      // both within the time slice
+    TEST_ASSERT_EQUAL(-1, SchedulePreempt(SCHEDULE_ROTATE, EVSE, EVSES, SLICE));
+}
+
+// The least charged EVSE goes next, and pauses the most charged one
+static void test_energy(void) {
+    SetEVSE(0, 0, 1, 0, 7200, 0, 3600, 300000);
+    SetEVSE(1, 0, 1, 0, 7200, 0, 3600, 500000);
+    SetEVSE(2, 1, 0, 0, 7200, 3600, 0, 400000);
+    SetEVSE(3, 1, 0, 0, 600, 600, 0, 0);
+    TEST_ASSERT_EQUAL(3, ScheduleNext(SCHEDULE_ENERGY, EVSE, EVSES));
+    TEST_ASSERT_EQUAL(1, SchedulePreempt(SCHEDULE_ENERGY, EVSE, EVSES, SLICE));
+
+    EVSE[3].Waiting = 0;                                                        // EVSE 2 charged more than EVSE 0
+    EVSE[1].Charging = 0;
+    TEST_ASSERT_EQUAL(-1, SchedulePreempt(SCHEDULE_ENERGY, EVSE, EVSES, SLICE));
+}
+
+// The highest priority goes next, and only pauses an EVSE with a lower priority
+static void test_priority(void) {
+    SetEVSE(0, 0, 1, 2, 7200, 0, 3600, 0);
+    SetEVSE(1, 0, 1, 1, 7200, 0, 3600, 0);
+    SetEVSE(2, 1, 0, 1, 7200, 3600, 0, 0);
+    SetEVSE(3, 1, 0, 3, 600, 600, 0, 0);
+    TEST_ASSERT_EQUAL(3, ScheduleNext(SCHEDULE_PRIORITY, EVSE, EVSES));
+    TEST_ASSERT_EQUAL(1, SchedulePreempt(SCHEDULE_PRIORITY, EVSE, EVSES, SLICE));
+
+    EVSE[3].Waiting = 0;                                                        // equal priority: first come keeps its slot
+    TEST_ASSERT_EQUAL(-1, SchedulePreempt(SCHEDULE_PRIORITY, EVSE, EVSES, SLICE));
+
+    EVSE[3].Waiting = 1;                                                        // not within the time slice
+    EVSE[1].Run = SLICE - 1;
+    TEST_ASSERT_EQUAL(0, SchedulePreempt(SCHEDULE_PRIORITY, EVSE, EVSES, SLICE));
+}
+
+// Equal EVSE's keep the index order
+static void test_equal(void) {
+    uint8_t policy;
+
+    SetEVSE(1, 1, 0, 1, 600, 600, 0, 0);
+    SetEVSE(2, 1, 0, 1, 600, 600, 0, 0);
+    for (policy = 0; policy < SCHEDULE_POLICIES; policy++) TEST_ASSERT_EQUAL(1, ScheduleNext(policy, EVSE, EVSES));
+}
+
+// EVSE 3 waits for a full sub-circuit, only EVSE 0 is on that circuit too
+static void test_circuit(void) {
+    uint8_t policy;
+
+    SetEVSE(0, 0, 1, 1, 7200, 0, 3600, 300000);
+    SetEVSE(1, 0, 1, 0, 9000, 0, 7200, 600000);                                 // first in line to be paused, on another circuit
+    SetEVSE(3, 1, 0, 2, 600, 600, 0, 0);
+    EVSE[1].Room = 0;
+    for (policy = SCHEDULE_ROTATE; policy < SCHEDULE_POLICIES; policy++) {
+        TEST_ASSERT_EQUAL(0, SchedulePreempt(policy, EVSE, EVSES, SLICE));
+    }
+
+    EVSE[0].Run = SLICE - 1;                                                    // within its time slice: nobody is paused
+    for (policy = SCHEDULE_ROTATE; policy < SCHEDULE_POLICIES; policy++) {
+        TEST_ASSERT_EQUAL(-1, SchedulePreempt(policy, EVSE, EVSES, SLICE));
+    }
+}
+
+/**
+ * 4 EV's arriving 10 minutes apart on 2 slots, for 6 hours, 6A each.
+ *
+ * @param uint8_t policy
+ * @param uint32_t charged[EVSES]: charge per EVSE (Ah)
+ * @return uint16_t number of pauses
+ */
+static uint16_t RunSlots(uint8_t policy, uint32_t *charged) {
+    static const uint8_t priority[EVSES] = { 0, 0, 2, 1 };
+    uint16_t pauses = 0;
+    uint32_t t;
+    uint8_t n, count;
+    int8_t next;
+
+    for (n = 0; n < EVSES; n++) EVSE[n].Priority = priority[n], EVSE[n].Room = 0xFF;
+    for (t = 0; t < 6 * 3600; t++) {
+        for (n = 0, count = 0; n < EVSES; n++) {
+            if (t >= n * 600u && !EVSE[n].Charging) EVSE[n].Waiting = 1;
+            count += EVSE[n].Charging;
+        }
+        if (count < 2) {
+            next = ScheduleNext(policy, EVSE, EVSES);
+            if (next >= 0) EVSE[next].Waiting = 0, EVSE[next].Charging = 1, EVSE[next].Run = 0;
+        } else {
+            next = SchedulePreempt(policy, EVSE, EVSES, SLICE);
+            if (next >= 0) EVSE[next].Charging = 0, EVSE[next].Waiting = 1, pauses++;
+        }
+        for (n = 0; n < EVSES; n++) if (t >= n * 600u) {
+            EVSE[n].Connected++;
+            if (EVSE[n].Charging) EVSE[n].Run++, EVSE[n].Charged += 60, EVSE[n].Idle = 0;
+            else EVSE[n].Idle++;
+        }
+    }
+    for (n = 0; n < EVSES; n++) charged[n] = EVSE[n].Charged / 36000;
+    return pauses;
+}
+
+static void test_slots(void) {
+    static const char * const name[SCHEDULE_POLICIES] = { "first come", "rotate", "least charged", "priority" };
+    uint32_t charged[SCHEDULE_POLICIES][EVSES];
+    uint16_t pauses[SCHEDULE_POLICIES];
+    uint8_t policy, n;
+    char msg[100];
+
+    for (policy = 0; policy < SCHEDULE_POLICIES; policy++) {
+        setUp();
+        pauses[policy] = RunSlots(policy, charged[policy]);
+        snprintf(msg, sizeof(msg), "%-13s: %2u pauses, charged %2uAh %2uAh %2uAh %2uAh", name[policy], pauses[policy],
+                 charged[policy][0], charged[policy][1], charged[policy][2], charged[policy][3]);
+        TEST_MESSAGE(msg);
+        TEST_ASSERT_LESS_OR_EQUAL(2 * 6 * 3600 / SLICE, pauses[policy]);        // a slot is given up once per time slice at most
+    }
+    TEST_ASSERT_EQUAL(0, pauses[SCHEDULE_FIFO]);
+    TEST_ASSERT_EQUAL(0, charged[SCHEDULE_FIFO][2]);                            // the last two never get a slot
+    for (n = 0; n < EVSES; n++) {
+        TEST_ASSERT_GREATER_OR_EQUAL(12, charged[SCHEDULE_ROTATE][n]);          // every EV gets a fair part of 72Ah
+        TEST_ASSERT_GREATER_OR_EQUAL(12, charged[SCHEDULE_ENERGY][n]);
+    }
+    for (n = 2; n < EVSES; n++) {                                               // the last two have a priority
+        TEST_ASSERT_GREATER_THAN(3 * charged[SCHEDULE_PRIORITY][0], charged[SCHEDULE_PRIORITY][n]);
+        TEST_ASSERT_GREATER_THAN(3 * charged[SCHEDULE_PRIORITY][1], charged[SCHEDULE_PRIORITY][n]);
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_none_waiting);
+    RUN_TEST(test_fifo);
+    RUN_TEST(test_rotate);
+    RUN_TEST(test_energy);
+    RUN_TEST(test_priority);
+    RUN_TEST(test_equal);
+    RUN_TEST(test_circuit);
+    RUN_TEST(test_slots);
+    return UNITY_END();
+}
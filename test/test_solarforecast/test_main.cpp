@@ -0,0 +1,226 @@
+/*
+;    Project:       Smart EVSE
+;
+;
+
+ */
+
+// Host tests of the solar import forecast, and a replay of solar charging days: pio test -e native -f test_solarforecast
+
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include "evse.h"
+#include "picontrol.h"
+#include "solarforecast.h"
+
+#define DAY 36000                                                               // 10 hours of daylight (s)
+#define DAYS 5                                                                  // replayed per type of weather
+#define MEASURE 2                                                               // time between the measurements (s)
+#define EV_MAX 160                                                              // EV on 3 phases, 6-16A (0.1A)
+
+enum Weather { CLEAR, SCATTERED, BROKEN, OVERCAST, NR_WEATHER };
+
+static const char * const WeatherName[NR_WEATHER] = { "clear", "scattered clouds", "broken clouds", "overcast, breaks" };
+
+static float Sun[DAY], House[DAY];                                              // PV and house load per phase (0.1A)
+static struct SolarForecast Forecast;
+static uint32_t Seed;
+
+// Reproducible pseudo random numbers 0-1
+static float Random(void) {
+    Seed = Seed * 1103515245 + 12345;
+    return ((Seed >> 8) & 0xFFFF) / 65536.0f;
+}
+
+/**
+ * Make a day: PV of a 9A per phase installation, with clouds passing, and a house load
+ * of 0.6A, 1A every other 15 minutes, and a 3kW kettle about once an hour.
+ *
+ * @param Weather weather
+ * @param uint32_t seed
+ */
+static void MakeDay(enum Weather weather, uint32_t seed) {
+    static const float rate[NR_WEATHER] = { 0, 1 / 300.0f, 1 / 120.0f, 1 / 240.0f };       // clouds per second
+    static const float length[NR_WEATHER] = { 0, 60, 120, 90 };                            // average time in the shade (s)
+    float sun, depth, ramp;
+    uint32_t t, k, duration, kettle = 0;
+
+    Seed = seed;
+    for (t = 0; t < DAY; t++) Sun[t] = weather == OVERCAST ? 0.3f : 1.0f;
+    for (t = 0; t < DAY; t++) {
+        if (Random() >= rate[weather]) continue;
+        duration = (uint32_t)(-logf(Random() + 1e-6f) * length[weather]);
+        depth = 0.2f + 0.5f * Random();
+        for (k = 0; k < duration && t + k < DAY; k++) {
+            ramp = fminf(1.0f, fminf(k, duration - k) / 10.0f);                  // the edge of a cloud takes 10 seconds
+            if (weather == OVERCAST) Sun[t + k] = 0.3f + 0.7f * ramp;            // a break in the clouds
+            else Sun[t + k] = 1.0f - (1.0f - depth) * ramp;
+        }
+    }
+    for (t = 0; t < DAY; t++) {
+        sun = sinf(M_PI * t / DAY);
+        Sun[t] *= 90 * powf(sun, 1.5f);
+        if (Random() < 1 / 3600.0f) kettle = 180;
+        House[t] = 6 + ((t / 900) % 2 ? 4 : 0) + (kettle ? 100 : 0);
+        if (kettle) kettle--;
+    }
+}
+
+struct Replay {
+    float Solar;            // EV energy from the PV (Ah, sum of all phases)
+    float Grid;             // EV energy from the grid (Ah, sum of all phases)
+    uint16_t Starts;
+};
+
+/**
+ * Replay a day of solar charging, with the decisions of CalcBalancedCurrent() and IsCurrentAvailable()
+ *
+ * @param bool forecast: false replays without the forecast (no samples)
+ * @return Replay
+ */
+static struct Replay ReplayDay(bool forecast) {
+    struct PIGains gains = {PI_KP, PI_KI, PI_KI_DOWN, PI_RATE_UP, PI_RATE_DOWN};
+    struct PIControl control;
+    struct Replay r = {0, 0, 0};
+    int32_t isum, load, expected, iset = 0;
+    uint32_t t;
+    uint16_t stoptimer = 0, chargedelay = 0;
+    bool active = false, nosun = false, available;
+    float ev = 0, surplus;
+
+    PIControlReset(&control);
+    SolarForecastInit(&Forecast, SOLAR_ALPHA, SOLAR_BETA);
+    for (t = 0; t < DAY; t++) {
+        ev += ((active ? iset : 0) - ev) / 2;                                   // the EV follows in a few seconds
+        isum = (int32_t)lroundf(3 * (House[t] - Sun[t] + ev));
+        surplus = fmaxf(0, 3 * (Sun[t] - House[t]));
+        r.Solar += fminf(3 * ev, surplus) / 36000;
+        r.Grid += fmaxf(0, 3 * ev - surplus) / 36000;
+
+        if (t % MEASURE == 0) {
+            load = active ? 3 * iset : 0;
+            if (forecast) SolarForecastAdd(&Forecast, isum - load, MEASURE * 1000);
+            if (active) {
+                iset = PIControlStep(&gains, &control, iset, -isum / 3, MEASURE * 1000, 0, EV_MAX);
+                if (iset < MIN_CURRENT * 10) {
+                    iset = MIN_CURRENT * 10;
+                    expected = SolarForecastImport(&Forecast, SOLAR_HORIZON, -SOLAR_SIGMAS) + load;
+                    if (Forecast.Samples < 2) expected = isum;
+                    if (isum > 10) {
+                        if (!stoptimer && expected > 10) stoptimer = STOP_TIME * 60;
+                    } else stoptimer = 0;
+                } else stoptimer = 0;
+            }
+        }
+
+        // Timer1S
+        if (stoptimer && --stoptimer == 0) {
+            active = false;
+            nosun = true;
+        }
+        if (chargedelay) chargedelay--;
+        available = active || (isum < -START_CURRENT * 10
+                    && (Forecast.Samples < 2 || SolarForecastImport(&Forecast, SOLAR_HORIZON, SOLAR_SIGMAS) < -START_CURRENT * 10));
+        if (nosun && available) nosun = false;
+        if (nosun) chargedelay = CHARGEDELAY;
+        if (!active && !nosun && !chargedelay) {
+            if (available) {
+                active = true;
+                iset = MIN_CURRENT * 10;
+                PIControlReset(&control);
+                r.Starts++;
+            } else nosun = true;
+        }
+    }
+    return r;
+}
+
+void setUp(void) {
+    SolarForecastInit(&Forecast, SOLAR_ALPHA, SOLAR_BETA);
+}
+
+void tearDown(void) {
+}
+
+// The first sample sets the level, without a trend
+static void test_first_sample(void) {
+    SolarForecastAdd(&Forecast, -120, 2000);
+    TEST_ASSERT_EQUAL(1, Forecast.Samples);
+    TEST_ASSERT_EQUAL(-120, SolarForecastImport(&Forecast, 0, 0));
+    TEST_ASSERT_EQUAL(-120, SolarForecastImport(&Forecast, SOLAR_HORIZON, 0));
+}
+
+// A ramp of 0.1A per second: the trend is found, and damped over SOLAR_TREND_TIME
+static void test_ramp(void) {
+    uint16_t t;
+
+    for (t = 0; t <= 600; t += MEASURE) SolarForecastAdd(&Forecast, t, MEASURE * 1000);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 1.0f, Forecast.Trend);
+    TEST_ASSERT_INT_WITHIN(5, 600, SolarForecastImport(&Forecast, 0, 0));
+    TEST_ASSERT_INT_WITHIN(5, 600 + SOLAR_TREND_TIME / 2, SolarForecastImport(&Forecast, SOLAR_TREND_TIME, 0));
+}
+
+// The bounds are as far from the expected import as the measurements vary, and widen with the horizon
+static void test_bounds(void) {
+    int32_t high, low, expected;
+    uint16_t n;
+
+    for (n = 0; n < 300; n++) SolarForecastAdd(&Forecast, n % 2 ? -100 : -140, MEASURE * 1000);
+    expected = SolarForecastImport(&Forecast, 10, 0);
+    high = SolarForecastImport(&Forecast, 10, 1);
+    low = SolarForecastImport(&Forecast, 10, -1);
+    TEST_ASSERT_INT_WITHIN(10, -120, expected);
+    TEST_ASSERT_GREATER_THAN(expected + 10, high);
+    TEST_ASSERT_INT_WITHIN(1, expected - low, high - expected);
+    TEST_ASSERT_GREATER_THAN(high, SolarForecastImport(&Forecast, SOLAR_HORIZON, 1));
+}
+
+// A sample without time between starts over from the measurement
+static void test_restart(void) {
+    SolarForecastAdd(&Forecast, -100, MEASURE * 1000);
+    SolarForecastAdd(&Forecast, 0, MEASURE * 1000);
+    SolarForecastAdd(&Forecast, 50, 0);
+    TEST_ASSERT_EQUAL(50, SolarForecastImport(&Forecast, SOLAR_HORIZON, 0));
+}
+
+// Passing clouds should not start and stop the charging more often, without losing solar energy
+static void test_replay(void) {
+    struct Replay day;
+    uint8_t weather, d;
+    char msg[120];
+
+    for (weather = 0; weather < NR_WEATHER; weather++) {
+        struct Replay now = {0, 0, 0}, forecast = {0, 0, 0};
+
+        for (d = 0; d < DAYS; d++) {
+            MakeDay((enum Weather)weather, 100 + d);
+            day = ReplayDay(false);
+            now.Solar += day.Solar / DAYS, now.Grid += day.Grid / DAYS, now.Starts += day.Starts;
+            day = ReplayDay(true);
+            forecast.Solar += day.Solar / DAYS, forecast.Grid += day.Grid / DAYS, forecast.Starts += day.Starts;
+        }
+        snprintf(msg, sizeof(msg), "%-16s without forecast: solar %5.1fAh grid %5.1fAh starts %4.1f/day",
+                 WeatherName[weather], now.Solar, now.Grid, now.Starts / (float)DAYS);
+        TEST_MESSAGE(msg);
+        snprintf(msg, sizeof(msg), "%-16s with forecast:    solar %5.1fAh grid %5.1fAh starts %4.1f/day",
+                 "", forecast.Solar, forecast.Grid, forecast.Starts / (float)DAYS);
+        TEST_MESSAGE(msg);
+
+        TEST_ASSERT_LESS_OR_EQUAL(now.Starts, forecast.Starts);
+        TEST_ASSERT_GREATER_OR_EQUAL(0.98f * now.Solar, forecast.Solar);
+        TEST_ASSERT_LESS_OR_EQUAL(now.Grid, forecast.Grid);                    // no more import from the grid
+        if (weather != CLEAR) TEST_ASSERT_LESS_THAN(now.Starts, forecast.Starts);
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_first_sample);
+    RUN_TEST(test_ramp);
+    RUN_TEST(test_bounds);
+    RUN_TEST(test_restart);
+    RUN_TEST(test_replay);
+    return UNITY_END();
+}